@@ -0,0 +1,417 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "render.h"
+#include "pool.h"
+#include "bvh.h"
+#include "spheres.h"
+#include "stats.h"
+
+/** generates a scene, given the number of objects */
+typedef void (*generate_fn_t)(uint32_t count);
+
+typedef struct {
+    const char *name;
+    const char *builtin;    // built-in scene, or NULL if generated
+    generate_fn_t generate;
+    uint32_t count;         // number of objects passed to generate
+    uint32_t size_x;
+    uint32_t size_y;
+} bench_scene_t;
+
+/** xorshift generator, so generated scenes are equal on every platform */
+static uint32_t random_state;
+
+static float random_float(float min, float max)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return min + (max - min) * (float) (random_state >> 8) / (float) (1u << 24);
+}
+
+static material_t random_material(void)
+{
+    material_t material = {
+            .color={random_float(.2f, 1.f), random_float(.2f, 1.f), random_float(.2f, 1.f)},
+            .shininess=100.f, .reflection={.type=NONE}
+    };
+    if (random_float(0.f, 1.f) < .3f) {
+        material.reflection.type = REFLECTIVE;
+        material.reflection.fraction.reflectiveness = .5f;
+    }
+
+    return material;
+}
+
+/** sets up the camera, ground plane and {lights_size} lights of a generated scene with {spheres_size} spheres */
+static void generate_common(uint32_t lights_size, uint32_t spheres_size)
+{
+    scene_allocate(lights_size, spheres_size, 1);
+
+    vec3f eye = {0.f, 20.f, -60.f};
+    vec3f target = {0.f, 0.f, 20.f};
+    vec3f background = {.2f, .7f, 1.f};
+    EYE = eye;
+    TARGET = target;
+    BACKGROUND = background;
+    FOV = (float) M_PI / 3.f;
+
+    plane_t ground = {
+            .type=PLANE_UNBOUNDED, .point={0.f, 0.f, 0.f}, .normal={0.f, 1.f, 0.f},
+            .material={.color={.8f, .8f, .8f}, .shininess=-1.f, .reflection={.type=NONE}},
+            .checkered_xz=true, .checker_color={.3f, .3f, .3f}
+    };
+    PLANES[0] = ground;
+
+    LIGHTS[0].type = LIGHT_AMBIENT;
+    LIGHTS[0].intensity = .2f;
+    for (uint32_t i = 1; i < lights_size; i++) {
+        LIGHTS[i].type = LIGHT_POINT;
+        LIGHTS[i].intensity = .8f / (float) (lights_size - 1);
+        vec3f location = {random_float(-60.f, 60.f), random_float(20.f, 60.f), random_float(-20.f, 100.f)};
+        LIGHTS[i].v.location = location;
+        LIGHTS[i].radius = 0.f;
+    }
+}
+
+/** {count} spheres of random size and material in a box above the ground, which shrink as there are more */
+static void generate_spheres(uint32_t count)
+{
+    generate_common(3, count);
+
+    float radius = 20.f / cbrtf((float) count);
+    for (uint32_t i = 0; i < count; i++) {
+        sphere_t sphere = {
+                .center={random_float(-50.f, 50.f), random_float(radius, 40.f), random_float(0.f, 100.f)},
+                .radius=random_float(.5f, 1.f) * radius, .material=random_material()
+        };
+        SPHERES[i] = sphere;
+    }
+}
+
+/** a thousand spheres lit by {count} point lights */
+static void generate_lights(uint32_t count)
+{
+    generate_common(count + 1, 1000);
+
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        sphere_t sphere = {
+                .center={random_float(-50.f, 50.f), random_float(2.f, 40.f), random_float(0.f, 100.f)},
+                .radius=random_float(1.f, 2.f), .material=random_material()
+        };
+        SPHERES[i] = sphere;
+    }
+}
+
+/** a grid of {count} transparent spheres, camera rays are reflected and refracted up to the maximum depth */
+static void generate_refraction(uint32_t count)
+{
+    generate_common(2, count);
+
+    uint32_t width = (uint32_t) ceilf(cbrtf((float) count));
+    for (uint32_t i = 0; i < count; i++) {
+        float x = (float) (i % width);
+        float y = (float) (i / width % width);
+        float z = (float) (i / (width * width));
+        sphere_t sphere = {
+                .center={(x - width / 2.f) * 6.f, 3.f + y * 6.f, z * 6.f}, .radius=2.8f,
+                .material={
+                        .color={1.f, 1.f, 1.f}, .shininess=1000.f,
+                        .reflection={.type=REFLECTIVE_REFRACTIVE, .refractive_index=1.5f}
+                }
+        };
+        SPHERES[i] = sphere;
+    }
+}
+
+/** a torus of about {count} triangles with a reflective sphere inside, tests the triangle kernel and mesh hierarchy */
+static void generate_mesh(uint32_t count)
+{
+    generate_common(2, 1);
+
+    sphere_t sphere = {
+            .center={0.f, 8.f, 40.f}, .radius=8.f,
+            .material={.color={1.f, 1.f, 1.f}, .shininess=1000.f,
+                       .reflection={.type=REFLECTIVE, .fraction.reflectiveness=.8f}}
+    };
+    SPHERES[0] = sphere;
+
+    /** a grid of n x n quads around the torus, each split into two triangles */
+    uint32_t n = (uint32_t) sqrtf((float) count / 2.f);
+    scene_allocate_meshes(1);
+    mesh_t *mesh = &MESHES[0];
+    mesh_allocate(mesh, n * n, 2 * n * n);
+    mesh->material = random_material();
+    for (uint32_t i = 0; i < n; i++) {
+        float a = 2.f * (float) M_PI * (float) i / (float) n;
+        for (uint32_t j = 0; j < n; j++) {
+            float b = 2.f * (float) M_PI * (float) j / (float) n;
+            float r = 30.f + 10.f * cosf(b);
+            vec3f v = {r * cosf(a), 12.f + 10.f * sinf(b), 40.f + r * sinf(a)};
+            mesh->vertices[i * n + j] = v;
+
+            uint32_t i1 = (i + 1) % n;
+            uint32_t j1 = (j + 1) % n;
+            triangle_t first = {{i * n + j, i * n + j1, i1 * n + j1}};
+            triangle_t second = {{i * n + j, i1 * n + j1, i1 * n + j}};
+            mesh->triangles[2 * (i * n + j)] = first;
+            mesh->triangles[2 * (i * n + j) + 1] = second;
+        }
+    }
+    mesh_build(mesh);
+}
+
+static const bench_scene_t SCENES[] = {
+        {.name="whitted", .builtin="whitted", .size_x=500, .size_y=375},
+        {.name="pool", .builtin="pool", .size_x=1000, .size_y=200},
+        {.name="art", .builtin="art", .size_x=400, .size_y=400},
+        {.name="spheres_10k", .generate=generate_spheres, .count=10000, .size_x=400, .size_y=300},
+        {.name="spheres_100k", .generate=generate_spheres, .count=100000, .size_x=400, .size_y=300},
+        {.name="spheres_1m", .generate=generate_spheres, .count=1000000, .size_x=400, .size_y=300},
+        {.name="lights_64", .generate=generate_lights, .count=64, .size_x=200, .size_y=150},
+        {.name="refraction", .generate=generate_refraction, .count=125, .size_x=400, .size_y=300},
+        {.name="mesh_1m", .generate=generate_mesh, .count=1000000, .size_x=400, .size_y=300},
+};
+
+#define SCENE_COUNT (sizeof(SCENES) / sizeof(SCENES[0]))
+
+/** measurements of a scene */
+typedef struct {
+    const char *name;
+    uint32_t runs;
+    double wall_median;  // seconds
+    double wall_stddev;  // seconds
+    double prepare;      // seconds to generate or load the scene and build the hierarchy
+    uint64_t rays;       // camera, reflection, refraction and shadow rays of a single run
+    uint64_t tests;      // sphere and plane intersection tests of a single run
+    double rays_per_second;
+    double ns_per_test;  // thread time per intersection test
+} bench_result_t;
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_scene(const bench_scene_t *scene, pool_t *pool, uint32_t runs, bench_result_t *result)
+{
+    uint64_t time = stats_now();
+    if (scene->builtin) {
+        scene_load_builtin(scene->builtin);
+    } else {
+        random_state = 2463534242u;
+        scene->generate(scene->count);
+    }
+    SIZE_X = scene->size_x;
+    SIZE_Y = scene->size_y;
+    scene_compile();
+    sphere_soa_from_scene(&SPHERES_SOA);
+#ifdef USE_BVH
+    bvh_build(&BVH);
+#endif
+    result->prepare = (stats_now() - time) / 1e9;
+
+    camera_t camera;
+    camera_init(&camera);
+    render_options_t options = {.packet_width=0, .min_weight=MIN_RAY_WEIGHT};
+    vec3f *image = malloc(SIZE_X * SIZE_Y * sizeof(vec3f));
+
+    double *walls = malloc(runs * sizeof(double));
+    render_stats_t stats;
+    for (uint32_t i = 0; i < runs; i++) {
+        time = stats_now();
+        render_image(pool, &camera, &options, image, &stats);
+        walls[i] = (stats_now() - time) / 1e9;
+    }
+
+    double mean = 0.;
+    for (uint32_t i = 0; i < runs; i++) {
+        mean += walls[i] / runs;
+    }
+    double variance = 0.;
+    for (uint32_t i = 0; i < runs; i++) {
+        variance += (walls[i] - mean) * (walls[i] - mean) / (runs > 1 ? runs - 1 : 1);
+    }
+    qsort(walls, runs, sizeof(double), compare_double);
+
+    const uint64_t *c = stats.counters.counters;
+    result->name = scene->name;
+    result->runs = runs;
+    result->wall_median = runs % 2 ? walls[runs / 2] : (walls[runs / 2 - 1] + walls[runs / 2]) / 2.;
+    result->wall_stddev = sqrt(variance);
+    result->rays = c[STAT_RAYS_PRIMARY] + c[STAT_RAYS_REFLECTION] + c[STAT_RAYS_REFRACTION] + c[STAT_RAYS_SHADOW];
+    result->tests = c[STAT_SPHERE_TESTS] + c[STAT_PLANE_TESTS] + c[STAT_TRIANGLE_TESTS];
+    result->rays_per_second = result->rays / result->wall_median;
+    result->ns_per_test = result->tests ? result->wall_median * pool_size(pool) * 1e9 / result->tests : 0.;
+
+    free(walls);
+    free(image);
+#ifdef USE_BVH
+    bvh_free(&BVH);
+#endif
+    sphere_soa_free(&SPHERES_SOA);
+    scene_unload();
+}
+
+static bool write_results(const char *path, const bench_result_t *results, uint32_t count, uint32_t threads)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    // one scene per line, so results can be diffed and read back by --compare
+    fprintf(file, "{\n  \"threads\": %u,\n  \"bvh\": %s,\n  \"kernel\": \"%s\",\n  \"scenes\": [\n", threads,
+#ifdef USE_BVH
+            "true",
+#else
+            "false",
+#endif
+            sphere_kernel_name(sphere_kernel_select(KERNEL_AUTO)));
+    for (uint32_t i = 0; i < count; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"runs\": %u, \"wall_median_s\": %.6f, \"wall_stddev_s\": %.6f, "
+                      "\"prepare_s\": %.6f, \"rays\": %llu, \"tests\": %llu, \"rays_per_s\": %.0f, "
+                      "\"ns_per_test\": %.3f}%s\n",
+                r->name, r->runs, r->wall_median, r->wall_stddev, r->prepare, (unsigned long long) r->rays,
+                (unsigned long long) r->tests, r->rays_per_second, r->ns_per_test, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+/**
+ * compares the median wall times of {results} with those in file {path} written by an earlier run.
+ * returns the number of scenes that became slower by more than a fraction {tolerance}, or -1 on failure */
+static int compare_results(const char *path, const bench_result_t *results, uint32_t count, double tolerance)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char name[64];
+        double wall;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"runs\": %*u, \"wall_median_s\": %lf", name, &wall) != 2) {
+            continue;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (strcmp(results[i].name, name) != 0) {
+                continue;
+            }
+            double change = results[i].wall_median / wall - 1.;
+            bool regression = change > tolerance;
+            regressions += regression;
+            printf("%-14s %9.4f s -> %9.4f s  %+6.1f%%%s\n",
+                   name, wall, results[i].wall_median, 100. * change, regression ? "  REGRESSION" : "");
+        }
+    }
+    fclose(file);
+
+    return regressions;
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--runs N] [--threads N] [--scenes NAME,...] [--output FILE] "
+                    "[--compare FILE] [--tolerance FRACTION]\nscenes:", name);
+    for (uint32_t i = 0; i < SCENE_COUNT; i++) {
+        fprintf(stderr, " %s", SCENES[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+/** returns whether scene {name} is in the comma separated list {list} */
+static bool in_list(const char *list, const char *name)
+{
+    size_t length = strlen(name);
+    for (const char *p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+        if (strncmp(p, name, length) == 0 && (p[length] == ',' || p[length] == '\0')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t runs = 5;
+    uint32_t thread_count = pool_processor_count();
+    const char *scenes = NULL;
+    const char *output_path = "bench.json";
+    const char *compare_path = NULL;
+    double tolerance = .1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scenes") == 0 && i + 1 < argc) {
+            scenes = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = strtod(argv[++i], NULL);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1 || thread_count < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!STATS_ENABLED) {
+        fprintf(stderr, "built without RAY_TRACER_STATS, rays and intersection tests are not counted\n");
+    }
+
+    sphere_kernel_select(KERNEL_AUTO);
+    pool_t *pool = pool_create(thread_count);
+    if (!pool) {
+        fprintf(stderr, "failed to create worker threads\n");
+        return 1;
+    }
+
+    printf("%-14s %10s %10s %10s %12s %12s %10s\n",
+           "scene", "median s", "stddev s", "prepare s", "Mrays/s", "ns/test", "tests/ray");
+    bench_result_t results[SCENE_COUNT];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < SCENE_COUNT; i++) {
+        if (scenes && !in_list(scenes, SCENES[i].name)) {
+            continue;
+        }
+        bench_result_t *r = &results[count++];
+        bench_scene(&SCENES[i], pool, runs, r);
+        printf("%-14s %10.4f %10.4f %10.4f %12.3f %12.2f %10.1f\n", r->name, r->wall_median, r->wall_stddev,
+               r->prepare, r->rays_per_second / 1e6, r->ns_per_test, r->rays ? (double) r->tests / r->rays : 0.);
+        fflush(stdout);
+    }
+    pool_destroy(pool);
+
+    // the baseline is read before the results are written, it may be the output file
+    int regressions = compare_path ? compare_results(compare_path, results, count, tolerance) : 0;
+    if (!write_results(output_path, results, count, thread_count)) {
+        return 1;
+    }
+
+    return regressions != 0;
+}
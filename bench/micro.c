@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "stats.h"
+
+/**
+ * microbenchmark of the vector operations on the intersection path: the ray-sphere intersection of reflect_sphere is
+ * timed with the inlined operations of vec3.h against copies that are kept out of line, as they were when compiled in
+ * their own translation unit, and the normalizations are timed against each other */
+
+#define SPHERE_COUNT 1024
+#define RAY_COUNT 1024
+#define MAX_RUNS 1000
+
+/** xorshift generator, so the inputs are equal on every platform */
+static uint32_t random_state = 2463534242u;
+
+static float random_float(float min, float max)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return min + (max - min) * (float) (random_state >> 8) / (float) (1u << 24);
+}
+
+static vec3f random_vec3f(float min, float max)
+{
+    vec3f result = {random_float(min, max), random_float(min, max), random_float(min, max)};
+
+    return result;
+}
+
+/** the operations as they were defined in vec3.c, which calls could not be inlined into */
+__attribute__((noinline)) static vec3f call_add(vec3f a, vec3f b)
+{
+    return vec3f_add(a, b);
+}
+
+__attribute__((noinline)) static vec3f call_sub(vec3f a, vec3f b)
+{
+    return vec3f_sub(a, b);
+}
+
+__attribute__((noinline)) static float call_dot(vec3f a, vec3f b)
+{
+    return vec3f_dot(a, b);
+}
+
+__attribute__((noinline)) static vec3f call_scale(vec3f a, float k)
+{
+    return vec3f_scale(a, k);
+}
+
+__attribute__((noinline)) static vec3f call_norm(vec3f a)
+{
+    float len = sqrtf(call_dot(a, a));
+    if (len == 0) {
+        vec3f result = {0.f, 0.f, 0.f};
+        return result;
+    }
+
+    vec3f result = {a.x / len, a.y / len, a.z / len};
+
+    return result;
+}
+
+/** reflect_sphere with the operations out of line, returns the distance to the hit or -1 */
+static float hit_out_of_line(ray_t ray, const sphere_record_t *sphere, vec3f *normal)
+{
+    vec3f v = call_sub(ray.start, sphere->center);
+    float b = call_dot(v, ray.direction);
+    float discriminant = b * b - (call_dot(v, v) - sphere->radius2);
+    if (discriminant < 0) {
+        return -1.f;
+    }
+    float square_root = sqrtf(discriminant);
+    float t = fminf(-b - square_root, -b + square_root);
+    if (t < 0) {
+        return -1.f;
+    }
+    *normal = call_norm(call_sub(call_add(ray.start, call_scale(ray.direction, t)), sphere->center));
+
+    return t;
+}
+
+/** reflect_sphere with the operations of vec3.h */
+static float hit_inline(ray_t ray, const sphere_record_t *sphere, vec3f *normal)
+{
+    vec3f v = vec3f_sub(ray.start, sphere->center);
+    float b = vec3f_dot(v, ray.direction);
+    float discriminant = b * b - (vec3f_dot(v, v) - sphere->radius2);
+    if (discriminant < 0) {
+        return -1.f;
+    }
+    float square_root = sqrtf(discriminant);
+    float t = fminf(-b - square_root, -b + square_root);
+    if (t < 0) {
+        return -1.f;
+    }
+    *normal = vec3f_norm(vec3f_sub(vec3f_madd(ray.start, ray.direction, t), sphere->center));
+
+    return t;
+}
+
+typedef float (*hit_fn_t)(ray_t ray, const sphere_record_t *sphere, vec3f *normal);
+typedef vec3f (*norm_fn_t)(vec3f a);
+
+/** the inputs shared by all measurements, and the normalized directions */
+static sphere_record_t spheres[SPHERE_COUNT];
+static ray_t rays[RAY_COUNT];
+static vec3f directions[RAY_COUNT];
+static vec3f normalized[RAY_COUNT];
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** returns the median of the {count} {values}, which are sorted */
+static double median(double *values, uint32_t count)
+{
+    qsort(values, count, sizeof(double), compare_double);
+
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.;
+}
+
+/**
+ * returns the median over {runs} of the nanoseconds per ray-sphere test of {hit}, {sum} receives a checksum of the
+ * results. always inlined, so {hit} is called directly and inlined in turn if it can be */
+__attribute__((always_inline)) static inline double time_hits(hit_fn_t hit, uint32_t runs, float *sum)
+{
+    double times[MAX_RUNS];
+    for (uint32_t r = 0; r < runs; r++) {
+        float result = 0.f;
+        uint64_t begin = stats_now();
+        for (uint32_t i = 0; i < RAY_COUNT; i++) {
+            for (uint32_t j = 0; j < SPHERE_COUNT; j++) {
+                vec3f normal;
+                float t = hit(rays[i], &spheres[j], &normal);
+                if (t >= 0.f) {
+                    result += t + normal.x;
+                }
+            }
+        }
+        times[r] = (double) (stats_now() - begin) / ((double) RAY_COUNT * SPHERE_COUNT);
+        *sum = result;
+    }
+
+    return median(times, runs);
+}
+
+static vec3f norm_strict(vec3f a)
+{
+    float len = vec3f_len(a);
+    if (len == 0) {
+        vec3f result = {0.f, 0.f, 0.f};
+        return result;
+    }
+
+    vec3f result = {a.x / len, a.y / len, a.z / len};
+
+    return result;
+}
+
+static vec3f norm(vec3f a)
+{
+    return vec3f_norm(a);
+}
+
+static vec3f norm_fast(vec3f a)
+{
+    return vec3f_norm_fast(a);
+}
+
+/**
+ * returns the median over {runs} of the nanoseconds per normalization of {fn}, and in {error} the largest deviation
+ * of a length from 1. always inlined, as time_hits */
+__attribute__((always_inline)) static inline double time_norm(norm_fn_t fn, uint32_t runs, float *sum, float *error)
+{
+    double times[MAX_RUNS];
+    for (uint32_t r = 0; r < runs; r++) {
+        uint64_t begin = stats_now();
+        for (uint32_t k = 0; k < SPHERE_COUNT; k++) {
+            for (uint32_t i = 0; i < RAY_COUNT; i++) {
+                normalized[i] = fn(directions[i]);
+            }
+        }
+        times[r] = (double) (stats_now() - begin) / ((double) RAY_COUNT * SPHERE_COUNT);
+    }
+
+    *sum = 0.f;
+    *error = 0.f;
+    for (uint32_t i = 0; i < RAY_COUNT; i++) {
+        // the length in double, so the error is not hidden by rounding
+        vec3f n = normalized[i];
+        double len = sqrt((double) n.x * n.x + (double) n.y * n.y + (double) n.z * n.z);
+        *error = fmaxf(*error, (float) fabs(len - 1.));
+        *sum += n.x;
+    }
+
+    return median(times, runs);
+}
+
+static void print_hits(const char *name, double ns, double baseline, float sum)
+{
+    printf("%-28s%6.2f ns, %.2fx (checksum %g)\n", name, ns, baseline / ns, (double) sum);
+}
+
+static void print_norm(const char *name, double ns, double baseline, float sum, float error)
+{
+    printf("%-28s%6.2f ns, %.2fx, length error %.1e (checksum %g)\n", name, ns, baseline / ns, (double) error,
+           (double) sum);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t runs = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1 || value > MAX_RUNS) {
+                fprintf(stderr, "--runs expects a number in [1, %u]\n", MAX_RUNS);
+                return 1;
+            }
+            runs = (uint32_t) value;
+        } else {
+            fprintf(stderr, "usage: %s [--runs N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /** spheres around the origin, rays from outside towards it so about half of the tests hit */
+    for (uint32_t i = 0; i < SPHERE_COUNT; i++) {
+        spheres[i].center = random_vec3f(-4.f, 4.f);
+        float radius = random_float(.5f, 3.f);
+        spheres[i].radius2 = radius * radius;
+    }
+    for (uint32_t i = 0; i < RAY_COUNT; i++) {
+        rays[i].start = random_vec3f(-20.f, 20.f);
+        rays[i].direction = vec3f_norm(vec3f_sub(random_vec3f(-2.f, 2.f), rays[i].start));
+        directions[i] = random_vec3f(-10.f, 10.f);
+    }
+
+    // each function is timed by its own call, so it is known where time_hits and time_norm are inlined
+    float sum;
+    float error;
+    double baseline = time_hits(hit_out_of_line, runs, &sum);
+    print_hits("sphere test, out of line", baseline, baseline, sum);
+    print_hits("sphere test, inlined", time_hits(hit_inline, runs, &sum), baseline, sum);
+
+    baseline = time_norm(norm_strict, runs, &sum, &error);
+    print_norm("norm, divisions", baseline, baseline, sum, error);
+    print_norm("vec3f_norm", time_norm(norm, runs, &sum, &error), baseline, sum, error);
+    print_norm("vec3f_norm_fast", time_norm(norm_fast, runs, &sum, &error), baseline, sum, error);
+
+    return 0;
+}
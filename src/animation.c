@@ -0,0 +1,286 @@
+#include "animation.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+
+/** returns the track of {type} and {index} in {animation}, which is added if there is none */
+static track_t *find_track(animation_t *animation, track_type_t type, uint32_t index)
+{
+    for (uint32_t i = 0; i < animation->track_count; i++) {
+        if (animation->tracks[i].type == type && animation->tracks[i].index == index) {
+            return &animation->tracks[i];
+        }
+    }
+
+    animation->tracks = realloc(animation->tracks, (animation->track_count + 1) * sizeof(track_t));
+    track_t *track = &animation->tracks[animation->track_count++];
+    *track = (track_t) {.type=type, .index=index, .keys=NULL, .key_count=0};
+
+    return track;
+}
+
+/** inserts {key} into {track} in order of frame, replacing a key of the same frame */
+static void insert_key(track_t *track, keyframe_t key)
+{
+    uint32_t i = track->key_count;
+    while (i > 0 && track->keys[i - 1].frame > key.frame) {
+        i--;
+    }
+    if (i > 0 && track->keys[i - 1].frame == key.frame) {
+        track->keys[i - 1] = key;
+        return;
+    }
+
+    track->keys = realloc(track->keys, (track->key_count + 1) * sizeof(keyframe_t));
+    memmove(&track->keys[i + 1], &track->keys[i], (track->key_count - i) * sizeof(keyframe_t));
+    track->keys[i] = key;
+    track->key_count++;
+}
+
+/** returns the number of objects that tracks of {type} can refer to */
+static uint32_t object_count(track_type_t type)
+{
+    switch (type) {
+        case TRACK_SPHERE:
+        case TRACK_SPHERE_COLOR:
+            return SPHERES_SIZE;
+        case TRACK_PLANE:
+        case TRACK_PLANE_COLOR:
+            return PLANES_SIZE;
+        case TRACK_LIGHT:
+            return LIGHTS_SIZE;
+        case TRACK_MESH:
+        case TRACK_MESH_COLOR:
+            return MESHES_SIZE;
+        default:
+            return 1;
+    }
+}
+
+/** returns the track of the color of the objects that tracks of {type} move, or {type} if they have no color */
+static track_type_t color_track(track_type_t type)
+{
+    switch (type) {
+        case TRACK_SPHERE:
+            return TRACK_SPHERE_COLOR;
+        case TRACK_PLANE:
+            return TRACK_PLANE_COLOR;
+        case TRACK_MESH:
+            return TRACK_MESH_COLOR;
+        default:
+            return type;
+    }
+}
+
+/** parses {line} into {animation}, returns false and prints the reason if it is not valid */
+static bool parse_line(animation_t *animation, char *line, const char *path, uint32_t number)
+{
+    char *comment = strchr(line, '#');
+    if (comment) {
+        *comment = '\0';
+    }
+
+    static const struct {
+        const char *name;
+        track_type_t type;
+    } TRACKS[] = {
+            {"eye", TRACK_EYE}, {"target", TRACK_TARGET}, {"sphere", TRACK_SPHERE}, {"plane", TRACK_PLANE},
+            {"light", TRACK_LIGHT}, {"mesh", TRACK_MESH}
+    };
+
+    char word[16];
+    int length = 0;
+    if (sscanf(line, "%15s%n", word, &length) != 1) {
+        return true; // blank line
+    }
+    const char *rest = line + length;
+    int end = 0;
+    if (strcmp(word, "frames") == 0) {
+        unsigned count;
+        if (sscanf(rest, "%u %n", &count, &end) != 1 || rest[end] != '\0' || count == 0) {
+            fprintf(stderr, "%s:%u: expected a positive number of frames\n", path, number);
+            return false;
+        }
+        animation->frame_count = count;
+        return true;
+    }
+    bool color = strcmp(word, "color") == 0;
+    if (color) {
+        // followed by the kind of object, of which the track is colored instead
+        if (sscanf(rest, "%15s%n", word, &length) != 1) {
+            length = 0;
+            word[0] = '\0';
+        }
+        rest += length;
+    }
+
+    for (uint32_t t = 0; t < sizeof(TRACKS) / sizeof(TRACKS[0]); t++) {
+        if (strcmp(word, TRACKS[t].name) != 0) {
+            continue;
+        }
+        track_type_t type = color ? color_track(TRACKS[t].type) : TRACKS[t].type;
+        if (color && type == TRACKS[t].type) {
+            break;
+        }
+        unsigned index = 0;
+        unsigned frame;
+        keyframe_t key;
+        bool camera = type == TRACK_EYE || type == TRACK_TARGET;
+        int count = camera ?
+                    sscanf(rest, "%u %f %f %f %n", &frame, &key.value.x, &key.value.y, &key.value.z, &end) + 1 :
+                    sscanf(rest, "%u %u %f %f %f %n", &index, &frame, &key.value.x, &key.value.y, &key.value.z, &end);
+        if (count != 5 || rest[end] != '\0') {
+            fprintf(stderr, "%s:%u: expected %sFRAME %s\n", path, number, camera ? "" : "INDEX ",
+                    color ? "R G B" : "X Y Z");
+            return false;
+        }
+        if (index >= object_count(type)) {
+            fprintf(stderr, "%s:%u: the scene has no %s %u\n", path, number, word, index);
+            return false;
+        }
+        if (type == TRACK_LIGHT && LIGHTS[index].type != LIGHT_POINT) {
+            fprintf(stderr, "%s:%u: light %u is not a point light\n", path, number, index);
+            return false;
+        }
+        key.frame = frame;
+        insert_key(find_track(animation, type, index), key);
+        return true;
+    }
+
+    if (color) {
+        fprintf(stderr, "%s:%u: expected color sphere|plane|mesh\n", path, number);
+    } else {
+        fprintf(stderr, "%s:%u: unknown keyword %s\n", path, number, word);
+    }
+    return false;
+}
+
+bool animation_load(animation_t *animation, const char *path)
+{
+    memset(animation, 0, sizeof(animation_t));
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[1024];
+    uint32_t number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        ok = parse_line(animation, line, path, number);
+    }
+    fclose(file);
+    if (ok && animation->frame_count == 0) {
+        fprintf(stderr, "%s: expected the number of frames\n", path);
+        ok = false;
+    }
+    if (!ok) {
+        animation_free(animation);
+    }
+
+    return ok;
+}
+
+void animation_free(animation_t *animation)
+{
+    for (uint32_t i = 0; i < animation->track_count; i++) {
+        free(animation->tracks[i].keys);
+    }
+    free(animation->tracks);
+    memset(animation, 0, sizeof(animation_t));
+}
+
+/** returns the value of {track} in {frame} */
+static vec3f track_value(const track_t *track, uint32_t frame)
+{
+    uint32_t i = 0;
+    while (i < track->key_count && track->keys[i].frame <= frame) {
+        i++;
+    }
+    if (i == 0) {
+        return track->keys[0].value;
+    }
+    if (i == track->key_count) {
+        return track->keys[i - 1].value;
+    }
+
+    const keyframe_t *a = &track->keys[i - 1];
+    const keyframe_t *b = &track->keys[i];
+    float s = (float) (frame - a->frame) / (float) (b->frame - a->frame);
+
+    return vec3f_madd(a->value, vec3f_sub(b->value, a->value), s);
+}
+
+bool animation_apply(const animation_t *animation, uint32_t frame)
+{
+    bool moved = false;
+    for (uint32_t i = 0; i < animation->track_count; i++) {
+        const track_t *track = &animation->tracks[i];
+        vec3f value = track_value(track, frame);
+        switch (track->type) {
+            case TRACK_EYE:
+                EYE = value;
+                break;
+            case TRACK_TARGET:
+                TARGET = value;
+                break;
+            case TRACK_SPHERE:
+                moved = moved || !vec3f_eq(SPHERES[track->index].center, value);
+                SPHERES[track->index].center = value;
+                break;
+            case TRACK_PLANE:
+                moved = moved || !vec3f_eq(PLANES[track->index].point, value);
+                PLANES[track->index].point = value;
+                break;
+            case TRACK_LIGHT:
+                moved = moved || !vec3f_eq(LIGHTS[track->index].v.location, value);
+                LIGHTS[track->index].v.location = value;
+                break;
+            case TRACK_MESH: {
+                mesh_t *mesh = &MESHES[track->index];
+                if (!vec3f_eq(mesh->translation, value)) {
+                    // a rigid move, the hierarchy of the mesh moves along
+                    mesh_transform(mesh, 1.f, vec3f_sub(value, mesh->translation));
+                    mesh->translation = value;
+                    moved = true;
+                }
+                break;
+            }
+            case TRACK_SPHERE_COLOR:
+                SPHERES[track->index].material.color = value;
+                break;
+            case TRACK_PLANE_COLOR:
+                PLANES[track->index].material.color = value;
+                break;
+            case TRACK_MESH_COLOR:
+                MESHES[track->index].material.color = value;
+                break;
+        }
+    }
+
+    return moved;
+}
+
+void animation_frame_path(char *buffer, size_t size, const char *pattern, uint32_t frame)
+{
+    const char *name = strrchr(pattern, '/');
+    name = name ? name + 1 : pattern;
+    const char *first = strchr(name, '#');
+    if (first) {
+        size_t width = strspn(first, "#");
+        snprintf(buffer, size, "%.*s%0*u%s", (int) (first - pattern), pattern, (int) width, frame, first + width);
+        return;
+    }
+
+    const char *extension = strrchr(name, '.');
+    if (!extension) {
+        extension = name + strlen(name);
+    }
+    snprintf(buffer, size, "%.*s.%04u%s", (int) (extension - pattern), pattern, frame, extension);
+}
@@ -0,0 +1,71 @@
+#ifndef RAY_TRACER_ANIMATION_H
+#define RAY_TRACER_ANIMATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vec3.h"
+
+/** what a track of keyframes moves or colors */
+typedef enum {
+    TRACK_EYE,          // EYE
+    TRACK_TARGET,       // TARGET
+    TRACK_SPHERE,       // center of a sphere
+    TRACK_PLANE,        // point of a plane
+    TRACK_LIGHT,        // location of a point light
+    TRACK_MESH,         // translation of a mesh
+    TRACK_SPHERE_COLOR, // color of the material of a sphere
+    TRACK_PLANE_COLOR,  // color of the material of a plane
+    TRACK_MESH_COLOR    // color of the material of a mesh
+} track_type_t;
+
+typedef struct {
+    uint32_t frame;
+    vec3f value;
+} keyframe_t;
+
+/** positions of a camera point or an object, or colors of an object, at keyframes, linearly interpolated in between */
+typedef struct {
+    track_type_t type;
+    uint32_t index;      // of the object in SPHERES, PLANES, LIGHTS or MESHES
+    keyframe_t *keys;    // in order of frame
+    uint32_t key_count;
+} track_t;
+
+typedef struct {
+    uint32_t frame_count;
+    track_t *tracks;
+    uint32_t track_count;
+} animation_t;
+
+/**
+ * loads {animation} of the current scene from file {path}. returns false and prints the reason on failure.
+ * the file consists of lines of whitespace-separated values, '#' starts a comment:
+ *   frames COUNT
+ *   eye FRAME X Y Z
+ *   target FRAME X Y Z
+ *   sphere INDEX FRAME X Y Z    center
+ *   plane INDEX FRAME X Y Z     point, the directions of the plane do not change
+ *   light INDEX FRAME X Y Z     location of a point light
+ *   mesh INDEX FRAME X Y Z      translation, added to the vertices as loaded and scaled
+ *   color sphere|plane|mesh INDEX FRAME R G B
+ *                               color of the material of the object, the other properties do not change
+ * objects are numbered in the order of the scene from 0, frames from 0 to COUNT - 1. before its first and after its
+ * last keyframe, a track keeps the value of that keyframe */
+bool animation_load(animation_t *animation, const char *path);
+
+/** frees the memory of {animation} */
+void animation_free(animation_t *animation);
+
+/**
+ * moves the camera and the objects of the current scene to their positions in {frame}, and sets the colors of objects.
+ * returns whether spheres, planes, meshes or lights moved, after which the scene has to be compiled and its hierarchy
+ * refit. colors are read from the objects as they are shaded, so only changing them needs neither */
+bool animation_apply(const animation_t *animation, uint32_t frame);
+
+/**
+ * writes to {buffer} of {size} bytes the path of {frame} following {pattern}: the first run of '#' in the file name is
+ * replaced by the zero-padded frame number, if there is none the number is inserted before the extension */
+void animation_frame_path(char *buffer, size_t size, const char *pattern, uint32_t frame);
+
+#endif //RAY_TRACER_ANIMATION_H
@@ -0,0 +1,168 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *CATEGORY_NAMES[MEMORY_CATEGORY_COUNT] = {"scene", "hierarchy", "image", "tiles", "threads"};
+
+void memory_budget_init(memory_budget_t *budget, size_t limit)
+{
+    memset(budget, 0, sizeof(memory_budget_t));
+    budget->limit = limit;
+}
+
+/** adds {size} bytes in use of {category} to {budget} */
+static void charge(memory_budget_t *budget, memory_category_t category, size_t size)
+{
+    budget->used[category] += size;
+    if (budget->used[category] > budget->peak[category]) {
+        budget->peak[category] = budget->used[category];
+    }
+    size_t used = 0;
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        used += budget->used[i];
+    }
+    if (used > budget->peak_used) {
+        budget->peak_used = used;
+    }
+}
+
+/** reserves {size} bytes of the limit of {budget}, returns false if they do not fit */
+static bool reserve(memory_budget_t *budget, size_t size)
+{
+    if (budget->limit > 0 && (size > budget->limit || budget->reserved > budget->limit - size)) {
+        return false;
+    }
+    budget->reserved += size;
+
+    return true;
+}
+
+bool memory_reserve(memory_budget_t *budget, memory_category_t category, size_t size)
+{
+    if (!reserve(budget, size)) {
+        return false;
+    }
+    charge(budget, category, size);
+
+    return true;
+}
+
+void memory_release(memory_budget_t *budget, memory_category_t category, size_t size)
+{
+    budget->reserved -= size;
+    budget->used[category] -= size;
+}
+
+/** writes {size} bytes to {text} in the largest unit of which there is at least one */
+static void format_size(char *text, size_t length, size_t size)
+{
+    if (size >= 1000000) {
+        snprintf(text, length, "%.2f MB", (double) size / 1e6);
+    } else if (size >= 1000) {
+        snprintf(text, length, "%.2f KB", (double) size / 1e3);
+    } else {
+        snprintf(text, length, "%zu bytes", size);
+    }
+}
+
+void memory_budget_print(const memory_budget_t *budget, FILE *file)
+{
+    char size[32];
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "memory %s:", CATEGORY_NAMES[i]);
+        format_size(size, sizeof(size), budget->peak[i]);
+        fprintf(file, "%-20s%s peak\n", label, size);
+    }
+    format_size(size, sizeof(size), budget->peak_used);
+    fprintf(file, "memory:             %s peak, ", size);
+    format_size(size, sizeof(size), budget->reserved);
+    fprintf(file, "%s reserved", size);
+    if (budget->limit > 0) {
+        format_size(size, sizeof(size), budget->limit);
+        fprintf(file, " of a budget of %s", size);
+    }
+    fprintf(file, "\n");
+}
+
+bool arena_init(arena_t *arena, memory_budget_t *budget, size_t capacity)
+{
+    memset(arena, 0, sizeof(arena_t));
+    capacity = arena_size(capacity);
+    if (budget && !reserve(budget, capacity)) {
+        return false;
+    }
+
+    void *data = NULL;
+    if (capacity > 0 && posix_memalign(&data, ARENA_ALIGNMENT, capacity) != 0) {
+        if (budget) {
+            budget->reserved -= capacity;
+        }
+        return false;
+    }
+    arena->budget = budget;
+    arena->data = data;
+    arena->capacity = capacity;
+    arena->owned = true;
+
+    return true;
+}
+
+/** returns {size} bytes of {arena} without accounting them, or NULL if it has no room */
+static void *take(arena_t *arena, size_t size)
+{
+    size = arena_size(size);
+    if (size > arena->capacity - arena->used) {
+        return NULL;
+    }
+    void *memory = arena->data + arena->used;
+    arena->used += size;
+
+    return memory;
+}
+
+void arena_split(arena_t *parent, arena_t *child, size_t capacity)
+{
+    // the child accounts its own allocations, the part of the parent it covers is not charged
+    memset(child, 0, sizeof(arena_t));
+    child->budget = parent->budget;
+    child->capacity = arena_size(capacity);
+    child->data = take(parent, child->capacity);
+}
+
+void *arena_alloc(arena_t *arena, memory_category_t category, size_t size)
+{
+    void *memory = take(arena, size);
+    if (memory) {
+        arena->charged[category] += arena_size(size);
+        if (arena->budget) {
+            charge(arena->budget, category, arena_size(size));
+        }
+    }
+
+    return memory;
+}
+
+void arena_reset(arena_t *arena)
+{
+    for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        if (arena->budget) {
+            arena->budget->used[i] -= arena->charged[i];
+        }
+        arena->charged[i] = 0;
+    }
+    arena->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_reset(arena);
+    if (arena->owned) {
+        if (arena->budget) {
+            arena->budget->reserved -= arena->capacity;
+        }
+        free(arena->data);
+    }
+    memset(arena, 0, sizeof(arena_t));
+}
@@ -0,0 +1,86 @@
+#ifndef RAY_TRACER_ARENA_H
+#define RAY_TRACER_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** alignment of the allocations of an arena, a cache line so the sub-arenas of threads do not share one */
+#define ARENA_ALIGNMENT 64
+
+/** what memory is used for, reported separately */
+typedef enum {
+    MEMORY_SCENE,     // objects, their intersection records and sphere arrays, and meshes
+    MEMORY_HIERARCHY, // hierarchies over the objects and the lights
+    MEMORY_IMAGE,     // linear colors of the images and the samples of progressive rendering
+    MEMORY_TILES,     // buffers of a render shared by its tiles
+    MEMORY_THREADS,   // state of each worker thread: ray stacks, light selection, camera rays and colors of a tile
+    MEMORY_CATEGORY_COUNT
+} memory_category_t;
+
+/**
+ * limit on the memory of a run, and the memory in use per category. memory is reserved against the limit when an
+ * arena is created or memory allocated elsewhere is accounted, so a run that does not fit fails before it starts.
+ * not thread-safe: arenas are created and reset by the thread that starts the renders */
+typedef struct {
+    size_t limit;                       // bytes that may be reserved, 0: no limit
+    size_t reserved;                    // bytes reserved so far
+    size_t used[MEMORY_CATEGORY_COUNT]; // bytes in use per category
+    size_t peak[MEMORY_CATEGORY_COUNT]; // most bytes in use at once per category
+    size_t peak_used;                   // most bytes in use at once over all categories
+} memory_budget_t;
+
+/**
+ * linear allocator over a block of memory reserved once. allocations are freed all at once by resetting the arena,
+ * so nothing is allocated or freed while rendering. a sub-arena is a part of the block of its parent, given to a
+ * thread that allocates from it without locking */
+typedef struct {
+    memory_budget_t *budget;                    // if not NULL: the allocations are accounted to it
+    uint8_t *data;
+    size_t capacity;
+    size_t used;
+    size_t charged[MEMORY_CATEGORY_COUNT];      // bytes accounted per category since the last reset
+    bool owned;                                 // the block was allocated by this arena, not by a parent
+} arena_t;
+
+/** returns {size} rounded up to ARENA_ALIGNMENT, the room an allocation of {size} bytes takes in an arena */
+static inline size_t arena_size(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+}
+
+/** makes {budget} an empty budget of {limit} bytes, 0 for no limit */
+void memory_budget_init(memory_budget_t *budget, size_t limit);
+
+/**
+ * accounts {size} bytes of {category}, allocated outside of arenas, to {budget}. returns false and accounts nothing
+ * if they exceed its limit */
+bool memory_reserve(memory_budget_t *budget, memory_category_t category, size_t size);
+
+/** releases {size} bytes of {category} accounted by memory_reserve */
+void memory_release(memory_budget_t *budget, memory_category_t category, size_t size);
+
+/** prints the peak usage per category and the reservations of {budget} to {file} */
+void memory_budget_print(const memory_budget_t *budget, FILE *file);
+
+/**
+ * makes {arena} an arena of {capacity} bytes reserved against {budget}, which may be NULL. returns false if the
+ * reservation exceeds the limit of {budget} or the memory cannot be allocated */
+bool arena_init(arena_t *arena, memory_budget_t *budget, size_t capacity);
+
+/** makes {child} a sub-arena of {capacity} bytes of {parent}, which must have room for it. it is reset with {parent} */
+void arena_split(arena_t *parent, arena_t *child, size_t capacity);
+
+/**
+ * returns {size} bytes of {arena} for {category}, aligned to ARENA_ALIGNMENT, or NULL if it has no room. the memory is
+ * not initialized */
+void *arena_alloc(arena_t *arena, memory_category_t category, size_t size);
+
+/** frees the allocations of {arena}. sub-arenas must be reset first, after which they are no longer valid */
+void arena_reset(arena_t *arena);
+
+/** resets {arena} and releases its block */
+void arena_free(arena_t *arena);
+
+#endif //RAY_TRACER_ARENA_H
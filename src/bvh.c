@@ -0,0 +1,591 @@
+#include "bvh.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include "scene.h"
+#include "stats.h"
+
+#define BIN_COUNT 16        // number of bins per axis when evaluating splits
+#define MAX_LEAF_SIZE 8     // nodes with more objects are always split, for the hierarchy over the scene objects
+#define MAX_SAH_DEPTH 40    // below this depth objects are split in halves, keeping the tree shallow
+#define MAX_DEPTH (BVH_STACK_SIZE - 1) // deepest leaf a traversal stack has room for
+#define TRAVERSAL_COST 1.f  // cost of visiting a node relative to intersecting an object
+
+bvh_t BVH;
+
+aabb_t aabb_empty(void)
+{
+    aabb_t result = {{FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+
+    return result;
+}
+
+void aabb_grow(aabb_t *a, vec3f p)
+{
+    // comparisons instead of fminf and fmaxf, which are calls unless nans may be ignored
+    a->min.x = p.x < a->min.x ? p.x : a->min.x;
+    a->min.y = p.y < a->min.y ? p.y : a->min.y;
+    a->min.z = p.z < a->min.z ? p.z : a->min.z;
+    a->max.x = p.x > a->max.x ? p.x : a->max.x;
+    a->max.y = p.y > a->max.y ? p.y : a->max.y;
+    a->max.z = p.z > a->max.z ? p.z : a->max.z;
+}
+
+static void aabb_merge(aabb_t *a, const aabb_t *b)
+{
+    aabb_grow(a, b->min);
+    aabb_grow(a, b->max);
+}
+
+static float aabb_area(const aabb_t *a)
+{
+    float dx = a->max.x - a->min.x;
+    float dy = a->max.y - a->min.y;
+    float dz = a->max.z - a->min.z;
+
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+static float component(vec3f v, uint32_t axis)
+{
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+/** grows {a} slightly, so hit points with rounding errors still lie inside */
+static void aabb_pad(aabb_t *a)
+{
+    a->min.x -= 1e-4f * (1.f + fabsf(a->min.x));
+    a->min.y -= 1e-4f * (1.f + fabsf(a->min.y));
+    a->min.z -= 1e-4f * (1.f + fabsf(a->min.z));
+    a->max.x += 1e-4f * (1.f + fabsf(a->max.x));
+    a->max.y += 1e-4f * (1.f + fabsf(a->max.y));
+    a->max.z += 1e-4f * (1.f + fabsf(a->max.z));
+}
+
+bool bvh_object_bounds(aabb_t *bounds, object_t object)
+{
+    if (object.type == OBJECT_SPHERE) {
+        const sphere_t *sphere = &SPHERES[object.index];
+        vec3f r = {sphere->radius, sphere->radius, sphere->radius};
+        bounds->min = vec3f_sub(sphere->center, r);
+        bounds->max = vec3f_add(sphere->center, r);
+        aabb_pad(bounds);
+
+        return true;
+    }
+
+    if (object.type == OBJECT_MESH) {
+        // meshes are never empty, the root of their own hierarchy bounds all triangles
+        *bounds = MESHES[object.index].nodes[0].bounds;
+        aabb_pad(bounds);
+
+        return true;
+    }
+
+    return bvh_plane_bounds(bounds, &PLANES[object.index]);
+}
+
+bool bvh_plane_bounds(aabb_t *bounds, const plane_t *plane)
+{
+    if (plane->type != PLANE_BOUNDED) {
+        return false;
+    }
+
+    // the plane contains the points a (relative to point) with a.n = 0, 0 <= a.f <= |first| and 0 <= a.s <= |second|,
+    // the corners are found by solving these three equations for the four combinations of bounds
+    vec3f n = vec3f_norm(plane->normal);
+    vec3f f = vec3f_norm(plane->first);
+    vec3f s = vec3f_norm(plane->second);
+    float det = vec3f_dot(f, vec3f_cross(s, n));
+    if (fabsf(det) < 1e-6f) {
+        // first and second do not span the plane, the region is not bounded
+        return false;
+    }
+
+    vec3f sn = vec3f_scale(vec3f_cross(s, n), 1.f / det);
+    vec3f nf = vec3f_scale(vec3f_cross(n, f), 1.f / det);
+    float u[2] = {0.f, vec3f_len(plane->first)};
+    float v[2] = {0.f, vec3f_len(plane->second)};
+
+    *bounds = aabb_empty();
+    for (uint32_t i = 0; i < 2; i++) {
+        for (uint32_t j = 0; j < 2; j++) {
+            aabb_grow(bounds, vec3f_add(plane->point, vec3f_add(vec3f_scale(sn, u[i]), vec3f_scale(nf, v[j]))));
+        }
+    }
+    aabb_pad(bounds);
+
+    return true;
+}
+
+typedef struct {
+    bvh_node_t *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    aabb_t *bounds;          // bounds per primitive, reordered along with the primitives
+    vec3f *centroids;        // centroid of the bounds per primitive
+    uint32_t max_leaf_size;
+    bvh_swap_fn_t swap;
+    void *items;
+} builder_t;
+
+static void swap_primitives(builder_t *builder, uint32_t a, uint32_t b)
+{
+    builder->swap(builder->items, a, b);
+
+    aabb_t bounds = builder->bounds[a];
+    builder->bounds[a] = builder->bounds[b];
+    builder->bounds[b] = bounds;
+
+    vec3f centroid = builder->centroids[a];
+    builder->centroids[a] = builder->centroids[b];
+    builder->centroids[b] = centroid;
+}
+
+static uint32_t bin_of(float c, float c_min, float c_extent)
+{
+    uint32_t bin = (uint32_t) ((c - c_min) * (BIN_COUNT / c_extent));
+
+    return bin < BIN_COUNT ? bin : BIN_COUNT - 1;
+}
+
+/** returns the smallest d for which 2^d >= {n} */
+static uint32_t log2_ceil(uint32_t n)
+{
+    uint32_t d = 0;
+    while (d < 32 && ((uint64_t) 1 << d) < n) {
+        d++;
+    }
+
+    return d;
+}
+
+/**
+ * builds the subtree over primitives [first, first + count) at {depth}, returns the index of its root. the subtree
+ * must fit: {depth} + log2_ceil({count}) <= MAX_DEPTH, which splitting in halves maintains */
+static uint32_t build_node(builder_t *builder, uint32_t first, uint32_t count, uint32_t depth)
+{
+    if (builder->node_count == builder->node_capacity) {
+        // the number of nodes depends on the splits, which leave most leaves with several primitives
+        builder->node_capacity *= 2;
+        builder->nodes = realloc(builder->nodes, builder->node_capacity * sizeof(bvh_node_t));
+    }
+    bvh_node_t *nodes = builder->nodes;
+    uint32_t index = builder->node_count++;
+
+    aabb_t bounds = aabb_empty();
+    aabb_t centroid_bounds = aabb_empty();
+    for (uint32_t i = first; i < first + count; i++) {
+        aabb_merge(&bounds, &builder->bounds[i]);
+        aabb_grow(&centroid_bounds, builder->centroids[i]);
+    }
+    nodes[index].bounds = bounds;
+
+    /** find the split with the lowest surface area heuristic cost */
+    float best_cost = FLT_MAX;
+    uint32_t best_axis = 0;
+    uint32_t best_bin = 0;
+    float node_area = aabb_area(&bounds);
+    // a heuristic split may leave all but one primitive on one side, which must still fit below this node
+    bool sah = depth < MAX_SAH_DEPTH && count > 1 && depth + 1 + log2_ceil(count - 1) <= MAX_DEPTH;
+    for (uint32_t axis = 0; axis < 3 && sah; axis++) {
+        float c_min = component(centroid_bounds.min, axis);
+        float c_extent = component(centroid_bounds.max, axis) - c_min;
+        if (c_extent <= 0.f) {
+            continue;
+        }
+
+        uint32_t bin_counts[BIN_COUNT] = {0};
+        aabb_t bin_bounds[BIN_COUNT];
+        for (uint32_t b = 0; b < BIN_COUNT; b++) {
+            bin_bounds[b] = aabb_empty();
+        }
+        for (uint32_t i = first; i < first + count; i++) {
+            uint32_t b = bin_of(component(builder->centroids[i], axis), c_min, c_extent);
+            bin_counts[b]++;
+            aabb_merge(&bin_bounds[b], &builder->bounds[i]);
+        }
+
+        // cost of the objects left of split b (between bins b and b + 1)
+        float left_cost[BIN_COUNT - 1];
+        aabb_t left = aabb_empty();
+        uint32_t left_count = 0;
+        for (uint32_t b = 0; b < BIN_COUNT - 1; b++) {
+            aabb_merge(&left, &bin_bounds[b]);
+            left_count += bin_counts[b];
+            left_cost[b] = left_count > 0 ? aabb_area(&left) * (float) left_count : 0.f;
+        }
+
+        aabb_t right = aabb_empty();
+        uint32_t right_count = 0;
+        for (uint32_t b = BIN_COUNT - 1; b > 0; b--) {
+            aabb_merge(&right, &bin_bounds[b]);
+            right_count += bin_counts[b];
+            if (right_count == 0 || right_count == count) {
+                // one of the sides would be empty
+                continue;
+            }
+
+            float cost = TRAVERSAL_COST + (left_cost[b - 1] + aabb_area(&right) * (float) right_count) / node_area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b - 1;
+            }
+        }
+    }
+
+    if (count == 1 || (count <= builder->max_leaf_size && (float) count <= best_cost)) {
+        // splitting is not cheaper than intersecting all primitives
+        nodes[index].offset = first;
+        nodes[index].count = count;
+
+        return index;
+    }
+
+    uint32_t mid;
+    if (best_cost < FLT_MAX) {
+        /** partition primitives according to the best split */
+        float c_min = component(centroid_bounds.min, best_axis);
+        float c_extent = component(centroid_bounds.max, best_axis) - c_min;
+        uint32_t i = first;
+        uint32_t j = first + count;
+        while (i < j) {
+            if (bin_of(component(builder->centroids[i], best_axis), c_min, c_extent) <= best_bin) {
+                i++;
+            } else {
+                swap_primitives(builder, i, --j);
+            }
+        }
+        mid = i;
+    } else {
+        // centroids coincide or the tree is too deep, split in halves
+        mid = first + count / 2;
+    }
+
+    build_node(builder, first, mid - first, depth + 1);
+    uint32_t second = build_node(builder, mid, first + count - mid, depth + 1);
+    // the children may have moved the nodes
+    builder->nodes[index].offset = second;
+    builder->nodes[index].count = 0;
+
+    return index;
+}
+
+bvh_node_t *bvh_build_nodes(
+        uint32_t *node_count, aabb_t *bounds, vec3f *centroids, uint32_t count, uint32_t max_leaf_size,
+        bvh_swap_fn_t swap, void *items)
+{
+    builder_t builder = {
+            .node_capacity=count > 0 ? count : 1, .bounds=bounds, .centroids=centroids,
+            .max_leaf_size=max_leaf_size, .swap=swap, .items=items
+    };
+    builder.nodes = malloc(builder.node_capacity * sizeof(bvh_node_t));
+    if (count > 0) {
+        build_node(&builder, 0, count, 0);
+    }
+    *node_count = builder.node_count;
+
+    return realloc(builder.nodes, (builder.node_count > 0 ? builder.node_count : 1) * sizeof(bvh_node_t));
+}
+
+static void swap_objects(void *items, uint32_t a, uint32_t b)
+{
+    object_t *objects = items;
+    object_t object = objects[a];
+    objects[a] = objects[b];
+    objects[b] = object;
+}
+
+void bvh_build(bvh_t *bvh)
+{
+    uint32_t capacity = get_object_count();
+    bvh->objects = malloc((capacity > 0 ? capacity : 1) * sizeof(object_t));
+    bvh->unbounded = malloc((PLANES_SIZE > 0 ? PLANES_SIZE : 1) * sizeof(uint32_t));
+    bvh->object_count = 0;
+    bvh->unbounded_count = 0;
+
+    aabb_t *bounds = malloc((capacity > 0 ? capacity : 1) * sizeof(aabb_t));
+    vec3f *centroids = malloc((capacity > 0 ? capacity : 1) * sizeof(vec3f));
+
+    /** collect objects with finite bounds, only planes can be unbounded */
+    for (uint32_t i = 0; i < capacity; i++) {
+        object_t object = get_object(i);
+        if (!bvh_object_bounds(&bounds[bvh->object_count], object)) {
+            bvh->unbounded[bvh->unbounded_count++] = object.index;
+            continue;
+        }
+
+        const aabb_t *object_bounds = &bounds[bvh->object_count];
+        centroids[bvh->object_count] = vec3f_scale(vec3f_add(object_bounds->min, object_bounds->max), .5f);
+        bvh->objects[bvh->object_count++] = object;
+    }
+
+    bvh->nodes = bvh_build_nodes(
+            &bvh->node_count, bounds, centroids, bvh->object_count, MAX_LEAF_SIZE, swap_objects, bvh->objects);
+
+    free(centroids);
+    free(bounds);
+
+    /** pack the spheres in leaf order, so a leaf is tested with a single kernel call */
+    sphere_soa_init(&bvh->spheres, bvh->object_count);
+    bvh->throughputs = malloc((bvh->object_count > 0 ? bvh->object_count : 1) * sizeof(float));
+    for (uint32_t i = 0; i < bvh->object_count; i++) {
+        if (bvh->objects[i].type == OBJECT_SPHERE) {
+            sphere_soa_set(&bvh->spheres, i, &SPHERE_RECORDS[bvh->objects[i].index]);
+        }
+        bvh->throughputs[i] = get_object_troughput(bvh->objects[i]);
+    }
+}
+
+void bvh_refit(bvh_t *bvh)
+{
+    // children follow their parent, so they are updated before it
+    for (uint32_t i = bvh->node_count; i-- > 0;) {
+        bvh_node_t *node = &bvh->nodes[i];
+        if (node->count == 0) {
+            node->bounds = bvh->nodes[i + 1].bounds;
+            aabb_merge(&node->bounds, &bvh->nodes[node->offset].bounds);
+            continue;
+        }
+
+        node->bounds = aabb_empty();
+        for (uint32_t j = node->offset; j < node->offset + node->count; j++) {
+            aabb_t bounds;
+            bvh_object_bounds(&bounds, bvh->objects[j]);
+            aabb_merge(&node->bounds, &bounds);
+        }
+    }
+
+    for (uint32_t i = 0; i < bvh->object_count; i++) {
+        if (bvh->objects[i].type == OBJECT_SPHERE) {
+            sphere_soa_set(&bvh->spheres, i, &SPHERE_RECORDS[bvh->objects[i].index]);
+        }
+    }
+}
+
+void bvh_free(bvh_t *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->objects);
+    free(bvh->unbounded);
+    sphere_soa_free(&bvh->spheres);
+    free(bvh->throughputs);
+    bvh->throughputs = NULL;
+    bvh->nodes = NULL;
+    bvh->objects = NULL;
+    bvh->unbounded = NULL;
+    bvh->node_count = 0;
+    bvh->object_count = 0;
+    bvh->unbounded_count = 0;
+}
+
+size_t bvh_memory(const bvh_t *bvh)
+{
+    return (size_t) bvh->node_count * sizeof(bvh_node_t) +
+           (size_t) bvh->object_count * (sizeof(object_t) + sizeof(float)) +
+           (size_t) bvh->unbounded_count * sizeof(uint32_t) + sphere_soa_memory(&bvh->spheres);
+}
+
+/** returns whether {ray} overlaps {bounds} within [t_min, t_max], if so: {t_enter} is the entry distance */
+static bool intersect_aabb(
+        float *t_enter, const aabb_t *bounds, vec3f start, vec3f inv_direction, float t_min, float t_max)
+{
+    float t0 = (bounds->min.x - start.x) * inv_direction.x;
+    float t1 = (bounds->max.x - start.x) * inv_direction.x;
+    t_min = fmaxf(t_min, fminf(t0, t1));
+    t_max = fminf(t_max, fmaxf(t0, t1));
+
+    t0 = (bounds->min.y - start.y) * inv_direction.y;
+    t1 = (bounds->max.y - start.y) * inv_direction.y;
+    t_min = fmaxf(t_min, fminf(t0, t1));
+    t_max = fminf(t_max, fmaxf(t0, t1));
+
+    t0 = (bounds->min.z - start.z) * inv_direction.z;
+    t1 = (bounds->max.z - start.z) * inv_direction.z;
+    t_min = fmaxf(t_min, fminf(t0, t1));
+    t_max = fminf(t_max, fmaxf(t0, t1));
+
+    *t_enter = t_min;
+
+    return t_min <= t_max;
+}
+
+static vec3f inverse(vec3f direction)
+{
+    vec3f result = {1.f / direction.x, 1.f / direction.y, 1.f / direction.z};
+
+    return result;
+}
+
+bool bvh_closest(const bvh_t *bvh, hit_t *reflected, object_t *object, ray_t origin, float t_min, float t_max)
+{
+    vec3f inv_direction = inverse(origin.direction);
+    float t_smallest = t_max;
+    bool found_one = false;
+
+    /** nodes on the stack overlap the ray, {t_enter} allows skipping them once a closer hit is found */
+    struct {
+        uint32_t node;
+        float t_enter;
+    } stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    float t_root;
+    if (bvh->node_count > 0 &&
+        intersect_aabb(&t_root, &bvh->nodes[0].bounds, origin.start, inv_direction, t_min, t_max)) {
+        stack[stack_size].node = 0;
+        stack[stack_size++].t_enter = t_root;
+    }
+
+    while (stack_size > 0) {
+        stack_size--;
+        if (found_one && stack[stack_size].t_enter > t_smallest) {
+            continue;
+        }
+        const bvh_node_t *node = &bvh->nodes[stack[stack_size].node];
+        STATS_ADD(STAT_NODE_VISITS, 1);
+
+        if (node->count == 0) {
+            /** interior node, visit the nearest child first */
+            uint32_t near = (uint32_t) (node - bvh->nodes) + 1;
+            uint32_t far = node->offset;
+            float t_near, t_far;
+            bool hit_near = intersect_aabb(
+                    &t_near, &bvh->nodes[near].bounds, origin.start, inv_direction, t_min, t_smallest);
+            bool hit_far = intersect_aabb(
+                    &t_far, &bvh->nodes[far].bounds, origin.start, inv_direction, t_min, t_smallest);
+            if (hit_near && hit_far && t_far < t_near) {
+                uint32_t node_tmp = near;
+                near = far;
+                far = node_tmp;
+                float t_tmp = t_near;
+                t_near = t_far;
+                t_far = t_tmp;
+            }
+            if (hit_far) {
+                stack[stack_size].node = far;
+                stack[stack_size++].t_enter = t_far;
+            }
+            if (hit_near) {
+                stack[stack_size].node = near;
+                stack[stack_size++].t_enter = t_near;
+            }
+            continue;
+        }
+
+        /** leaf node, first test all spheres at once, then the other objects */
+        float t;
+        uint32_t sphere = closest_sphere(&bvh->spheres, node->offset, node->count, origin, t_min, t_smallest, &t);
+        if (sphere != NO_SPHERE && (!found_one || t < t_smallest)) {
+            t_smallest = t;
+            found_one = true;
+
+            *object = bvh->objects[sphere];
+            reflect_sphere(reflected, origin, &SPHERE_RECORDS[object->index]);
+        }
+
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            hit_t hit;
+            bool hit_object;
+            if (bvh->objects[i].type == OBJECT_PLANE) {
+                hit_object = reflect_plane(&hit, origin, &PLANE_RECORDS[bvh->objects[i].index]) &&
+                             hit.t >= t_min && hit.t <= t_max;
+            } else if (bvh->objects[i].type == OBJECT_MESH) {
+                hit_object = mesh_closest(&MESHES[bvh->objects[i].index], &hit, origin, t_min, t_smallest);
+            } else {
+                continue;
+            }
+            if (hit_object && (!found_one || hit.t < t_smallest)) {
+                t_smallest = hit.t;
+                found_one = true;
+
+                *object = bvh->objects[i];
+                *reflected = hit;
+            }
+        }
+    }
+
+    /** planes outside of the hierarchy */
+    for (uint32_t i = 0; i < bvh->unbounded_count; i++) {
+        hit_t hit;
+        uint32_t index = bvh->unbounded[i];
+        if (reflect_plane(&hit, origin, &PLANE_RECORDS[index]) && hit.t >= t_min && hit.t <= t_max &&
+            (!found_one || hit.t < t_smallest)) {
+            t_smallest = hit.t;
+            found_one = true;
+
+            object->type = OBJECT_PLANE;
+            object->index = index;
+            *reflected = hit;
+        }
+    }
+
+    return found_one;
+}
+
+float bvh_shadow_factor(const bvh_t *bvh, ray_t l, float t_min, float t_max, object_t *occluder)
+{
+    // light starts at full strength
+    float light_strength = 1.f;
+
+    /** planes outside of the hierarchy, these are few but large and likely to block the light */
+    for (uint32_t i = 0; i < bvh->unbounded_count; i++) {
+        object_t object = {OBJECT_PLANE, bvh->unbounded[i]};
+        float throughput = get_object_troughput(object);
+        if (throughput == 1.f || !occludes_plane(l, &PLANE_RECORDS[object.index], t_min, t_max)) {
+            continue;
+        }
+
+        light_strength *= throughput;
+        if (light_strength == 0.f) {
+            // if the throughput has reached 0, return early
+            STATS_ADD(STAT_SHADOW_BLOCKED, 1);
+            if (occluder && throughput == 0.f) {
+                *occluder = object;
+            }
+            return 0.f;
+        }
+    }
+
+    vec3f inv_direction = inverse(l.direction);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    if (bvh->node_count > 0) {
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0) {
+        const bvh_node_t *node = &bvh->nodes[stack[--stack_size]];
+        STATS_ADD(STAT_NODE_VISITS, 1);
+        float t_enter;
+        if (!intersect_aabb(&t_enter, &node->bounds, l.start, inv_direction, t_min, t_max)) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            stack[stack_size++] = node->offset;
+            stack[stack_size++] = (uint32_t) (node - bvh->nodes) + 1;
+            continue;
+        }
+
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            // fully transparent objects do not change the light, do not test them
+            float throughput = bvh->throughputs[i];
+            if (throughput == 1.f || !occludes_object(l, bvh->objects[i], t_min, t_max)) {
+                continue;
+            }
+
+            light_strength *= throughput;
+            if (light_strength == 0.f) {
+                STATS_ADD(STAT_SHADOW_BLOCKED, 1);
+                if (occluder && throughput == 0.f) {
+                    *occluder = bvh->objects[i];
+                }
+                return 0.f;
+            }
+        }
+    }
+
+    return light_strength;
+}
@@ -0,0 +1,85 @@
+#ifndef RAY_TRACER_BVH_H
+#define RAY_TRACER_BVH_H
+
+#include <stdint.h>
+#include "vec3.h"
+#include "util.h"
+#include "spheres.h"
+
+typedef struct {
+    vec3f min;
+    vec3f max;
+} aabb_t;
+
+/**
+ * entries of the stack of a traversal of a hierarchy built by bvh_build_nodes. a traversal pushes both children of a
+ * node, so the stack holds at most one entry more than the depth of the deepest leaf, which the build bounds */
+#define BVH_STACK_SIZE 64
+
+typedef struct {
+    aabb_t bounds;
+    uint32_t offset; // leaf: index of first object, interior: index of second child (first child follows node)
+    uint32_t count;  // leaf: number of objects, interior: 0
+} bvh_node_t;
+
+/** bounding volume hierarchy over the spheres, bounded planes and meshes of the scene */
+typedef struct {
+    bvh_node_t *nodes;
+    uint32_t node_count;
+    object_t *objects;    // objects referenced by the leaves, in leaf order
+    uint32_t object_count;
+    sphere_soa_t spheres; // geometry of the spheres in objects, placeholders for planes
+    float *throughputs;   // fraction of light let through by each of objects
+    uint32_t *unbounded;  // indices of planes in PLANES that cannot be bounded, tested linearly
+    uint32_t unbounded_count;
+} bvh_t;
+
+/** exchanges primitives {a} and {b} of {items}, called when the primitives are reordered during a build */
+typedef void (*bvh_swap_fn_t)(void *items, uint32_t a, uint32_t b);
+
+/** the hierarchy of the current scene */
+extern bvh_t BVH;
+
+/** builds {bvh} over SPHERES, PLANES and MESHES using binned surface area heuristic splits, call scene_compile first */
+void bvh_build(bvh_t *bvh);
+
+/**
+ * updates the bounds of {bvh} after objects of the scene moved, keeping its structure, call scene_compile first.
+ * much faster than building it again, but the hierarchy gets worse as objects move further from where it was built.
+ * bounded planes remain bounded as they move */
+void bvh_refit(bvh_t *bvh);
+
+/**
+ * builds a hierarchy over {count} primitives with {bounds} and {centroids} using binned surface area heuristic splits.
+ * the primitives in {items} are reordered with {swap}, along with {bounds} and {centroids}, so each leaf refers to a
+ * range of at most {max_leaf_size} of them. no leaf is deeper than BVH_STACK_SIZE - 1, splits switch from the heuristic
+ * to halves where needed. returns the {node_count} nodes, the root is the first */
+bvh_node_t *bvh_build_nodes(
+        uint32_t *node_count, aabb_t *bounds, vec3f *centroids, uint32_t count, uint32_t max_leaf_size,
+        bvh_swap_fn_t swap, void *items);
+
+/** returns bounds that contain nothing */
+aabb_t aabb_empty(void);
+
+/** grows {a} to contain {p} */
+void aabb_grow(aabb_t *a, vec3f p);
+
+/** frees the memory of {bvh} */
+void bvh_free(bvh_t *bvh);
+
+/** returns the number of bytes used by the nodes, objects and sphere arrays of {bvh} */
+size_t bvh_memory(const bvh_t *bvh);
+
+/** returns whether the bounds of {object} are finite, if so: {bounds} contains them */
+bool bvh_object_bounds(aabb_t *bounds, object_t object);
+
+/** same as bvh_object_bounds for {plane}, which need not be part of the scene */
+bool bvh_plane_bounds(aabb_t *bounds, const plane_t *plane);
+
+/** same as get_closest_object, by traversing {bvh} */
+bool bvh_closest(const bvh_t *bvh, hit_t *reflected, object_t *object, ray_t origin, float t_min, float t_max);
+
+/** same as get_shadow_factor without testing {occluder} first, by traversing {bvh} */
+float bvh_shadow_factor(const bvh_t *bvh, ray_t l, float t_min, float t_max, object_t *occluder);
+
+#endif //RAY_TRACER_BVH_H
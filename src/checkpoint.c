@@ -0,0 +1,213 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "scene.h"
+#include "stats.h"
+
+/** "RTCK" in little endian */
+#define CHECKPOINT_MAGIC 0x4b435452u
+#define CHECKPOINT_VERSION 1u
+
+/** start of a checkpoint file, followed by the records of the tiles */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t size_x;    // of the image
+    uint32_t size_y;
+    uint32_t tile_size; // TILE_SIZE of the render
+    uint32_t reserved;
+} checkpoint_header_t;
+
+struct checkpoint {
+    const char *path;
+    FILE *file;
+    const vec3f *image;
+    uint32_t tiles_x;
+    bool *finished;      // per tile, handed to the render options
+
+    pthread_mutex_t lock;
+    uint64_t last_flush; // time the file was last flushed
+    bool failed;         // a write failed, no more tiles are written
+};
+
+uint64_t checkpoint_key(uint64_t scene, const render_options_t *options, const region_t *crop)
+{
+    // the fields are hashed one by one, the padding of the structures is undefined
+    uint32_t values[] = {
+            crop->x0, crop->y0, crop->x1, crop->y1, options->packet_width, options->wavefront,
+            options->light_samples, options->sampler.type, options->sampler.count, options->sampler.seed};
+    float thresholds[] = {options->min_weight, options->light_threshold};
+    uint64_t hash = hash_bytes(HASH_INIT, &scene, sizeof(scene));
+    hash = hash_bytes(hash, values, sizeof(values));
+
+    return hash_bytes(hash, thresholds, sizeof(thresholds));
+}
+
+/** computes the pixel bounds of tile {task} of the image as render_image does */
+static region_t tile_region(const checkpoint_t *checkpoint, uint32_t task)
+{
+    region_t tile;
+    tile.x0 = (task % checkpoint->tiles_x) * TILE_SIZE;
+    tile.y0 = (task / checkpoint->tiles_x) * TILE_SIZE;
+    tile.x1 = tile.x0 + TILE_SIZE < SIZE_X ? tile.x0 + TILE_SIZE : SIZE_X;
+    tile.y1 = tile.y0 + TILE_SIZE < SIZE_Y ? tile.y0 + TILE_SIZE : SIZE_Y;
+
+    return tile;
+}
+
+/**
+ * reads the records of the tiles of {checkpoint} into {image} and marks them finished, up to the first that is cut
+ * short, which is truncated from the file. returns the number of records read, or -1 on failure */
+static int64_t checkpoint_restore(checkpoint_t *checkpoint, vec3f *image, uint32_t tile_count)
+{
+    int64_t count = 0;
+    long end = ftell(checkpoint->file);
+    uint32_t task;
+    while (fread(&task, sizeof(uint32_t), 1, checkpoint->file) == 1 && task < tile_count) {
+        // the tile is only marked finished once all of its rows are read, a partial tile is rendered again
+        region_t tile = tile_region(checkpoint, task);
+        uint32_t y = tile.y0;
+        while (y < tile.y1 && fread(&image[y * SIZE_X + tile.x0], sizeof(vec3f), tile.x1 - tile.x0,
+                                    checkpoint->file) == tile.x1 - tile.x0) {
+            y++;
+        }
+        if (y < tile.y1) {
+            break;
+        }
+        checkpoint->finished[task] = true;
+        end = ftell(checkpoint->file);
+        count++;
+    }
+    if (ferror(checkpoint->file) || fseek(checkpoint->file, end, SEEK_SET) != 0 ||
+        ftruncate(fileno(checkpoint->file), end) != 0) {
+        return -1;
+    }
+
+    return count;
+}
+
+/** writes the record of tile {task} to the checkpoint {arg}, called by render_image once the tile is rendered */
+static void checkpoint_tile(void *arg, uint32_t task, const region_t *tile)
+{
+    checkpoint_t *checkpoint = arg;
+    pthread_mutex_lock(&checkpoint->lock);
+    if (!checkpoint->failed) {
+        bool ok = fwrite(&task, sizeof(uint32_t), 1, checkpoint->file) == 1;
+        for (uint32_t y = tile->y0; ok && y < tile->y1; y++) {
+            ok = fwrite(&checkpoint->image[y * SIZE_X + tile->x0], sizeof(vec3f), tile->x1 - tile->x0,
+                        checkpoint->file) == tile->x1 - tile->x0;
+        }
+
+        uint64_t now = stats_now();
+        if (ok && (double) (now - checkpoint->last_flush) / 1e9 >= CHECKPOINT_INTERVAL) {
+            ok = fflush(checkpoint->file) == 0;
+            checkpoint->last_flush = now;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: failed to write checkpoint: %s\n", checkpoint->path, strerror(errno));
+            checkpoint->failed = true;
+        }
+    }
+    pthread_mutex_unlock(&checkpoint->lock);
+}
+
+/** reads and checks the header of the file of {checkpoint} against {expected}, then restores its tiles */
+static bool checkpoint_resume(
+        checkpoint_t *checkpoint, const checkpoint_header_t *expected, vec3f *image, uint32_t tile_count,
+        uint32_t *restored)
+{
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, checkpoint->file) != 1 || header.magic != CHECKPOINT_MAGIC ||
+        header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "%s: not a checkpoint\n", checkpoint->path);
+        return false;
+    }
+    if (memcmp(&header, expected, sizeof(header)) != 0) {
+        fprintf(stderr, "%s: checkpoint of another scene, size or options, remove it to start over\n",
+                checkpoint->path);
+        return false;
+    }
+    int64_t count = checkpoint_restore(checkpoint, image, tile_count);
+    if (count < 0) {
+        fprintf(stderr, "%s: failed to read checkpoint: %s\n", checkpoint->path, strerror(errno));
+        return false;
+    }
+    *restored = (uint32_t) count;
+
+    return true;
+}
+
+checkpoint_t *checkpoint_open(
+        const char *path, uint64_t key, vec3f *image, render_options_t *options, uint32_t *restored)
+{
+    *restored = 0;
+    uint32_t tiles_x = (SIZE_X + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tile_count = tiles_x * ((SIZE_Y + TILE_SIZE - 1) / TILE_SIZE);
+    checkpoint_t *checkpoint = calloc(1, sizeof(checkpoint_t));
+    bool *finished = calloc(tile_count > 0 ? tile_count : 1, sizeof(bool));
+    if (!checkpoint || !finished) {
+        fprintf(stderr, "%s: not enough memory for a checkpoint of %u tiles\n", path, tile_count);
+        free(finished);
+        free(checkpoint);
+        return NULL;
+    }
+    checkpoint->path = path;
+    checkpoint->image = image;
+    checkpoint->tiles_x = tiles_x;
+    checkpoint->finished = finished;
+
+    checkpoint_header_t expected = {
+            .magic=CHECKPOINT_MAGIC, .version=CHECKPOINT_VERSION, .key=key, .size_x=SIZE_X, .size_y=SIZE_Y,
+            .tile_size=TILE_SIZE, .reserved=0};
+    bool ok;
+    checkpoint->file = fopen(path, "r+b");
+    if (checkpoint->file) {
+        ok = checkpoint_resume(checkpoint, &expected, image, tile_count, restored);
+    } else {
+        checkpoint->file = fopen(path, "w+b");
+        ok = checkpoint->file && fwrite(&expected, sizeof(expected), 1, checkpoint->file) == 1 &&
+             fflush(checkpoint->file) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s: failed to create checkpoint: %s\n", path, strerror(errno));
+        }
+    }
+    if (!ok) {
+        if (checkpoint->file) {
+            fclose(checkpoint->file);
+        }
+        free(checkpoint->finished);
+        free(checkpoint);
+        return NULL;
+    }
+
+    pthread_mutex_init(&checkpoint->lock, NULL);
+    checkpoint->last_flush = stats_now();
+    options->finished = checkpoint->finished;
+    options->tile_done = checkpoint_tile;
+    options->tile_done_arg = checkpoint;
+
+    return checkpoint;
+}
+
+void checkpoint_close(checkpoint_t *checkpoint, render_options_t *options, bool complete)
+{
+    options->finished = NULL;
+    options->tile_done = NULL;
+    options->tile_done_arg = NULL;
+
+    if (fclose(checkpoint->file) != 0 && !complete) {
+        fprintf(stderr, "%s: failed to write checkpoint: %s\n", checkpoint->path, strerror(errno));
+    }
+    if (complete) {
+        remove(checkpoint->path);
+    }
+    pthread_mutex_destroy(&checkpoint->lock);
+    free(checkpoint->finished);
+    free(checkpoint);
+}
@@ -0,0 +1,36 @@
+#ifndef RAY_TRACER_CHECKPOINT_H
+#define RAY_TRACER_CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vec3.h"
+#include "render.h"
+
+/** seconds between flushing the tiles written to a checkpoint to its file */
+#define CHECKPOINT_INTERVAL 5.
+
+/**
+ * file the tiles of a render are written to as they are finished, so a render that is killed can be resumed. the file
+ * holds a header with the key and size of the image, followed by a record per tile: its index and its colors. a record
+ * cut short by the kill is ignored */
+typedef struct checkpoint checkpoint_t;
+
+/**
+ * returns a key of the render of the scene with hash {scene}, see scene_hash, with {options} into {crop} of the frame
+ * of the scene. renders with different keys have different images */
+uint64_t checkpoint_key(uint64_t scene, const render_options_t *options, const region_t *crop);
+
+/**
+ * opens the checkpoint at {path} for the render with {key} into {image} of SIZE_X * SIZE_Y linear colors. if the file
+ * exists, the tiles it holds are copied into {image} and their number is written to {restored}, otherwise it is
+ * created. {options} are made to skip the restored tiles in render_image and to write the others to the checkpoint.
+ * returns NULL and prints the reason if the file cannot be read or written, or holds a render with another key */
+checkpoint_t *checkpoint_open(
+        const char *path, uint64_t key, vec3f *image, render_options_t *options, uint32_t *restored);
+
+/**
+ * closes {checkpoint}, after which {options} no longer refer to it. if {complete}, the image is written and the file
+ * is removed, otherwise the tiles written so far are flushed to it */
+void checkpoint_close(checkpoint_t *checkpoint, render_options_t *options, bool complete);
+
+#endif //RAY_TRACER_CHECKPOINT_H
@@ -0,0 +1,581 @@
+#include "daemon.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include "bvh.h"
+#include "deflate.h"
+#include "net.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "spheres.h"
+#include "stats.h"
+
+/** changed whenever the messages change, clients of another version are refused */
+#define PROTOCOL_VERSION 1
+/** maximum length of the scene name or path of a request */
+#define MAX_SCENE_LENGTH 4096
+/** maximum length of the reason sent back for a request that failed */
+#define MAX_ERROR_LENGTH 256
+
+/** the types of the messages between daemon and clients, see message_header_t */
+typedef enum {
+    MESSAGE_REQUEST, // client: request_message_t
+    MESSAGE_IMAGE,   // daemon: the encoded image
+    MESSAGE_ERROR    // daemon: the reason the request failed, a string
+} message_type_t;
+
+typedef struct {
+    uint32_t version;
+    int32_t priority;
+    uint32_t size_x;
+    uint32_t size_y;
+    uint32_t set_eye;
+    vec3f eye;
+    uint32_t set_target;
+    vec3f target;
+    uint32_t samples;
+    uint32_t format;
+    float exposure;
+    char scene[MAX_SCENE_LENGTH];
+} request_message_t;
+
+/** a scene kept loaded by the daemon, with everything built for it */
+typedef struct {
+    bool used;
+    uint64_t hash;       // of the contents of the scene, see scene_hash
+    uint64_t last_used;  // number of the last request that rendered it
+    scene_state_t scene;
+    sphere_soa_t soa;
+#ifdef USE_BVH
+    bvh_t bvh;
+#endif
+} cached_scene_t;
+
+/** a client that connected */
+typedef struct {
+    int fd;
+    bool queued;         // whether its request is complete and queued, after which the queue owns the connection
+    byte_buffer_t input; // received bytes of the request
+} client_t;
+
+/** a request waiting to be rendered */
+typedef struct {
+    request_message_t request;
+    int fd;
+    uint64_t number;     // order of arrival
+    uint64_t arrival;    // time the request was received, see stats_now
+} queued_request_t;
+
+/**
+ * requests are received by the thread that runs the daemon and rendered by another, so they are queued as they arrive,
+ * also while a request is rendered */
+typedef struct {
+    pool_t *pool;
+    const render_options_t *options;
+    cached_scene_t cache[DAEMON_CACHE_SIZE]; // used by the rendering thread only
+    uint64_t requests;                       // number of requests received, used by the receiving thread only
+
+    pthread_mutex_t lock;                    // guards the queue and {stopped}
+    pthread_cond_t changed;                  // signalled when a request is queued or {stopped} is set
+    queued_request_t *queue;                 // binary heap, the next request to render is at the top
+    uint32_t queued;
+    uint32_t queue_capacity;
+    bool stopped;                            // the rendering thread exits once it is set
+} daemon_t;
+
+/** set by the signal handler when the daemon should exit */
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop(int signal)
+{
+    (void) signal;
+    stopping = 1;
+}
+
+/** returns whether {a} is rendered before {b} */
+static bool goes_before(const queued_request_t *a, const queued_request_t *b)
+{
+    if (a->request.priority != b->request.priority) {
+        return a->request.priority > b->request.priority;
+    }
+
+    return a->number < b->number;
+}
+
+static void queue_swap(daemon_t *daemon, uint32_t a, uint32_t b)
+{
+    queued_request_t request = daemon->queue[a];
+    daemon->queue[a] = daemon->queue[b];
+    daemon->queue[b] = request;
+}
+
+static void queue_push(daemon_t *daemon, const queued_request_t *request)
+{
+    if (daemon->queued == daemon->queue_capacity) {
+        daemon->queue_capacity = daemon->queue_capacity > 0 ? daemon->queue_capacity * 2 : 16;
+        daemon->queue = realloc(daemon->queue, daemon->queue_capacity * sizeof(queued_request_t));
+    }
+    uint32_t i = daemon->queued++;
+    daemon->queue[i] = *request;
+    while (i > 0 && goes_before(&daemon->queue[i], &daemon->queue[(i - 1) / 2])) {
+        queue_swap(daemon, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static queued_request_t queue_pop(daemon_t *daemon)
+{
+    queued_request_t top = daemon->queue[0];
+    daemon->queue[0] = daemon->queue[--daemon->queued];
+    uint32_t i = 0;
+    while (true) {
+        uint32_t first = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = 2 * i + 2;
+        if (left < daemon->queued && goes_before(&daemon->queue[left], &daemon->queue[first])) {
+            first = left;
+        }
+        if (right < daemon->queued && goes_before(&daemon->queue[right], &daemon->queue[first])) {
+            first = right;
+        }
+        if (first == i) {
+            break;
+        }
+        queue_swap(daemon, i, first);
+        i = first;
+    }
+
+    return top;
+}
+
+/** makes the scene of {entry} the current scene, with its spheres and hierarchy */
+static void cache_attach(cached_scene_t *entry)
+{
+    scene_attach(&entry->scene);
+    SPHERES_SOA = entry->soa;
+#ifdef USE_BVH
+    BVH = entry->bvh;
+#endif
+}
+
+/** moves the current scene with its spheres and hierarchy into {entry} */
+static void cache_detach(cached_scene_t *entry)
+{
+    scene_detach(&entry->scene);
+    entry->soa = SPHERES_SOA;
+    memset(&SPHERES_SOA, 0, sizeof(sphere_soa_t));
+#ifdef USE_BVH
+    entry->bvh = BVH;
+    memset(&BVH, 0, sizeof(bvh_t));
+#endif
+}
+
+/** unloads the scene of {entry} */
+static void cache_evict(cached_scene_t *entry)
+{
+    cache_attach(entry);
+#ifdef USE_BVH
+    bvh_free(&BVH);
+#endif
+    sphere_soa_free(&SPHERES_SOA);
+    scene_unload();
+    entry->used = false;
+}
+
+/**
+ * returns the cached scene {name}, loading and building it if it is not cached. {cached} is set to whether it was.
+ * returns NULL and writes the reason to {error} if the scene cannot be loaded */
+static cached_scene_t *cache_get(daemon_t *daemon, const queued_request_t *queued, const char *name, bool *cached,
+                                 char *error)
+{
+    uint64_t hash;
+    if (!scene_hash(name, &hash)) {
+        snprintf(error, MAX_ERROR_LENGTH, "%s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    cached_scene_t *entry = NULL; // the scene, or else the slot to load it into
+    for (uint32_t i = 0; i < DAEMON_CACHE_SIZE; i++) {
+        cached_scene_t *candidate = &daemon->cache[i];
+        if (candidate->used && candidate->hash == hash) {
+            candidate->last_used = queued->number;
+            *cached = true;
+            return candidate;
+        }
+        if (!entry || (entry->used && (!candidate->used || candidate->last_used < entry->last_used))) {
+            entry = candidate;
+        }
+    }
+    *cached = false;
+    if (entry->used) {
+        cache_evict(entry);
+    }
+
+    if (!scene_load_builtin(name) && !scene_load_file(name)) {
+        snprintf(error, MAX_ERROR_LENGTH, "%s: failed to load the scene", name);
+        scene_unload();
+        return NULL;
+    }
+    scene_compile();
+    sphere_soa_from_scene(&SPHERES_SOA);
+#ifdef USE_BVH
+    bvh_build(&BVH);
+#endif
+    cache_detach(entry);
+    entry->used = true;
+    entry->hash = hash;
+    entry->last_used = queued->number;
+
+    return entry;
+}
+
+/** renders {request} and sends the image, or the reason it failed, to its client */
+static void serve(daemon_t *daemon, const queued_request_t *queued)
+{
+    const request_message_t *request = &queued->request;
+    uint64_t begin = stats_now();
+    char error[MAX_ERROR_LENGTH] = "";
+    char scene[MAX_SCENE_LENGTH];
+    memcpy(scene, request->scene, MAX_SCENE_LENGTH);
+    scene[MAX_SCENE_LENGTH - 1] = '\0';
+
+    bool cached;
+    cached_scene_t *entry = cache_get(daemon, queued, scene, &cached, error);
+    uint64_t loaded = stats_now();
+    if (!entry) {
+        fprintf(stderr, "request %llu failed: %s\n", (unsigned long long) queued->number, error);
+        send_message(queued->fd, MESSAGE_ERROR, error, (uint32_t) strlen(error) + 1);
+        return;
+    }
+
+    /** the overrides are applied to the current scene, and undone before it is put back */
+    cache_attach(entry);
+    uint32_t size_x = SIZE_X;
+    uint32_t size_y = SIZE_Y;
+    vec3f eye = EYE;
+    vec3f target = TARGET;
+    if (request->size_x > 0) {
+        SIZE_X = request->size_x;
+        SIZE_Y = request->size_y;
+    }
+    if (request->set_eye) {
+        EYE = request->eye;
+    }
+    if (request->set_target) {
+        TARGET = request->target;
+    }
+    camera_t camera;
+    camera_init(&camera);
+
+    // the size is up to the client, the memory may not be there
+    vec3f *image = malloc((size_t) SIZE_X * SIZE_Y * sizeof(vec3f));
+    accumulator_t accumulator = {.sums=NULL, .samples=0};
+    if (image && request->samples > 0) {
+        accumulator_init(&accumulator);
+    }
+    if (!image || (request->samples > 0 && !accumulator.sums)) {
+        snprintf(error, sizeof(error), "not enough memory to render a %ux%u image", SIZE_X, SIZE_Y);
+        fprintf(stderr, "request %llu failed: %s\n", (unsigned long long) queued->number, error);
+        send_message(queued->fd, MESSAGE_ERROR, error, (uint32_t) strlen(error) + 1);
+    } else {
+        if (request->samples > 0) {
+            while (accumulator.samples < request->samples) {
+                render_pass(daemon->pool, &camera, daemon->options, &accumulator, NULL);
+            }
+            accumulator_resolve(&accumulator, image);
+        } else {
+            render_image(daemon->pool, &camera, daemon->options, image, NULL);
+        }
+        uint64_t rendered = stats_now();
+
+        byte_buffer_t encoded = {.data=NULL, .size=0, .capacity=0};
+        if (image_encode(image, (image_format_t) request->format, request->exposure, &encoded)) {
+            send_message(queued->fd, MESSAGE_IMAGE, encoded.data, (uint32_t) encoded.size);
+        } else {
+            snprintf(error, sizeof(error), "failed to encode the image");
+            send_message(queued->fd, MESSAGE_ERROR, error, (uint32_t) strlen(error) + 1);
+        }
+        fprintf(stderr, "request %llu: %s %ux%u, %s, queued %.1f ms, load %.1f ms, render %.1f ms, %zu bytes\n",
+                (unsigned long long) queued->number, scene, SIZE_X, SIZE_Y, cached ? "cached" : "loaded",
+                (double) (begin - queued->arrival) / 1e6, (double) (loaded - begin) / 1e6,
+                (double) (rendered - loaded) / 1e6, encoded.size);
+        byte_buffer_free(&encoded);
+    }
+    accumulator_free(&accumulator);
+    free(image);
+
+    SIZE_X = size_x;
+    SIZE_Y = size_y;
+    EYE = eye;
+    TARGET = target;
+    cache_detach(entry);
+}
+
+/**
+ * renders the queued requests in order until the daemon stops, run by a thread of its own. the connection of a request
+ * is closed once it is answered */
+static void *render_requests(void *arg)
+{
+    daemon_t *daemon = arg;
+    pthread_mutex_lock(&daemon->lock);
+    while (true) {
+        while (daemon->queued == 0 && !daemon->stopped) {
+            pthread_cond_wait(&daemon->changed, &daemon->lock);
+        }
+        if (daemon->stopped) {
+            break;
+        }
+        queued_request_t request = queue_pop(daemon);
+        pthread_mutex_unlock(&daemon->lock);
+
+        serve(daemon, &request);
+        // each client sends a single request
+        close(request.fd);
+
+        pthread_mutex_lock(&daemon->lock);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    return NULL;
+}
+
+/**
+ * reads what {client} sent, and queues its request once it is complete. returns false if the connection is closed or
+ * the request is invalid, after which the client is dropped */
+static bool client_receive(daemon_t *daemon, client_t *client)
+{
+    uint8_t buffer[65536];
+    ssize_t received = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+    byte_buffer_append(&client->input, buffer, (size_t) received);
+    if (client->input.size < sizeof(message_header_t) + sizeof(request_message_t)) {
+        return true;
+    }
+
+    message_header_t header;
+    memcpy(&header, client->input.data, sizeof(header));
+    queued_request_t queued = {.fd=client->fd, .number=daemon->requests, .arrival=stats_now()};
+    memcpy(&queued.request, client->input.data + sizeof(header), sizeof(request_message_t));
+    const request_message_t *request = &queued.request;
+    if (header.type != MESSAGE_REQUEST || header.size != sizeof(request_message_t) ||
+        client->input.size != sizeof(header) + header.size) {
+        return false;
+    }
+    if (request->version != PROTOCOL_VERSION) {
+        static const char REFUSED[] = "the daemon is of another version";
+        send_message(client->fd, MESSAGE_ERROR, REFUSED, sizeof(REFUSED));
+        return false;
+    }
+    if (request->size_x > MAX_IMAGE_SIZE || request->size_y > MAX_IMAGE_SIZE ||
+        (request->size_x == 0) != (request->size_y == 0) || request->format > IMAGE_EXR) {
+        static const char INVALID[] = "invalid request";
+        send_message(client->fd, MESSAGE_ERROR, INVALID, sizeof(INVALID));
+        return false;
+    }
+
+    daemon->requests++;
+    pthread_mutex_lock(&daemon->lock);
+    queue_push(daemon, &queued);
+    pthread_cond_signal(&daemon->changed);
+    pthread_mutex_unlock(&daemon->lock);
+    client->queued = true;
+
+    return true;
+}
+
+bool run_daemon(const char *address_text, pool_t *pool, const render_options_t *options)
+{
+    address_t address;
+    if (!parse_address(&address, address_text, true)) {
+        return false;
+    }
+    int listener = listen_at(&address, address_text);
+    if (listener < 0) {
+        return false;
+    }
+
+    // interrupted system calls are not restarted, so the poll returns to check for the signal
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "listening at %s\n", address_text);
+
+    daemon_t daemon;
+    memset(&daemon, 0, sizeof(daemon_t));
+    daemon.pool = pool;
+    daemon.options = options;
+    pthread_mutex_init(&daemon.lock, NULL);
+    pthread_cond_init(&daemon.changed, NULL);
+
+    // the signals are handled by this thread, so they interrupt its poll
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_t renderer;
+    int error = pthread_create(&renderer, NULL, render_requests, &daemon);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0) {
+        fprintf(stderr, "failed to create the rendering thread: %s\n", strerror(error));
+        pthread_cond_destroy(&daemon.changed);
+        pthread_mutex_destroy(&daemon.lock);
+        close(listener);
+        return false;
+    }
+
+    client_t *clients = NULL;
+    uint32_t client_count = 0;
+    struct pollfd *fds = NULL;
+    while (!stopping) {
+        /** requests are queued as soon as they arrive, the queue decides which is rendered next */
+        fds = realloc(fds, (client_count + 1) * sizeof(struct pollfd));
+        fds[0] = (struct pollfd) {.fd=listener, .events=POLLIN};
+        for (uint32_t i = 0; i < client_count; i++) {
+            fds[i + 1] = (struct pollfd) {.fd=clients[i].fd, .events=POLLIN};
+        }
+        int ready = poll(fds, client_count + 1, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            break;
+        }
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < client_count; i++) {
+            client_t *client = &clients[i];
+            bool received = !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) || client_receive(&daemon, client);
+            if (!received) {
+                close(client->fd);
+            }
+            if (!received || client->queued) {
+                // a queued connection is closed by the rendering thread
+                byte_buffer_free(&client->input);
+            } else {
+                clients[kept++] = *client;
+            }
+        }
+        client_count = kept;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                clients = realloc(clients, (client_count + 1) * sizeof(client_t));
+                clients[client_count++] = (client_t) {.fd=fd, .queued=false, .input={NULL, 0, 0}};
+            }
+        }
+    }
+
+    /** the request being rendered is finished, those still queued are dropped */
+    pthread_mutex_lock(&daemon.lock);
+    daemon.stopped = true;
+    pthread_cond_signal(&daemon.changed);
+    pthread_mutex_unlock(&daemon.lock);
+    pthread_join(renderer, NULL);
+    for (uint32_t i = 0; i < daemon.queued; i++) {
+        close(daemon.queue[i].fd);
+    }
+    for (uint32_t i = 0; i < client_count; i++) {
+        close(clients[i].fd);
+        byte_buffer_free(&clients[i].input);
+    }
+    for (uint32_t i = 0; i < DAEMON_CACHE_SIZE; i++) {
+        if (daemon.cache[i].used) {
+            cache_evict(&daemon.cache[i]);
+        }
+    }
+    close(listener);
+    if (address.family == AF_UNIX) {
+        unlink(((struct sockaddr_un *) &address.storage)->sun_path);
+    }
+    free(fds);
+    free(clients);
+    free(daemon.queue);
+    pthread_cond_destroy(&daemon.changed);
+    pthread_mutex_destroy(&daemon.lock);
+
+    return true;
+}
+
+bool run_client(const char *address_text, const daemon_request_t *request, const char *path)
+{
+    request_message_t message;
+    memset(&message, 0, sizeof(message));
+    message.version = PROTOCOL_VERSION;
+    message.priority = request->priority;
+    message.size_x = request->size_x;
+    message.size_y = request->size_y;
+    message.set_eye = request->eye != NULL;
+    message.eye = request->eye ? *request->eye : (vec3f) {0.f, 0.f, 0.f};
+    message.set_target = request->target != NULL;
+    message.target = request->target ? *request->target : (vec3f) {0.f, 0.f, 0.f};
+    message.samples = request->samples;
+    message.format = request->format;
+    message.exposure = request->exposure;
+    if (strlen(request->scene) >= MAX_SCENE_LENGTH) {
+        fprintf(stderr, "%s: scene path too long\n", request->scene);
+        return false;
+    }
+    strcpy(message.scene, request->scene);
+
+    address_t address;
+    if (!parse_address(&address, address_text, false)) {
+        return false;
+    }
+    int fd = connect_to(&address, address_text);
+    if (fd < 0) {
+        return false;
+    }
+
+    message_header_t header;
+    if (!send_message(fd, MESSAGE_REQUEST, &message, sizeof(message)) || !receive_all(fd, &header, sizeof(header))) {
+        fprintf(stderr, "%s: lost the connection to the daemon\n", address_text);
+        close(fd);
+        return false;
+    }
+    uint8_t *payload = malloc(header.size > 0 ? header.size : 1);
+    bool ok = receive_all(fd, payload, header.size);
+    close(fd);
+    if (!ok || (header.type != MESSAGE_IMAGE && header.type != MESSAGE_ERROR)) {
+        fprintf(stderr, "%s: lost the connection to the daemon\n", address_text);
+        free(payload);
+        return false;
+    }
+    if (header.type == MESSAGE_ERROR) {
+        fprintf(stderr, "%.*s\n", (int) header.size, (const char *) payload);
+        free(payload);
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        free(payload);
+        return false;
+    }
+    fwrite(payload, 1, header.size, file);
+    ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write image\n", path);
+    }
+    free(payload);
+
+    return ok;
+}
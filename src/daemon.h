@@ -0,0 +1,40 @@
+#ifndef RAY_TRACER_DAEMON_H
+#define RAY_TRACER_DAEMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vec3.h"
+#include "image.h"
+#include "pool.h"
+#include "render.h"
+
+/** number of scenes a daemon keeps loaded, the least recently used is unloaded to make room */
+#define DAEMON_CACHE_SIZE 8
+
+/** a render requested from a daemon */
+typedef struct {
+    const char *scene;     // name or file of the scene, as loaded by the daemon
+    int32_t priority;      // queued requests of higher priority are rendered first, then in order of arrival
+    uint32_t size_x;       // if not 0: replaces the size of the image of the scene
+    uint32_t size_y;
+    const vec3f *eye;      // if not NULL: replaces the eye of the scene
+    const vec3f *target;   // if not NULL: replaces the target of the scene
+    uint32_t samples;      // 0: fixed supersampling, otherwise: number of progressive samples per pixel
+    image_format_t format; // of the image sent back
+    float exposure;        // scale of the colors of 8-bit formats
+} daemon_request_t;
+
+/**
+ * runs a daemon: listens at {address} and renders the requests of the clients that connect with the threads of
+ * {pool} and {options}, one at a time, until interrupted. each client sends one request and receives the encoded image.
+ * scenes are kept loaded and built, keyed by a hash of the contents of their file, so a request for a scene rendered
+ * before only pays for rendering. meshes referenced by a scene are not part of its hash. requests that arrive while
+ * another is rendered are queued by priority. returns false and prints the reason if the daemon could not start */
+bool run_daemon(const char *address, pool_t *pool, const render_options_t *options);
+
+/**
+ * sends {request} to the daemon at {address} and writes the image it renders to {path}. returns false and prints the
+ * reason on failure */
+bool run_client(const char *address, const daemon_request_t *request, const char *path);
+
+#endif //RAY_TRACER_DAEMON_H
@@ -0,0 +1,241 @@
+#include "deflate.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** number of bits of the hash of three bytes that starts a chain of earlier positions */
+#define HASH_BITS 15
+/** distances and lengths of matches allowed by the format */
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+/** number of earlier positions compared before settling for the longest match so far */
+#define MAX_CHAIN 32
+
+/** smallest length and distance of each code, and the number of extra bits that follow the code */
+static const uint16_t LENGTH_BASE[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227,
+        258
+};
+static const uint8_t LENGTH_EXTRA[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DISTANCE_BASE[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+        6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DISTANCE_EXTRA[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+void byte_buffer_append(byte_buffer_t *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        buffer->capacity = buffer->capacity * 2 > buffer->size + size ? buffer->capacity * 2 : buffer->size + size;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+void byte_buffer_free(byte_buffer_t *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+/** writes bits to a buffer, starting at the least significant bit of each byte */
+typedef struct {
+    byte_buffer_t *out;
+    uint64_t bits;
+    uint32_t count;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *writer, uint32_t value, uint32_t count)
+{
+    writer->bits |= (uint64_t) value << writer->count;
+    writer->count += count;
+    while (writer->count >= 8) {
+        uint8_t byte = (uint8_t) writer->bits;
+        byte_buffer_append(writer->out, &byte, 1);
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+/** writes the remaining bits, padded with zeros to a whole byte */
+static void align_bits(bit_writer_t *writer)
+{
+    if (writer->count > 0) {
+        put_bits(writer, 0, 8 - writer->count);
+    }
+}
+
+/** writes huffman code {code} of {length} bits, which are stored from the most significant bit */
+static void put_code(bit_writer_t *writer, uint32_t code, uint32_t length)
+{
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+    }
+    put_bits(writer, reversed, length);
+}
+
+/** writes literal or length symbol {symbol} with the fixed codes */
+static void put_symbol(bit_writer_t *writer, uint32_t symbol)
+{
+    if (symbol < 144) {
+        put_code(writer, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(writer, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(writer, symbol - 256, 7);
+    } else {
+        put_code(writer, 0xc0 + symbol - 280, 8);
+    }
+}
+
+/** writes a match of {length} bytes at {distance} bytes back */
+static void put_match(bit_writer_t *writer, uint32_t length, uint32_t distance)
+{
+    uint32_t l = 28;
+    while (LENGTH_BASE[l] > length) {
+        l--;
+    }
+    put_symbol(writer, 257 + l);
+    put_bits(writer, length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+    uint32_t d = 29;
+    while (DISTANCE_BASE[d] > distance) {
+        d--;
+    }
+    put_code(writer, d, 5);
+    put_bits(writer, distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+static uint32_t hash(const uint8_t *data)
+{
+    uint32_t x = (uint32_t) data[0] << 16 | (uint32_t) data[1] << 8 | data[2];
+
+    return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void deflate_block(byte_buffer_t *out, const uint8_t *data, size_t size, bool final)
+{
+    bit_writer_t writer = {.out=out, .bits=0, .count=0};
+    put_bits(&writer, final ? 1 : 0, 1);
+    put_bits(&writer, 1, 2); // fixed codes
+
+    // chains of earlier positions with the same hash, -1 ends a chain
+    int32_t *head = malloc((1u << HASH_BITS) * sizeof(int32_t));
+    int32_t *previous = malloc((size > 0 ? size : 1) * sizeof(int32_t));
+    memset(head, 0xff, (1u << HASH_BITS) * sizeof(int32_t));
+
+    size_t i = 0;
+    while (i < size) {
+        uint32_t best_length = 0;
+        uint32_t best_distance = 0;
+        if (i + MIN_MATCH <= size) {
+            uint32_t h = hash(&data[i]);
+            uint32_t max_length = size - i < MAX_MATCH ? (uint32_t) (size - i) : MAX_MATCH;
+            int32_t candidate = head[h];
+            for (uint32_t chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+                if (i - (size_t) candidate > WINDOW_SIZE) {
+                    break;
+                }
+                uint32_t length = 0;
+                const uint8_t *match = &data[candidate];
+                while (length < max_length && match[length] == data[i + length]) {
+                    length++;
+                }
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = (uint32_t) (i - candidate);
+                    if (length == max_length) {
+                        break;
+                    }
+                }
+                candidate = previous[candidate];
+            }
+        }
+
+        uint32_t advance = best_length >= MIN_MATCH ? best_length : 1;
+        if (best_length >= MIN_MATCH) {
+            put_match(&writer, best_length, best_distance);
+        } else {
+            put_symbol(&writer, data[i]);
+        }
+
+        // insert the positions passed into the chains
+        for (size_t end = i + advance; i < end; i++) {
+            if (i + MIN_MATCH <= size) {
+                uint32_t h = hash(&data[i]);
+                previous[i] = head[h];
+                head[h] = (int32_t) i;
+            }
+        }
+    }
+    free(previous);
+    free(head);
+
+    put_symbol(&writer, 256); // end of block
+    if (!final) {
+        // empty stored block, which aligns the stream to a byte
+        put_bits(&writer, 0, 3);
+        align_bits(&writer);
+        static const uint8_t EMPTY[4] = {0x00, 0x00, 0xff, 0xff};
+        byte_buffer_append(out, EMPTY, sizeof(EMPTY));
+    } else {
+        align_bits(&writer);
+    }
+}
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t size)
+{
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (size > 0) {
+        // the sums cannot overflow within this many bytes before the modulo
+        size_t n = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < n; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+
+    return b << 16 | a;
+}
+
+/** remainders of the bytes, computed once by crc32_init */
+static uint32_t CRC32_TABLE[256];
+static pthread_once_t CRC32_ONCE = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (uint32_t k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        CRC32_TABLE[n] = c;
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+    pthread_once(&CRC32_ONCE, crc32_init);
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = CRC32_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,33 @@
+#ifndef RAY_TRACER_DEFLATE_H
+#define RAY_TRACER_DEFLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** growable array of bytes */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} byte_buffer_t;
+
+/** appends {size} bytes of {data} to {buffer} */
+void byte_buffer_append(byte_buffer_t *buffer, const void *data, size_t size);
+
+/** frees the memory of {buffer} */
+void byte_buffer_free(byte_buffer_t *buffer);
+
+/**
+ * appends {size} bytes of {data} to {out}, compressed as a deflate block with the fixed codes. matches are only
+ * searched within {data}, so that separate parts of a stream can be compressed independently. if not {final}, an empty
+ * stored block follows to end on a byte boundary, where the next part of the stream continues */
+void deflate_block(byte_buffer_t *out, const uint8_t *data, size_t size, bool final);
+
+/** returns the adler-32 checksum of zlib streams of {adler} updated with {size} bytes of {data}, starting at 1 */
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t size);
+
+/** returns the crc-32 checksum of PNG chunks of {crc} updated with {size} bytes of {data}, starting at 0 */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size);
+
+#endif //RAY_TRACER_DEFLATE_H
@@ -0,0 +1,533 @@
+#include "distributed.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "bvh.h"
+#include "deflate.h"
+#include "net.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "spheres.h"
+
+/** changed whenever the messages change, workers of another version are refused */
+#define PROTOCOL_VERSION 4
+/** maximum length of the scene name or path sent to the workers */
+#define MAX_SCENE_LENGTH 4096
+/** number of tiles handed to a worker before it returns the first, so it does not wait for the next */
+#define PIPELINE_DEPTH 2
+/** messages larger than this are taken for a broken connection */
+#define MAX_MESSAGE_SIZE (1u << 24)
+
+/** the types of the messages between coordinator and workers, see message_header_t */
+typedef enum {
+    MESSAGE_HELLO,  // worker: hello_message_t
+    MESSAGE_JOB,    // coordinator: job_message_t
+    MESSAGE_TILE,   // coordinator: region_t to render
+    MESSAGE_RESULT, // worker: result_message_t, followed by the colors of the region row by row
+    MESSAGE_DONE    // coordinator: no more tiles, no payload
+} message_type_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t stats_size; // size of render_stats_t, which differs between builds with and without statistics
+} hello_message_t;
+
+typedef struct {
+    uint32_t size_x;     // size of the image, to check the workers loaded the same scene
+    uint32_t size_y;
+    uint32_t packet_width;
+    uint32_t wavefront;
+    float min_weight;
+    float light_threshold;
+    uint32_t light_samples;
+    float adaptive_threshold;
+    uint32_t adaptive_rate;
+    sampler_t sampler;
+    char scene[MAX_SCENE_LENGTH];
+} job_message_t;
+
+typedef struct {
+    region_t region;
+    render_stats_t stats;
+} result_message_t;
+
+/** a connected worker, as seen by the coordinator */
+typedef struct {
+    int fd;
+    bool ready;                       // has sent a valid hello and received the job
+    uint32_t tiles[PIPELINE_DEPTH];   // tiles handed out and not returned yet
+    uint32_t outstanding;
+    byte_buffer_t input;              // received bytes of incomplete messages
+} connection_t;
+
+/** returns the region of tile {tile} of the image, of which there are {tiles_x} per row */
+static region_t tile_region(uint32_t tile, uint32_t tiles_x)
+{
+    uint32_t x = tile % tiles_x * DISTRIBUTED_TILE_SIZE;
+    uint32_t y = tile / tiles_x * DISTRIBUTED_TILE_SIZE;
+
+    return (region_t) {
+            .x0=x, .y0=y,
+            .x1=x + DISTRIBUTED_TILE_SIZE < SIZE_X ? x + DISTRIBUTED_TILE_SIZE : SIZE_X,
+            .y1=y + DISTRIBUTED_TILE_SIZE < SIZE_Y ? y + DISTRIBUTED_TILE_SIZE : SIZE_Y
+    };
+}
+
+/** state of the coordinator during a render */
+typedef struct {
+    const render_options_t *options;
+    vec3f *image;
+    render_stats_t *stats;
+    distributed_stats_t *distributed_stats;
+    uint32_t tiles_x;
+    uint32_t tile_count;
+    uint32_t *queue;          // tiles not handed out, the next is at the end
+    uint32_t queued;
+    bool *done;               // per tile
+    uint32_t *row_remaining;  // per row of tiles: tiles not done
+    uint32_t remaining;       // tiles not done
+} coordinator_state_t;
+
+/** closes {connection}, its outstanding tiles are queued to be handed out next */
+static void connection_lost(coordinator_state_t *state, connection_t *connection)
+{
+    for (uint32_t i = 0; i < connection->outstanding; i++) {
+        uint32_t tile = connection->tiles[i];
+        if (!state->done[tile]) {
+            state->queue[state->queued++] = tile;
+            state->distributed_stats->requeued++;
+        }
+    }
+    if (connection->ready && state->remaining > 0) {
+        state->distributed_stats->lost++;
+    }
+    close(connection->fd);
+    byte_buffer_free(&connection->input);
+}
+
+/** hands out tiles to {connection} until its pipeline is full. returns false if the connection is broken */
+static bool connection_fill(coordinator_state_t *state, connection_t *connection)
+{
+    while (connection->ready && connection->outstanding < PIPELINE_DEPTH && state->queued > 0) {
+        uint32_t tile = state->queue[--state->queued];
+        connection->tiles[connection->outstanding++] = tile;
+        region_t region = tile_region(tile, state->tiles_x);
+        if (!send_message(connection->fd, MESSAGE_TILE, &region, sizeof(region))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/** copies the colors of a result into the image. returns false if the result is not of an outstanding tile */
+static bool handle_result(coordinator_state_t *state, connection_t *connection, const uint8_t *payload, uint32_t size)
+{
+    if (size < sizeof(result_message_t)) {
+        return false;
+    }
+    result_message_t result;
+    memcpy(&result, payload, sizeof(result));
+
+    uint32_t index = 0;
+    region_t region;
+    while (index < connection->outstanding) {
+        region = tile_region(connection->tiles[index], state->tiles_x);
+        if (memcmp(&region, &result.region, sizeof(region_t)) == 0) {
+            break;
+        }
+        index++;
+    }
+    if (index == connection->outstanding) {
+        return false;
+    }
+    uint32_t width = region.x1 - region.x0;
+    uint32_t height = region.y1 - region.y0;
+    if (size != sizeof(result) + width * height * sizeof(vec3f)) {
+        return false;
+    }
+    uint32_t tile = connection->tiles[index];
+    connection->tiles[index] = connection->tiles[--connection->outstanding];
+
+    // a tile may be returned by a worker that was taken for lost, the first result is kept
+    if (state->done[tile]) {
+        return true;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(&state->image[(region.y0 + y) * SIZE_X + region.x0],
+               payload + sizeof(result) + y * width * sizeof(vec3f), width * sizeof(vec3f));
+    }
+    if (state->stats) {
+        render_stats_add(state->stats, &result.stats);
+    }
+    state->done[tile] = true;
+    state->remaining--;
+    state->distributed_stats->tiles++;
+    if (--state->row_remaining[tile / state->tiles_x] == 0 && state->options->rows_done) {
+        state->options->rows_done(state->options->rows_done_arg, region.y0, region.y1);
+    }
+
+    return true;
+}
+
+/**
+ * handles the complete messages in the input of {connection}, then hands out tiles.
+ * returns false if the connection is broken or the worker misbehaves */
+static bool connection_receive(
+        coordinator_state_t *state, connection_t *connection, const job_message_t *job)
+{
+    uint8_t buffer[65536];
+    ssize_t received = recv(connection->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (received <= 0) {
+        return false;
+    }
+    byte_buffer_append(&connection->input, buffer, (size_t) received);
+
+    size_t offset = 0;
+    while (connection->input.size - offset >= sizeof(message_header_t)) {
+        message_header_t header;
+        memcpy(&header, connection->input.data + offset, sizeof(header));
+        if (header.size > MAX_MESSAGE_SIZE) {
+            return false;
+        }
+        if (connection->input.size - offset - sizeof(header) < header.size) {
+            break;
+        }
+        const uint8_t *payload = connection->input.data + offset + sizeof(header);
+        offset += sizeof(header) + header.size;
+
+        if (header.type == MESSAGE_HELLO && !connection->ready) {
+            hello_message_t hello;
+            if (header.size != sizeof(hello)) {
+                return false;
+            }
+            memcpy(&hello, payload, sizeof(hello));
+            if (hello.version != PROTOCOL_VERSION || hello.stats_size != sizeof(render_stats_t)) {
+                fprintf(stderr, "refused a worker of another version\n");
+                return false;
+            }
+            if (!send_message(connection->fd, MESSAGE_JOB, job, sizeof(job_message_t))) {
+                return false;
+            }
+            connection->ready = true;
+            state->distributed_stats->workers++;
+        } else if (header.type == MESSAGE_RESULT && connection->ready) {
+            if (!handle_result(state, connection, payload, header.size)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    memmove(connection->input.data, connection->input.data + offset, connection->input.size - offset);
+    connection->input.size -= offset;
+
+    return connection_fill(state, connection);
+}
+
+/** starts a local worker process connecting to {address}, returns its process id or -1 on failure */
+static pid_t spawn_worker(const char *address, uint32_t thread_count)
+{
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%u", thread_count > 0 ? thread_count : 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the worker is this program, started afresh as the threads of the coordinator are not copied
+        execl("/proc/self/exe", "ray_tracer", "--worker", address, "--threads", threads, (char *) NULL);
+        fprintf(stderr, "failed to start a worker: %s\n", strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "failed to start a worker: %s\n", strerror(errno));
+    }
+
+    return pid;
+}
+
+bool render_distributed(
+        const coordinator_t *coordinator, const render_options_t *options, vec3f *image, render_stats_t *stats,
+        distributed_stats_t *distributed_stats)
+{
+    memset(distributed_stats, 0, sizeof(distributed_stats_t));
+    if (stats) {
+        memset(stats, 0, sizeof(render_stats_t));
+    }
+
+    job_message_t job = {
+            .size_x=SIZE_X, .size_y=SIZE_Y, .packet_width=options->packet_width,
+            .wavefront=options->wavefront, .min_weight=options->min_weight,
+            .light_threshold=options->light_threshold, .light_samples=options->light_samples,
+            .adaptive_threshold=options->adaptive_threshold, .adaptive_rate=options->adaptive_rate,
+            .sampler=options->sampler
+    };
+    if (strlen(coordinator->scene) >= MAX_SCENE_LENGTH) {
+        fprintf(stderr, "%s: scene path too long\n", coordinator->scene);
+        return false;
+    }
+    strcpy(job.scene, coordinator->scene);
+
+    address_t address;
+    if (!parse_address(&address, coordinator->address, true)) {
+        return false;
+    }
+    int listener = listen_at(&address, coordinator->address);
+    if (listener < 0) {
+        return false;
+    }
+
+    /** queue the tiles, the first row of tiles is handed out first */
+    coordinator_state_t state = {.options=options, .image=image, .stats=stats, .distributed_stats=distributed_stats};
+    state.tiles_x = (SIZE_X + DISTRIBUTED_TILE_SIZE - 1) / DISTRIBUTED_TILE_SIZE;
+    uint32_t tiles_y = (SIZE_Y + DISTRIBUTED_TILE_SIZE - 1) / DISTRIBUTED_TILE_SIZE;
+    state.tile_count = state.tiles_x * tiles_y;
+    state.queue = malloc((state.tile_count > 0 ? state.tile_count : 1) * sizeof(uint32_t));
+    state.done = calloc(state.tile_count > 0 ? state.tile_count : 1, sizeof(bool));
+    state.row_remaining = malloc((tiles_y > 0 ? tiles_y : 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < state.tile_count; i++) {
+        state.queue[i] = state.tile_count - 1 - i;
+    }
+    for (uint32_t i = 0; i < tiles_y; i++) {
+        state.row_remaining[i] = state.tiles_x;
+    }
+    state.queued = state.tile_count;
+    state.remaining = state.tile_count;
+
+    uint32_t children = 0; // local workers still running
+    for (uint32_t i = 0; i < coordinator->spawn; i++) {
+        if (spawn_worker(coordinator->address, coordinator->threads) > 0) {
+            children++;
+        }
+    }
+
+    connection_t *connections = NULL;
+    uint32_t connection_count = 0;
+    struct pollfd *fds = NULL;
+    bool ok = true;
+    bool waiting_reported = false;
+    while (state.remaining > 0) {
+        fds = realloc(fds, (connection_count + 1) * sizeof(struct pollfd));
+        fds[0] = (struct pollfd) {.fd=listener, .events=POLLIN};
+        for (uint32_t i = 0; i < connection_count; i++) {
+            fds[i + 1] = (struct pollfd) {.fd=connections[i].fd, .events=POLLIN};
+        }
+        if (poll(fds, connection_count + 1, 100) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+
+        /** handle the workers before accepting new ones, as the pollfds follow the connections */
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < connection_count; i++) {
+            connection_t *connection = &connections[i];
+            bool alive = true;
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                alive = connection_receive(&state, connection, &job);
+            }
+            if (!alive) {
+                connection_lost(&state, connection);
+            } else {
+                connections[kept++] = *connection;
+            }
+        }
+        connection_count = kept;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) {
+                connections = realloc(connections, (connection_count + 1) * sizeof(connection_t));
+                connections[connection_count++] = (connection_t) {.fd=fd, .ready=false, .outstanding=0};
+            }
+        }
+
+        // hand out the tiles of lost workers
+        kept = 0;
+        for (uint32_t i = 0; i < connection_count; i++) {
+            if (connection_fill(&state, &connections[i])) {
+                connections[kept++] = connections[i];
+            } else {
+                connection_lost(&state, &connections[i]);
+            }
+        }
+        connection_count = kept;
+
+        /** local workers that exited, they are not started again */
+        while (children > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+            children--;
+        }
+        if (children == 0 && connection_count == 0 && state.remaining > 0) {
+            if (coordinator->spawn > 0 && !coordinator->wait_for_workers) {
+                fprintf(stderr, "all workers exited before the render was done\n");
+                ok = false;
+                break;
+            }
+            if (!waiting_reported) {
+                fprintf(stderr, "waiting for workers at %s\n", coordinator->address);
+                waiting_reported = true;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < connection_count; i++) {
+        if (connections[i].ready) {
+            send_message(connections[i].fd, MESSAGE_DONE, NULL, 0);
+        }
+        close(connections[i].fd);
+        byte_buffer_free(&connections[i].input);
+    }
+    for (; children > 0; children--) {
+        wait(NULL);
+    }
+    close(listener);
+    if (address.family == AF_UNIX) {
+        unlink(((struct sockaddr_un *) &address.storage)->sun_path);
+    }
+    free(fds);
+    free(connections);
+    free(state.row_remaining);
+    free(state.done);
+    free(state.queue);
+
+    return ok;
+}
+
+/** loads and prepares the scene of {job}, returns false and prints the reason on failure */
+static bool worker_load(const job_message_t *job)
+{
+    char scene[MAX_SCENE_LENGTH];
+    memcpy(scene, job->scene, MAX_SCENE_LENGTH);
+    scene[MAX_SCENE_LENGTH - 1] = '\0';
+    if (!scene_load_builtin(scene) && !scene_load_file(scene)) {
+        return false;
+    }
+    if (SIZE_X != job->size_x || SIZE_Y != job->size_y) {
+        fprintf(stderr, "%s: the scene differs from the scene of the coordinator\n", scene);
+        scene_unload();
+        return false;
+    }
+    scene_compile();
+    sphere_soa_from_scene(&SPHERES_SOA);
+#ifdef USE_BVH
+    bvh_build(&BVH);
+#endif
+
+    return true;
+}
+
+static void worker_unload(void)
+{
+#ifdef USE_BVH
+    bvh_free(&BVH);
+#endif
+    sphere_soa_free(&SPHERES_SOA);
+    scene_unload();
+}
+
+bool run_worker(const char *address_text, uint32_t thread_count)
+{
+    address_t address;
+    if (!parse_address(&address, address_text, false)) {
+        return false;
+    }
+    int fd = connect_to(&address, address_text);
+    if (fd < 0) {
+        return false;
+    }
+
+    hello_message_t hello = {.version=PROTOCOL_VERSION, .stats_size=sizeof(render_stats_t)};
+    message_header_t header;
+    job_message_t job;
+    if (!send_message(fd, MESSAGE_HELLO, &hello, sizeof(hello)) || !receive_all(fd, &header, sizeof(header)) ||
+        header.type != MESSAGE_JOB || header.size != sizeof(job) || !receive_all(fd, &job, sizeof(job))) {
+        fprintf(stderr, "%s: the coordinator refused the worker\n", address_text);
+        close(fd);
+        return false;
+    }
+    if (!worker_load(&job)) {
+        close(fd);
+        return false;
+    }
+
+    render_options_t options = {
+            .packet_width=job.packet_width, .wavefront=job.wavefront != 0, .min_weight=job.min_weight,
+            .light_threshold=job.light_threshold, .light_samples=job.light_samples,
+            .adaptive_threshold=job.adaptive_threshold, .adaptive_rate=job.adaptive_rate, .sampler=job.sampler,
+            .rows_done=NULL
+    };
+    camera_t camera;
+    camera_init(&camera);
+    pool_t *pool = pool_create(thread_count);
+    if (!pool) {
+        fprintf(stderr, "failed to create worker threads\n");
+        worker_unload();
+        close(fd);
+        return false;
+    }
+
+    // tiles are rendered into an image of the full size, as the colors of the pixels do not depend on the region
+    vec3f *image = malloc((size_t) SIZE_X * SIZE_Y * sizeof(vec3f));
+    uint8_t *result = malloc(sizeof(result_message_t) + DISTRIBUTED_TILE_SIZE * DISTRIBUTED_TILE_SIZE * sizeof(vec3f));
+    if (!image || !result) {
+        // the coordinator hands the tiles of this worker to the others once the connection is closed
+        fprintf(stderr, "not enough memory for a %ux%u image\n", SIZE_X, SIZE_Y);
+        free(result);
+        free(image);
+        pool_destroy(pool);
+        worker_unload();
+        close(fd);
+        return false;
+    }
+    bool ok = false;
+    while (receive_all(fd, &header, sizeof(header))) {
+        if (header.type == MESSAGE_DONE) {
+            ok = true;
+            break;
+        }
+        region_t region;
+        if (header.type != MESSAGE_TILE || header.size != sizeof(region) || !receive_all(fd, &region, sizeof(region)) ||
+            region.x0 >= region.x1 || region.y0 >= region.y1 || region.x1 > SIZE_X || region.y1 > SIZE_Y ||
+            region.x1 - region.x0 > DISTRIBUTED_TILE_SIZE || region.y1 - region.y0 > DISTRIBUTED_TILE_SIZE) {
+            break;
+        }
+
+        result_message_t message = {.region=region};
+        render_region(pool, &camera, &options, &region, image, &message.stats);
+        uint32_t width = region.x1 - region.x0;
+        uint32_t height = region.y1 - region.y0;
+        memcpy(result, &message, sizeof(message));
+        for (uint32_t y = 0; y < height; y++) {
+            memcpy(result + sizeof(message) + y * width * sizeof(vec3f),
+                   &image[(size_t) (region.y0 + y) * SIZE_X + region.x0], width * sizeof(vec3f));
+        }
+        if (!send_message(fd, MESSAGE_RESULT, result, sizeof(message) + width * height * sizeof(vec3f))) {
+            break;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: lost the connection to the coordinator\n", address_text);
+    }
+
+    free(result);
+    free(image);
+    pool_destroy(pool);
+    worker_unload();
+    close(fd);
+
+    return ok;
+}
+
+void distributed_stats_print(const distributed_stats_t *stats, FILE *file)
+{
+    fprintf(file, "workers:            %u connected, %u lost\n", stats->workers, stats->lost);
+    fprintf(file, "tiles:              %lu rendered, %lu handed out again\n",
+            (unsigned long) stats->tiles, (unsigned long) stats->requeued);
+}
@@ -0,0 +1,47 @@
+#ifndef RAY_TRACER_DISTRIBUTED_H
+#define RAY_TRACER_DISTRIBUTED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "render.h"
+
+/** width and height of the tiles handed to workers in pixels, a multiple of TILE_SIZE */
+#define DISTRIBUTED_TILE_SIZE 64
+
+/** settings of the coordinator of a distributed render */
+typedef struct {
+    const char *address;   // unix:PATH or tcp:HOST:PORT to accept workers at
+    uint32_t spawn;        // number of local worker processes to start
+    uint32_t threads;      // number of threads of each local worker
+    const char *scene;     // name or file of the scene, as loaded by the workers
+    bool wait_for_workers; // whether to wait for workers to connect once the local workers have exited
+} coordinator_t;
+
+/** statistics of a distributed render */
+typedef struct {
+    uint32_t workers;   // workers that connected
+    uint32_t lost;      // workers that disconnected before the render was done
+    uint64_t tiles;     // tiles rendered
+    uint64_t requeued;  // tiles handed out again because their worker was lost
+} distributed_stats_t;
+
+/**
+ * renders the loaded scene into {image} of SIZE_X * SIZE_Y linear colors by handing out tiles to worker processes.
+ * the workers connect to the address of {coordinator}, load the scene themselves and send back the colors of each
+ * tile as floats. tiles of a worker that disconnects are handed to the others. {options} is passed to the workers,
+ * except its rows_done, which is called here when rows of the image are complete. {stats} receives the statistics the
+ * workers reported. returns false and prints the reason if the render could not be completed */
+bool render_distributed(
+        const coordinator_t *coordinator, const render_options_t *options, vec3f *image, render_stats_t *stats,
+        distributed_stats_t *distributed_stats);
+
+/**
+ * runs a worker: connects to the coordinator at {address}, then renders the tiles it is handed with {thread_count}
+ * threads until the coordinator is done. returns false and prints the reason on failure */
+bool run_worker(const char *address, uint32_t thread_count);
+
+/** prints a summary of {stats} to {file} */
+void distributed_stats_print(const distributed_stats_t *stats, FILE *file);
+
+#endif //RAY_TRACER_DISTRIBUTED_H
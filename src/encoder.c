@@ -0,0 +1,144 @@
+#include "encoder.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "scene.h"
+
+struct encoder {
+    const vec3f *image;
+    image_writer_t writers[ENCODER_MAX_OUTPUTS];
+    const char *paths[ENCODER_MAX_OUTPUTS];
+    char *temporary_paths[ENCODER_MAX_OUTPUTS];
+    uint32_t count;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;      // signalled when the first unfinished row moves down
+    bool *finished;            // per row
+    uint32_t first_unfinished;
+    bool cancelled;            // the remaining rows are not written
+};
+
+/** writes the rows in order, waiting for each to be finished */
+static void *encoder_main(void *arg)
+{
+    encoder_t *encoder = arg;
+
+    uint32_t written = 0;
+    while (written < SIZE_Y) {
+        pthread_mutex_lock(&encoder->lock);
+        while (encoder->first_unfinished == written && !encoder->cancelled) {
+            pthread_cond_wait(&encoder->ready, &encoder->lock);
+        }
+        uint32_t end = encoder->first_unfinished;
+        bool cancelled = encoder->cancelled;
+        pthread_mutex_unlock(&encoder->lock);
+        if (cancelled) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < encoder->count; i++) {
+            image_writer_rows(&encoder->writers[i], encoder->image, written, end);
+        }
+        written = end;
+    }
+
+    return NULL;
+}
+
+/** closes the files of {encoder}, which replace their destinations if {complete}, and frees it. returns whether ok */
+static bool encoder_free(encoder_t *encoder, bool complete)
+{
+    bool ok = complete;
+    for (uint32_t i = 0; i < encoder->count; i++) {
+        bool written = image_writer_close(&encoder->writers[i]) && complete;
+        if (written && rename(encoder->temporary_paths[i], encoder->paths[i]) != 0) {
+            fprintf(stderr, "%s: failed to write image\n", encoder->paths[i]);
+            written = false;
+        }
+        if (!written) {
+            remove(encoder->temporary_paths[i]);
+        }
+        ok = ok && written;
+        free(encoder->temporary_paths[i]);
+    }
+    free(encoder->finished);
+    free(encoder);
+
+    return ok;
+}
+
+encoder_t *encoder_start(const vec3f *image, const char *const *paths, uint32_t count, float exposure)
+{
+    encoder_t *encoder = calloc(1, sizeof(encoder_t));
+    encoder->image = image;
+    encoder->finished = calloc(SIZE_Y > 0 ? SIZE_Y : 1, sizeof(bool));
+    for (uint32_t i = 0; i < count && i < ENCODER_MAX_OUTPUTS; i++) {
+        encoder->paths[i] = paths[i];
+        size_t size = strlen(paths[i]) + sizeof(".tmp");
+        encoder->temporary_paths[i] = malloc(size);
+        snprintf(encoder->temporary_paths[i], size, "%s.tmp", paths[i]);
+        if (!image_writer_open(&encoder->writers[i], encoder->temporary_paths[i], image_format(paths[i]), exposure)) {
+            free(encoder->temporary_paths[i]);
+            encoder_free(encoder, false);
+            return NULL;
+        }
+        encoder->count++;
+    }
+
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->ready, NULL);
+    if (pthread_create(&encoder->thread, NULL, encoder_main, encoder) != 0) {
+        fprintf(stderr, "failed to create the encoder thread\n");
+        pthread_cond_destroy(&encoder->ready);
+        pthread_mutex_destroy(&encoder->lock);
+        encoder_free(encoder, false);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+void encoder_rows(encoder_t *encoder, uint32_t y0, uint32_t y1)
+{
+    pthread_mutex_lock(&encoder->lock);
+    for (uint32_t y = y0; y < y1; y++) {
+        encoder->finished[y] = true;
+    }
+    uint32_t first = encoder->first_unfinished;
+    while (encoder->first_unfinished < SIZE_Y && encoder->finished[encoder->first_unfinished]) {
+        encoder->first_unfinished++;
+    }
+    if (encoder->first_unfinished != first) {
+        pthread_cond_signal(&encoder->ready);
+    }
+    pthread_mutex_unlock(&encoder->lock);
+}
+
+/** waits for the thread of {encoder} to end, then frees it as encoder_free does */
+static bool encoder_join(encoder_t *encoder, bool complete)
+{
+    pthread_join(encoder->thread, NULL);
+    pthread_cond_destroy(&encoder->ready);
+    pthread_mutex_destroy(&encoder->lock);
+
+    return encoder_free(encoder, complete);
+}
+
+bool encoder_finish(encoder_t *encoder)
+{
+    return encoder_join(encoder, true);
+}
+
+void encoder_cancel(encoder_t *encoder)
+{
+    pthread_mutex_lock(&encoder->lock);
+    encoder->cancelled = true;
+    pthread_cond_signal(&encoder->ready);
+    pthread_mutex_unlock(&encoder->lock);
+
+    encoder_join(encoder, false);
+}
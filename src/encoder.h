@@ -0,0 +1,29 @@
+#ifndef RAY_TRACER_ENCODER_H
+#define RAY_TRACER_ENCODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vec3.h"
+
+/** maximum number of files an encoder writes to */
+#define ENCODER_MAX_OUTPUTS 8
+
+/** background thread writing the rows of an image to files as they are finished */
+typedef struct encoder encoder_t;
+
+/**
+ * starts a thread writing {image} of SIZE_X * SIZE_Y linear colors to the {count} files {paths}, each in the format of
+ * its extension. {exposure} scales the colors of 8-bit formats. rows are written once they are marked finished by
+ * encoder_rows, to temporary files that replace {paths} once complete. returns NULL and prints the reason on failure */
+encoder_t *encoder_start(const vec3f *image, const char *const *paths, uint32_t count, float exposure);
+
+/** marks rows [{y0}, {y1}) of the image as finished, they are not changed until encoder_finish. thread-safe */
+void encoder_rows(encoder_t *encoder, uint32_t y0, uint32_t y1);
+
+/** waits until all rows are marked finished and written, then frees {encoder}. returns whether all files are written */
+bool encoder_finish(encoder_t *encoder);
+
+/** stops writing and frees {encoder}, its temporary files are removed and {paths} are not changed */
+void encoder_cancel(encoder_t *encoder);
+
+#endif //RAY_TRACER_ENCODER_H
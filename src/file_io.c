@@ -0,0 +1,30 @@
+#include "file_io.h"
+
+bool at_line_end(const char **p, const char *end)
+{
+    const char *q = *p;
+    while ((!end || q < end) && (*q == ' ' || *q == '\t' || *q == '\r')) {
+        q++;
+    }
+    *p = q;
+
+    return (end ? q == end : *q == '\0') || *q == '\n' || *q == '#';
+}
+
+bool write_array(FILE *file, uint64_t *offset, uint64_t to, const void *array, size_t size, uint32_t count)
+{
+    static const char padding[64];
+    while (*offset < to) {
+        size_t padding_size = to - *offset < sizeof(padding) ? (size_t) (to - *offset) : sizeof(padding);
+        if (fwrite(padding, 1, padding_size, file) != padding_size) {
+            return false;
+        }
+        *offset += padding_size;
+    }
+    if (fwrite(array, size, count, file) != count) {
+        return false;
+    }
+    *offset += (uint64_t) count * size;
+
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef RAY_TRACER_FILE_IO_H
+#define RAY_TRACER_FILE_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * skips the blanks at {*p} in a text that ends at {end}, or at a '\0' if {end} is NULL. returns whether the current
+ * line has no more values: the line or the text ends, or a '#' comment starts */
+bool at_line_end(const char **p, const char *end);
+
+/**
+ * pads {file} with zeros from {offset} up to {to}, then writes {count} elements of {size} bytes from {array}. updates
+ * {offset}, returns false if writing fails */
+bool write_array(FILE *file, uint64_t *offset, uint64_t to, const void *array, size_t size, uint32_t count);
+
+#endif //RAY_TRACER_FILE_IO_H
@@ -0,0 +1,412 @@
+#include "image.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "scene.h"
+
+/** number of rows converted at a time, for PNG also the rows compressed independently of the others */
+#define BAND_ROWS 32
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+image_format_t image_format(const char *path)
+{
+    const char *extension = strrchr(path, '.');
+    if (extension && strcasecmp(extension, ".ppm") == 0) {
+        return IMAGE_PPM;
+    }
+    if (extension && strcasecmp(extension, ".pfm") == 0) {
+        return IMAGE_PFM;
+    }
+    if (extension && strcasecmp(extension, ".exr") == 0) {
+        return IMAGE_EXR;
+    }
+
+    return IMAGE_PNG;
+}
+
+/** returns {value} clamped to [0, 1] and quantized, in the order of the vector instructions so NaN becomes 1 */
+static uint8_t quantize(float value)
+{
+    value = value < 1.f ? value : 1.f;
+    value = value > 0.f ? value : 0.f;
+
+    return (uint8_t) (value * 255.f);
+}
+
+void image_tonemap(const vec3f *image, color_t *buffer, uint32_t count, float exposure)
+{
+    // both are arrays of channels without padding
+    const float *in = (const float *) image;
+    uint8_t *out = (uint8_t *) buffer;
+    size_t channels = (size_t) count * 3;
+
+    size_t i = 0;
+#ifdef __SSE2__
+    // sixteen channels at a time, the conversion truncates as the scalar cast does
+    const __m128 scale = _mm_set1_ps(exposure);
+    const __m128 max = _mm_set1_ps(255.f);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 16 <= channels; i += 16) {
+        __m128i q[4];
+        for (uint32_t k = 0; k < 4; k++) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(&in[i + 4 * k]), scale);
+            v = _mm_max_ps(_mm_min_ps(v, one), zero);
+            q[k] = _mm_cvttps_epi32(_mm_mul_ps(v, max));
+        }
+        __m128i low = _mm_packs_epi32(q[0], q[1]);
+        __m128i high = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i *) &out[i], _mm_packus_epi16(low, high));
+    }
+#endif
+    for (; i < channels; i++) {
+        out[i] = quantize(in[i] * exposure);
+    }
+}
+
+/** writes {count} floats of {values} to {file} in little-endian byte order */
+static void write_floats_le(FILE *file, const float *values, size_t count)
+{
+    uint8_t bytes[4 * 64];
+    while (count > 0) {
+        size_t n = count < 64 ? count : 64;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t bits;
+            memcpy(&bits, &values[i], sizeof(bits));
+            for (uint32_t b = 0; b < 4; b++) {
+                bytes[4 * i + b] = (uint8_t) (bits >> (8 * b));
+            }
+        }
+        fwrite(bytes, 4, n, file);
+        values += n;
+        count -= n;
+    }
+}
+
+/** writes {value} to {file} in little-endian byte order, in {size} bytes */
+static void write_le(FILE *file, uint64_t value, uint32_t size)
+{
+    for (uint32_t b = 0; b < size; b++) {
+        fputc((int) ((value >> (8 * b)) & 0xff), file);
+    }
+}
+
+/** writes {value} to {file} in big-endian byte order, in 4 bytes */
+static void write_be32(FILE *file, uint32_t value)
+{
+    uint8_t bytes[4] = {(uint8_t) (value >> 24), (uint8_t) (value >> 16), (uint8_t) (value >> 8), (uint8_t) value};
+    fwrite(bytes, 1, 4, file);
+}
+
+/** writes a PNG chunk of {type} holding {size} bytes of {data} */
+static void write_png_chunk(FILE *file, const char *type, const uint8_t *data, size_t size)
+{
+    write_be32(file, (uint32_t) size);
+    fwrite(type, 1, 4, file);
+    fwrite(data, 1, size, file);
+    write_be32(file, crc32_update(crc32_update(0, (const uint8_t *) type, 4), data, size));
+}
+
+/** returns the predictor of the paeth filter for left {a}, above {b} and upper left {c} */
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/** returns byte {i} of {row} below {above} filtered with filter {type} */
+static uint8_t filter_byte(uint8_t type, const uint8_t *row, const uint8_t *above, uint32_t i)
+{
+    const uint32_t bpp = sizeof(color_t);
+    uint8_t a = i >= bpp ? row[i - bpp] : 0;
+    uint8_t b = above[i];
+    uint8_t c = i >= bpp ? above[i - bpp] : 0;
+    switch (type) {
+        case 0:
+            return row[i];
+        case 1:
+            return (uint8_t) (row[i] - a);
+        case 2:
+            return (uint8_t) (row[i] - b);
+        case 3:
+            return (uint8_t) (row[i] - (a + b) / 2);
+        default:
+            return (uint8_t) (row[i] - paeth(a, b, c));
+    }
+}
+
+/**
+ * writes the filter type and the filtered bytes of {row} of {size} bytes below {above} to {out}. of the five filters,
+ * the one of which the filtered bytes have the smallest sum of magnitudes is taken, which tends to compress best */
+static void filter_row(uint8_t *out, const uint8_t *row, const uint8_t *above, uint32_t size)
+{
+    uint8_t best = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (uint8_t type = 0; type < 5; type++) {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < size; i++) {
+            uint8_t value = filter_byte(type, row, above, i);
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = type;
+        }
+    }
+
+    out[0] = best;
+    for (uint32_t i = 0; i < size; i++) {
+        out[1 + i] = filter_byte(best, row, above, i);
+    }
+}
+
+/** writes header attribute {name} of {type} with a value of {size} bytes, of which the caller writes the value */
+static void write_exr_attribute(FILE *file, const char *name, const char *type, uint32_t size)
+{
+    fwrite(name, 1, strlen(name) + 1, file);
+    fwrite(type, 1, strlen(type) + 1, file);
+    write_le(file, size, 4);
+}
+
+/** writes the header and the offsets of the scan lines of an uncompressed single part image of 32-bit floats */
+static void write_exr_header(FILE *file)
+{
+    write_le(file, 20000630, 4); // magic number
+    write_le(file, 2, 4);        // version 2, no flags
+
+    // channels are sorted by name, each a 32-bit float sampled at every pixel
+    static const char *CHANNELS[3] = {"B", "G", "R"};
+    write_exr_attribute(file, "channels", "chlist", 3 * (2 + 16) + 1);
+    for (uint32_t c = 0; c < 3; c++) {
+        fwrite(CHANNELS[c], 1, 2, file);
+        write_le(file, 2, 4); // pixel type float
+        write_le(file, 0, 4); // linear flag and reserved bytes
+        write_le(file, 1, 4); // x sampling
+        write_le(file, 1, 4); // y sampling
+    }
+    fputc(0, file);
+
+    write_exr_attribute(file, "compression", "compression", 1);
+    fputc(0, file); // none
+    const char *windows[2] = {"dataWindow", "displayWindow"};
+    for (uint32_t w = 0; w < 2; w++) {
+        write_exr_attribute(file, windows[w], "box2i", 16);
+        write_le(file, 0, 4);
+        write_le(file, 0, 4);
+        write_le(file, SIZE_X - 1, 4);
+        write_le(file, SIZE_Y - 1, 4);
+    }
+    write_exr_attribute(file, "lineOrder", "lineOrder", 1);
+    fputc(0, file); // increasing y
+    float aspect = 1.f;
+    write_exr_attribute(file, "pixelAspectRatio", "float", 4);
+    write_floats_le(file, &aspect, 1);
+    float center[2] = {0.f, 0.f};
+    write_exr_attribute(file, "screenWindowCenter", "v2f", 8);
+    write_floats_le(file, center, 2);
+    write_exr_attribute(file, "screenWindowWidth", "float", 4);
+    write_floats_le(file, &aspect, 1);
+    fputc(0, file); // end of header
+
+    // each scan line is a block of its y and size, followed by the row of each channel
+    uint64_t line_size = (uint64_t) SIZE_X * 3 * sizeof(float);
+    uint64_t offset = (uint64_t) ftell(file) + (uint64_t) SIZE_Y * 8;
+    for (uint32_t j = 0; j < SIZE_Y; j++) {
+        write_le(file, offset + j * (8 + line_size), 8);
+    }
+}
+
+/** writes the scan lines [{y0}, {y1}) of {image} */
+static void write_exr_rows(FILE *file, const vec3f *image, uint32_t y0, uint32_t y1)
+{
+    float *row = malloc(SIZE_X * sizeof(float));
+    for (uint32_t j = y0; j < y1; j++) {
+        write_le(file, j, 4);
+        write_le(file, (uint64_t) SIZE_X * 3 * sizeof(float), 4);
+        for (uint32_t c = 0; c < 3; c++) {
+            const float *channel = (const float *) &image[j * SIZE_X] + (2 - c);
+            for (uint32_t i = 0; i < SIZE_X; i++) {
+                row[i] = channel[3 * i];
+            }
+            write_floats_le(file, row, SIZE_X);
+        }
+    }
+    free(row);
+}
+
+/** sets up {writer} to write to {file}, named {path} in messages, and writes the header */
+static void writer_begin(image_writer_t *writer, FILE *file, const char *path, image_format_t format, float exposure)
+{
+    memset(writer, 0, sizeof(image_writer_t));
+    writer->format = format;
+    writer->path = path;
+    writer->exposure = exposure;
+    writer->file = file;
+
+    if (format == IMAGE_PNG || format == IMAGE_PPM) {
+        writer->colors = malloc(BAND_ROWS * SIZE_X * sizeof(color_t));
+    }
+
+    if (format == IMAGE_PNG) {
+        static const uint8_t SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        fwrite(SIGNATURE, 1, sizeof(SIGNATURE), file);
+
+        // 8-bit rgb without interlacing
+        uint8_t header[13] = {
+                (uint8_t) (SIZE_X >> 24), (uint8_t) (SIZE_X >> 16), (uint8_t) (SIZE_X >> 8), (uint8_t) SIZE_X,
+                (uint8_t) (SIZE_Y >> 24), (uint8_t) (SIZE_Y >> 16), (uint8_t) (SIZE_Y >> 8), (uint8_t) SIZE_Y,
+                8, 2, 0, 0, 0
+        };
+        write_png_chunk(file, "IHDR", header, sizeof(header));
+
+        writer->filtered = malloc(BAND_ROWS * (1 + SIZE_X * sizeof(color_t)));
+        writer->previous = calloc(SIZE_X, sizeof(color_t));
+        writer->adler = 1;
+
+        // the image data is a single zlib stream split over the chunks of the bands
+        static const uint8_t ZLIB_HEADER[2] = {0x78, 0x5e};
+        byte_buffer_append(&writer->chunk, ZLIB_HEADER, sizeof(ZLIB_HEADER));
+    } else if (format == IMAGE_PPM) {
+        fprintf(file, "P6\n%u %u\n255\n", SIZE_X, SIZE_Y);
+    } else if (format == IMAGE_PFM) {
+        // a negative scale marks little-endian floats
+        fprintf(file, "PF\n%u %u\n-1.0\n", SIZE_X, SIZE_Y);
+        writer->data_offset = ftell(file);
+    } else {
+        write_exr_header(file);
+    }
+}
+
+bool image_writer_open(image_writer_t *writer, const char *path, image_format_t format, float exposure)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    writer_begin(writer, file, path, format, exposure);
+
+    return true;
+}
+
+/** writes rows [{y0}, {y1}) of {image}, at most BAND_ROWS */
+static void write_band(image_writer_t *writer, const vec3f *image, uint32_t y0, uint32_t y1)
+{
+    FILE *file = writer->file;
+    const vec3f *band = &image[y0 * SIZE_X];
+    uint32_t row_size = SIZE_X * sizeof(color_t);
+
+    switch (writer->format) {
+        case IMAGE_PNG: {
+            image_tonemap(band, writer->colors, (y1 - y0) * SIZE_X, writer->exposure);
+            const uint8_t *colors = (const uint8_t *) writer->colors;
+            for (uint32_t j = 0; j < y1 - y0; j++) {
+                const uint8_t *above = j > 0 ? &colors[(j - 1) * row_size] : writer->previous;
+                filter_row(&writer->filtered[j * (1 + row_size)], &colors[j * row_size], above, row_size);
+            }
+            memcpy(writer->previous, &colors[(y1 - y0 - 1) * row_size], row_size);
+
+            size_t size = (y1 - y0) * (1 + row_size);
+            bool final = y1 == SIZE_Y;
+            deflate_block(&writer->chunk, writer->filtered, size, final);
+            writer->adler = adler32_update(writer->adler, writer->filtered, size);
+            if (final) {
+                uint8_t adler[4] = {
+                        (uint8_t) (writer->adler >> 24), (uint8_t) (writer->adler >> 16),
+                        (uint8_t) (writer->adler >> 8), (uint8_t) writer->adler
+                };
+                byte_buffer_append(&writer->chunk, adler, sizeof(adler));
+            }
+            write_png_chunk(file, "IDAT", writer->chunk.data, writer->chunk.size);
+            writer->chunk.size = 0;
+            break;
+        }
+        case IMAGE_PPM:
+            image_tonemap(band, writer->colors, (y1 - y0) * SIZE_X, writer->exposure);
+            fwrite(writer->colors, row_size, y1 - y0, file);
+            break;
+        case IMAGE_PFM:
+            // rows are stored from the bottom up
+            for (uint32_t j = y0; j < y1; j++) {
+                long row_offset = (long) (SIZE_Y - 1 - j) * SIZE_X * 3 * (long) sizeof(float);
+                fseek(file, writer->data_offset + row_offset, SEEK_SET);
+                write_floats_le(file, (const float *) &image[j * SIZE_X], (size_t) SIZE_X * 3);
+            }
+            break;
+        case IMAGE_EXR:
+            write_exr_rows(file, image, y0, y1);
+            break;
+    }
+}
+
+void image_writer_rows(image_writer_t *writer, const vec3f *image, uint32_t y0, uint32_t y1)
+{
+    for (uint32_t y = y0; y < y1; y += BAND_ROWS) {
+        write_band(writer, image, y, y + BAND_ROWS < y1 ? y + BAND_ROWS : y1);
+    }
+    writer->next_row = y1;
+}
+
+/** writes the trailer of the image of {writer} and frees its buffers, the file is left open */
+static void writer_end(image_writer_t *writer)
+{
+    if (writer->format == IMAGE_PNG) {
+        write_png_chunk(writer->file, "IEND", NULL, 0);
+    }
+    free(writer->colors);
+    free(writer->filtered);
+    free(writer->previous);
+    byte_buffer_free(&writer->chunk);
+}
+
+bool image_writer_close(image_writer_t *writer)
+{
+    writer_end(writer);
+
+    bool ok = !ferror(writer->file) && writer->next_row == SIZE_Y;
+    ok = fclose(writer->file) == 0 && ok;
+    writer->file = NULL;
+    if (!ok && writer->next_row == SIZE_Y) {
+        fprintf(stderr, "%s: failed to write image\n", writer->path);
+    }
+
+    return ok;
+}
+
+bool image_encode(const vec3f *image, image_format_t format, float exposure, byte_buffer_t *buffer)
+{
+    // a temporary file rather than a buffer, as float maps are written from the bottom up
+    FILE *file = tmpfile();
+    if (!file) {
+        fprintf(stderr, "failed to create a temporary file: %s\n", strerror(errno));
+        return false;
+    }
+    image_writer_t writer;
+    writer_begin(&writer, file, "temporary file", format, exposure);
+    image_writer_rows(&writer, image, 0, SIZE_Y);
+    writer_end(&writer);
+
+    fseek(file, 0, SEEK_SET);
+    uint8_t block[65536];
+    size_t read;
+    while ((read = fread(block, 1, sizeof(block), file)) > 0) {
+        byte_buffer_append(buffer, block, read);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "failed to encode the image\n");
+    }
+
+    return ok;
+}
@@ -0,0 +1,64 @@
+#ifndef RAY_TRACER_IMAGE_H
+#define RAY_TRACER_IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "vec3.h"
+#include "render.h"
+#include "deflate.h"
+
+/** formats an image can be written in */
+typedef enum {
+    IMAGE_PNG, // 8 bits per channel, tone mapped
+    IMAGE_PPM, // binary portable pixmap, 8 bits per channel, tone mapped
+    IMAGE_PFM, // portable float map, linear 32-bit floats
+    IMAGE_EXR  // uncompressed OpenEXR, linear 32-bit floats
+} image_format_t;
+
+/** writes an image of SIZE_X * SIZE_Y pixels to a file, a band of rows at a time */
+typedef struct {
+    image_format_t format;
+    FILE *file;
+    const char *path;
+    float exposure;       // scale of the colors of tone mapped formats
+    uint32_t next_row;    // rows are written from the top down
+    long data_offset;     // PFM: size of the header, as rows are stored from the bottom up
+    /** tone mapped formats */
+    color_t *colors;      // tone mapped colors of a band
+    /** PNG */
+    uint8_t *filtered;    // filter type and filtered bytes of the rows of a band
+    uint8_t *previous;    // tone mapped colors of the row above the band
+    uint32_t adler;       // checksum of the filtered bytes so far
+    byte_buffer_t chunk;  // compressed band
+} image_writer_t;
+
+/** returns the format of which {path} has the extension, PNG if it has none of the supported */
+image_format_t image_format(const char *path);
+
+/**
+ * tone maps the {count} linear colors of {image} to {buffer}: each channel is scaled by {exposure}, clamped to [0, 1]
+ * and quantized to 8 bits. NaN is mapped to the brightest value */
+void image_tonemap(const vec3f *image, color_t *buffer, uint32_t count, float exposure);
+
+/**
+ * creates file {path} and writes the header of an image in {format}, to which the rows are written by
+ * image_writer_rows. {exposure} scales the colors of 8-bit formats. returns false and prints the reason on failure */
+bool image_writer_open(image_writer_t *writer, const char *path, image_format_t format, float exposure);
+
+/**
+ * writes rows [{y0}, {y1}) of {image} of SIZE_X * SIZE_Y linear colors, which follow the rows written before.
+ * the memory used does not depend on the number of rows, as these are converted in bands */
+void image_writer_rows(image_writer_t *writer, const vec3f *image, uint32_t y0, uint32_t y1);
+
+/**
+ * completes the file of {writer} and closes it. returns false if not all rows were written, and also prints a message
+ * if any write failed */
+bool image_writer_close(image_writer_t *writer);
+
+/**
+ * appends {image} of SIZE_X * SIZE_Y linear colors to {buffer}, encoded in {format} as image_writer_open writes it.
+ * {exposure} scales the colors of 8-bit formats. returns false and prints the reason on failure */
+bool image_encode(const vec3f *image, image_format_t format, float exposure, byte_buffer_t *buffer);
+
+#endif //RAY_TRACER_IMAGE_H
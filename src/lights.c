@@ -0,0 +1,260 @@
+#include "lights.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "stats.h"
+
+#define MAX_LEAF_SIZE 4 // nodes with more lights are always split
+
+light_tree_t LIGHT_TREE;
+
+static void swap_lights(void *items, uint32_t a, uint32_t b)
+{
+    uint32_t *lights = items;
+    uint32_t light = lights[a];
+    lights[a] = lights[b];
+    lights[b] = light;
+}
+
+void light_tree_build(light_tree_t *tree)
+{
+    uint32_t capacity = LIGHTS_SIZE > 0 ? LIGHTS_SIZE : 1;
+    tree->lights = malloc(capacity * sizeof(uint32_t));
+    tree->unbounded = malloc(capacity * sizeof(uint32_t));
+    tree->light_count = 0;
+    tree->unbounded_count = 0;
+
+    aabb_t *bounds = malloc(capacity * sizeof(aabb_t));
+    vec3f *centroids = malloc(capacity * sizeof(vec3f));
+    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
+        const light_t *light = &LIGHTS[i];
+        if (light->type != LIGHT_POINT || light->radius == 0.f) {
+            tree->unbounded[tree->unbounded_count++] = i;
+            continue;
+        }
+
+        vec3f extent = {light->radius, light->radius, light->radius};
+        bounds[tree->light_count] = (aabb_t) {
+                vec3f_sub(light->v.location, extent), vec3f_add(light->v.location, extent)
+        };
+        centroids[tree->light_count] = light->v.location;
+        tree->lights[tree->light_count++] = i;
+    }
+
+    tree->nodes = bvh_build_nodes(
+            &tree->node_count, bounds, centroids, tree->light_count, MAX_LEAF_SIZE, swap_lights, tree->lights);
+
+    free(centroids);
+    free(bounds);
+}
+
+void light_tree_free(light_tree_t *tree)
+{
+    free(tree->nodes);
+    free(tree->lights);
+    free(tree->unbounded);
+    memset(tree, 0, sizeof(light_tree_t));
+}
+
+size_t light_tree_memory(const light_tree_t *tree)
+{
+    return (size_t) tree->node_count * sizeof(bvh_node_t) +
+           ((size_t) tree->light_count + tree->unbounded_count) * sizeof(uint32_t);
+}
+
+static bool overlaps(const aabb_t *a, const aabb_t *b)
+{
+    return a->min.x <= b->max.x && a->max.x >= b->min.x && a->min.y <= b->max.y && a->max.y >= b->min.y &&
+           a->min.z <= b->max.z && a->max.z >= b->min.z;
+}
+
+/** returns whether the sphere of influence of point light {light} overlaps {bounds} */
+static bool light_overlaps(const light_t *light, const aabb_t *bounds)
+{
+    // squared distance from the light to the closest point of the bounds
+    vec3f p = light->v.location;
+    vec3f closest = {
+            fminf(fmaxf(p.x, bounds->min.x), bounds->max.x), fminf(fmaxf(p.y, bounds->min.y), bounds->max.y),
+            fminf(fmaxf(p.z, bounds->min.z), bounds->max.z)
+    };
+    vec3f d = vec3f_sub(closest, p);
+
+    return vec3f_dot(d, d) < light->radius * light->radius;
+}
+
+uint32_t light_tree_query(const light_tree_t *tree, const aabb_t *bounds, uint32_t *lights)
+{
+    uint32_t count = tree->unbounded_count;
+    memcpy(lights, tree->unbounded, tree->unbounded_count * sizeof(uint32_t));
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    if (tree->node_count > 0) {
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0) {
+        const bvh_node_t *node = &tree->nodes[stack[--stack_size]];
+        if (!overlaps(&node->bounds, bounds)) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            stack[stack_size++] = node->offset;
+            stack[stack_size++] = (uint32_t) (node - tree->nodes) + 1;
+            continue;
+        }
+
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            if (light_overlaps(&LIGHTS[tree->lights[i]], bounds)) {
+                lights[count++] = tree->lights[i];
+            }
+        }
+    }
+
+    // in the order of LIGHTS, so the lights of a point are added up alike however the tree is built, few lights reach
+    // a point so they are sorted by insertion
+    for (uint32_t i = tree->unbounded_count + 1; i < count; i++) {
+        uint32_t light = lights[i];
+        uint32_t j = i;
+        for (; j > tree->unbounded_count && lights[j - 1] > light; j--) {
+            lights[j] = lights[j - 1];
+        }
+        lights[j] = light;
+    }
+
+    return count;
+}
+
+float light_falloff(const light_t *light, vec3f point)
+{
+    if (light->type != LIGHT_POINT || light->radius == 0.f) {
+        return 1.f;
+    }
+
+    vec3f d = vec3f_sub(point, light->v.location);
+    float x = vec3f_dot(d, d) / (light->radius * light->radius);
+    if (x >= 1.f) {
+        return 0.f;
+    }
+
+    return (1.f - x) * (1.f - x);
+}
+
+float light_scale(const trace_context_t *context, const light_t *light, vec3f point)
+{
+    if (light->type == LIGHT_AMBIENT) {
+        return 1.f;
+    }
+
+    float falloff = light_falloff(light, point);
+
+    return fabsf(light->intensity) * falloff > context->light_threshold ? falloff : 0.f;
+}
+
+/** returns a seed for the draws of light_select at {point}, a hash of its coordinates */
+static uint32_t point_seed(vec3f point)
+{
+    uint32_t bits[3];
+    memcpy(bits, &point, sizeof(bits));
+
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < 3; i++) {
+        // murmur3 finalizer of each coordinate, combined
+        uint32_t x = bits[i];
+        x ^= x >> 16;
+        x *= 0x85ebca6bu;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35u;
+        x ^= x >> 16;
+        h = (h ^ x) * 16777619u;
+    }
+
+    return h ? h : 2463534242u;
+}
+
+/** returns a number in [0, 1) from xorshift generator {state} */
+static float next_float(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return (float) (x >> 8) / (float) (1u << 24);
+}
+
+uint32_t light_select(trace_context_t *context, vec3f point, light_sample_t *samples)
+{
+    const light_tree_t *tree = &LIGHT_TREE;
+    aabb_t bounds = {point, point};
+    uint32_t *candidates = context->light_candidates;
+    uint32_t candidate_count = light_tree_query(tree, &bounds, candidates);
+
+    uint32_t count = 0;
+    uint32_t first_bounded = 0; // index of the first sample of a light with a radius
+    for (uint32_t i = 0; i < candidate_count; i++) {
+        if (i == tree->unbounded_count) {
+            first_bounded = count;
+        }
+        float scale = light_scale(context, &LIGHTS[candidates[i]], point);
+        if (scale > 0.f) {
+            samples[count++] = (light_sample_t) {candidates[i], scale};
+        }
+    }
+    if (candidate_count <= tree->unbounded_count) {
+        first_bounded = count;
+    }
+
+    uint32_t bounded_count = count - first_bounded;
+    uint32_t draws = context->light_samples;
+    if (draws == 0 || bounded_count <= draws) {
+        STATS_ADD(STAT_LIGHTS_SKIPPED, LIGHTS_SIZE - count);
+        return count;
+    }
+
+    /** draw lights with probability proportional to the intensity reaching the point */
+    light_sample_t *bounded = &samples[first_bounded];
+    float *cumulative = context->light_weights;
+    float total = 0.f;
+    for (uint32_t i = 0; i < bounded_count; i++) {
+        total += fabsf(LIGHTS[bounded[i].light].intensity) * bounded[i].scale;
+        cumulative[i] = total;
+    }
+
+    uint32_t *picks = candidates; // the candidates are no longer needed
+    memset(picks, 0, bounded_count * sizeof(uint32_t));
+    uint32_t state = point_seed(point);
+    for (uint32_t d = 0; d < draws; d++) {
+        float u = next_float(&state) * total;
+        uint32_t low = 0;
+        uint32_t high = bounded_count - 1;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (cumulative[middle] > u) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        picks[low]++;
+    }
+
+    // each draw of a light is weighted by the inverse of its probability, lights drawn more than once are shaded once
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < bounded_count; i++) {
+        if (picks[i] > 0) {
+            float intensity = fabsf(LIGHTS[bounded[i].light].intensity);
+            bounded[kept++] = (light_sample_t) {
+                    bounded[i].light, (float) picks[i] * total / ((float) draws * intensity)
+            };
+        }
+    }
+    count = first_bounded + kept;
+    STATS_ADD(STAT_LIGHTS_SKIPPED, LIGHTS_SIZE - count);
+
+    return count;
+}
@@ -0,0 +1,54 @@
+#ifndef RAY_TRACER_LIGHTS_H
+#define RAY_TRACER_LIGHTS_H
+
+#include <stdint.h>
+#include "util.h"
+#include "bvh.h"
+
+/** hierarchy over the point lights with a radius, so a point is only lit by the lights that can reach it */
+typedef struct {
+    bvh_node_t *nodes;      // over the spheres of influence of the lights
+    uint32_t node_count;
+    uint32_t *lights;       // indices in LIGHTS of the lights referenced by the leaves, in leaf order
+    uint32_t light_count;
+    uint32_t *unbounded;    // indices in LIGHTS of the ambient, directional and other point lights, in order
+    uint32_t unbounded_count;
+} light_tree_t;
+
+/** the light hierarchy of the current scene, set by scene_compile */
+extern light_tree_t LIGHT_TREE;
+
+/** builds {tree} over LIGHTS */
+void light_tree_build(light_tree_t *tree);
+
+/** frees the memory of {tree} */
+void light_tree_free(light_tree_t *tree);
+
+/** returns the number of bytes used by the nodes and light indices of {tree} */
+size_t light_tree_memory(const light_tree_t *tree);
+
+/**
+ * stores the indices of the lights that can reach a point within {bounds} in {lights}, which has room for
+ * LIGHTS_SIZE, and returns their number. the unbounded lights come first, then the lights with a radius, both in the
+ * order of LIGHTS. the lights found for a point are in the same order as for bounds containing it */
+uint32_t light_tree_query(const light_tree_t *tree, const aabb_t *bounds, uint32_t *lights);
+
+/**
+ * returns the fraction of the intensity of {light} that reaches {point}: 1 unless it is a point light with a radius,
+ * which falls off smoothly as (1 - d^2 / radius^2)^2 with distance d */
+float light_falloff(const light_t *light, vec3f point);
+
+/**
+ * returns the fraction of the intensity of {light} that reaches {point} as light_falloff, or 0 if the intensity that
+ * reaches it is not above the light_threshold of {context}. ambient lights are never skipped */
+float light_scale(const trace_context_t *context, const light_t *light, vec3f point);
+
+/**
+ * selects the lights shading {point} into {samples}, which has room for LIGHTS_SIZE, and returns their number.
+ * lights are found with LIGHT_TREE and skipped if light_scale is 0. if more lights with a radius remain than the
+ * light_samples of {context}, that many are drawn with probability proportional to the intensity reaching the point,
+ * and scaled so the expected sum is unchanged. the draws only depend on the point, so images do not depend on the
+ * order of tracing. the order of the samples is that of light_tree_query */
+uint32_t light_select(trace_context_t *context, vec3f point, light_sample_t *samples);
+
+#endif //RAY_TRACER_LIGHTS_H
@@ -1,78 +1,787 @@
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-
-#include <stb_image_write.h>
 #include <stdint.h>
-#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <float.h>
-#include "vec3.h"
 #include "scene.h"
+#include "scene_file.h"
+#include "render.h"
+#include "pool.h"
+#include "bvh.h"
+#include "spheres.h"
+#include "stats.h"
+#include "encoder.h"
+#include "distributed.h"
+#include "animation.h"
+#include "daemon.h"
+#include "checkpoint.h"
+#include <unistd.h>
+
+/** files the image is written to, each in the format of its extension */
+typedef struct {
+    const char *paths[ENCODER_MAX_OUTPUTS];
+    uint32_t count;  // 0: out.png
+    float exposure;  // scale of the colors written to 8-bit images
+} output_t;
 
-// only use to write to file
+/** progressive rendering, when either limit is set */
 typedef struct {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} color_t;
-
-const float T_MAX = FLT_MAX; // default far clipping plane
-const float T_MIN = 0.f;     // default near clipping plane
-const uint32_t DEPTH = 8;    // number of iterations for reflections/refractions
-const uint32_t RAYS_PER_PIXEL_X = 2;                // number of pixels in horizontal direction
-const uint32_t RAYS_PER_PIXEL_Y = RAYS_PER_PIXEL_X; // number of pixels in vertical direction
-const uint32_t RAYS_PER_PIXEL = RAYS_PER_PIXEL_X * RAYS_PER_PIXEL_Y; // the level of supersampling
-
-int main()
+    uint32_t samples;      // number of samples per pixel to stop at, 0: no limit
+    double time_budget;    // seconds to stop within, 0: no limit
+    double interval;       // seconds between writing intermediate images, 0: only write the final image
+} progressive_t;
+
+static void print_usage(const char *name)
 {
-    // https://en.wikipedia.org/wiki/Ray_tracing_(graphics)
-    const uint32_t K = SIZE_X * RAYS_PER_PIXEL_X; // number of rays in horizontal direction
-    const uint32_t M = SIZE_Y * RAYS_PER_PIXEL_Y; // number of rays in vertical direction
+    fprintf(stderr,
+            "usage: %s [--scene NAME|FILE] [--threads N] [--simd auto|scalar|sse|avx2] [--packets 0|4|8]\n"
+            "       [--wavefront] [--min-weight W] [--adaptive THRESHOLD] [--adaptive-rate N]\n"
+            "       [--sampler grid|jittered|halton|sobol] [--samples N] [--seed N]\n"
+            "       [--light-threshold T] [--light-samples N]\n"
+            "       [--stats] [--stats-json FILE] [--spp N] [--time-budget SECONDS] [--progress-interval SECONDS]\n"
+            "       [--output FILE.png|FILE.pfm|FILE.exr]... [--exposure STOPS] [--crop X0,Y0,X1,Y1]\n"
+            "       [--checkpoint FILE] [--memory-budget MB]\n"
+            "       [--coordinator unix:PATH|tcp:HOST:PORT] [--spawn N] [--animation FILE [--incremental]]\n"
+            "       %s --worker unix:PATH|tcp:HOST:PORT [--threads N] [--simd auto|scalar|sse|avx2]\n"
+            "       %s --daemon unix:PATH|tcp:HOST:PORT [rendering options]\n"
+            "       %s --client unix:PATH|tcp:HOST:PORT [--scene NAME|FILE] [--priority N] [--size W,H]\n"
+            "       [--eye X,Y,Z] [--target X,Y,Z] [--spp N] [--output FILE] [--exposure STOPS]\n"
+            "       %s [--scene NAME|FILE] --export FILE|--compile FILE\n"
+            "       %s --compile-mesh MESH FILE\n", name, name, name, name, name, name);
+    fprintf(stderr, "built-in scenes:");
+    for (uint32_t i = 0; scene_builtin_name(i); i++) {
+        fprintf(stderr, " %s", scene_builtin_name(i));
+    }
+    fprintf(stderr, "\n");
+}
+
+/** starts writing {image} to the files of {output} as its rows are finished, returns NULL on failure */
+static encoder_t *start_output(const output_t *output, const vec3f *image)
+{
+    static const char *DEFAULT_PATH = "out.png";
+    if (output->count == 0) {
+        return encoder_start(image, &DEFAULT_PATH, 1, output->exposure);
+    }
+
+    return encoder_start(image, output->paths, output->count, output->exposure);
+}
+
+/** reports rows [{y0}, {y1}) of the image to encoder {arg} */
+static void encode_rows(void *arg, uint32_t y0, uint32_t y1)
+{
+    encoder_rows(arg, y0, y1);
+}
+
+/**
+ * renders passes of one sample per pixel until a limit of {progressive} is reached, then resolves them into {image}.
+ * a pass is only started if it is expected to end within the time budget, but at least one pass is rendered.
+ * intermediate images are written to {output} while the next passes are traced, the time spent waiting for them is
+ * added to {time_write} */
+static void render_progressive(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, const progressive_t *progressive,
+        const output_t *output, vec3f *image, render_stats_t *stats, uint64_t *time_write)
+{
+    accumulator_t accumulator;
+    accumulator_init(&accumulator);
+    memset(stats, 0, sizeof(render_stats_t));
+
+    uint64_t begin = stats_now();
+    uint64_t last_write = begin;
+    encoder_t *encoder = NULL; // writing the previous intermediate image
+    bool more;
+    do {
+        uint64_t pass_begin = stats_now();
+        render_pass(pool, camera, options, &accumulator, stats);
+        uint64_t now = stats_now();
+
+        // assume the next pass takes as long as this one
+        more = (progressive->samples == 0 || accumulator.samples < progressive->samples) &&
+               (progressive->time_budget == 0. ||
+                (double) (2 * now - pass_begin - begin) / 1e9 <= progressive->time_budget);
+        if (more && progressive->interval > 0. && (double) (now - last_write) / 1e9 >= progressive->interval) {
+            if (encoder) {
+                encoder_finish(encoder);
+            }
+            accumulator_resolve(&accumulator, image);
+            encoder = start_output(output, image);
+            if (encoder) {
+                encoder_rows(encoder, 0, SIZE_Y);
+            }
+            last_write = stats_now();
+            *time_write += last_write - now;
+        }
+    } while (more);
+
+    uint64_t time = stats_now();
+    if (encoder) {
+        encoder_finish(encoder);
+    }
+    accumulator_resolve(&accumulator, image);
+    *time_write += stats_now() - time;
+    fprintf(stderr, "samples:            %u per pixel, %.1f ms per pass\n", accumulator.samples,
+            (double) (stats_now() - begin - *time_write) / 1e6 / accumulator.samples);
+    accumulator_free(&accumulator);
+}
+
+/** brings the intersection records, sphere arrays and hierarchy up to date after objects of the scene moved */
+static void refit_scene(void)
+{
+    scene_compile();
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        sphere_soa_set(&SPHERES_SOA, i, &SPHERE_RECORDS[i]);
+    }
+#ifdef USE_BVH
+    bvh_refit(&BVH);
+#endif
+}
+
+/** a frame of an animation that is being written */
+typedef struct {
+    vec3f *image;
+    encoder_t *encoder;
+    char paths[ENCODER_MAX_OUTPUTS][1024]; // referred to by the encoder until it is finished
+} frame_output_t;
+
+/**
+ * renders the frames of {animation}, with the scene of the first frame applied and built. the thread pool, the scene
+ * and its hierarchy, which is refit when objects move, are kept between frames. each frame is written to the files of
+ * {output} numbered by animation_frame_path, while the next frame is traced into a second image. {image} is the first
+ * of these. the time spent waiting for the last frames to be written is added to {time_write}. if the options have a
+ * cache, each frame only renders the tiles that the changes since the previous frame can affect. returns whether all
+ * frames were written */
+static bool render_animation(
+        pool_t *pool, const render_options_t *options, const animation_t *animation, const output_t *output,
+        vec3f *image, render_stats_t *stats, uint64_t *time_write)
+{
+    static const char *DEFAULT_PATTERN = "frame_####.png";
+    const char *const *patterns = output->count > 0 ? output->paths : &DEFAULT_PATTERN;
+    uint32_t count = output->count > 0 ? output->count : 1;
+
+    frame_output_t *frames = calloc(2, sizeof(frame_output_t));
+    vec3f *next = malloc((size_t) SIZE_X * SIZE_Y * sizeof(vec3f));
+    if (!frames || !next) {
+        fprintf(stderr, "not enough memory for a second %ux%u image\n", SIZE_X, SIZE_Y);
+        free(frames);
+        free(next);
+        return false;
+    }
+    frames[0].image = image;
+    frames[1].image = next;
+    memset(stats, 0, sizeof(render_stats_t));
+
+    uint64_t begin = stats_now();
+    uint64_t tiles_rendered = 0;
+    uint64_t tiles_total = 0;
+    bool ok = true;
+    for (uint32_t frame = 0; frame < animation->frame_count && ok; frame++) {
+        // the image of two frames ago is reused once it is written
+        frame_output_t *current = &frames[frame % 2];
+        if (current->encoder) {
+            ok = encoder_finish(current->encoder);
+            current->encoder = NULL;
+            if (!ok) {
+                break;
+            }
+        }
+
+        if (frame > 0 && animation_apply(animation, frame)) {
+            refit_scene();
+        }
+        camera_t camera;
+        camera_init(&camera);
 
-    /** pre-calculation for camera rays */
-    vec3f t = vec3f_sub(TARGET, EYE); // look direction
-    vec3f b = vec3f_cross(UP, t);     // perpendicular to up and look
-    t = vec3f_norm(t);
-    b = vec3f_norm(b);
-    vec3f v = vec3f_cross(t, b);
+        const char *paths[ENCODER_MAX_OUTPUTS];
+        for (uint32_t i = 0; i < count; i++) {
+            animation_frame_path(current->paths[i], sizeof(current->paths[i]), patterns[i], frame);
+            paths[i] = current->paths[i];
+        }
+        current->encoder = encoder_start(current->image, paths, count, output->exposure);
+        if (!current->encoder) {
+            ok = false;
+            break;
+        }
 
-    float gx = tanf(FOV / 2.f);      // (half) viewport size in horizontal dimension
-    float gy = (gx * M) / (float) K; // (half) viewport size in vertical dimension
+        if (options->cache) {
+            // the clean tiles keep the pixels of the previous frame
+            tiles_rendered += render_cache_update(options->cache);
+            tiles_total += options->cache->tiles_x * options->cache->tiles_y;
+            if (frame > 0) {
+                memcpy(current->image, frames[(frame + 1) % 2].image, (size_t) SIZE_X * SIZE_Y * sizeof(vec3f));
+            }
+        }
 
-    vec3f p11 = vec3f_add(vec3f_sub(t, vec3f_scale(b, gx)), vec3f_scale(v, gy)); // top left ray
+        render_options_t frame_options = *options;
+        frame_options.rows_done = encode_rows;
+        frame_options.rows_done_arg = current->encoder;
+        render_stats_t frame_stats;
+        render_image(pool, &camera, &frame_options, current->image, &frame_stats);
+        render_stats_add(stats, &frame_stats);
+    }
 
-    vec3f qx = vec3f_scale(b, (2.f * gx) / (K - 1.f));
-    vec3f qy = vec3f_scale(v, (2.f * gy) / (M - 1.f));
+    uint64_t time = stats_now();
+    for (uint32_t i = 0; i < 2; i++) {
+        if (frames[i].encoder) {
+            ok = encoder_finish(frames[i].encoder) && ok;
+        }
+    }
+    *time_write += stats_now() - time;
+    fprintf(stderr, "frames:             %u, %.1f ms per frame\n", animation->frame_count,
+            (double) (stats_now() - begin) / 1e6 / animation->frame_count);
+    if (options->cache) {
+        fprintf(stderr, "incremental:        %llu of %llu tiles rendered\n", (unsigned long long) tiles_rendered,
+                (unsigned long long) tiles_total);
+    }
 
-    /** allocate memory */
-    color_t *buffer = malloc(M * K * sizeof(color_t));
+    free(frames[1].image);
+    free(frames);
 
-    /** begin tracing */
-    for (uint32_t j = 0; j < SIZE_Y; j++) {
-        for (uint32_t i = 0; i < SIZE_X; i++) {
-            // color for this pixel
-            vec3f color = {0.f, 0.f, 0.f};
+    return ok;
+}
 
-            for (uint32_t jj = 0; jj < RAYS_PER_PIXEL_Y; jj++) {
-                for (uint32_t ii = 0; ii < RAYS_PER_PIXEL_X; ii++) {
-                    uint32_t x = i * RAYS_PER_PIXEL_X + ii;
-                    uint32_t y = j * RAYS_PER_PIXEL_Y + jj;
-                    vec3f rij = vec3f_norm(vec3f_sub(vec3f_add(p11, vec3f_scale(qx, x)), vec3f_scale(qy, y)));
-                    ray_t ray = {.start=EYE, .direction=rij};
+int main(int argc, char *argv[])
+{
+    uint32_t thread_count = pool_processor_count();
+    sphere_kernel_t kernel = KERNEL_AUTO;
+    render_options_t options = {.packet_width=0, .min_weight=MIN_RAY_WEIGHT, .adaptive_threshold=0.f, .adaptive_rate=2};
+    const char *scene = DEFAULT_SCENE;
+    const char *export_path = NULL;
+    const char *compile_path = NULL;
+    const char *mesh_path = NULL;
+    bool print_stats = false;
+    const char *stats_path = NULL;
+    progressive_t progressive = {.samples=0, .time_budget=0., .interval=0.};
+    output_t output = {.count=0, .exposure=1.f};
+    coordinator_t coordinator = {.address=NULL, .spawn=0, .wait_for_workers=false};
+    const char *worker_address = NULL;
+    const char *animation_path = NULL;
+    bool incremental = false;
+    const char *daemon_address = NULL;
+    const char *client_address = NULL;
+    daemon_request_t request = {.priority=0, .size_x=0, .size_y=0, .eye=NULL, .target=NULL};
+    vec3f eye, target;
+    region_t crop = {0, 0, 0, 0}; // empty: the whole frame
+    const char *checkpoint_path = NULL;
+    double memory_limit = 0.; // MB
 
-                    vec3f computed_color = trace_ray(ray, DEPTH, T_MIN, T_MAX);
-                    color = vec3f_add(color, vec3f_scale(computed_color, 1.f / (float) RAYS_PER_PIXEL));
-                }
+    /** parse arguments */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            scene = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--compile-mesh") == 0 && i + 2 < argc) {
+            mesh_path = argv[++i];
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1) {
+                fprintf(stderr, "--threads expects a positive number\n");
+                return 1;
+            }
+            thread_count = (uint32_t) value;
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            kernel = KERNEL_AUTO;
+            while (kernel <= KERNEL_AVX2 && strcmp(name, sphere_kernel_name(kernel)) != 0) {
+                kernel++;
+            }
+            if (kernel > KERNEL_AVX2) {
+                fprintf(stderr, "unknown kernel %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value != 0 && value != 4 && value != 8) {
+                fprintf(stderr, "--packets expects 0, 4 or 8\n");
+                return 1;
+            }
+            options.packet_width = (uint32_t) value;
+        } else if (strcmp(argv[i], "--wavefront") == 0) {
+            options.wavefront = true;
+        } else if (strcmp(argv[i], "--min-weight") == 0 && i + 1 < argc) {
+            float value = strtof(argv[++i], NULL);
+            if (!(value >= 0.f && value <= 1.f)) {
+                fprintf(stderr, "--min-weight expects a number in [0, 1]\n");
+                return 1;
+            }
+            options.min_weight = value;
+        } else if (strcmp(argv[i], "--light-threshold") == 0 && i + 1 < argc) {
+            float value = strtof(argv[++i], NULL);
+            if (!(value >= 0.f)) {
+                fprintf(stderr, "--light-threshold expects a non-negative number\n");
+                return 1;
+            }
+            options.light_threshold = value;
+        } else if (strcmp(argv[i], "--light-samples") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 0 || value > 1 << 16) {
+                fprintf(stderr, "--light-samples expects a number in [0, 65536]\n");
+                return 1;
+            }
+            options.light_samples = (uint32_t) value;
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            float value = strtof(argv[++i], NULL);
+            if (!(value >= 0.f)) {
+                fprintf(stderr, "--adaptive expects a non-negative number\n");
+                return 1;
             }
+            options.adaptive_threshold = value;
+        } else if (strcmp(argv[i], "--adaptive-rate") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1 || value > 16) {
+                fprintf(stderr, "--adaptive-rate expects a number in [1, 16]\n");
+                return 1;
+            }
+            options.adaptive_rate = (uint32_t) value;
+        } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            options.sampler.type = SAMPLER_GRID;
+            while (options.sampler.type <= SAMPLER_SOBOL && strcmp(name, sampler_name(options.sampler.type)) != 0) {
+                options.sampler.type++;
+            }
+            if (options.sampler.type > SAMPLER_SOBOL) {
+                fprintf(stderr, "unknown sampler %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1 || value > 1024) {
+                fprintf(stderr, "--samples expects a number in [1, 1024]\n");
+                return 1;
+            }
+            options.sampler.count = (uint32_t) value;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.sampler.seed = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1 || value > 65536) {
+                fprintf(stderr, "--spp expects a number in [1, 65536]\n");
+                return 1;
+            }
+            progressive.samples = (uint32_t) value;
+        } else if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc) {
+            double value = strtod(argv[++i], NULL);
+            if (!(value > 0.)) {
+                fprintf(stderr, "--time-budget expects a positive number of seconds\n");
+                return 1;
+            }
+            progressive.time_budget = value;
+        } else if (strcmp(argv[i], "--progress-interval") == 0 && i + 1 < argc) {
+            double value = strtod(argv[++i], NULL);
+            if (!(value > 0.)) {
+                fprintf(stderr, "--progress-interval expects a positive number of seconds\n");
+                return 1;
+            }
+            progressive.interval = value;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            if (output.count == ENCODER_MAX_OUTPUTS) {
+                fprintf(stderr, "--output can be given at most %u times\n", ENCODER_MAX_OUTPUTS);
+                return 1;
+            }
+            output.paths[output.count++] = argv[++i];
+        } else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+            float value = strtof(argv[++i], NULL);
+            if (!(value >= -20.f && value <= 20.f)) {
+                fprintf(stderr, "--exposure expects a number of stops in [-20, 20]\n");
+                return 1;
+            }
+            output.exposure = exp2f(value);
+        } else if (strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc) {
+            coordinator.address = argv[++i];
+            coordinator.wait_for_workers = true;
+        } else if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 1 || value > 256) {
+                fprintf(stderr, "--spawn expects a number in [1, 256]\n");
+                return 1;
+            }
+            coordinator.spawn = (uint32_t) value;
+        } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            worker_address = argv[++i];
+        } else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc) {
+            animation_path = argv[++i];
+        } else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc) {
+            daemon_address = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client_address = argv[++i];
+        } else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            request.priority = (int32_t) strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u,%u", &request.size_x, &request.size_y) != 2 || request.size_x < 1 ||
+                request.size_y < 1 || request.size_x > 16384 || request.size_y > 16384) {
+                fprintf(stderr, "--size expects W,H in [1, 16384]\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--eye") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%f,%f,%f", &eye.x, &eye.y, &eye.z) != 3) {
+                fprintf(stderr, "--eye expects X,Y,Z\n");
+                return 1;
+            }
+            request.eye = &eye;
+        } else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%f,%f,%f", &target.x, &target.y, &target.z) != 3) {
+                fprintf(stderr, "--target expects X,Y,Z\n");
+                return 1;
+            }
+            request.target = &target;
+        } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u,%u,%u,%u", &crop.x0, &crop.y0, &crop.x1, &crop.y1) != 4 ||
+                crop.x0 >= crop.x1 || crop.y0 >= crop.y1) {
+                fprintf(stderr, "--crop expects X0,Y0,X1,Y1 with X0 < X1 and Y0 < Y1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            memory_limit = strtod(argv[++i], NULL);
+            if (memory_limit <= 0.) {
+                fprintf(stderr, "--memory-budget expects a positive number of MB\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            incremental = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.adaptive_threshold > 0.f && options.packet_width > 0) {
+        fprintf(stderr, "--adaptive traces single rays and cannot be combined with --packets\n");
+        return 1;
+    }
+    if (options.sampler.type == SAMPLER_GRID && options.sampler.count > 0) {
+        fprintf(stderr, "--samples requires a --sampler other than the grid\n");
+        return 1;
+    }
+    if (options.sampler.count == 0) {
+        options.sampler.count = RAYS_PER_PIXEL;
+    }
+    if (options.light_samples > 0 && options.packet_width > 0) {
+        fprintf(stderr, "--light-samples draws lights per hit and cannot be combined with --packets\n");
+        return 1;
+    }
+    if (options.wavefront && (options.packet_width > 0 || options.adaptive_threshold > 0.f)) {
+        fprintf(stderr, "--wavefront cannot be combined with --packets and --adaptive\n");
+        return 1;
+    }
+    bool is_progressive = progressive.samples > 0 || progressive.time_budget > 0.;
+    if (options.sampler.type != SAMPLER_GRID && !is_progressive &&
+        (options.packet_width > 0 || options.wavefront || options.adaptive_threshold > 0.f)) {
+        fprintf(stderr, "--sampler traces single rays unless rendering progressively, and cannot be combined with "
+                        "--packets, --wavefront and --adaptive\n");
+        return 1;
+    }
+    if (is_progressive && options.wavefront) {
+        fprintf(stderr, "--spp and --time-budget cannot be combined with --wavefront\n");
+        return 1;
+    }
+    if (is_progressive && options.adaptive_threshold > 0.f) {
+        fprintf(stderr, "--spp and --time-budget cannot be combined with --adaptive\n");
+        return 1;
+    }
+    if (progressive.interval > 0. && !is_progressive) {
+        fprintf(stderr, "--progress-interval requires --spp or --time-budget\n");
+        return 1;
+    }
+    bool is_distributed = coordinator.address || coordinator.spawn > 0;
+    if (is_distributed && is_progressive) {
+        fprintf(stderr, "--coordinator and --spawn cannot be combined with --spp or --time-budget\n");
+        return 1;
+    }
+    if (animation_path && (is_progressive || is_distributed)) {
+        fprintf(stderr, "--animation cannot be combined with progressive or distributed rendering\n");
+        return 1;
+    }
+    if (incremental && !animation_path) {
+        fprintf(stderr, "--incremental requires --animation\n");
+        return 1;
+    }
+    if (incremental && (options.packet_width > 0 || options.wavefront || options.adaptive_threshold > 0.f)) {
+        fprintf(stderr, "--incremental records single rays and cannot be combined with --packets, --wavefront and "
+                        "--adaptive\n");
+        return 1;
+    }
+    bool is_requested = request.priority != 0 || request.size_x > 0 || request.eye || request.target;
+    if (is_requested && !client_address) {
+        fprintf(stderr, "--priority, --size, --eye and --target require --client\n");
+        return 1;
+    }
+    if (daemon_address && (is_progressive || is_distributed || animation_path)) {
+        fprintf(stderr, "--daemon cannot be combined with progressive or distributed rendering and --animation\n");
+        return 1;
+    }
+    bool is_cropped = crop.x1 > 0;
+    if (is_cropped && (is_distributed || animation_path || daemon_address || client_address)) {
+        fprintf(stderr, "--crop cannot be combined with distributed rendering, --animation, --daemon and --client\n");
+        return 1;
+    }
+    if (checkpoint_path && (is_progressive || is_distributed || animation_path || daemon_address || client_address ||
+                            options.adaptive_threshold > 0.f)) {
+        fprintf(stderr, "--checkpoint cannot be combined with progressive or distributed rendering, --animation, "
+                        "--daemon, --client and --adaptive\n");
+        return 1;
+    }
+    if (memory_limit > 0. && (daemon_address || client_address || worker_address)) {
+        fprintf(stderr, "--memory-budget cannot be combined with --daemon, --client and --worker\n");
+        return 1;
+    }
+    if (memory_limit > 0. && (options.wavefront || incremental)) {
+        // waves grow with the rays they spawn and the records of the tiles with the objects they hit
+        fprintf(stderr, "--memory-budget cannot be combined with --wavefront and --incremental, whose memory grows "
+                        "while rendering\n");
+        return 1;
+    }
+    if ((print_stats || stats_path) && !STATS_ENABLED) {
+        fprintf(stderr, "statistics are not available, build with RAY_TRACER_STATS\n");
+        return 1;
+    }
+
+    if (client_address) {
+        /** the scene is loaded and rendered by the daemon */
+        request.scene = scene;
+        request.samples = progressive.samples;
+        request.format = image_format(output.count > 0 ? output.paths[0] : "out.png");
+        request.exposure = output.exposure;
+        return run_client(client_address, &request, output.count > 0 ? output.paths[0] : "out.png") ? 0 : 1;
+    }
+
+    if (daemon_address) {
+        /** scenes are loaded as they are requested */
+        sphere_kernel_select(kernel);
+        pool_t *pool = pool_create(thread_count);
+        if (!pool) {
+            fprintf(stderr, "failed to create worker threads\n");
+            return 1;
+        }
+        bool ok = run_daemon(daemon_address, pool, &options);
+        pool_destroy(pool);
+        return ok ? 0 : 1;
+    }
+
+    if (worker_address) {
+        /** the scene and options are sent by the coordinator */
+        sphere_kernel_select(kernel);
+        return run_worker(worker_address, thread_count) ? 0 : 1;
+    }
+
+    if (mesh_path) {
+        /** convert the mesh, its hierarchy is built once and stored with it */
+        mesh_t mesh;
+        if (!mesh_load(&mesh, mesh_path)) {
+            return 1;
+        }
+        fprintf(stderr, "%u triangles, %u vertices, %u nodes: %.1f bytes per triangle\n",
+                mesh.triangle_count, mesh.vertex_count, mesh.node_count,
+                (double) mesh_memory(&mesh) / (double) mesh.triangle_count);
+        bool ok = mesh_write_binary(&mesh, compile_path);
+        mesh_free(&mesh);
+        return ok ? 0 : 1;
+    }
+
+    /** load the scene, a built-in scene takes precedence over a file of the same name */
+    uint64_t time = stats_now();
+    if (!scene_load_builtin(scene) && !scene_load_file(scene)) {
+        return 1;
+    }
+    uint64_t time_load = stats_now() - time;
+    if (export_path || compile_path) {
+        bool ok = (!export_path || scene_write_text(export_path)) && (!compile_path || scene_write_compiled(compile_path));
+        scene_unload();
+        return ok ? 0 : 1;
+    }
 
-            // apply pixel
-            color_t colorRGB = {(uint8_t) (color.x * 255), (uint8_t) (color.y * 255), (uint8_t) (color.z * 255)};
-            memcpy(&buffer[j * SIZE_X + i], &colorRGB, sizeof(color_t));
+    /** the hierarchy is built for the first frame of an animation, and refit for the others */
+    animation_t animation = {.frame_count=0};
+    if (animation_path) {
+        if (!animation_load(&animation, animation_path)) {
+            return 1;
         }
+        animation_apply(&animation, 0);
+    }
+
+    time = stats_now();
+    camera_t camera;
+    camera_init(&camera);
+    if (!is_cropped) {
+        crop = (region_t) {0, 0, SIZE_X, SIZE_Y};
+    } else if (crop.x1 > SIZE_X || crop.y1 > SIZE_Y) {
+        fprintf(stderr, "--crop exceeds the frame of %ux%u pixels\n", SIZE_X, SIZE_Y);
+        return 1;
+    } else {
+        // the camera is set up for the whole frame, the image is the crop
+        camera_crop(&camera, &crop);
     }
 
-    stbi_write_png("out.png", SIZE_X, SIZE_Y, sizeof(color_t), buffer, (signed) (SIZE_X * sizeof(color_t)));
+    sphere_kernel_select(kernel);
+    scene_compile();
+    sphere_soa_from_scene(&SPHERES_SOA);
+#ifdef USE_BVH
+    bvh_build(&BVH);
+#endif
+    uint64_t time_build = stats_now() - time;
+
+    /** the memory of the render is reserved up front, a render that does not fit the budget fails before it starts */
+    memory_budget_t budget;
+    memory_budget_init(&budget, (size_t) (memory_limit * 1e6));
+    render_cache_t cache;
+    render_cache_init(&cache);
+    if (incremental) {
+        options.cache = &cache;
+    }
+    region_t image_region = {0, 0, SIZE_X, SIZE_Y};
+    size_t scene_size = scene_memory() + sphere_soa_memory(&SPHERES_SOA);
+    size_t hierarchy_size = light_tree_memory(&LIGHT_TREE);
+#ifdef USE_BVH
+    hierarchy_size += bvh_memory(&BVH);
+#endif
+    // an animation renders into a second image while the first is written, progressive rendering accumulates samples
+    size_t image_size = (size_t) SIZE_X * SIZE_Y * sizeof(vec3f);
+    if (animation.frame_count > 0 || is_progressive) {
+        image_size *= 2;
+    }
+    size_t render_size = is_distributed ? 0 : arena_size(render_memory(thread_count, &options, &image_region));
+    size_t needed = scene_size + hierarchy_size + image_size + render_size;
+    if (budget.limit > 0 && needed > budget.limit) {
+        fprintf(stderr, "the render needs %.1f MB, more than the memory budget of %.1f MB\n", (double) needed / 1e6,
+                (double) budget.limit / 1e6);
+        return 1;
+    }
+    memory_reserve(&budget, MEMORY_SCENE, scene_size);
+    memory_reserve(&budget, MEMORY_HIERARCHY, hierarchy_size);
+    memory_reserve(&budget, MEMORY_IMAGE, image_size);
+    arena_t arena;
+    if (!arena_init(&arena, &budget, render_size)) {
+        fprintf(stderr, "failed to allocate %.1f MB for the render\n", (double) render_size / 1e6);
+        return 1;
+    }
+    if (!is_distributed) {
+        options.arena = &arena;
+    }
+
+    pool_t *pool = pool_create(thread_count);
+    if (!pool) {
+        fprintf(stderr, "failed to create worker threads\n");
+        return 1;
+    }
+
+    /** allocate memory, the image is rendered in linear floats and tone mapped to 8 bits by the encoder */
+    vec3f *image = malloc((size_t) SIZE_X * SIZE_Y * sizeof(vec3f));
+    if (!image) {
+        fprintf(stderr, "not enough memory for a %ux%u image\n", SIZE_X, SIZE_Y);
+        return 1;
+    }
+
+    /** tiles finished by an earlier run that was killed are restored, the others are rendered */
+    checkpoint_t *checkpoint = NULL;
+    if (checkpoint_path) {
+        uint64_t hash;
+        if (!scene_hash(scene, &hash)) {
+            fprintf(stderr, "%s: failed to read scene\n", scene);
+            return 1;
+        }
+        uint32_t restored;
+        uint64_t key = checkpoint_key(hash, &options, &crop);
+        checkpoint = checkpoint_open(checkpoint_path, key, image, &options, &restored);
+        if (!checkpoint) {
+            return 1;
+        }
+        uint32_t tiles = ((SIZE_X + TILE_SIZE - 1) / TILE_SIZE) * ((SIZE_Y + TILE_SIZE - 1) / TILE_SIZE);
+        fprintf(stderr, "checkpoint:         %u of %u tiles restored\n", restored, tiles);
+    }
+
+    /** begin tracing, finished rows are written while the others are traced */
+    time = stats_now();
+    render_stats_t stats;
+    uint64_t time_write = 0;
+    encoder_t *encoder = NULL;
+    bool written = true;
+    if (animation.frame_count > 0) {
+        written = render_animation(pool, &options, &animation, &output, image, &stats, &time_write);
+    } else if (is_progressive) {
+        render_progressive(pool, &camera, &options, &progressive, &output, image, &stats, &time_write);
+        encoder = start_output(&output, image);
+        if (encoder) {
+            encoder_rows(encoder, 0, SIZE_Y);
+        }
+    } else {
+        encoder = start_output(&output, image);
+        if (!encoder) {
+            return 1;
+        }
+        options.rows_done = encode_rows;
+        options.rows_done_arg = encoder;
+        if (is_distributed) {
+            // a private socket for the local workers, the threads are divided over them
+            char address[64];
+            if (!coordinator.address) {
+                snprintf(address, sizeof(address), "unix:/tmp/ray_tracer.%ld.sock", (long) getpid());
+                coordinator.address = address;
+            }
+            coordinator.threads = coordinator.spawn > 0 && thread_count > coordinator.spawn ?
+                                  thread_count / coordinator.spawn : 1;
+            coordinator.scene = scene;
+            distributed_stats_t distributed_stats;
+            if (!render_distributed(&coordinator, &options, image, &stats, &distributed_stats)) {
+                encoder_cancel(encoder);
+                return 1;
+            }
+            distributed_stats_print(&distributed_stats, stderr);
+        } else {
+            render_image(pool, &camera, &options, image, &stats);
+        }
+    }
+    stats.counters.timers[STAT_TIMER_RENDER] = stats_now() - time - time_write;
+    if (options.packet_width > 0) {
+        packet_stats_print(&stats.packets, stderr);
+    }
+    if (options.adaptive_threshold > 0.f) {
+        adaptive_stats_print(&stats.adaptive, stderr);
+    }
+
+    // wait for the rows that were not written while tracing
+    time = stats_now();
+    if (animation.frame_count == 0) {
+        written = encoder && encoder_finish(encoder);
+    }
+    if (checkpoint) {
+        // kept until the image is written, so a render that fails to write it can be resumed
+        checkpoint_close(checkpoint, &options, written);
+    }
+    stats.counters.timers[STAT_TIMER_WRITE] = stats_now() - time + time_write;
+
+    stats.counters.timers[STAT_TIMER_LOAD] = time_load;
+    stats.counters.timers[STAT_TIMER_BUILD] = time_build;
+    if (print_stats) {
+        stats_print(&stats.counters, stderr);
+        memory_budget_print(&budget, stderr);
+        for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+            char label[32];
+            snprintf(label, sizeof(label), "mesh %u:", i);
+            fprintf(stderr, "%-20s%u triangles, %.1f MB, %.1f bytes per triangle\n", label,
+                    MESHES[i].triangle_count, (double) mesh_memory(&MESHES[i]) / 1e6,
+                    (double) mesh_memory(&MESHES[i]) / (double) MESHES[i].triangle_count);
+        }
+    }
+    if (stats_path && !stats_write_json(&stats.counters, stats_path)) {
+        return 1;
+    }
 
-    free(buffer);
+    free(image);
+    options.cache = NULL;
+    render_cache_free(&cache);
+    arena_free(&arena);
+    animation_free(&animation);
+    pool_destroy(pool);
+#ifdef USE_BVH
+    bvh_free(&BVH);
+#endif
+    sphere_soa_free(&SPHERES_SOA);
+    scene_unload();
 
-    return 0;
-}
\ No newline at end of file
+    return written ? 0 : 1;
+}
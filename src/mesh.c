@@ -0,0 +1,803 @@
+#include "mesh.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_io.h"
+#include "stats.h"
+
+#define MAX_LEAF_SIZE 4   // triangles are cheap to test, larger leaves save little memory for slower queries
+#define NO_TRIANGLE UINT32_MAX
+
+/** exit distances of nodes are scaled by this, so rounding cannot make rays slip between touching nodes */
+#define EXIT_ROUND_UP (1.f + 4.f * FLT_EPSILON)
+
+/** identifies a binary mesh */
+static const char MESH_MAGIC[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+static const uint32_t MESH_VERSION = 1;
+static const uint32_t MESH_ENDIANNESS = 0x01020304;
+
+/** header of a binary mesh, followed by the vertices, triangles and nodes at the given offsets */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianness;
+    uint32_t node_size; // sizeof(bvh_node_t) of the writer
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint64_t vertices_offset;
+    uint64_t triangles_offset;
+    uint64_t nodes_offset;
+} mesh_header_t;
+
+/** alignment of the arrays in a binary mesh */
+#define MESH_ALIGNMENT 64
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + MESH_ALIGNMENT - 1) & ~(uint64_t) (MESH_ALIGNMENT - 1);
+}
+
+void mesh_allocate(mesh_t *mesh, uint32_t vertex_count, uint32_t triangle_count)
+{
+    memset(mesh, 0, sizeof(mesh_t));
+
+    // a single allocation, both arrays have members of four bytes
+    size_t size = (size_t) vertex_count * sizeof(vec3f) + (size_t) triangle_count * sizeof(triangle_t);
+    mesh->vertices = malloc(size > 0 ? size : 1);
+    mesh->triangles = (triangle_t *) (mesh->vertices + vertex_count);
+    mesh->vertex_count = vertex_count;
+    mesh->triangle_count = triangle_count;
+    mesh->scale = 1.f;
+}
+
+static void swap_triangles(void *items, uint32_t a, uint32_t b)
+{
+    triangle_t *triangles = items;
+    triangle_t triangle = triangles[a];
+    triangles[a] = triangles[b];
+    triangles[b] = triangle;
+}
+
+void mesh_build(mesh_t *mesh)
+{
+    uint32_t count = mesh->triangle_count;
+    aabb_t *bounds = malloc((count > 0 ? count : 1) * sizeof(aabb_t));
+    vec3f *centroids = malloc((count > 0 ? count : 1) * sizeof(vec3f));
+    for (uint32_t i = 0; i < count; i++) {
+        const triangle_t *triangle = &mesh->triangles[i];
+        bounds[i] = aabb_empty();
+        for (uint32_t j = 0; j < 3; j++) {
+            aabb_grow(&bounds[i], mesh->vertices[triangle->v[j]]);
+        }
+        centroids[i] = vec3f_scale(vec3f_add(bounds[i].min, bounds[i].max), .5f);
+    }
+
+    if (!mesh->mapping) {
+        free(mesh->nodes);
+    }
+    mesh->nodes = bvh_build_nodes(
+            &mesh->node_count, bounds, centroids, count, MAX_LEAF_SIZE, swap_triangles, mesh->triangles);
+
+    free(centroids);
+    free(bounds);
+}
+
+/** returns {v} scaled by {scale}, then moved by {translation} */
+static vec3f transform(vec3f v, float scale, vec3f translation)
+{
+    vec3f result = {v.x * scale + translation.x, v.y * scale + translation.y, v.z * scale + translation.z};
+
+    return result;
+}
+
+void mesh_transform(mesh_t *mesh, float scale, vec3f translation)
+{
+    for (uint32_t i = 0; i < mesh->vertex_count; i++) {
+        mesh->vertices[i] = transform(mesh->vertices[i], scale, translation);
+    }
+
+    // rounding is monotonic and the scale positive, so the transformed bounds still contain the transformed vertices
+    for (uint32_t i = 0; i < mesh->node_count; i++) {
+        mesh->nodes[i].bounds.min = transform(mesh->nodes[i].bounds.min, scale, translation);
+        mesh->nodes[i].bounds.max = transform(mesh->nodes[i].bounds.max, scale, translation);
+    }
+
+    mesh->translation = transform(mesh->translation, scale, translation);
+    mesh->scale *= scale;
+}
+
+void mesh_free(mesh_t *mesh)
+{
+    if (mesh->mapping) {
+        munmap(mesh->mapping, mesh->mapping_size);
+    } else {
+        free(mesh->vertices);
+        free(mesh->nodes);
+    }
+    free(mesh->path);
+    memset(mesh, 0, sizeof(mesh_t));
+}
+
+size_t mesh_memory(const mesh_t *mesh)
+{
+    return (size_t) mesh->vertex_count * sizeof(vec3f) + (size_t) mesh->triangle_count * sizeof(triangle_t) +
+           (size_t) mesh->node_count * sizeof(bvh_node_t);
+}
+
+/** state of parsing an OBJ file, which is mapped and not terminated */
+typedef struct {
+    const char *path;
+    const char *p;   // current position
+    const char *end;
+    uint32_t line;
+} obj_parser_t;
+
+static bool obj_error(const obj_parser_t *parser, const char *message)
+{
+    fprintf(stderr, "%s:%u: %s\n", parser->path, parser->line, message);
+
+    return false;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void obj_skip_blank(obj_parser_t *parser)
+{
+    while (parser->p < parser->end && is_blank(*parser->p)) {
+        parser->p++;
+    }
+}
+
+/** moves to the start of the next line, returns false at the end of the file */
+static bool obj_next_line(obj_parser_t *parser)
+{
+    const char *newline = memchr(parser->p, '\n', (size_t) (parser->end - parser->p));
+    if (!newline) {
+        parser->p = parser->end;
+        return false;
+    }
+    parser->p = newline + 1;
+    parser->line++;
+
+    return parser->p < parser->end;
+}
+
+/** returns whether the current line starts with {keyword} followed by a blank, if so: moves past it */
+static bool obj_keyword(obj_parser_t *parser, const char *keyword, size_t length)
+{
+    obj_skip_blank(parser);
+    if ((size_t) (parser->end - parser->p) <= length || memcmp(parser->p, keyword, length) != 0 ||
+        !is_blank(parser->p[length])) {
+        return false;
+    }
+    parser->p += length;
+
+    return true;
+}
+
+/** exact powers of ten that a double can hold */
+static const double POWERS_OF_TEN[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+        1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * parses a decimal number, strtof cannot be used as the text is not terminated. the digits are collected in an
+ * integer that is scaled once in double precision, which is accurate to a float for the numbers exporters write */
+static bool obj_parse_float(obj_parser_t *parser, float *value)
+{
+    obj_skip_blank(parser);
+    const char *p = parser->p;
+    const char *end = parser->end;
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int32_t exponent = 0;
+    uint32_t digits = 0;
+    for (; p < end && is_digit(*p); p++, digits++) {
+        if (mantissa < 100000000000000000ull) {
+            mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+        } else {
+            // more digits than a float can represent
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++, digits++) {
+            if (mantissa < 100000000000000000ull) {
+                mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (digits == 0) {
+        return obj_error(parser, "expected a number");
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negative_exponent = *q == '-';
+            q++;
+        }
+        int32_t e = 0;
+        if (q < end && is_digit(*q)) {
+            for (; q < end && is_digit(*q); q++) {
+                if (e < 10000) {
+                    e = e * 10 + (*q - '0');
+                }
+            }
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    double result = (double) mantissa;
+    if (exponent < 0) {
+        result = -exponent <= 22 ? result / POWERS_OF_TEN[-exponent] : result * pow(10., exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ? result * POWERS_OF_TEN[exponent] : result * pow(10., exponent);
+    }
+    *value = (float) (negative ? -result : result);
+    parser->p = p;
+
+    return true;
+}
+
+/**
+ * parses the vertex reference of a face, of which only the position is used. positive indices count from the first
+ * vertex of the file, negative indices back from the last of the {vertices_read} vertices read so far */
+static bool obj_parse_index(obj_parser_t *parser, uint32_t vertex_count, uint32_t vertices_read, uint32_t *index)
+{
+    obj_skip_blank(parser);
+    const char *p = parser->p;
+    const char *end = parser->end;
+
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        p++;
+    }
+    uint64_t value = 0;
+    const char *digits = p;
+    for (; p < end && is_digit(*p) && value <= UINT32_MAX; p++) {
+        value = value * 10 + (uint64_t) (*p - '0');
+    }
+    if (p == digits) {
+        return obj_error(parser, "expected a vertex index");
+    }
+
+    uint64_t resolved = negative ? (uint64_t) vertices_read - value : value - 1;
+    if (value == 0 || value > (negative ? vertices_read : vertex_count) || resolved >= vertex_count) {
+        return obj_error(parser, "vertex index out of range");
+    }
+    *index = (uint32_t) resolved;
+
+    // skip the texture coordinate and normal indices
+    while (p < end && !is_blank(*p) && *p != '\n' && *p != '#') {
+        p++;
+    }
+    parser->p = p;
+
+    return true;
+}
+
+/** returns the number of vertex references of the face on the current line, does not move the parser */
+static uint32_t obj_count_face(const obj_parser_t *parser)
+{
+    uint32_t count = 0;
+    const char *p = parser->p;
+    while (p < parser->end && *p != '\n' && *p != '#') {
+        while (p < parser->end && is_blank(*p)) {
+            p++;
+        }
+        if (p == parser->end || *p == '\n' || *p == '#') {
+            break;
+        }
+        count++;
+        while (p < parser->end && !is_blank(*p) && *p != '\n' && *p != '#') {
+            p++;
+        }
+    }
+
+    return count;
+}
+
+/** parses the OBJ file {text} of {size} bytes into {mesh}, the elements are counted first to allocate them at once */
+static bool parse_obj(mesh_t *mesh, const char *path, const char *text, size_t size)
+{
+    obj_parser_t parser = {.path=path, .p=text, .end=text + size, .line=1};
+
+    /** first pass: count the vertices and triangles */
+    uint64_t vertex_count = 0;
+    uint64_t triangle_count = 0;
+    do {
+        if (obj_keyword(&parser, "v", 1)) {
+            vertex_count++;
+        } else if (obj_keyword(&parser, "f", 1)) {
+            uint32_t count = obj_count_face(&parser);
+            if (count < 3) {
+                return obj_error(&parser, "face has less than three vertices");
+            }
+            triangle_count += count - 2;
+        }
+    } while (obj_next_line(&parser));
+
+    if (vertex_count > UINT32_MAX || triangle_count > UINT32_MAX) {
+        fprintf(stderr, "%s: mesh is too large\n", path);
+        return false;
+    }
+    if (triangle_count == 0) {
+        fprintf(stderr, "%s: mesh has no faces\n", path);
+        return false;
+    }
+    mesh_allocate(mesh, (uint32_t) vertex_count, (uint32_t) triangle_count);
+
+    /** second pass: parse the vertices and split the faces into fans of triangles */
+    parser.p = text;
+    parser.line = 1;
+    uint32_t vertex = 0;
+    uint32_t triangle = 0;
+    bool ok = true;
+    do {
+        if (obj_keyword(&parser, "v", 1)) {
+            vec3f *v = &mesh->vertices[vertex++];
+            // further values are the optional weight or a color, which are not used
+            ok = obj_parse_float(&parser, &v->x) && obj_parse_float(&parser, &v->y) &&
+                 obj_parse_float(&parser, &v->z);
+        } else if (obj_keyword(&parser, "f", 1)) {
+            uint32_t first, previous, current;
+            ok = obj_parse_index(&parser, mesh->vertex_count, vertex, &first) &&
+                 obj_parse_index(&parser, mesh->vertex_count, vertex, &previous);
+            while (ok && !at_line_end(&parser.p, parser.end)) {
+                ok = obj_parse_index(&parser, mesh->vertex_count, vertex, &current);
+                if (ok) {
+                    triangle_t *t = &mesh->triangles[triangle++];
+                    t->v[0] = first;
+                    t->v[1] = previous;
+                    t->v[2] = current;
+                    previous = current;
+                }
+            }
+        }
+    } while (ok && obj_next_line(&parser));
+
+    if (!ok) {
+        mesh_free(mesh);
+    }
+
+    return ok;
+}
+
+/**
+ * returns whether children follow their parent in the hierarchy of {mesh} and have no other parent, so traversals end
+ * within the depth of the stack, and whether leaves and triangles refer to triangles and vertices of {mesh} */
+static bool mesh_valid(const mesh_t *mesh)
+{
+    bool ok = true;
+    for (uint32_t i = 0; i < mesh->triangle_count && ok; i++) {
+        const triangle_t *triangle = &mesh->triangles[i];
+        ok = triangle->v[0] < mesh->vertex_count && triangle->v[1] < mesh->vertex_count &&
+             triangle->v[2] < mesh->vertex_count;
+    }
+    // depth of each node below the root, 0 for the root and the nodes no parent refers to so far
+    uint8_t *depths = calloc(mesh->node_count > 0 ? mesh->node_count : 1, 1);
+    if (!depths) {
+        fprintf(stderr, "not enough memory to check a hierarchy of %u nodes\n", mesh->node_count);
+        return false;
+    }
+    for (uint32_t i = 0; i < mesh->node_count && ok; i++) {
+        const bvh_node_t *node = &mesh->nodes[i];
+        if (node->count > 0) {
+            ok = node->count <= mesh->triangle_count && node->offset <= mesh->triangle_count - node->count;
+            continue;
+        }
+        // parents come before their children, so the depth of a child with one parent is final once it is set
+        ok = node->offset > i + 1 && node->offset < mesh->node_count && depths[i] + 1 < BVH_STACK_SIZE &&
+             depths[i + 1] == 0 && depths[node->offset] == 0;
+        if (ok) {
+            depths[i + 1] = depths[node->offset] = (uint8_t) (depths[i] + 1);
+        }
+    }
+    free(depths);
+
+    return ok;
+}
+
+/** makes {mesh} refer to the binary mesh {mapping} of {size} bytes, after checking it refers to nothing outside */
+static bool map_binary(mesh_t *mesh, const char *path, void *mapping, size_t size)
+{
+    const mesh_header_t *header = mapping;
+    if (header->version != MESH_VERSION || header->endianness != MESH_ENDIANNESS ||
+        header->node_size != sizeof(bvh_node_t)) {
+        fprintf(stderr, "%s: binary mesh was written by an incompatible build\n", path);
+        return false;
+    }
+    if (header->vertices_offset + (uint64_t) header->vertex_count * sizeof(vec3f) > size ||
+        header->triangles_offset + (uint64_t) header->triangle_count * sizeof(triangle_t) > size ||
+        header->nodes_offset + (uint64_t) header->node_count * sizeof(bvh_node_t) > size ||
+        header->vertices_offset % sizeof(float) != 0 || header->triangles_offset % sizeof(uint32_t) != 0 ||
+        header->nodes_offset % sizeof(float) != 0 || header->triangle_count == 0 || header->node_count == 0) {
+        fprintf(stderr, "%s: binary mesh is truncated or corrupt\n", path);
+        return false;
+    }
+
+    memset(mesh, 0, sizeof(mesh_t));
+    mesh->vertices = (vec3f *) ((char *) mapping + header->vertices_offset);
+    mesh->vertex_count = header->vertex_count;
+    mesh->triangles = (triangle_t *) ((char *) mapping + header->triangles_offset);
+    mesh->triangle_count = header->triangle_count;
+    mesh->nodes = (bvh_node_t *) ((char *) mapping + header->nodes_offset);
+    mesh->node_count = header->node_count;
+    mesh->scale = 1.f;
+
+    if (!mesh_valid(mesh)) {
+        fprintf(stderr, "%s: binary mesh is corrupt\n", path);
+        memset(mesh, 0, sizeof(mesh_t));
+        return false;
+    }
+    mesh->mapping = mapping;
+    mesh->mapping_size = size;
+
+    return true;
+}
+
+bool mesh_load(mesh_t *mesh, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t) info.st_size;
+    if (size == 0) {
+        fprintf(stderr, "%s: mesh has no faces\n", path);
+        close(fd);
+        return false;
+    }
+
+    char magic[sizeof(MESH_MAGIC)];
+    bool binary = size >= sizeof(mesh_header_t) &&
+                  pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) &&
+                  memcmp(magic, MESH_MAGIC, sizeof(magic)) == 0;
+
+    // binary meshes are used in place, privately writable so they can be transformed
+    void *mapping = mmap(NULL, size, binary ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool ok;
+    if (binary) {
+        ok = map_binary(mesh, path, mapping, size);
+        if (!ok) {
+            munmap(mapping, size);
+        }
+    } else {
+        /** OBJ file, read once front to back per pass */
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        ok = parse_obj(mesh, path, mapping, size);
+        munmap(mapping, size);
+        if (ok) {
+            mesh_build(mesh);
+            // binary meshes are checked the same way when loaded, so a mesh is only written if it can be read back
+            ok = mesh_valid(mesh);
+            if (!ok) {
+                fprintf(stderr, "%s: hierarchy of mesh is too deep\n", path);
+                mesh_free(mesh);
+            }
+        }
+    }
+
+    if (ok) {
+        // the absolute path remains valid when the scene is written elsewhere
+        mesh->path = realpath(path, NULL);
+    }
+
+    return ok;
+}
+
+bool mesh_write_binary(const mesh_t *mesh, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    mesh_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+    header.version = MESH_VERSION;
+    header.endianness = MESH_ENDIANNESS;
+    header.node_size = sizeof(bvh_node_t);
+    header.vertex_count = mesh->vertex_count;
+    header.triangle_count = mesh->triangle_count;
+    header.node_count = mesh->node_count;
+    header.vertices_offset = align_offset(sizeof(header));
+    header.triangles_offset = align_offset(header.vertices_offset + (uint64_t) mesh->vertex_count * sizeof(vec3f));
+    header.nodes_offset = align_offset(header.triangles_offset + (uint64_t) mesh->triangle_count * sizeof(triangle_t));
+
+    uint64_t offset = sizeof(header);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && write_array(file, &offset, header.vertices_offset, mesh->vertices, sizeof(vec3f), mesh->vertex_count);
+    ok = ok && write_array(
+            file, &offset, header.triangles_offset, mesh->triangles, sizeof(triangle_t), mesh->triangle_count);
+    ok = ok && write_array(file, &offset, header.nodes_offset, mesh->nodes, sizeof(bvh_node_t), mesh->node_count);
+
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write mesh\n", path);
+    }
+
+    return ok;
+}
+
+/**
+ * ray prepared for the watertight ray/triangle test of Woop, Benthin and Wald. vertices are moved into the frame of
+ * the ray and sheared so the ray runs along axis kz, the largest component of its direction. the hit test then
+ * only compares the signs of 2D edge functions, which are equal for triangles sharing an edge */
+typedef struct {
+    vec3f start;
+    vec3f inv_direction;
+    uint32_t kx, ky, kz;
+    float sx, sy, sz;
+} mesh_ray_t;
+
+static float component(vec3f v, uint32_t axis)
+{
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static mesh_ray_t prepare_ray(ray_t ray)
+{
+    mesh_ray_t r;
+    vec3f d = ray.direction;
+    r.start = ray.start;
+    r.inv_direction.x = 1.f / d.x;
+    r.inv_direction.y = 1.f / d.y;
+    r.inv_direction.z = 1.f / d.z;
+
+    float ax = fabsf(d.x);
+    float ay = fabsf(d.y);
+    float az = fabsf(d.z);
+    r.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    r.kx = (r.kz + 1) % 3;
+    r.ky = (r.kx + 1) % 3;
+    if (component(d, r.kz) < 0.f) {
+        // keep the winding of the triangles
+        uint32_t k = r.kx;
+        r.kx = r.ky;
+        r.ky = k;
+    }
+
+    r.sz = 1.f / component(d, r.kz);
+    r.sx = component(d, r.kx) * r.sz;
+    r.sy = component(d, r.ky) * r.sz;
+
+    return r;
+}
+
+/** returns whether {r} hits triangle {t} of {mesh} on either side, if so: {distance} is the distance to the hit */
+static bool intersect_triangle(const mesh_t *mesh, const mesh_ray_t *r, const triangle_t *t, float *distance)
+{
+    const vec3f *v0 = &mesh->vertices[t->v[0]];
+    const vec3f *v1 = &mesh->vertices[t->v[1]];
+    const vec3f *v2 = &mesh->vertices[t->v[2]];
+    vec3f a = {v0->x - r->start.x, v0->y - r->start.y, v0->z - r->start.z};
+    vec3f b = {v1->x - r->start.x, v1->y - r->start.y, v1->z - r->start.z};
+    vec3f c = {v2->x - r->start.x, v2->y - r->start.y, v2->z - r->start.z};
+
+    float az = component(a, r->kz);
+    float bz = component(b, r->kz);
+    float cz = component(c, r->kz);
+    float ax = component(a, r->kx) - r->sx * az;
+    float ay = component(a, r->ky) - r->sy * az;
+    float bx = component(b, r->kx) - r->sx * bz;
+    float by = component(b, r->ky) - r->sy * bz;
+    float cx = component(c, r->kx) - r->sx * cz;
+    float cy = component(c, r->ky) - r->sy * cz;
+
+    /** scaled barycentric coordinates, the ray hits if all have the same sign */
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if (u == 0.f || v == 0.f || w == 0.f) {
+        // the ray passes through an edge or vertex up to float precision, decide in double precision
+        u = (float) ((double) cx * (double) by - (double) cy * (double) bx);
+        v = (float) ((double) ax * (double) cy - (double) ay * (double) cx);
+        w = (float) ((double) bx * (double) ay - (double) by * (double) ax);
+    }
+    if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f)) {
+        return false;
+    }
+
+    float det = u + v + w;
+    if (det == 0.f) {
+        // the ray lies in the plane of the triangle
+        return false;
+    }
+    *distance = (u * az * r->sz + v * bz * r->sz + w * cz * r->sz) / det;
+
+    return true;
+}
+
+/** returns the smaller of {a} and {b}, unlike fminf this is not a call and prefers {b} if one is nan */
+static float min_float(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+/** returns the larger of {a} and {b}, unlike fmaxf this is not a call and prefers {b} if one is nan */
+static float max_float(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+/**
+ * same as intersect_aabb of bvh.c, with the exit distance rounded up. slabs of which a distance is nan (the ray
+ * starts on a face it runs parallel to) do not narrow the range, as the ranges are passed second */
+static bool intersect_node(float *t_enter, const aabb_t *bounds, const mesh_ray_t *r, float t_min, float t_max)
+{
+    float t0 = (bounds->min.x - r->start.x) * r->inv_direction.x;
+    float t1 = (bounds->max.x - r->start.x) * r->inv_direction.x;
+    t_min = max_float(min_float(t0, t1), t_min);
+    t_max = min_float(max_float(t0, t1) * EXIT_ROUND_UP, t_max);
+
+    t0 = (bounds->min.y - r->start.y) * r->inv_direction.y;
+    t1 = (bounds->max.y - r->start.y) * r->inv_direction.y;
+    t_min = max_float(min_float(t0, t1), t_min);
+    t_max = min_float(max_float(t0, t1) * EXIT_ROUND_UP, t_max);
+
+    t0 = (bounds->min.z - r->start.z) * r->inv_direction.z;
+    t1 = (bounds->max.z - r->start.z) * r->inv_direction.z;
+    t_min = max_float(min_float(t0, t1), t_min);
+    t_max = min_float(max_float(t0, t1) * EXIT_ROUND_UP, t_max);
+
+    *t_enter = t_min;
+
+    return t_min <= t_max;
+}
+
+bool mesh_closest(const mesh_t *mesh, hit_t *hit, ray_t ray, float t_min, float t_max)
+{
+    mesh_ray_t r = prepare_ray(ray);
+    uint32_t closest = NO_TRIANGLE;
+
+    /** same traversal as bvh_closest */
+    struct {
+        uint32_t node;
+        float t_enter;
+    } stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    float t_root;
+    if (intersect_node(&t_root, &mesh->nodes[0].bounds, &r, t_min, t_max)) {
+        stack[stack_size].node = 0;
+        stack[stack_size++].t_enter = t_root;
+    }
+
+    while (stack_size > 0) {
+        stack_size--;
+        if (stack[stack_size].t_enter > t_max) {
+            continue;
+        }
+        const bvh_node_t *node = &mesh->nodes[stack[stack_size].node];
+        STATS_ADD(STAT_NODE_VISITS, 1);
+
+        if (node->count == 0) {
+            /** interior node, visit the nearest child first */
+            uint32_t near = (uint32_t) (node - mesh->nodes) + 1;
+            uint32_t far = node->offset;
+            float t_near, t_far;
+            bool hit_near = intersect_node(&t_near, &mesh->nodes[near].bounds, &r, t_min, t_max);
+            bool hit_far = intersect_node(&t_far, &mesh->nodes[far].bounds, &r, t_min, t_max);
+            if (hit_near && hit_far && t_far < t_near) {
+                uint32_t node_tmp = near;
+                near = far;
+                far = node_tmp;
+                float t_tmp = t_near;
+                t_near = t_far;
+                t_far = t_tmp;
+            }
+            if (hit_far) {
+                stack[stack_size].node = far;
+                stack[stack_size++].t_enter = t_far;
+            }
+            if (hit_near) {
+                stack[stack_size].node = near;
+                stack[stack_size++].t_enter = t_near;
+            }
+            continue;
+        }
+
+        /** leaf node */
+        STATS_ADD(STAT_TRIANGLE_TESTS, node->count);
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            float t;
+            // the first hit may lie at t_max, later hits must be strictly closer
+            if (intersect_triangle(mesh, &r, &mesh->triangles[i], &t) && t >= t_min &&
+                (closest == NO_TRIANGLE ? t <= t_max : t < t_max)) {
+                t_max = t;
+                closest = i;
+            }
+        }
+    }
+
+    if (closest == NO_TRIANGLE) {
+        return false;
+    }
+
+    const triangle_t *triangle = &mesh->triangles[closest];
+    vec3f v0 = mesh->vertices[triangle->v[0]];
+    vec3f e1 = vec3f_sub(mesh->vertices[triangle->v[1]], v0);
+    vec3f e2 = vec3f_sub(mesh->vertices[triangle->v[2]], v0);
+    hit->t = t_max;
+    hit->normal = vec3f_norm(vec3f_cross(e1, e2));
+    hit->reflect.start = vec3f_madd(ray.start, ray.direction, t_max);
+    hit->reflect.direction = reflect(ray.direction, hit->normal);
+
+    return true;
+}
+
+bool mesh_occludes(const mesh_t *mesh, ray_t ray, float t_min, float t_max)
+{
+    mesh_ray_t r = prepare_ray(ray);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const bvh_node_t *node = &mesh->nodes[stack[--stack_size]];
+        STATS_ADD(STAT_NODE_VISITS, 1);
+        float t_enter;
+        if (!intersect_node(&t_enter, &node->bounds, &r, t_min, t_max)) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            stack[stack_size++] = node->offset;
+            stack[stack_size++] = (uint32_t) (node - mesh->nodes) + 1;
+            continue;
+        }
+
+        STATS_ADD(STAT_TRIANGLE_TESTS, node->count);
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            float t;
+            if (intersect_triangle(mesh, &r, &mesh->triangles[i], &t) && t_min < t && t < t_max) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
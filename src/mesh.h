@@ -0,0 +1,67 @@
+#ifndef RAY_TRACER_MESH_H
+#define RAY_TRACER_MESH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vec3.h"
+#include "util.h"
+#include "bvh.h"
+
+typedef struct {
+    uint32_t v[3]; // indices into the vertices of the mesh, counter-clockwise seen from the front
+} triangle_t;
+
+/** triangle mesh of a single material, with its own hierarchy of which the leaves refer to ranges of triangles */
+typedef struct {
+    vec3f *vertices;
+    uint32_t vertex_count;
+    triangle_t *triangles; // in leaf order
+    uint32_t triangle_count;
+    bvh_node_t *nodes;
+    uint32_t node_count;
+    /** properties of mesh */
+    material_t material;
+    /** origin of mesh, to write it back to a scene */
+    char *path;            // absolute path of the file the mesh was loaded from, or NULL
+    float scale;           // applied to the loaded vertices before translation
+    vec3f translation;
+    /** memory of mesh */
+    void *mapping;         // mapped binary mesh holding the arrays, or NULL if vertices and nodes are allocated
+    size_t mapping_size;
+} mesh_t;
+
+/**
+ * loads {mesh} from file {path}, which is either a binary mesh written by mesh_write_binary or a wavefront OBJ file.
+ * of OBJ files only the vertex positions and faces are used, faces with more than three vertices are split into
+ * triangles. returns false and prints the reason to stderr if the file cannot be loaded */
+bool mesh_load(mesh_t *mesh, const char *path);
+
+/**
+ * makes {mesh} an empty mesh with room for {vertex_count} vertices and {triangle_count} triangles in a single
+ * allocation, which are left uninitialized. call mesh_build once they are set */
+void mesh_allocate(mesh_t *mesh, uint32_t vertex_count, uint32_t triangle_count);
+
+/** builds the hierarchy of {mesh}, which reorders its triangles */
+void mesh_build(mesh_t *mesh);
+
+/** scales the vertices of {mesh} by {scale} > 0, then moves them by {translation} */
+void mesh_transform(mesh_t *mesh, float scale, vec3f translation);
+
+/** writes {mesh} with its hierarchy to {path} in the binary format, which is mapped as is when loaded */
+bool mesh_write_binary(const mesh_t *mesh, const char *path);
+
+/** frees the memory of {mesh} */
+void mesh_free(mesh_t *mesh);
+
+/** returns the number of bytes used by the vertices, triangles and hierarchy of {mesh} */
+size_t mesh_memory(const mesh_t *mesh);
+
+/**
+ * returns whether {ray} hits a triangle of {mesh} at a distance in [t_min, t_max], if so: {hit} contains the closest
+ * intersection. the normal is that of the triangle, facing the side from which its vertices are counter-clockwise */
+bool mesh_closest(const mesh_t *mesh, hit_t *hit, ray_t ray, float t_min, float t_max);
+
+/** returns whether {ray} hits a triangle of {mesh} at a distance in (t_min, t_max) */
+bool mesh_occludes(const mesh_t *mesh, ray_t ray, float t_min, float t_max);
+
+#endif //RAY_TRACER_MESH_H
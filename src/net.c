@@ -0,0 +1,156 @@
+#include "net.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/** time to keep trying to connect to a socket that is not listening yet, in milliseconds */
+#define CONNECT_TIMEOUT 10000
+
+bool parse_address(address_t *address, const char *text, bool passive)
+{
+    memset(address, 0, sizeof(address_t));
+    if (strncmp(text, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *) &address->storage;
+        const char *path = text + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "%s: invalid socket path\n", text);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        address->family = AF_UNIX;
+        address->length = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    if (strncmp(text, "tcp:", 4) == 0) {
+        const char *colon = strrchr(text + 4, ':');
+        if (!colon || colon[1] == '\0') {
+            fprintf(stderr, "%s: expected tcp:HOST:PORT\n", text);
+            return false;
+        }
+        char host[256];
+        size_t length = (size_t) (colon - (text + 4));
+        if (length >= sizeof(host)) {
+            fprintf(stderr, "%s: host name too long\n", text);
+            return false;
+        }
+        memcpy(host, text + 4, length);
+        host[length] = '\0';
+
+        struct addrinfo hints = {.ai_family=AF_UNSPEC, .ai_socktype=SOCK_STREAM, .ai_flags=passive ? AI_PASSIVE : 0};
+        struct addrinfo *info;
+        int error = getaddrinfo(length > 0 ? host : NULL, colon + 1, &hints, &info);
+        if (error != 0) {
+            fprintf(stderr, "%s: %s\n", text, gai_strerror(error));
+            return false;
+        }
+        memcpy(&address->storage, info->ai_addr, info->ai_addrlen);
+        address->family = info->ai_family;
+        address->length = info->ai_addrlen;
+        freeaddrinfo(info);
+        return true;
+    }
+
+    fprintf(stderr, "%s: expected unix:PATH or tcp:HOST:PORT\n", text);
+    return false;
+}
+
+bool send_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+
+    return true;
+}
+
+bool receive_all(int fd, void *data, size_t size)
+{
+    uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= (size_t) received;
+    }
+
+    return true;
+}
+
+bool send_message(int fd, uint32_t type, const void *payload, uint32_t size)
+{
+    message_header_t header = {.type=type, .size=size};
+
+    return send_all(fd, &header, sizeof(header)) && (size == 0 || send_all(fd, payload, size));
+}
+
+int listen_at(const address_t *address, const char *text)
+{
+    if (address->family == AF_UNIX) {
+        // replace the socket of an earlier coordinator, but no other file
+        const char *path = ((const struct sockaddr_un *) &address->storage)->sun_path;
+        struct stat status;
+        if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    int fd = socket(address->family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", text, strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    if (address->family != AF_UNIX) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, (const struct sockaddr *) &address->storage, address->length) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "%s: %s\n", text, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int connect_to(const address_t *address, const char *text)
+{
+    for (uint32_t waited = 0;; waited += 50) {
+        int fd = socket(address->family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", text, strerror(errno));
+            return -1;
+        }
+        if (connect(fd, (const struct sockaddr *) &address->storage, address->length) == 0) {
+            return fd;
+        }
+        int error = errno;
+        close(fd);
+        if ((error != ENOENT && error != ECONNREFUSED) || waited >= CONNECT_TIMEOUT) {
+            fprintf(stderr, "%s: %s\n", text, strerror(error));
+            return -1;
+        }
+        nanosleep(&(struct timespec) {.tv_sec=0, .tv_nsec=50000000}, NULL);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef RAY_TRACER_NET_H
+#define RAY_TRACER_NET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/** socket address parsed from unix:PATH or tcp:HOST:PORT */
+typedef struct {
+    int family;
+    struct sockaddr_storage storage;
+    socklen_t length;
+} address_t;
+
+/**
+ * header of a message, followed by its payload. messages are sent in the byte order and layout of the sender, so both
+ * ends are expected to be built for the same architecture, as compiled scenes are */
+typedef struct {
+    uint32_t type;
+    uint32_t size; // of the payload following the header
+} message_header_t;
+
+/** parses {text} into {address}, resolving host names. returns false and prints the reason on failure */
+bool parse_address(address_t *address, const char *text, bool passive);
+
+/** sends all {size} bytes of {data}, returns false if the connection is broken */
+bool send_all(int fd, const void *data, size_t size);
+
+/** receives exactly {size} bytes into {data}, returns false if the connection is closed or broken */
+bool receive_all(int fd, void *data, size_t size);
+
+/** sends a message of {type} with {size} bytes of {payload}, returns false if the connection is broken */
+bool send_message(int fd, uint32_t type, const void *payload, uint32_t size);
+
+/**
+ * creates a socket listening at {address}, replacing the UNIX socket of an earlier listener. {text} names the address
+ * in messages. returns -1 and prints the reason on failure */
+int listen_at(const address_t *address, const char *text);
+
+/** connects to {address}, retrying while nothing listens there yet. returns -1 and prints the reason on failure */
+int connect_to(const address_t *address, const char *text);
+
+#endif //RAY_TRACER_NET_H
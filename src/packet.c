@@ -0,0 +1,618 @@
+#include "packet.h"
+
+#include <math.h>
+#include "scene.h"
+#include "stats.h"
+#include "bvh.h"
+#include "lights.h"
+#include "spheres.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define LANES 4         // rays tested per instruction
+
+/** rays of a packet in structure of arrays layout, padded to a multiple of LANES with rays that never hit */
+typedef struct {
+    uint32_t count;
+    float sx[PACKET_MAX_RAYS], sy[PACKET_MAX_RAYS], sz[PACKET_MAX_RAYS]; // start
+    float dx[PACKET_MAX_RAYS], dy[PACKET_MAX_RAYS], dz[PACKET_MAX_RAYS]; // direction
+    float ix[PACKET_MAX_RAYS], iy[PACKET_MAX_RAYS], iz[PACKET_MAX_RAYS]; // inverse direction
+    float t_max[PACKET_MAX_RAYS]; // per ray, negative for rays that are no longer active
+    float t_min;
+} packet_t;
+
+static void packet_set(packet_t *p, uint32_t r, ray_t ray, float t_max)
+{
+    p->sx[r] = ray.start.x;
+    p->sy[r] = ray.start.y;
+    p->sz[r] = ray.start.z;
+    p->dx[r] = ray.direction.x;
+    p->dy[r] = ray.direction.y;
+    p->dz[r] = ray.direction.z;
+    p->ix[r] = 1.f / ray.direction.x;
+    p->iy[r] = 1.f / ray.direction.y;
+    p->iz[r] = 1.f / ray.direction.z;
+    p->t_max[r] = t_max;
+}
+
+static ray_t packet_ray(const packet_t *p, uint32_t r)
+{
+    ray_t ray = {{p->sx[r], p->sy[r], p->sz[r]}, {p->dx[r], p->dy[r], p->dz[r]}};
+
+    return ray;
+}
+
+/** returns the number of rays of {p} that are still active */
+static uint32_t packet_active(const packet_t *p)
+{
+    uint32_t count = 0;
+    for (uint32_t k = 0; k < p->count; k++) {
+        count += p->t_max[k] >= p->t_min;
+    }
+
+    return count;
+}
+
+/** pads {p} to a multiple of LANES with inactive rays */
+static void packet_pad(packet_t *p)
+{
+    ray_t inactive = {{0.f, 0.f, 0.f}, {1.f, 1.f, 1.f}};
+    for (uint32_t r = p->count; r % LANES != 0; r++) {
+        packet_set(p, r, inactive, -FLT_MAX);
+    }
+}
+
+#ifdef USE_BVH
+static uint32_t lane_count(uint32_t mask)
+{
+    uint32_t count = 0;
+    for (; mask; mask >>= 1) {
+        count += mask & 1;
+    }
+
+    return count;
+}
+
+/** returns a mask of the rays [r, r + LANES) of {p} that overlap {bounds} within [t_min, t_max] */
+static uint32_t packet_aabb(const packet_t *p, uint32_t r, const aabb_t *bounds)
+{
+#ifdef __SSE2__
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->min.x), _mm_loadu_ps(&p->sx[r])), _mm_loadu_ps(&p->ix[r]));
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->max.x), _mm_loadu_ps(&p->sx[r])), _mm_loadu_ps(&p->ix[r]));
+    __m128 lo = _mm_max_ps(_mm_set1_ps(p->t_min), _mm_min_ps(t0, t1));
+    __m128 hi = _mm_min_ps(_mm_loadu_ps(&p->t_max[r]), _mm_max_ps(t0, t1));
+
+    t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->min.y), _mm_loadu_ps(&p->sy[r])), _mm_loadu_ps(&p->iy[r]));
+    t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->max.y), _mm_loadu_ps(&p->sy[r])), _mm_loadu_ps(&p->iy[r]));
+    lo = _mm_max_ps(lo, _mm_min_ps(t0, t1));
+    hi = _mm_min_ps(hi, _mm_max_ps(t0, t1));
+
+    t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->min.z), _mm_loadu_ps(&p->sz[r])), _mm_loadu_ps(&p->iz[r]));
+    t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds->max.z), _mm_loadu_ps(&p->sz[r])), _mm_loadu_ps(&p->iz[r]));
+    lo = _mm_max_ps(lo, _mm_min_ps(t0, t1));
+    hi = _mm_min_ps(hi, _mm_max_ps(t0, t1));
+
+    return (uint32_t) _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+#else
+    uint32_t mask = 0;
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        uint32_t i = r + lane;
+        float t0 = (bounds->min.x - p->sx[i]) * p->ix[i];
+        float t1 = (bounds->max.x - p->sx[i]) * p->ix[i];
+        float lo = fmaxf(p->t_min, fminf(t0, t1));
+        float hi = fminf(p->t_max[i], fmaxf(t0, t1));
+        t0 = (bounds->min.y - p->sy[i]) * p->iy[i];
+        t1 = (bounds->max.y - p->sy[i]) * p->iy[i];
+        lo = fmaxf(lo, fminf(t0, t1));
+        hi = fminf(hi, fmaxf(t0, t1));
+        t0 = (bounds->min.z - p->sz[i]) * p->iz[i];
+        t1 = (bounds->max.z - p->sz[i]) * p->iz[i];
+        lo = fmaxf(lo, fminf(t0, t1));
+        hi = fminf(hi, fmaxf(t0, t1));
+        mask |= (uint32_t) (lo <= hi) << lane;
+    }
+
+    return mask;
+#endif
+}
+
+/** returns whether any ray of {p} overlaps {bounds}, and counts the visit and a node test per ray */
+static uint32_t visit_node(const packet_t *p, const aabb_t *bounds, packet_stats_t *stats)
+{
+    uint32_t any = 0;
+    for (uint32_t r = 0; r < p->count; r += LANES) {
+        uint32_t mask = packet_aabb(p, r, bounds);
+        stats->lane_hits += lane_count(mask);
+        any |= mask;
+    }
+    stats->node_visits++;
+    stats->lane_tests += p->count;
+    STATS_ADD(STAT_NODE_VISITS, p->count);
+
+    return any;
+}
+#endif
+
+/**
+ * returns a mask of the rays [r, r + LANES) of {p} that hit the sphere at {center} with squared radius {r2} within
+ * [t_min, t_max], {t} contains the distances. terms are evaluated as in reflect_sphere, so the distances are equal */
+static uint32_t packet_sphere(const packet_t *p, uint32_t r, vec3f center, float r2, float *t)
+{
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps();
+    __m128 dx = _mm_loadu_ps(&p->dx[r]);
+    __m128 dy = _mm_loadu_ps(&p->dy[r]);
+    __m128 dz = _mm_loadu_ps(&p->dz[r]);
+    __m128 vx = _mm_sub_ps(_mm_loadu_ps(&p->sx[r]), _mm_set1_ps(center.x));
+    __m128 vy = _mm_sub_ps(_mm_loadu_ps(&p->sy[r]), _mm_set1_ps(center.y));
+    __m128 vz = _mm_sub_ps(_mm_loadu_ps(&p->sz[r]), _mm_set1_ps(center.z));
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, dx), _mm_mul_ps(vy, dy)), _mm_mul_ps(vz, dz));
+    __m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+    __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_sub_ps(vv, _mm_set1_ps(r2)));
+    __m128 square_root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+    __m128 neg_b = _mm_xor_ps(b, _mm_set1_ps(-0.f));
+    __m128 t_neg = _mm_sub_ps(neg_b, square_root);
+    __m128 t_pos = _mm_add_ps(neg_b, square_root);
+
+    __m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t_pos, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(t_neg, _mm_set1_ps(p->t_min)));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(t_neg, _mm_loadu_ps(&p->t_max[r])));
+    _mm_storeu_ps(t, t_neg);
+
+    return (uint32_t) _mm_movemask_ps(mask);
+#else
+    uint32_t mask = 0;
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        uint32_t k = r + lane;
+        float vx = p->sx[k] - center.x;
+        float vy = p->sy[k] - center.y;
+        float vz = p->sz[k] - center.z;
+        float b = vx * p->dx[k] + vy * p->dy[k] + vz * p->dz[k];
+        float discriminant = b * b - ((vx * vx + vy * vy + vz * vz) - r2);
+        float square_root = sqrtf(fmaxf(discriminant, 0.f));
+        t[lane] = -b - square_root;
+        bool hit = discriminant >= 0.f && -b + square_root >= 0.f && t[lane] >= p->t_min && t[lane] <= p->t_max[k];
+        mask |= (uint32_t) hit << lane;
+    }
+
+    return mask;
+#endif
+}
+
+/** updates the closest hit of the rays in {p} with the spheres [first, first + count) of {soa} */
+static void packet_closest_spheres(
+        packet_t *p, const sphere_soa_t *soa, uint32_t first, uint32_t count,
+        const object_t *objects, object_t *closest, bool *found)
+{
+    for (uint32_t i = first; i < first + count; i++) {
+        if (soa->r2[i] < 0.f) {
+            // placeholder of another object
+            continue;
+        }
+
+        vec3f center = {soa->x[i], soa->y[i], soa->z[i]};
+        STATS_ADD(STAT_SPHERE_TESTS, p->count);
+        for (uint32_t r = 0; r < p->count; r += LANES) {
+            float t[LANES];
+            uint32_t mask = packet_sphere(p, r, center, soa->r2[i], t);
+            for (uint32_t lane = 0; mask; lane++, mask >>= 1) {
+                uint32_t k = r + lane;
+                // the first hit may lie at t_max, later hits must be strictly closer
+                if ((mask & 1) && (!found[k] || t[lane] < p->t_max[k])) {
+                    p->t_max[k] = t[lane];
+                    found[k] = true;
+                    closest[k].type = OBJECT_SPHERE;
+                    closest[k].index = objects ? objects[i].index : i;
+                }
+            }
+        }
+    }
+}
+
+#ifdef USE_BVH
+/** updates the closest hit of the rays in {p} with plane {index} */
+static void packet_closest_plane(packet_t *p, uint32_t index, object_t *closest, bool *found)
+{
+    for (uint32_t k = 0; k < p->count; k++) {
+        hit_t hit;
+        if (p->t_max[k] >= p->t_min && reflect_plane(&hit, packet_ray(p, k), &PLANE_RECORDS[index]) &&
+            hit.t >= p->t_min && hit.t <= p->t_max[k] && (!found[k] || hit.t < p->t_max[k])) {
+            p->t_max[k] = hit.t;
+            found[k] = true;
+            closest[k].type = OBJECT_PLANE;
+            closest[k].index = index;
+        }
+    }
+}
+
+/** updates the closest hit of the rays in {p} with mesh {index}, one ray at a time */
+static void packet_closest_mesh(packet_t *p, uint32_t index, object_t *closest, bool *found)
+{
+    for (uint32_t k = 0; k < p->count; k++) {
+        hit_t hit;
+        if (p->t_max[k] >= p->t_min && mesh_closest(&MESHES[index], &hit, packet_ray(p, k), p->t_min, p->t_max[k]) &&
+            (!found[k] || hit.t < p->t_max[k])) {
+            p->t_max[k] = hit.t;
+            found[k] = true;
+            closest[k].type = OBJECT_MESH;
+            closest[k].index = index;
+        }
+    }
+}
+#endif
+
+/** finds the closest object of each ray in {p}, same as get_closest_object */
+static void packet_closest(packet_t *p, object_t *closest, bool *found, packet_stats_t *stats)
+{
+    for (uint32_t k = 0; k < p->count; k++) {
+        found[k] = false;
+    }
+
+#ifdef USE_BVH
+    const bvh_t *bvh = &BVH;
+    vec3f start = {p->sx[0], p->sy[0], p->sz[0]};
+    vec3f direction = {p->dx[0], p->dy[0], p->dz[0]};
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    if (bvh->node_count > 0) {
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0) {
+        const bvh_node_t *node = &bvh->nodes[stack[--stack_size]];
+        if (!visit_node(p, &node->bounds, stats)) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            /** interior node, visit the child nearest along the first ray first */
+            uint32_t near = (uint32_t) (node - bvh->nodes) + 1;
+            uint32_t far = node->offset;
+            const aabb_t *a = &bvh->nodes[near].bounds;
+            const aabb_t *b = &bvh->nodes[far].bounds;
+            float d_near = vec3f_dot(vec3f_sub(vec3f_scale(vec3f_add(a->min, a->max), .5f), start), direction);
+            float d_far = vec3f_dot(vec3f_sub(vec3f_scale(vec3f_add(b->min, b->max), .5f), start), direction);
+            if (d_far < d_near) {
+                uint32_t tmp = near;
+                near = far;
+                far = tmp;
+            }
+            stack[stack_size++] = far;
+            stack[stack_size++] = near;
+            continue;
+        }
+
+        /** leaf node, spheres before the other objects as in bvh_closest */
+        packet_closest_spheres(p, &bvh->spheres, node->offset, node->count, bvh->objects, closest, found);
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            if (bvh->objects[i].type == OBJECT_PLANE) {
+                packet_closest_plane(p, bvh->objects[i].index, closest, found);
+            } else if (bvh->objects[i].type == OBJECT_MESH) {
+                packet_closest_mesh(p, bvh->objects[i].index, closest, found);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < bvh->unbounded_count; i++) {
+        packet_closest_plane(p, bvh->unbounded[i], closest, found);
+    }
+#else
+    (void) stats;
+
+    /** find the closest sphere and the closest plane separately, then pick as get_closest_object */
+    float t_far[PACKET_MAX_RAYS];
+    for (uint32_t k = 0; k < p->count; k++) {
+        t_far[k] = p->t_max[k];
+    }
+    packet_closest_spheres(p, &SPHERES_SOA, 0, SPHERES_SOA.count, NULL, closest, found);
+
+    for (uint32_t k = 0; k < p->count; k++) {
+        uint32_t plane;
+        hit_t plane_hit;
+        if (get_closest_plane(&plane_hit, &plane, packet_ray(p, k), p->t_min, t_far[k]) &&
+            (!found[k] || plane_hit.t <= p->t_max[k])) {
+            found[k] = true;
+            closest[k].type = OBJECT_PLANE;
+            closest[k].index = plane;
+        }
+
+        // meshes have to be strictly closer than the sphere or plane
+        float t_closest = !found[k] ? t_far[k] : closest[k].type == OBJECT_PLANE ? plane_hit.t : p->t_max[k];
+        uint32_t mesh;
+        hit_t mesh_hit;
+        if (get_closest_mesh(&mesh_hit, &mesh, packet_ray(p, k), p->t_min, t_closest) &&
+            (!found[k] || mesh_hit.t < t_closest)) {
+            found[k] = true;
+            closest[k].type = OBJECT_MESH;
+            closest[k].index = mesh;
+            p->t_max[k] = mesh_hit.t;
+        }
+    }
+#endif
+}
+
+/**
+ * multiplies {strength} of each active ray in {p} with {throughput} of {object} if it lies within (t_min, t_max).
+ * rays that become fully blocked are deactivated, and {occluder} is set if {object} blocked them on its own */
+static void packet_shadow_object(
+        packet_t *p, const float *t_max, float *strength, object_t object, float throughput, object_t *occluder)
+{
+    if (throughput == 1.f) {
+        // fully transparent objects do not change the light, do not test them
+        return;
+    }
+
+    if (object.type == OBJECT_SPHERE) {
+        const sphere_record_t *sphere = &SPHERE_RECORDS[object.index];
+        STATS_ADD(STAT_SPHERE_TESTS, p->count);
+        for (uint32_t r = 0; r < p->count; r += LANES) {
+            float t[LANES];
+            uint32_t mask = packet_sphere(p, r, sphere->center, sphere->radius2, t);
+            for (uint32_t lane = 0; mask; lane++, mask >>= 1) {
+                uint32_t k = r + lane;
+                if ((mask & 1) && p->t_min < t[lane] && t[lane] < t_max[k]) {
+                    strength[k] *= throughput;
+                    if (strength[k] == 0.f) {
+                        // the light is blocked, deactivate the ray
+                        p->t_max[k] = -FLT_MAX;
+                        if (throughput == 0.f) {
+                            *occluder = object;
+                        }
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
+    // planes and meshes are tested one ray at a time
+    for (uint32_t k = 0; k < p->count; k++) {
+        if (p->t_max[k] >= p->t_min && occludes_object(packet_ray(p, k), object, p->t_min, t_max[k])) {
+            strength[k] *= throughput;
+            if (strength[k] == 0.f) {
+                p->t_max[k] = -FLT_MAX;
+                if (throughput == 0.f) {
+                    *occluder = object;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * computes the fraction of light reaching the start of each active ray in {p}, same as get_shadow_factor.
+ * {occluder} is tested first and updated with the last object that blocked a ray on its own. the rays blocked by
+ * {occluder} and by the other objects are counted as in get_shadow_factor */
+static void packet_shadow(packet_t *p, float *strength, object_t *occluder, packet_stats_t *stats)
+{
+    // keep the actual ranges, p->t_max is negative for rays that are blocked or not part of the query
+    float t_max[PACKET_MAX_RAYS];
+    for (uint32_t k = 0; k < p->count; k++) {
+        t_max[k] = p->t_max[k];
+        strength[k] = p->t_max[k] >= p->t_min ? 1.f : 0.f;
+    }
+
+    stats->shadow_packets++;
+    uint32_t active = packet_active(p);
+
+    if (occluder->index != NO_OBJECT) {
+        // the cached occluder is opaque, rays it blocks are done
+        object_t cached = *occluder;
+        packet_shadow_object(p, t_max, strength, cached, 0.f, occluder);
+        uint32_t open = packet_active(p);
+        STATS_ADD(STAT_SHADOW_CACHED, active - open);
+        active = open;
+    }
+
+#ifdef USE_BVH
+    const bvh_t *bvh = &BVH;
+    for (uint32_t i = 0; i < bvh->unbounded_count; i++) {
+        object_t object = {OBJECT_PLANE, bvh->unbounded[i]};
+        packet_shadow_object(p, t_max, strength, object, get_object_troughput(object), occluder);
+    }
+
+    uint32_t stack[BVH_STACK_SIZE];
+    uint32_t stack_size = 0;
+    if (bvh->node_count > 0) {
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0) {
+        const bvh_node_t *node = &bvh->nodes[stack[--stack_size]];
+        if (!visit_node(p, &node->bounds, stats)) {
+            continue;
+        }
+
+        if (node->count == 0) {
+            // same order as bvh_shadow_factor, so the throughputs are multiplied in the same order
+            stack[stack_size++] = node->offset;
+            stack[stack_size++] = (uint32_t) (node - bvh->nodes) + 1;
+            continue;
+        }
+
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++) {
+            packet_shadow_object(p, t_max, strength, bvh->objects[i], bvh->throughputs[i], occluder);
+        }
+    }
+#else
+    for (uint32_t i = 0; i < get_object_count(); i++) {
+        object_t object = get_object(i);
+        packet_shadow_object(p, t_max, strength, object, get_object_troughput(object), occluder);
+    }
+#endif
+    STATS_ADD(STAT_SHADOW_BLOCKED, active - packet_active(p));
+}
+
+void trace_packet(
+        trace_context_t *context, vec3f *colors, const ray_t *rays, uint32_t count, uint32_t depth,
+        float t_min, float t_max, packet_stats_t *stats)
+{
+    packet_t p;
+    p.count = count;
+    p.t_min = t_min;
+    for (uint32_t k = 0; k < count; k++) {
+        packet_set(&p, k, rays[k], t_max);
+    }
+    packet_pad(&p);
+
+    STATS_TIME_BEGIN(STAT_TIMER_TRACE);
+    STATS_ADD(STAT_RAYS_PRIMARY, count);
+    stats->packets++;
+    stats->rays += count;
+
+    /** closest intersections */
+    object_t objects[PACKET_MAX_RAYS];
+    bool found[PACKET_MAX_RAYS];
+    STATS_TIME_BEGIN(STAT_TIMER_INTERSECT);
+    packet_closest(&p, objects, found, stats);
+    STATS_TIME_END(STAT_TIMER_INTERSECT);
+
+    bool coherent = true;
+    for (uint32_t k = 1; k < count; k++) {
+        coherent = coherent && found[k] == found[0] &&
+                   (!found[k] || (objects[k].type == objects[0].type && objects[k].index == objects[0].index));
+    }
+    stats->coherent += coherent;
+
+    hit_t hits[PACKET_MAX_RAYS];
+    material_t materials[PACKET_MAX_RAYS];
+    float intensity[PACKET_MAX_RAYS];
+    for (uint32_t k = 0; k < count; k++) {
+        if (!found[k]) {
+            continue;
+        }
+
+        if (objects[k].type == OBJECT_SPHERE) {
+            reflect_sphere(&hits[k], rays[k], &SPHERE_RECORDS[objects[k].index]);
+        } else if (objects[k].type == OBJECT_PLANE) {
+            reflect_plane(&hits[k], rays[k], &PLANE_RECORDS[objects[k].index]);
+        } else {
+            // the closest triangle lies at the distance found
+            mesh_closest(&MESHES[objects[k].index], &hits[k], rays[k], t_min, p.t_max[k]);
+        }
+        materials[k] = get_material(objects[k], &hits[k]);
+        intensity[k] = 0.f;
+    }
+
+    /** lighting, with one shadow packet per light that can reach a hit of the packet */
+    STATS_TIME_BEGIN(STAT_TIMER_LIGHTING);
+    aabb_t bounds = aabb_empty();
+    for (uint32_t k = 0; k < count; k++) {
+        if (found[k]) {
+            aabb_grow(&bounds, hits[k].reflect.start);
+        }
+    }
+    uint32_t *lights = context->light_candidates;
+    uint32_t light_count = light_tree_query(&LIGHT_TREE, &bounds, lights);
+    uint32_t shaded = 0; // number of lights shading a hit, the others are counted as skipped
+    for (uint32_t i = 0; i < light_count; i++) {
+        const light_t *light = &LIGHTS[lights[i]];
+        if (light->type == LIGHT_AMBIENT) {
+            for (uint32_t k = 0; k < count; k++) {
+                intensity[k] += light->intensity;
+                shaded += found[k];
+            }
+            continue;
+        }
+
+        // the rays of hits the light does not reach are inactive
+        float scale[PACKET_MAX_RAYS];
+        bool reached = false;
+        for (uint32_t k = 0; k < count; k++) {
+            scale[k] = found[k] ? light_scale(context, light, hits[k].reflect.start) : 0.f;
+            reached = reached || scale[k] > 0.f;
+        }
+        if (!reached) {
+            continue;
+        }
+
+        packet_t shadow;
+        shadow.count = count;
+        shadow.t_min = T_CLOSE;
+        vec3f directions[PACKET_MAX_RAYS];
+        for (uint32_t k = 0; k < count; k++) {
+            float light_t_max = -FLT_MAX;
+            ray_t l = {{0.f, 0.f, 0.f}, {1.f, 1.f, 1.f}};
+            if (scale[k] > 0.f) {
+                l = get_light_ray(light, hits[k].reflect.start, &light_t_max);
+                stats->shadow_rays++;
+                STATS_ADD(STAT_RAYS_SHADOW, 1);
+                shaded++;
+            }
+            directions[k] = l.direction;
+            packet_set(&shadow, k, l, light_t_max);
+        }
+        packet_pad(&shadow);
+
+        float strength[PACKET_MAX_RAYS];
+        STATS_TIME_BEGIN(STAT_TIMER_SHADOW);
+        packet_shadow(&shadow, strength, &context->occluders[lights[i]], stats);
+        STATS_TIME_END(STAT_TIMER_SHADOW);
+
+        for (uint32_t k = 0; k < count; k++) {
+            if (scale[k] > 0.f) {
+                intensity[k] = add_light(
+                        intensity[k], light, directions[k], strength[k] * scale[k],
+                        rays[k], hits[k].normal, hits[k].reflect, materials[k].shininess);
+            }
+        }
+    }
+    uint32_t hit_count = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        hit_count += found[k];
+    }
+    STATS_ADD(STAT_LIGHTS_SKIPPED, (uint64_t) hit_count * LIGHTS_SIZE - shaded);
+    STATS_TIME_END(STAT_TIMER_LIGHTING);
+
+    /** shading, rays diverge after reflection and refraction and continue on their own */
+    for (uint32_t k = 0; k < count; k++) {
+        if (!found[k]) {
+            vec3f background_color = BACKGROUND;
+            colors[k] = background_color;
+            continue;
+        }
+
+        if (depth > 0 && materials[k].reflection.type != NONE) {
+            stats->single_rays++;
+        }
+        colors[k] = shade_hit(context, rays[k], hits[k], materials[k], clamp_intensity(intensity[k]), depth, t_max);
+    }
+    STATS_TIME_END(STAT_TIMER_TRACE);
+}
+
+void packet_stats_add(packet_stats_t *a, const packet_stats_t *b)
+{
+    a->packets += b->packets;
+    a->rays += b->rays;
+    a->coherent += b->coherent;
+    a->shadow_packets += b->shadow_packets;
+    a->shadow_rays += b->shadow_rays;
+    a->node_visits += b->node_visits;
+    a->lane_tests += b->lane_tests;
+    a->lane_hits += b->lane_hits;
+    a->single_rays += b->single_rays;
+}
+
+void packet_stats_print(const packet_stats_t *stats, FILE *file)
+{
+    double packets = stats->packets > 0 ? (double) stats->packets : 1.;
+    double shadow_packets = stats->shadow_packets > 0 ? (double) stats->shadow_packets : 1.;
+    double lane_tests = stats->lane_tests > 0 ? (double) stats->lane_tests : 1.;
+    double rays = stats->rays > 0 ? (double) stats->rays : 1.;
+
+    fprintf(file, "packets:            %llu camera (%.1f rays each), %llu shadow (%.1f rays each)\n",
+            (unsigned long long) stats->packets, (double) stats->rays / packets,
+            (unsigned long long) stats->shadow_packets, (double) stats->shadow_rays / shadow_packets);
+    fprintf(file, "coherent packets:   %.1f%% (all rays hit the same object)\n",
+            100. * (double) stats->coherent / packets);
+    fprintf(file, "node visits:        %.1f per packet\n",
+            (double) stats->node_visits / (packets + (double) stats->shadow_packets));
+    fprintf(file, "lane utilization:   %.1f%% (rays overlapping the bounds of visited nodes)\n",
+            100. * (double) stats->lane_hits / lane_tests);
+    fprintf(file, "diverged rays:      %.1f%% (continued as single rays)\n",
+            100. * (double) stats->single_rays / rays);
+}
@@ -0,0 +1,39 @@
+#ifndef RAY_TRACER_PACKET_H
+#define RAY_TRACER_PACKET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+
+/** maximum width of a square packet of camera rays */
+#define PACKET_MAX_WIDTH 8
+#define PACKET_MAX_RAYS (PACKET_MAX_WIDTH * PACKET_MAX_WIDTH)
+
+/** counters describing how coherent the traced packets were */
+typedef struct {
+    uint64_t packets;        // number of camera ray packets
+    uint64_t rays;           // number of camera rays in those packets
+    uint64_t coherent;       // packets of which all rays hit the same object, or all miss
+    uint64_t shadow_packets; // number of shadow ray packets
+    uint64_t shadow_rays;    // number of shadow rays in those packets
+    uint64_t node_visits;    // hierarchy nodes visited by packets
+    uint64_t lane_tests;     // rays tested against the bounds of visited nodes
+    uint64_t lane_hits;      // rays that overlapped the bounds of visited nodes
+    uint64_t single_rays;    // rays continuing as single rays after a reflection or refraction
+} packet_stats_t;
+
+/**
+ * traces the {count} (at most PACKET_MAX_RAYS) camera rays {rays} together, including the shadow rays from their
+ * intersections, and stores their colors in {colors}. reflections and refractions are traced as single rays.
+ * the colors equal those of trace_ray. {context} is the state of the calling thread */
+void trace_packet(
+        trace_context_t *context, vec3f *colors, const ray_t *rays, uint32_t count, uint32_t depth,
+        float t_min, float t_max, packet_stats_t *stats);
+
+/** adds the counters of {b} to {a} */
+void packet_stats_add(packet_stats_t *a, const packet_stats_t *b);
+
+/** prints a summary of {stats} to {file} */
+void packet_stats_print(const packet_stats_t *stats, FILE *file);
+
+#endif //RAY_TRACER_PACKET_H
@@ -0,0 +1,211 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * tasks are only pushed at the start of a run as a contiguous block, so a deque is the range [top, bottom).
+ * the owner pops from the bottom (keeping neighbouring tiles on one thread), thieves take from the top */
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t top;    // next task to be stolen
+    uint32_t bottom; // one past the next task to be popped by the owner
+} deque_t;
+
+typedef struct {
+    struct pool *pool;
+    pthread_t thread;
+    uint32_t index;
+    uint32_t generation; // last run this worker has participated in
+    deque_t deque;
+} worker_t;
+
+struct pool {
+    worker_t *workers;
+    uint32_t worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when a run starts or the pool shuts down
+    pthread_cond_t done; // signalled when the last worker finishes a run
+    uint32_t generation; // incremented for every run
+    uint32_t active;     // number of workers still busy with the current run
+    bool shutdown;
+
+    /** current run */
+    task_fn_t fn;
+    void *arg;
+};
+
+static bool pop_own(worker_t *worker, uint32_t *task)
+{
+    deque_t *deque = &worker->deque;
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) {
+        *task = --deque->bottom;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+static bool steal(worker_t *worker, uint32_t *task)
+{
+    struct pool *pool = worker->pool;
+    // start at the neighbour, so thieves spread over the victims
+    for (uint32_t k = 1; k < pool->worker_count; k++) {
+        deque_t *deque = &pool->workers[(worker->index + k) % pool->worker_count].deque;
+        bool found = false;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->top < deque->bottom) {
+            *task = deque->top++;
+            found = true;
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found) {
+            return true;
+        }
+    }
+
+    // no new tasks are pushed during a run, so if all deques are empty the run is over for this worker
+    return false;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    struct pool *pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && worker->generation == pool->generation) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        worker->generation = pool->generation;
+        task_fn_t fn = pool->fn;
+        void *fn_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint32_t task;
+        while (pop_own(worker, &task) || steal(worker, &task)) {
+            fn(fn_arg, task, worker->index);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+pool_t *pool_create(uint32_t thread_count)
+{
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = calloc(thread_count, sizeof(worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (uint32_t i = 0; i < thread_count; i++) {
+        worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            // keep the workers that did start
+            pthread_mutex_destroy(&worker->deque.lock);
+            break;
+        }
+        pool->worker_count++;
+    }
+
+    if (pool->worker_count == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+uint32_t pool_size(const pool_t *pool)
+{
+    return pool->worker_count;
+}
+
+void pool_run(pool_t *pool, uint32_t task_count, task_fn_t fn, void *arg)
+{
+    if (task_count == 0) {
+        return;
+    }
+
+    // give each worker a contiguous block of tasks
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        deque_t *deque = &pool->workers[i].deque;
+        pthread_mutex_lock(&deque->lock);
+        deque->top = (uint32_t) (((uint64_t) task_count * i) / pool->worker_count);
+        deque->bottom = (uint32_t) (((uint64_t) task_count * (i + 1)) / pool->worker_count);
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->active = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+uint32_t pool_processor_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count < 1 ? 1 : (uint32_t) count;
+}
@@ -0,0 +1,29 @@
+#ifndef RAY_TRACER_POOL_H
+#define RAY_TRACER_POOL_H
+
+#include <stdint.h>
+
+/** function executing task {task} on worker thread {thread} */
+typedef void (*task_fn_t)(void *arg, uint32_t task, uint32_t thread);
+
+/** persistent pool of worker threads, each owning a deque of tasks */
+typedef struct pool pool_t;
+
+/** creates a pool of {thread_count} worker threads, returns NULL on failure */
+pool_t *pool_create(uint32_t thread_count);
+
+/** returns the number of worker threads in {pool} */
+uint32_t pool_size(const pool_t *pool);
+
+/**
+ * executes tasks [0, {task_count}) by calling {fn} and blocks until all of them are finished.
+ * tasks are split in contiguous blocks over the deques of the workers, idle workers steal from others */
+void pool_run(pool_t *pool, uint32_t task_count, task_fn_t fn, void *arg);
+
+/** stops and joins all worker threads */
+void pool_destroy(pool_t *pool);
+
+/** returns the number of online processors, at least 1 */
+uint32_t pool_processor_count(void);
+
+#endif //RAY_TRACER_POOL_H
@@ -0,0 +1,687 @@
+#include "render.h"
+
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "wavefront.h"
+
+const float T_MAX = FLT_MAX; // default far clipping plane
+const float T_MIN = 0.f;     // default near clipping plane
+const uint32_t DEPTH = 8;    // number of iterations for reflections/refractions
+const uint32_t RAYS_PER_PIXEL_X = 2;                // number of pixels in horizontal direction
+const uint32_t RAYS_PER_PIXEL_Y = RAYS_PER_PIXEL_X; // number of pixels in vertical direction
+const uint32_t RAYS_PER_PIXEL = RAYS_PER_PIXEL_X * RAYS_PER_PIXEL_Y; // the level of supersampling
+
+const uint32_t TILE_SIZE = 32;
+
+void camera_init(camera_t *camera)
+{
+    // https://en.wikipedia.org/wiki/Ray_tracing_(graphics)
+    camera->k = SIZE_X * RAYS_PER_PIXEL_X;
+    camera->m = SIZE_Y * RAYS_PER_PIXEL_Y;
+
+    vec3f t = vec3f_sub(TARGET, EYE); // look direction
+    vec3f b = vec3f_cross(UP, t);     // perpendicular to up and look
+    t = vec3f_norm(t);
+    b = vec3f_norm(b);
+    vec3f v = vec3f_cross(t, b);
+
+    float gx = tanf(FOV / 2.f);                          // (half) viewport size in horizontal dimension
+    float gy = (gx * camera->m) / (float) camera->k; // (half) viewport size in vertical dimension
+
+    camera->p11 = vec3f_add(vec3f_sub(t, vec3f_scale(b, gx)), vec3f_scale(v, gy));
+
+    camera->qx = vec3f_scale(b, (2.f * gx) / (camera->k - 1.f));
+    camera->qy = vec3f_scale(v, (2.f * gy) / (camera->m - 1.f));
+    camera->x0 = 0;
+    camera->y0 = 0;
+}
+
+void camera_crop(camera_t *camera, const region_t *crop)
+{
+    camera->x0 = crop->x0;
+    camera->y0 = crop->y0;
+    SIZE_X = crop->x1 - crop->x0;
+    SIZE_Y = crop->y1 - crop->y0;
+}
+
+ray_t camera_ray(const camera_t *camera, uint32_t x, uint32_t y)
+{
+    return camera_ray_at(
+            camera, (float) (x + camera->x0 * RAYS_PER_PIXEL_X), (float) (y + camera->y0 * RAYS_PER_PIXEL_Y));
+}
+
+ray_t camera_ray_at(const camera_t *camera, float x, float y)
+{
+    vec3f rij = vec3f_norm(vec3f_sub(vec3f_add(camera->p11, vec3f_scale(camera->qx, x)), vec3f_scale(camera->qy, y)));
+    ray_t ray = {.start=EYE, .direction=rij};
+
+    return ray;
+}
+
+/** returns the camera ray through position ({u}, {v}) of pixel ({i}, {j}), see sample_position and sampler_position */
+static ray_t pixel_ray(const camera_t *camera, uint32_t i, uint32_t j, float u, float v)
+{
+    // pixel (i, j) spans [i * RAYS_PER_PIXEL_X - .5, (i + 1) * RAYS_PER_PIXEL_X - .5) of the grid of rays horizontally
+    return camera_ray_at(
+            camera,
+            (float) ((i + camera->x0) * RAYS_PER_PIXEL_X) - .5f + u * (float) RAYS_PER_PIXEL_X,
+            (float) ((j + camera->y0) * RAYS_PER_PIXEL_Y) - .5f + v * (float) RAYS_PER_PIXEL_Y);
+}
+
+vec3f render_pixel(trace_context_t *context, const camera_t *camera, const sampler_t *sampler, uint32_t i, uint32_t j)
+{
+    // color for this pixel
+    vec3f color = {0.f, 0.f, 0.f};
+
+    if (sampler->type != SAMPLER_GRID) {
+        for (uint32_t n = 0; n < sampler->count; n++) {
+            float u, v;
+            sampler_position(sampler, i + camera->x0, j + camera->y0, n, &u, &v);
+            vec3f computed_color = trace_ray(context, pixel_ray(camera, i, j, u, v), DEPTH, T_MIN, T_MAX);
+            color = vec3f_add(color, vec3f_scale(computed_color, 1.f / (float) sampler->count));
+        }
+
+        return color;
+    }
+
+    for (uint32_t jj = 0; jj < RAYS_PER_PIXEL_Y; jj++) {
+        for (uint32_t ii = 0; ii < RAYS_PER_PIXEL_X; ii++) {
+            ray_t ray = camera_ray(camera, i * RAYS_PER_PIXEL_X + ii, j * RAYS_PER_PIXEL_Y + jj);
+
+            vec3f computed_color = trace_ray(context, ray, DEPTH, T_MIN, T_MAX);
+            color = vec3f_add(color, vec3f_scale(computed_color, 1.f / (float) RAYS_PER_PIXEL));
+        }
+    }
+
+    return color;
+}
+
+typedef struct {
+    const camera_t *camera;
+    const render_options_t *options;
+    vec3f *image;
+    region_t region;               // pixels to render, tiles start at its top left corner
+    uint32_t tiles_x;              // number of tiles in horizontal direction
+    arena_t *arena;                // the memory of the job, reset when it is finished
+    arena_t own_arena;             // if the options have no arena
+    arena_t *thread_arenas;        // per thread: the part of arena its trace context is allocated from
+    trace_context_t *contexts;     // per thread
+    trace_scratch_t *scratches;    // per thread, if the options have a cache: where the rays of a tile are recorded
+    vec3f *ray_colors;             // per thread: colors of the camera rays of a tile, when tracing packets or waves
+    ray_t *tile_rays;              // per thread: camera rays of a tile, when tracing waves
+    wavefront_t *wavefronts;       // per thread, when tracing waves
+    packet_stats_t *packet_stats;  // per thread
+    vec3f *corners;                // adaptive supersampling: colors of the rays through the corners of the pixels
+    adaptive_stats_t *adaptive_stats; // per thread
+    accumulator_t *accumulator;    // progressive rendering: the samples to add to
+    uint32_t *tiles_finished;      // per row of tiles, if the rows are reported: number of finished tiles
+} render_job_t;
+
+static void apply_pixel(vec3f *image, uint32_t i, uint32_t j, vec3f color)
+{
+    image[j * SIZE_X + i] = color;
+}
+
+/**
+ * writes pixels [x0, x1) x [y0, y1) of the image of {job} from the colors {ray_colors} of their camera rays, in rows of
+ * the tile. accumulates in the same order as render_pixel */
+static void resolve_tile(
+        const render_job_t *job, const vec3f *ray_colors, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+{
+    uint32_t rays_x = (x1 - x0) * RAYS_PER_PIXEL_X;
+    for (uint32_t j = y0; j < y1; j++) {
+        for (uint32_t i = x0; i < x1; i++) {
+            vec3f color = {0.f, 0.f, 0.f};
+            for (uint32_t jj = 0; jj < RAYS_PER_PIXEL_Y; jj++) {
+                for (uint32_t ii = 0; ii < RAYS_PER_PIXEL_X; ii++) {
+                    uint32_t x = (i - x0) * RAYS_PER_PIXEL_X + ii;
+                    uint32_t y = (j - y0) * RAYS_PER_PIXEL_Y + jj;
+                    color = vec3f_add(color, vec3f_scale(ray_colors[y * rays_x + x], 1.f / (float) RAYS_PER_PIXEL));
+                }
+            }
+
+            apply_pixel(job->image, i, j, color);
+        }
+    }
+}
+
+/** traces the camera rays of pixels [x0, x1) x [y0, y1) in square packets, then resolves the pixels */
+static void render_tile_packets(
+        const render_job_t *job, uint32_t thread, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+{
+    const uint32_t width = job->options->packet_width;
+    vec3f *ray_colors = &job->ray_colors[thread * TILE_SIZE * TILE_SIZE * RAYS_PER_PIXEL];
+
+    /** grid of camera rays of this tile */
+    uint32_t rx0 = x0 * RAYS_PER_PIXEL_X;
+    uint32_t ry0 = y0 * RAYS_PER_PIXEL_Y;
+    uint32_t rays_x = (x1 - x0) * RAYS_PER_PIXEL_X;
+    uint32_t rays_y = (y1 - y0) * RAYS_PER_PIXEL_Y;
+
+    for (uint32_t py = 0; py < rays_y; py += width) {
+        for (uint32_t px = 0; px < rays_x; px += width) {
+            ray_t rays[PACKET_MAX_RAYS];
+            vec3f colors[PACKET_MAX_RAYS];
+            uint32_t count = 0;
+            for (uint32_t y = py; y < py + width && y < rays_y; y++) {
+                for (uint32_t x = px; x < px + width && x < rays_x; x++) {
+                    rays[count++] = camera_ray(job->camera, rx0 + x, ry0 + y);
+                }
+            }
+
+            trace_packet(&job->contexts[thread], colors, rays, count, DEPTH, T_MIN, T_MAX, &job->packet_stats[thread]);
+
+            count = 0;
+            for (uint32_t y = py; y < py + width && y < rays_y; y++) {
+                for (uint32_t x = px; x < px + width && x < rays_x; x++) {
+                    ray_colors[y * rays_x + x] = colors[count++];
+                }
+            }
+        }
+    }
+
+    resolve_tile(job, ray_colors, x0, y0, x1, y1);
+}
+
+/** traces the camera rays of pixels [x0, x1) x [y0, y1) in waves, then resolves the pixels */
+static void render_tile_wavefront(
+        const render_job_t *job, uint32_t thread, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+{
+    vec3f *ray_colors = &job->ray_colors[thread * TILE_SIZE * TILE_SIZE * RAYS_PER_PIXEL];
+    ray_t *rays = &job->tile_rays[thread * TILE_SIZE * TILE_SIZE * RAYS_PER_PIXEL];
+
+    /** grid of camera rays of this tile, in the order of ray_colors */
+    uint32_t rx0 = x0 * RAYS_PER_PIXEL_X;
+    uint32_t ry0 = y0 * RAYS_PER_PIXEL_Y;
+    uint32_t rays_x = (x1 - x0) * RAYS_PER_PIXEL_X;
+    uint32_t rays_y = (y1 - y0) * RAYS_PER_PIXEL_Y;
+    for (uint32_t y = 0; y < rays_y; y++) {
+        for (uint32_t x = 0; x < rays_x; x++) {
+            rays[y * rays_x + x] = camera_ray(job->camera, rx0 + x, ry0 + y);
+        }
+    }
+
+    trace_wavefront(
+            &job->contexts[thread], &job->wavefronts[thread], ray_colors, rays, rays_x * rays_y, DEPTH, T_MIN, T_MAX);
+
+    resolve_tile(job, ray_colors, x0, y0, x1, y1);
+}
+
+/** computes the pixel bounds [{x0}, {x1}) x [{y0}, {y1}) of tile {task} */
+static void tile_bounds(const render_job_t *job, uint32_t task, uint32_t *x0, uint32_t *y0, uint32_t *x1, uint32_t *y1)
+{
+    const region_t *region = &job->region;
+    *x0 = region->x0 + (task % job->tiles_x) * TILE_SIZE;
+    *y0 = region->y0 + (task / job->tiles_x) * TILE_SIZE;
+    *x1 = *x0 + TILE_SIZE < region->x1 ? *x0 + TILE_SIZE : region->x1;
+    *y1 = *y0 + TILE_SIZE < region->y1 ? *y0 + TILE_SIZE : region->y1;
+}
+
+/** counts tile {task} spanning rows [{y0}, {y1}) as finished, reports the rows if it was the last tile of the row */
+static void finish_tile(const render_job_t *job, uint32_t task, uint32_t y0, uint32_t y1)
+{
+    if (!job->tiles_finished) {
+        return;
+    }
+
+    // the release makes the pixels of all tiles in the row visible to the worker that finishes it last
+    if (__atomic_add_fetch(&job->tiles_finished[task / job->tiles_x], 1, __ATOMIC_ACQ_REL) == job->tiles_x) {
+        job->options->rows_done(job->options->rows_done_arg, y0, y1);
+    }
+}
+
+static void render_tile(void *arg, uint32_t task, uint32_t thread)
+{
+    const render_job_t *job = arg;
+    STATS_BIND(&job->contexts[thread].stats);
+
+    uint32_t x0, y0, x1, y1;
+    tile_bounds(job, task, &x0, &y0, &x1, &y1);
+
+    render_cache_t *cache = job->options->cache;
+    trace_context_t *context = &job->contexts[thread];
+    if (job->options->finished && job->options->finished[task]) {
+        finish_tile(job, task, y0, y1);
+        return;
+    }
+    if (cache) {
+        // the region of a job with a cache is the whole image, so its tasks are the tiles of the cache
+        if (!cache->dirty[task]) {
+            finish_tile(job, task, y0, y1);
+            return;
+        }
+        trace_record_clear(&cache->tiles[task], &job->scratches[thread]);
+        context->record = &cache->tiles[task];
+    }
+
+    if (job->options->wavefront) {
+        render_tile_wavefront(job, thread, x0, y0, x1, y1);
+    } else if (job->options->packet_width > 0) {
+        render_tile_packets(job, thread, x0, y0, x1, y1);
+    } else {
+        for (uint32_t j = y0; j < y1; j++) {
+            for (uint32_t i = x0; i < x1; i++) {
+                apply_pixel(job->image, i, j, render_pixel(context, job->camera, &job->options->sampler, i, j));
+            }
+        }
+    }
+    if (cache) {
+        trace_record_finish(&cache->tiles[task]);
+        context->record = NULL;
+        cache->dirty[task] = false;
+    }
+    if (job->options->tile_done) {
+        region_t tile = {x0, y0, x1, y1};
+        job->options->tile_done(job->options->tile_done_arg, task, &tile);
+    }
+    if (job->options->finished) {
+        job->options->finished[task] = true;
+    }
+    finish_tile(job, task, y0, y1);
+}
+
+/** returns the index in the corners of {job} of the top left corner of pixel ({i}, {j}) */
+static uint32_t corner_index(const render_job_t *job, uint32_t i, uint32_t j)
+{
+    return (j - job->region.y0) * (job->region.x1 - job->region.x0 + 1) + i - job->region.x0;
+}
+
+/**
+ * first pass of adaptive supersampling: traces the rays through the corners of the pixels of tile {task}.
+ * corners are shared between neighboring pixels, tiles at the right and bottom of the region also trace the outer
+ * corners */
+static void render_tile_corners(void *arg, uint32_t task, uint32_t thread)
+{
+    const render_job_t *job = arg;
+    STATS_BIND(&job->contexts[thread].stats);
+
+    uint32_t x0, y0, x1, y1;
+    tile_bounds(job, task, &x0, &y0, &x1, &y1);
+    if (x1 == job->region.x1) {
+        x1++;
+    }
+    if (y1 == job->region.y1) {
+        y1++;
+    }
+
+    // pixel (i, j) spans [i * RAYS_PER_PIXEL_X - .5, (i + 1) * RAYS_PER_PIXEL_X - .5) of the grid of rays horizontally
+    for (uint32_t j = y0; j < y1; j++) {
+        for (uint32_t i = x0; i < x1; i++) {
+            ray_t ray = camera_ray_at(
+                    job->camera, (float) ((i + job->camera->x0) * RAYS_PER_PIXEL_X) - .5f,
+                    (float) ((j + job->camera->y0) * RAYS_PER_PIXEL_Y) - .5f);
+            job->corners[corner_index(job, i, j)] = trace_ray(&job->contexts[thread], ray, DEPTH, T_MIN, T_MAX);
+        }
+    }
+    job->adaptive_stats[thread].samples += (x1 - x0) * (y1 - y0);
+}
+
+/** returns whether the corners of pixel ({i}, {j}) differ more than the threshold, otherwise {color} is their mean */
+static bool needs_refinement(const render_job_t *job, uint32_t i, uint32_t j, vec3f *color)
+{
+    const vec3f *corners = &job->corners[corner_index(job, i, j)];
+    uint32_t stride = job->region.x1 - job->region.x0 + 1;
+    vec3f samples[4] = {corners[0], corners[1], corners[stride], corners[stride + 1]};
+
+    vec3f min = samples[0];
+    vec3f max = samples[0];
+    *color = vec3f_scale(samples[0], .25f);
+    for (uint32_t k = 1; k < 4; k++) {
+        min.x = fminf(min.x, samples[k].x);
+        min.y = fminf(min.y, samples[k].y);
+        min.z = fminf(min.z, samples[k].z);
+        max.x = fmaxf(max.x, samples[k].x);
+        max.y = fmaxf(max.y, samples[k].y);
+        max.z = fmaxf(max.z, samples[k].z);
+        *color = vec3f_add(*color, vec3f_scale(samples[k], .25f));
+    }
+
+    float threshold = job->options->adaptive_threshold;
+    return max.x - min.x > threshold || max.y - min.y > threshold || max.z - min.z > threshold;
+}
+
+/**
+ * second pass of adaptive supersampling: resolves the pixels of tile {task}, the pixels of which the corners differ
+ * are refined with a grid of rays. with a grid as wide as RAYS_PER_PIXEL_X, those equal render_pixel */
+static void render_tile_adaptive(void *arg, uint32_t task, uint32_t thread)
+{
+    const render_job_t *job = arg;
+    STATS_BIND(&job->contexts[thread].stats);
+    const uint32_t rate = job->options->adaptive_rate;
+    adaptive_stats_t *stats = &job->adaptive_stats[thread];
+
+    uint32_t x0, y0, x1, y1;
+    tile_bounds(job, task, &x0, &y0, &x1, &y1);
+
+    // distance between the rays of the refinement grid, in units of the grid of rays
+    float step_x = RAYS_PER_PIXEL_X / (float) rate;
+    float step_y = RAYS_PER_PIXEL_Y / (float) rate;
+    for (uint32_t j = y0; j < y1; j++) {
+        for (uint32_t i = x0; i < x1; i++) {
+            stats->pixels++;
+            vec3f color;
+            if (!needs_refinement(job, i, j, &color)) {
+                apply_pixel(job->image, i, j, color);
+                continue;
+            }
+
+            color = (vec3f) {0.f, 0.f, 0.f};
+            for (uint32_t jj = 0; jj < rate; jj++) {
+                for (uint32_t ii = 0; ii < rate; ii++) {
+                    ray_t ray = camera_ray_at(
+                            job->camera,
+                            (float) ((i + job->camera->x0) * RAYS_PER_PIXEL_X) - .5f + (ii + .5f) * step_x,
+                            (float) ((j + job->camera->y0) * RAYS_PER_PIXEL_Y) - .5f + (jj + .5f) * step_y);
+
+                    vec3f computed_color = trace_ray(&job->contexts[thread], ray, DEPTH, T_MIN, T_MAX);
+                    color = vec3f_add(color, vec3f_scale(computed_color, 1.f / (float) (rate * rate)));
+                }
+            }
+            apply_pixel(job->image, i, j, color);
+            stats->refined++;
+            stats->samples += rate * rate;
+        }
+    }
+    finish_tile(job, task, y0, y1);
+}
+
+/** returns the radical inverse of {n} in {base}, which mirrors its digits around the radix point */
+static float radical_inverse(uint32_t n, uint32_t base)
+{
+    float digit = 1.f / (float) base;
+    float result = 0.f;
+    for (float scale = digit; n > 0; n /= base, scale *= digit) {
+        result += (float) (n % base) * scale;
+    }
+
+    return result;
+}
+
+/**
+ * computes the position ({u}, {v}) in [0, 1)^2 within the pixel of sample {n}. these are the points of the halton
+ * sequence in bases 2 and 3, which fill the pixel evenly at any count, shifted to place the first at the center */
+static void sample_position(uint32_t n, float *u, float *v)
+{
+    *u = radical_inverse(n, 2) + .5f;
+    *v = radical_inverse(n, 3) + .5f;
+    *u -= *u >= 1.f ? 1.f : 0.f;
+    *v -= *v >= 1.f ? 1.f : 0.f;
+}
+
+/** adds a sample to each pixel of tile {task}, in square packets of one ray per pixel or one ray at a time */
+static void render_tile_pass(void *arg, uint32_t task, uint32_t thread)
+{
+    const render_job_t *job = arg;
+    STATS_BIND(&job->contexts[thread].stats);
+    vec3f *sums = job->accumulator->sums;
+
+    uint32_t x0, y0, x1, y1;
+    tile_bounds(job, task, &x0, &y0, &x1, &y1);
+
+    // the grid takes the same position in every pixel
+    const sampler_t *sampler = &job->options->sampler;
+    const uint32_t n = job->accumulator->samples;
+    float u, v;
+    sample_position(n, &u, &v);
+
+    const uint32_t width = job->options->packet_width;
+    if (width == 0) {
+        for (uint32_t j = y0; j < y1; j++) {
+            for (uint32_t i = x0; i < x1; i++) {
+                if (sampler->type != SAMPLER_GRID) {
+                    sampler_position(sampler, i + job->camera->x0, j + job->camera->y0, n, &u, &v);
+                }
+                ray_t ray = pixel_ray(job->camera, i, j, u, v);
+                vec3f color = trace_ray(&job->contexts[thread], ray, DEPTH, T_MIN, T_MAX);
+                sums[j * SIZE_X + i] = vec3f_add(sums[j * SIZE_X + i], color);
+            }
+        }
+        return;
+    }
+
+    for (uint32_t py = y0; py < y1; py += width) {
+        for (uint32_t px = x0; px < x1; px += width) {
+            ray_t rays[PACKET_MAX_RAYS];
+            vec3f colors[PACKET_MAX_RAYS];
+            uint32_t count = 0;
+            for (uint32_t j = py; j < py + width && j < y1; j++) {
+                for (uint32_t i = px; i < px + width && i < x1; i++) {
+                    if (sampler->type != SAMPLER_GRID) {
+                        sampler_position(sampler, i + job->camera->x0, j + job->camera->y0, n, &u, &v);
+                    }
+                    rays[count++] = pixel_ray(job->camera, i, j, u, v);
+                }
+            }
+
+            trace_packet(&job->contexts[thread], colors, rays, count, DEPTH, T_MIN, T_MAX, &job->packet_stats[thread]);
+
+            count = 0;
+            for (uint32_t j = py; j < py + width && j < y1; j++) {
+                for (uint32_t i = px; i < px + width && i < x1; i++) {
+                    sums[j * SIZE_X + i] = vec3f_add(sums[j * SIZE_X + i], colors[count++]);
+                }
+            }
+        }
+    }
+}
+
+/** returns the bytes of the state of a thread of a render with {options} */
+static size_t thread_memory(const render_options_t *options)
+{
+    size_t size = trace_context_memory(DEPTH);
+    if (options->cache) {
+        size += trace_scratch_memory();
+    }
+
+    return size;
+}
+
+size_t render_memory(uint32_t thread_count, const render_options_t *options, const region_t *region)
+{
+    // as allocated by job_init
+    uint32_t tile_rays = TILE_SIZE * TILE_SIZE * RAYS_PER_PIXEL;
+    size_t size = arena_size(thread_count * sizeof(trace_context_t)) +
+                  arena_size(thread_count * sizeof(packet_stats_t)) +
+                  arena_size(thread_count * sizeof(adaptive_stats_t)) + arena_size(thread_count * sizeof(arena_t)) +
+                  thread_count * arena_size(thread_memory(options));
+    if (options->cache) {
+        size += arena_size(thread_count * sizeof(trace_scratch_t));
+    }
+    if (options->packet_width > 0 || options->wavefront) {
+        size += arena_size(thread_count * tile_rays * sizeof(vec3f));
+    }
+    if (options->wavefront) {
+        size += arena_size(thread_count * tile_rays * sizeof(ray_t)) + arena_size(thread_count * sizeof(wavefront_t));
+    }
+    // whether rows are reported is often only set once the output is started
+    size += arena_size(((region->y1 - region->y0 + TILE_SIZE - 1) / TILE_SIZE) * sizeof(uint32_t));
+    if (options->adaptive_threshold > 0.f) {
+        size += arena_size((region->x1 - region->x0 + 1) * (region->y1 - region->y0 + 1) * sizeof(vec3f));
+    }
+
+    return size;
+}
+
+/**
+ * sets up {job} rendering {region} with the workers of {pool}: allocates the per thread state and the buffers of the
+ * tiles from the arena of the options, or from an arena of its own. nothing is allocated while the tiles are rendered,
+ * except the buffers of waves, which grow with the rays they spawn */
+static void job_init(
+        render_job_t *job, pool_t *pool, const camera_t *camera, const render_options_t *options,
+        const region_t *region, vec3f *image)
+{
+    uint32_t thread_count = pool_size(pool);
+
+    memset(job, 0, sizeof(render_job_t));
+    job->camera = camera;
+    job->options = options;
+    job->image = image;
+    job->region = *region;
+    job->tiles_x = (region->x1 - region->x0 + TILE_SIZE - 1) / TILE_SIZE;
+    job->arena = options->arena;
+    if (!job->arena) {
+        arena_init(&job->own_arena, NULL, render_memory(thread_count, options, region));
+        job->arena = &job->own_arena;
+    }
+    arena_t *arena = job->arena;
+
+    job->contexts = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(trace_context_t));
+    job->packet_stats = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(packet_stats_t));
+    memset(job->packet_stats, 0, thread_count * sizeof(packet_stats_t));
+    job->adaptive_stats = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(adaptive_stats_t));
+    memset(job->adaptive_stats, 0, thread_count * sizeof(adaptive_stats_t));
+    job->thread_arenas = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(arena_t));
+    for (uint32_t i = 0; i < thread_count; i++) {
+        arena_split(arena, &job->thread_arenas[i], thread_memory(options));
+        trace_context_init(&job->contexts[i], &job->thread_arenas[i], DEPTH);
+        job->contexts[i].min_weight = options->min_weight;
+        job->contexts[i].light_threshold = options->light_threshold;
+        job->contexts[i].light_samples = options->light_samples;
+    }
+    if (options->cache) {
+        job->scratches = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(trace_scratch_t));
+        for (uint32_t i = 0; i < thread_count; i++) {
+            trace_scratch_init(&job->scratches[i], &job->thread_arenas[i]);
+        }
+    }
+
+    uint32_t tile_rays = TILE_SIZE * TILE_SIZE * RAYS_PER_PIXEL;
+    if (options->packet_width > 0 || options->wavefront) {
+        job->ray_colors = arena_alloc(arena, MEMORY_THREADS, thread_count * tile_rays * sizeof(vec3f));
+    }
+    if (options->wavefront) {
+        job->tile_rays = arena_alloc(arena, MEMORY_THREADS, thread_count * tile_rays * sizeof(ray_t));
+        job->wavefronts = arena_alloc(arena, MEMORY_THREADS, thread_count * sizeof(wavefront_t));
+        for (uint32_t i = 0; i < thread_count; i++) {
+            wavefront_init(&job->wavefronts[i]);
+        }
+    }
+    if (options->rows_done) {
+        uint32_t tiles_y = (region->y1 - region->y0 + TILE_SIZE - 1) / TILE_SIZE;
+        job->tiles_finished = arena_alloc(arena, MEMORY_TILES, tiles_y * sizeof(uint32_t));
+        memset(job->tiles_finished, 0, tiles_y * sizeof(uint32_t));
+    }
+    if (options->adaptive_threshold > 0.f) {
+        job->corners = arena_alloc(
+                arena, MEMORY_TILES, (region->x1 - region->x0 + 1) * (region->y1 - region->y0 + 1) * sizeof(vec3f));
+    }
+}
+
+/** adds the statistics of the threads of {job} to {stats} if it is not NULL, then frees the state of {job} */
+static void job_finish(render_job_t *job, pool_t *pool, render_stats_t *stats)
+{
+    uint32_t thread_count = pool_size(pool);
+
+    if (stats) {
+        for (uint32_t i = 0; i < thread_count; i++) {
+            render_stats_t thread_stats = {
+                    .packets=job->packet_stats[i], .adaptive=job->adaptive_stats[i], .counters=job->contexts[i].stats
+            };
+            render_stats_add(stats, &thread_stats);
+        }
+    }
+    if (job->wavefronts) {
+        for (uint32_t i = 0; i < thread_count; i++) {
+            wavefront_free(&job->wavefronts[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < thread_count; i++) {
+        arena_reset(&job->thread_arenas[i]);
+    }
+    if (job->arena == &job->own_arena) {
+        arena_free(&job->own_arena);
+    } else {
+        arena_reset(job->arena);
+    }
+}
+
+void render_image(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, vec3f *image, render_stats_t *stats)
+{
+    region_t region = {0, 0, SIZE_X, SIZE_Y};
+    render_region(pool, camera, options, &region, image, stats);
+}
+
+void render_region(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, const region_t *region, vec3f *image,
+        render_stats_t *stats)
+{
+    render_job_t job;
+    job_init(&job, pool, camera, options, region, image);
+    uint32_t tiles_y = (region->y1 - region->y0 + TILE_SIZE - 1) / TILE_SIZE;
+    if (options->adaptive_threshold > 0.f) {
+        pool_run(pool, job.tiles_x * tiles_y, render_tile_corners, &job);
+        pool_run(pool, job.tiles_x * tiles_y, render_tile_adaptive, &job);
+    } else {
+        pool_run(pool, job.tiles_x * tiles_y, render_tile, &job);
+    }
+
+    if (stats) {
+        memset(stats, 0, sizeof(render_stats_t));
+    }
+    job_finish(&job, pool, stats);
+}
+
+void accumulator_init(accumulator_t *accumulator)
+{
+    accumulator->sums = calloc(SIZE_X * SIZE_Y, sizeof(vec3f));
+    accumulator->samples = 0;
+}
+
+void accumulator_free(accumulator_t *accumulator)
+{
+    free(accumulator->sums);
+    accumulator->sums = NULL;
+    accumulator->samples = 0;
+}
+
+void accumulator_resolve(const accumulator_t *accumulator, vec3f *image)
+{
+    float scale = accumulator->samples > 0 ? 1.f / (float) accumulator->samples : 0.f;
+    for (uint32_t j = 0; j < SIZE_Y; j++) {
+        for (uint32_t i = 0; i < SIZE_X; i++) {
+            apply_pixel(image, i, j, vec3f_scale(accumulator->sums[j * SIZE_X + i], scale));
+        }
+    }
+}
+
+void render_pass(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, accumulator_t *accumulator,
+        render_stats_t *stats)
+{
+    uint32_t tiles_x = (SIZE_X + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (SIZE_Y + TILE_SIZE - 1) / TILE_SIZE;
+
+    region_t region = {0, 0, SIZE_X, SIZE_Y};
+    render_job_t job;
+    job_init(&job, pool, camera, options, &region, NULL);
+    job.accumulator = accumulator;
+    pool_run(pool, tiles_x * tiles_y, render_tile_pass, &job);
+    accumulator->samples++;
+
+    job_finish(&job, pool, stats);
+}
+
+void render_stats_add(render_stats_t *a, const render_stats_t *b)
+{
+    packet_stats_add(&a->packets, &b->packets);
+    a->adaptive.pixels += b->adaptive.pixels;
+    a->adaptive.refined += b->adaptive.refined;
+    a->adaptive.samples += b->adaptive.samples;
+    stats_add(&a->counters, &b->counters);
+}
+
+void adaptive_stats_print(const adaptive_stats_t *stats, FILE *file)
+{
+    uint64_t fixed = stats->pixels * RAYS_PER_PIXEL;
+    fprintf(file, "refined pixels:     %.1f%% (%llu of %llu)\n",
+            stats->pixels ? 100. * stats->refined / stats->pixels : 0.,
+            (unsigned long long) stats->refined, (unsigned long long) stats->pixels);
+    fprintf(file, "camera rays:        %llu, %.2f per pixel (fixed supersampling: %llu, %.2fx)\n",
+            (unsigned long long) stats->samples, stats->pixels ? (double) stats->samples / stats->pixels : 0.,
+            (unsigned long long) fixed, stats->samples ? (double) fixed / stats->samples : 0.);
+}
@@ -0,0 +1,156 @@
+#ifndef RAY_TRACER_RENDER_H
+#define RAY_TRACER_RENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "vec3.h"
+#include "arena.h"
+#include "pool.h"
+#include "packet.h"
+#include "render_cache.h"
+#include "sampler.h"
+
+// only use to write to file, see image_tonemap
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} color_t;
+
+/** pre-calculation for camera rays */
+typedef struct {
+    uint32_t k;  // number of rays in horizontal direction
+    uint32_t m;  // number of rays in vertical direction
+    vec3f p11;   // top left ray
+    vec3f qx;    // offset between rays in horizontal direction
+    vec3f qy;    // offset between rays in vertical direction
+    uint32_t x0; // pixel of the frame that is the top left pixel of the image, when rendering a crop
+    uint32_t y0;
+} camera_t;
+
+/** rectangle of pixels [x0, x1) x [y0, y1) of an image */
+typedef struct {
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1;
+    uint32_t y1;
+} region_t;
+
+/** function called with rows [{y0}, {y1}) of an image once they are final */
+typedef void (*rows_fn_t)(void *arg, uint32_t y0, uint32_t y1);
+
+/** function called with tile {task} of render_image, covering {tile} of the image, once its pixels are final */
+typedef void (*tile_fn_t)(void *arg, uint32_t task, const region_t *tile);
+
+typedef struct {
+    uint32_t packet_width; // 0: trace camera rays one by one, otherwise: width of square packets of camera rays
+    bool wavefront;        // trace the camera rays of a tile in sorted waves, see trace_wavefront. not with packets
+    float min_weight;      // reflections and refractions contributing less to a camera ray are not traced
+    float light_threshold; // lights reaching a hit with no more intensity are skipped
+    uint32_t light_samples; // 0: shade all lights that reach a hit, otherwise: lights with a radius drawn per hit
+    float adaptive_threshold; // 0: fixed supersampling, otherwise: difference between neighboring pixels to refine at
+    uint32_t adaptive_rate;   // when refining a pixel, width of the square grid of rays traced through it
+    sampler_t sampler;        // positions of the camera rays in a pixel, other than the grid: single rays/progressive
+    render_cache_t *cache;    // if not NULL: only its dirty tiles are rendered, see render_cache_update. single rays
+    rows_fn_t rows_done;      // if not NULL: called by render_image from the worker that finished the rows
+    void *rows_done_arg;
+    bool *finished;           // if not NULL: per tile, tiles set are skipped and the others are set once rendered
+    tile_fn_t tile_done;      // if not NULL: called by render_image from the worker that rendered the tile
+    void *tile_done_arg;
+    arena_t *arena;           // if not NULL: a render allocates from it and resets it, see render_memory
+} render_options_t;
+
+/** number of samples spent by adaptive supersampling */
+typedef struct {
+    uint64_t pixels;  // number of pixels
+    uint64_t refined; // pixels that were refined
+    uint64_t samples; // camera rays traced
+} adaptive_stats_t;
+
+/** colors of progressive rendering, to which each pass adds one sample per pixel */
+typedef struct {
+    vec3f *sums;      // per pixel: sum of the colors of its samples
+    uint32_t samples; // number of samples per pixel so far
+} accumulator_t;
+
+/** statistics of rendering an image, merged over all threads */
+typedef struct {
+    packet_stats_t packets;    // if packets are traced
+    adaptive_stats_t adaptive; // if supersampling is adaptive
+    stats_t counters;          // if built with statistics
+} render_stats_t;
+
+/** width and height of a tile in pixels */
+extern const uint32_t TILE_SIZE;
+
+/** number of rays of the grid per pixel, also the default number of samples of the other samplers */
+extern const uint32_t RAYS_PER_PIXEL;
+
+/** sets up {camera} from EYE, TARGET, UP and FOV of the scene */
+void camera_init(camera_t *camera);
+
+/**
+ * makes {camera}, set up for the whole frame, render the pixels of {crop} of the frame only: SIZE_X and SIZE_Y are set
+ * to the size of the crop, and pixel (i, j) of the image is pixel (x0 + i, y0 + j) of the frame. the colors of the
+ * pixels are those of the whole frame */
+void camera_crop(camera_t *camera, const region_t *crop);
+
+/** returns the camera ray through ({x}, {y}) of the grid of rays of the image */
+ray_t camera_ray(const camera_t *camera, uint32_t x, uint32_t y);
+
+/** returns the camera ray through ({x}, {y}) of the grid of rays of the frame, which may lie between its rays */
+ray_t camera_ray_at(const camera_t *camera, float x, float y);
+
+/**
+ * returns the supersampled color of pixel ({i}, {j}), the mean of the rays of the grid or the samples of {sampler},
+ * traced with the state {context} of the calling thread */
+vec3f render_pixel(trace_context_t *context, const camera_t *camera, const sampler_t *sampler, uint32_t i, uint32_t j);
+
+/**
+ * returns the bytes of the arena a render of {region} of the image with {options} on {thread_count} threads allocates
+ * from, for render_image, render_region and render_pass. without an arena in the options, each render allocates an
+ * arena of its own of this size */
+size_t render_memory(uint32_t thread_count, const render_options_t *options, const region_t *region);
+
+/**
+ * renders the scene into {image} of SIZE_X * SIZE_Y linear colors, which are not clamped. tiles are distributed over
+ * the workers of {pool}. if {stats} is not NULL, it receives the statistics of the render. if the options have a cache
+ * or finished tiles, the pixels of the tiles that are skipped are left as they are, so {image} should hold them. tile
+ * {task} starts at pixel ((task % tiles_x) * TILE_SIZE, (task / tiles_x) * TILE_SIZE), with tiles_x the number of
+ * tiles in a row of the image. the finished tiles and tile_done are not used with adaptive supersampling */
+void render_image(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, vec3f *image, render_stats_t *stats);
+
+/**
+ * renders the pixels of {region} of the scene into {image} of SIZE_X * SIZE_Y linear colors, as render_image does. the
+ * other pixels are not changed, the colors of the rendered pixels do not depend on the region */
+void render_region(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, const region_t *region, vec3f *image,
+        render_stats_t *stats);
+
+/** makes {accumulator} an empty accumulator of SIZE_X * SIZE_Y pixels */
+void accumulator_init(accumulator_t *accumulator);
+
+/** frees the memory of {accumulator} */
+void accumulator_free(accumulator_t *accumulator);
+
+/** writes the mean colors of the samples in {accumulator} to {image} of SIZE_X * SIZE_Y linear colors */
+void accumulator_resolve(const accumulator_t *accumulator, vec3f *image);
+
+/**
+ * progressive rendering: adds one sample per pixel to {accumulator}, tiles are distributed over the workers of {pool}.
+ * with the grid sampler, the samples of consecutive passes are stratified over the pixel, the first lies at its center,
+ * other samplers give each pixel its own positions. the adaptive options are not used. if {stats} is not NULL, the
+ * statistics of the pass are added to it */
+void render_pass(
+        pool_t *pool, const camera_t *camera, const render_options_t *options, accumulator_t *accumulator,
+        render_stats_t *stats);
+
+/** adds the statistics of {b} to {a} */
+void render_stats_add(render_stats_t *a, const render_stats_t *b);
+
+/** prints a summary of {stats} to {file} */
+void adaptive_stats_print(const adaptive_stats_t *stats, FILE *file);
+
+#endif //RAY_TRACER_RENDER_H
@@ -0,0 +1,601 @@
+#include "render_cache.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "render.h"
+#include "scene.h"
+
+/**
+ * keys of bundles, of the rays that are traced and of shadow rays, above the octant of their direction, the depth or
+ * light, and the object */
+#define KEY_TRACED (1ull << 62)
+#define KEY_SHADOW (2ull << 62)
+#define KEY_OCTANT 59
+
+/** number of bundles looked at for a key before its rays are added to a bundle of another key */
+#define MAX_PROBES 8
+
+/** number of steps narrowing down where the box of a bundle comes closest to a sphere */
+#define SWEEP_STEPS 40
+
+/** a part of the scene that changed: a box, or the sphere in it if {radius} is not negative */
+typedef struct {
+    aabb_t bounds;
+    vec3f center;
+    float radius;
+    bool shadows; // whether shadow rays that cross it are affected, not if it lets all light through
+} change_t;
+
+/** the changes found by an update */
+typedef struct {
+    bool all;             // every tile is affected
+    change_t *parts;      // tiles whose rays crossed these parts are affected
+    uint32_t part_count;
+    uint32_t *objects;    // tiles whose rays hit these objects are affected
+    uint32_t object_count;
+} changes_t;
+
+void render_cache_init(render_cache_t *cache)
+{
+    memset(cache, 0, sizeof(render_cache_t));
+}
+
+static void free_tiles(render_cache_t *cache)
+{
+    for (uint32_t i = 0; i < cache->tiles_x * cache->tiles_y; i++) {
+        free(cache->tiles[i].objects);
+        free(cache->tiles[i].bundles);
+    }
+    free(cache->tiles);
+    free(cache->dirty);
+    cache->tiles = NULL;
+    cache->dirty = NULL;
+}
+
+void render_cache_free(render_cache_t *cache)
+{
+    free_tiles(cache);
+    free(cache->spheres);
+    free(cache->planes);
+    free(cache->lights);
+    free(cache->meshes);
+    memset(cache, 0, sizeof(render_cache_t));
+}
+
+/** returns the index of {object} as by get_object */
+static uint32_t object_id(object_t object)
+{
+    switch (object.type) {
+        case OBJECT_SPHERE:
+            return object.index;
+        case OBJECT_PLANE:
+            return SPHERES_SIZE + object.index;
+        default:
+            return SPHERES_SIZE + PLANES_SIZE + object.index;
+    }
+}
+
+static aabb_t sphere_bounds(const sphere_t *sphere)
+{
+    vec3f r = {sphere->radius, sphere->radius, sphere->radius};
+    aabb_t bounds = {vec3f_sub(sphere->center, r), vec3f_add(sphere->center, r)};
+
+    return bounds;
+}
+
+static aabb_t light_bounds(const light_t *light)
+{
+    vec3f r = {light->radius, light->radius, light->radius};
+    aabb_t bounds = {vec3f_sub(light->v.location, r), vec3f_add(light->v.location, r)};
+
+    return bounds;
+}
+
+static aabb_t mesh_bounds(uint32_t i)
+{
+    aabb_t bounds;
+    bvh_object_bounds(&bounds, (object_t) {OBJECT_MESH, i});
+
+    return bounds;
+}
+
+static bool is_bounded_light(const light_t *light)
+{
+    return light->type == LIGHT_POINT && light->radius > 0.f;
+}
+
+static void aabb_merge(aabb_t *a, const aabb_t *b)
+{
+    aabb_grow(a, b->min);
+    aabb_grow(a, b->max);
+}
+
+/** sets the bounds of {cache} around the bounded objects and lights and the eye of the scene */
+static void compute_bounds(render_cache_t *cache)
+{
+    aabb_t bounds = aabb_empty();
+    aabb_grow(&bounds, EYE);
+    for (uint32_t i = 0; i < get_object_count(); i++) {
+        aabb_t object_bounds;
+        if (bvh_object_bounds(&object_bounds, get_object(i))) {
+            aabb_merge(&bounds, &object_bounds);
+        }
+    }
+    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
+        if (is_bounded_light(&LIGHTS[i])) {
+            aabb_t light = light_bounds(&LIGHTS[i]);
+            aabb_merge(&bounds, &light);
+        }
+    }
+
+    // room for objects to move a little without leaving the bounds
+    vec3f extent = vec3f_sub(bounds.max, bounds.min);
+    float pad = .05f * fmaxf(extent.x, fmaxf(extent.y, extent.z)) + 1e-3f;
+    vec3f margin = {pad, pad, pad};
+    cache->bounds.min = vec3f_sub(bounds.min, margin);
+    cache->bounds.max = vec3f_add(bounds.max, margin);
+}
+
+static bool contains(const aabb_t *outer, const aabb_t *inner)
+{
+    return inner->min.x >= outer->min.x && inner->min.y >= outer->min.y && inner->min.z >= outer->min.z &&
+           inner->max.x <= outer->max.x && inner->max.y <= outer->max.y && inner->max.z <= outer->max.z;
+}
+
+/**
+ * marks the tiles whose rays crossed {bounds}, or the sphere in them of {radius}, as affected by {changes}. shadow rays
+ * only if {shadows} */
+static void change_part(
+        changes_t *changes, const render_cache_t *cache, const aabb_t *bounds, float radius, bool shadows)
+{
+    if (!contains(&cache->bounds, bounds)) {
+        changes->all = true;
+        return;
+    }
+
+    // the ends of the recorded rays are rounded
+    vec3f extent = vec3f_sub(cache->bounds.max, cache->bounds.min);
+    float pad = 1e-4f * fmaxf(extent.x, fmaxf(extent.y, extent.z));
+    vec3f slack = {pad, pad, pad};
+    changes->parts = realloc(changes->parts, (changes->part_count + 1) * sizeof(change_t));
+    change_t *part = &changes->parts[changes->part_count++];
+    part->bounds.min = vec3f_sub(bounds->min, slack);
+    part->bounds.max = vec3f_add(bounds->max, slack);
+    part->center = vec3f_scale(vec3f_add(bounds->min, bounds->max), .5f);
+    part->radius = radius < 0.f ? radius : radius + pad;
+    part->shadows = shadows;
+}
+
+static void change_bounds(changes_t *changes, const render_cache_t *cache, const aabb_t *bounds, bool shadows)
+{
+    change_part(changes, cache, bounds, -1.f, shadows);
+}
+
+static void change_sphere(changes_t *changes, const render_cache_t *cache, vec3f center, float radius, bool shadows)
+{
+    vec3f r = {radius, radius, radius};
+    aabb_t bounds = {vec3f_sub(center, r), vec3f_add(center, r)};
+    change_part(changes, cache, &bounds, radius, shadows);
+}
+
+/** returns whether an object of material {before} and then {after} blocks some light */
+static bool casts_shadows(const material_t *before, const material_t *after)
+{
+    return get_light_troughput(*before) < 1.f || get_light_troughput(*after) < 1.f;
+}
+
+/** marks the tiles whose rays hit {object} as affected by {changes} */
+static void change_object(changes_t *changes, object_t object)
+{
+    changes->objects = realloc(changes->objects, (changes->object_count + 1) * sizeof(uint32_t));
+    changes->objects[changes->object_count++] = object_id(object);
+}
+
+/**
+ * adds the change of the appearance of an object of which the geometry did not change, from {before} to {after}.
+ * {bounds} are those of the object, or NULL if it is not bounded */
+static void change_material(
+        changes_t *changes, const render_cache_t *cache, object_t object, const material_t *before,
+        const material_t *after, const aabb_t *bounds)
+{
+    if (get_light_troughput(*before) == get_light_troughput(*after)) {
+        // shadow rays pass it as before, only the rays hitting it change
+        change_object(changes, object);
+    } else if (bounds) {
+        change_bounds(changes, cache, bounds, true);
+    } else {
+        changes->all = true;
+    }
+}
+
+static bool vec3f_differ(vec3f a, vec3f b)
+{
+    return !vec3f_eq(a, b);
+}
+
+/** compares the objects and lights of the scene to those of {cache} */
+static void compare_scene(changes_t *changes, const render_cache_t *cache)
+{
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        const sphere_t *before = &cache->spheres[i];
+        const sphere_t *after = &SPHERES[i];
+        object_t object = {OBJECT_SPHERE, i};
+        if (vec3f_differ(before->center, after->center) || before->radius != after->radius) {
+            bool shadows = casts_shadows(&before->material, &after->material);
+            change_sphere(changes, cache, before->center, before->radius, shadows);
+            change_sphere(changes, cache, after->center, after->radius, shadows);
+        } else if (memcmp(&before->material, &after->material, sizeof(material_t)) != 0) {
+            aabb_t bounds = sphere_bounds(after);
+            change_material(changes, cache, object, &before->material, &after->material, &bounds);
+        }
+    }
+
+    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
+        const plane_t *before = &cache->planes[i];
+        const plane_t *after = &PLANES[i];
+        object_t object = {OBJECT_PLANE, i};
+        aabb_t bounds_before, bounds_after;
+        bool bounded = bvh_plane_bounds(&bounds_before, before) && bvh_plane_bounds(&bounds_after, after);
+        if (before->type != after->type || vec3f_differ(before->point, after->point) ||
+            vec3f_differ(before->normal, after->normal) || vec3f_differ(before->first, after->first) ||
+            vec3f_differ(before->second, after->second)) {
+            if (!bounded) {
+                changes->all = true;
+                return;
+            }
+            bool shadows = casts_shadows(&before->material, &after->material);
+            change_bounds(changes, cache, &bounds_before, shadows);
+            change_bounds(changes, cache, &bounds_after, shadows);
+        } else if (memcmp(&before->material, &after->material, sizeof(material_t)) != 0 ||
+                   before->checkered_xz != after->checkered_xz ||
+                   vec3f_differ(before->checker_color, after->checker_color)) {
+            change_material(
+                    changes, cache, object, &before->material, &after->material, bounded ? &bounds_after : NULL);
+        }
+    }
+
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        const mesh_state_t *before = &cache->meshes[i];
+        object_t object = {OBJECT_MESH, i};
+        aabb_t bounds = mesh_bounds(i);
+        if (memcmp(&before->bounds, &bounds, sizeof(aabb_t)) != 0) {
+            bool shadows = casts_shadows(&before->material, &MESHES[i].material);
+            change_bounds(changes, cache, &before->bounds, shadows);
+            change_bounds(changes, cache, &bounds, shadows);
+        } else if (memcmp(&before->material, &MESHES[i].material, sizeof(material_t)) != 0) {
+            change_material(changes, cache, object, &before->material, &MESHES[i].material, &bounds);
+        }
+    }
+
+    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
+        const light_t *before = &cache->lights[i];
+        const light_t *after = &LIGHTS[i];
+        if (memcmp(before, after, sizeof(light_t)) == 0) {
+            continue;
+        }
+        if (!is_bounded_light(before) || !is_bounded_light(after)) {
+            changes->all = true;
+            return;
+        }
+        // the light only reaches hits within its radius, where the rays towards it end
+        change_sphere(changes, cache, before->v.location, before->radius, true);
+        change_sphere(changes, cache, after->v.location, after->radius, true);
+    }
+}
+
+/** remembers the current scene in {cache} */
+static void remember_scene(render_cache_t *cache)
+{
+    cache->size_x = SIZE_X;
+    cache->size_y = SIZE_Y;
+    cache->fov = FOV;
+    cache->eye = EYE;
+    cache->target = TARGET;
+    cache->up = UP;
+    cache->background = BACKGROUND;
+
+    cache->spheres = realloc(cache->spheres, (SPHERES_SIZE > 0 ? SPHERES_SIZE : 1) * sizeof(sphere_t));
+    memcpy(cache->spheres, SPHERES, SPHERES_SIZE * sizeof(sphere_t));
+    cache->planes = realloc(cache->planes, (PLANES_SIZE > 0 ? PLANES_SIZE : 1) * sizeof(plane_t));
+    memcpy(cache->planes, PLANES, PLANES_SIZE * sizeof(plane_t));
+    cache->lights = realloc(cache->lights, (LIGHTS_SIZE > 0 ? LIGHTS_SIZE : 1) * sizeof(light_t));
+    memcpy(cache->lights, LIGHTS, LIGHTS_SIZE * sizeof(light_t));
+    cache->meshes = realloc(cache->meshes, (MESHES_SIZE > 0 ? MESHES_SIZE : 1) * sizeof(mesh_state_t));
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        cache->meshes[i].bounds = mesh_bounds(i);
+        cache->meshes[i].material = MESHES[i].material;
+    }
+    cache->spheres_size = SPHERES_SIZE;
+    cache->planes_size = PLANES_SIZE;
+    cache->lights_size = LIGHTS_SIZE;
+    cache->meshes_size = MESHES_SIZE;
+    cache->valid = true;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * narrows [{s0}, {s1}] to where c + k s <= 0, for {c} and {k} of the distance to a side of bounds of the box of a
+ * bundle that is s of the way from its starts to its ends */
+static void clip_sweep(float *s0, float *s1, float c, float k)
+{
+    if (k > 0.f) {
+        *s1 = fminf(*s1, -c / k);
+    } else if (k < 0.f) {
+        *s0 = fmaxf(*s0, -c / k);
+    } else if (c > 0.f) {
+        *s1 = -1.f;
+    }
+}
+
+/** returns the squared distance of {p} to the box of {bundle} that is {s} of the way from its starts to its ends */
+static float sweep_distance2(const ray_bundle_t *bundle, vec3f p, float s)
+{
+    const float *starts_min = &bundle->starts.min.x, *starts_max = &bundle->starts.max.x;
+    const float *ends_min = &bundle->ends.min.x, *ends_max = &bundle->ends.max.x;
+    const float *q = &p.x;
+    float distance2 = 0.f;
+    for (uint32_t a = 0; a < 3; a++) {
+        float d = fmaxf(0.f, fmaxf(starts_min[a] + (ends_min[a] - starts_min[a]) * s - q[a],
+                                   q[a] - starts_max[a] - (ends_max[a] - starts_max[a]) * s));
+        distance2 += d * d;
+    }
+
+    return distance2;
+}
+
+/**
+ * returns whether a segment of the rays of {bundle} may cross {part}: whether the box that moves from its starts to
+ * its ends, which holds the points of the segments as far along, meets {part} */
+static bool bundle_crosses(const ray_bundle_t *bundle, const change_t *part)
+{
+    const float *starts_min = &bundle->starts.min.x, *starts_max = &bundle->starts.max.x;
+    const float *ends_min = &bundle->ends.min.x, *ends_max = &bundle->ends.max.x;
+    const float *min = &part->bounds.min.x, *max = &part->bounds.max.x;
+    float s0 = 0.f, s1 = 1.f;
+    for (uint32_t a = 0; a < 3; a++) {
+        // the lower side of the box is below the upper side of the bounds, and the other way around
+        clip_sweep(&s0, &s1, starts_min[a] - max[a], ends_min[a] - starts_min[a]);
+        clip_sweep(&s0, &s1, min[a] - starts_max[a], starts_max[a] - ends_max[a]);
+    }
+    if (!(s0 <= s1) || part->radius < 0.f) {
+        return s0 <= s1;
+    }
+
+    // the distance of the center to the moving box is convex in how far it moved, so its least one is found by
+    // narrowing down [s0, s1] in thirds
+    for (uint32_t i = 0; i < SWEEP_STEPS; i++) {
+        float a = s0 + (s1 - s0) / 3.f, b = s1 - (s1 - s0) / 3.f;
+        if (sweep_distance2(bundle, part->center, a) < sweep_distance2(bundle, part->center, b)) {
+            s1 = b;
+        } else {
+            s0 = a;
+        }
+    }
+
+    return sweep_distance2(bundle, part->center, s0) <= part->radius * part->radius;
+}
+
+/** returns whether {record} hit an object of {changes} or a bundle of it crossed one of its parts */
+static bool is_affected(const trace_record_t *record, const changes_t *changes)
+{
+    for (uint32_t i = 0; i < record->bundle_count; i++) {
+        bool shadow = (record->bundles[i].key & KEY_SHADOW) != 0;
+        for (uint32_t j = 0; j < changes->part_count; j++) {
+            if ((!shadow || changes->parts[j].shadows) && bundle_crosses(&record->bundles[i], &changes->parts[j])) {
+                return true;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < changes->object_count; i++) {
+        if (bsearch(&changes->objects[i], record->objects, record->object_count, sizeof(uint32_t), compare_ids)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t render_cache_update(render_cache_t *cache)
+{
+    changes_t changes;
+    memset(&changes, 0, sizeof(changes_t));
+    changes.all = !cache->valid || cache->size_x != SIZE_X || cache->size_y != SIZE_Y || cache->fov != FOV ||
+                  vec3f_differ(cache->eye, EYE) || vec3f_differ(cache->target, TARGET) || vec3f_differ(cache->up, UP) ||
+                  vec3f_differ(cache->background, BACKGROUND) || cache->spheres_size != SPHERES_SIZE ||
+                  cache->planes_size != PLANES_SIZE || cache->lights_size != LIGHTS_SIZE ||
+                  cache->meshes_size != MESHES_SIZE;
+    if (!changes.all) {
+        compare_scene(&changes, cache);
+    }
+
+    uint32_t dirty = 0;
+    if (changes.all) {
+        // all tiles are rendered again, so the bounds can be fit to the scene as it is now
+        free_tiles(cache);
+        cache->tiles_x = (SIZE_X + TILE_SIZE - 1) / TILE_SIZE;
+        cache->tiles_y = (SIZE_Y + TILE_SIZE - 1) / TILE_SIZE;
+        cache->tiles = calloc(cache->tiles_x * cache->tiles_y, sizeof(trace_record_t));
+        cache->dirty = malloc(cache->tiles_x * cache->tiles_y * sizeof(bool));
+        compute_bounds(cache);
+        for (uint32_t i = 0; i < cache->tiles_x * cache->tiles_y; i++) {
+            cache->tiles[i].bounds = cache->bounds;
+            cache->dirty[i] = true;
+        }
+        dirty = cache->tiles_x * cache->tiles_y;
+    } else {
+        for (uint32_t i = 0; i < cache->tiles_x * cache->tiles_y; i++) {
+            cache->dirty[i] = cache->dirty[i] || is_affected(&cache->tiles[i], &changes);
+            dirty += cache->dirty[i];
+        }
+    }
+    free(changes.parts);
+    free(changes.objects);
+
+    remember_scene(cache);
+
+    return dirty;
+}
+
+/** returns the number of 64-bit words of a bitset over the objects of the scene */
+static uint32_t hit_words(void)
+{
+    return (get_object_count() + 63) / 64;
+}
+
+size_t trace_scratch_memory(void)
+{
+    return arena_size(hit_words() * sizeof(uint64_t)) + arena_size(RENDER_CACHE_BUNDLES * sizeof(ray_bundle_t)) +
+           arena_size(RENDER_CACHE_BUNDLES * sizeof(uint32_t));
+}
+
+void trace_scratch_init(trace_scratch_t *scratch, arena_t *arena)
+{
+    scratch->hit = arena_alloc(arena, MEMORY_THREADS, hit_words() * sizeof(uint64_t));
+    memset(scratch->hit, 0, hit_words() * sizeof(uint64_t));
+    scratch->bundles = arena_alloc(arena, MEMORY_THREADS, RENDER_CACHE_BUNDLES * sizeof(ray_bundle_t));
+    memset(scratch->bundles, 0, RENDER_CACHE_BUNDLES * sizeof(ray_bundle_t));
+    scratch->used = arena_alloc(arena, MEMORY_THREADS, RENDER_CACHE_BUNDLES * sizeof(uint32_t));
+    scratch->used_count = 0;
+    scratch->last = 0;
+    scratch->shading = NO_OBJECT;
+}
+
+void trace_record_clear(trace_record_t *record, trace_scratch_t *scratch)
+{
+    record->scratch = scratch;
+}
+
+void trace_record_finish(trace_record_t *record)
+{
+    trace_scratch_t *scratch = record->scratch;
+
+    // the words are visited in order, so the objects are sorted
+    uint32_t words = hit_words();
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        count += (uint32_t) __builtin_popcountll(scratch->hit[w]);
+    }
+    record->objects = realloc(record->objects, (count > 0 ? count : 1) * sizeof(uint32_t));
+    record->object_count = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        for (uint64_t bits = scratch->hit[w]; bits != 0; bits &= bits - 1) {
+            record->objects[record->object_count++] = w * 64 + (uint32_t) __builtin_ctzll(bits);
+        }
+        scratch->hit[w] = 0;
+    }
+
+    uint32_t bundles = scratch->used_count > 0 ? scratch->used_count : 1;
+    record->bundles = realloc(record->bundles, bundles * sizeof(ray_bundle_t));
+    record->bundle_count = scratch->used_count;
+    for (uint32_t i = 0; i < scratch->used_count; i++) {
+        record->bundles[i] = scratch->bundles[scratch->used[i]];
+        scratch->bundles[scratch->used[i]].key = 0;
+    }
+    scratch->used_count = 0;
+    scratch->last = 0;
+    scratch->shading = NO_OBJECT;
+    record->scratch = NULL;
+}
+
+static bool inside(const aabb_t *bounds, vec3f p)
+{
+    return p.x >= bounds->min.x && p.y >= bounds->min.y && p.z >= bounds->min.z && p.x <= bounds->max.x &&
+           p.y <= bounds->max.y && p.z <= bounds->max.z;
+}
+
+/** sets [{t0}, {t1}] to the part of [{t0}, {t1}] of {ray} within {bounds}, returns false if there is none */
+static bool clip(const aabb_t *bounds, ray_t ray, float *t0, float *t1)
+{
+    const float *start = &ray.start.x, *direction = &ray.direction.x;
+    const float *min = &bounds->min.x, *max = &bounds->max.x;
+    for (uint32_t a = 0; a < 3; a++) {
+        if (direction[a] == 0.f) {
+            if (start[a] < min[a] || start[a] > max[a]) {
+                return false;
+            }
+            continue;
+        }
+        float ta = (min[a] - start[a]) / direction[a];
+        float tb = (max[a] - start[a]) / direction[a];
+        *t0 = fmaxf(*t0, fminf(ta, tb));
+        *t1 = fminf(*t1, fmaxf(ta, tb));
+    }
+
+    return *t0 <= *t1;
+}
+
+/** returns the bundle of {key} of {scratch}, or an empty one, or if there is none near, one of another key */
+static ray_bundle_t *find_bundle(trace_scratch_t *scratch, uint64_t key)
+{
+    // rays in a row mostly share their key
+    if (scratch->bundles[scratch->last].key == key) {
+        return &scratch->bundles[scratch->last];
+    }
+
+    uint32_t slot = (uint32_t) ((key * 0x9e3779b97f4a7c15ull) >> 56) % RENDER_CACHE_BUNDLES;
+    for (uint32_t probe = 1; probe < MAX_PROBES; probe++) {
+        uint64_t found = scratch->bundles[slot].key;
+        if (found == key || found == 0) {
+            break;
+        }
+        slot = (slot + 1) % RENDER_CACHE_BUNDLES;
+    }
+    ray_bundle_t *bundle = &scratch->bundles[slot];
+    if (bundle->key == 0) {
+        bundle->key = key;
+        bundle->starts = aabb_empty();
+        bundle->ends = aabb_empty();
+        scratch->used[scratch->used_count++] = slot;
+    }
+    scratch->last = slot;
+
+    return bundle;
+}
+
+/** adds the part [{t_min}, {t_max}] of {ray} within the bounds of {record} to its bundle of {key} */
+static void add_segment(trace_record_t *record, ray_t ray, float t_min, float t_max, uint64_t key)
+{
+    // segments that end at a bounded object lie within the bounds, rays that hit nothing are clipped
+    vec3f start = vec3f_madd(ray.start, ray.direction, t_min);
+    vec3f end = vec3f_madd(ray.start, ray.direction, t_max);
+    if (!inside(&record->bounds, start) || !inside(&record->bounds, end)) {
+        float t0 = t_min, t1 = t_max;
+        if (!clip(&record->bounds, ray, &t0, &t1)) {
+            return;
+        }
+        start = vec3f_madd(ray.start, ray.direction, t0);
+        end = vec3f_madd(ray.start, ray.direction, t1);
+    }
+
+    // rays in different directions spread over different sides of the bounds
+    key |= (uint64_t) ((ray.direction.x < 0.f) | (ray.direction.y < 0.f) << 1 | (ray.direction.z < 0.f) << 2)
+           << KEY_OCTANT;
+    ray_bundle_t *bundle = find_bundle(record->scratch, key);
+    aabb_grow(&bundle->starts, start);
+    aabb_grow(&bundle->ends, end);
+}
+
+void trace_record_ray(trace_record_t *record, ray_t ray, float t_min, float t_max, uint32_t depth, const object_t *hit)
+{
+    trace_scratch_t *scratch = record->scratch;
+    uint32_t id = NO_OBJECT;
+    if (hit) {
+        id = object_id(*hit);
+        scratch->hit[id / 64] |= 1ull << (id % 64);
+    }
+    scratch->shading = id;
+    add_segment(record, ray, t_min, t_max, KEY_TRACED | (uint64_t) depth << 32 | id);
+}
+
+void trace_record_shadow(trace_record_t *record, ray_t ray, float t_min, float t_max, uint32_t light)
+{
+    add_segment(record, ray, t_min, t_max, KEY_SHADOW | (uint64_t) light << 32 | record->scratch->shading);
+}
@@ -0,0 +1,120 @@
+#ifndef RAY_TRACER_RENDER_CACHE_H
+#define RAY_TRACER_RENDER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "util.h"
+#include "bvh.h"
+#include "mesh.h"
+
+/** number of bundles a thread collects the rays of a tile in, rays of further bundles widen the ones it has */
+#define RENDER_CACHE_BUNDLES 256
+
+/**
+ * rays of a tile that go alike: camera rays, reflections and refractions by their depth and the object they hit, shadow
+ * rays by their light and the object they leave, both by the octant of their direction. every segment of its rays
+ * within the bounds of the cache goes from a point in {starts} to a point in {ends} */
+typedef struct {
+    uint64_t key; // what the rays share, 0 if the bundle is empty
+    aabb_t starts;
+    aabb_t ends;
+} ray_bundle_t;
+
+/** the state a thread records the rays of a tile in, allocated once per render */
+typedef struct {
+    uint64_t *hit;         // per object, whether a ray hit it
+    ray_bundle_t *bundles; // RENDER_CACHE_BUNDLES, hashed by key
+    uint32_t *used;        // indices of the bundles that are not empty
+    uint32_t used_count;
+    uint32_t last;         // the bundle last added to
+    uint32_t shading;      // index as by get_object of the object last hit, which the shadow rays leave
+} trace_scratch_t;
+
+/** the objects hit and the bundles of rays traced for a tile */
+typedef struct trace_record {
+    aabb_t bounds;            // bounds of the cache, segments of rays are clipped to them
+    ray_bundle_t *bundles;    // set once the tile is done
+    uint32_t bundle_count;
+    uint32_t *objects;        // indices as by get_object of the objects hit by a ray, sorted, set once the tile is done
+    uint32_t object_count;
+    trace_scratch_t *scratch; // while the tile is traced: the state of the tracing thread
+} trace_record_t;
+
+/** the geometry and appearance of a mesh, as far as compared between renders */
+typedef struct {
+    aabb_t bounds;
+    material_t material;
+} mesh_state_t;
+
+/**
+ * incremental rendering: remembers per tile of TILE_SIZE which objects the rays of its pixels hit, and the bundles of
+ * its camera rays, reflections, refractions and shadow rays. when the scene changes, only the tiles that may see the
+ * change are rendered again:
+ *   - an object of which only the color or shininess changed affects the tiles whose rays hit it.
+ *   - an object that moved, or lets a different fraction of light through, affects the tiles whose rays crossed its
+ *     bounds, for a sphere the sphere, before or after the change. shadow rays are not affected by a moving object
+ *     that lets all light through.
+ *   - a point light with a radius affects the tiles whose rays crossed its sphere of influence before or after.
+ *   - any other change of a light, of the camera or of an unbounded plane affects all tiles.
+ * the rays of a tile may have crossed a part of the scene if the box moving from the starts to the ends of one of its
+ * bundles meets it. meshes are compared by their bounds and material only */
+typedef struct {
+    bool valid;           // whether the scene was recorded by an update
+    /** the scene as of the last update */
+    uint32_t size_x;
+    uint32_t size_y;
+    float fov;
+    vec3f eye;
+    vec3f target;
+    vec3f up;
+    vec3f background;
+    sphere_t *spheres;
+    plane_t *planes;
+    light_t *lights;
+    mesh_state_t *meshes;
+    uint32_t spheres_size;
+    uint32_t planes_size;
+    uint32_t lights_size;
+    uint32_t meshes_size;
+    /** the tiles */
+    aabb_t bounds;        // around the bounded objects, lights and the eye, rays are recorded within
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    trace_record_t *tiles;
+    bool *dirty;          // per tile: whether it has to be rendered
+} render_cache_t;
+
+/** makes {cache} an empty cache, of which all tiles are rendered after the first update */
+void render_cache_init(render_cache_t *cache);
+
+/** frees the memory of {cache} */
+void render_cache_free(render_cache_t *cache);
+
+/**
+ * compares the current scene to the scene of the previous update of {cache} and marks the tiles it may affect as
+ * dirty, then remembers the current scene. returns the number of dirty tiles. call scene_compile first */
+uint32_t render_cache_update(render_cache_t *cache);
+
+/** returns the bytes trace_scratch_init takes from an arena */
+size_t trace_scratch_memory(void);
+
+/** allocates {scratch} from {arena}, for the tiles one thread traces */
+void trace_scratch_init(trace_scratch_t *scratch, arena_t *arena);
+
+/** clears {record} before the rays of its tile are traced again with {scratch}, kept until trace_record_finish */
+void trace_record_clear(trace_record_t *record, trace_scratch_t *scratch);
+
+/** collects the objects and bundles of {record} once the rays of its tile are traced, leaving its scratch empty */
+void trace_record_finish(trace_record_t *record);
+
+/**
+ * adds the part [{t_min}, {t_max}] of {ray}, traced with {depth} bounces left, to {record}. {hit} is the object the ray
+ * hit, at {t_max}, or NULL */
+void trace_record_ray(trace_record_t *record, ray_t ray, float t_min, float t_max, uint32_t depth, const object_t *hit);
+
+/** adds the part [{t_min}, {t_max}] of {ray}, a shadow ray towards light {light} of the last object hit, to {record} */
+void trace_record_shadow(trace_record_t *record, ray_t ray, float t_min, float t_max, uint32_t light);
+
+#endif //RAY_TRACER_RENDER_CACHE_H
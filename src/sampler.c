@@ -0,0 +1,142 @@
+#include "sampler.h"
+
+#include <math.h>
+
+const char *sampler_name(sampler_type_t type)
+{
+    switch (type) {
+        case SAMPLER_GRID:
+            return "grid";
+        case SAMPLER_JITTERED:
+            return "jittered";
+        case SAMPLER_HALTON:
+            return "halton";
+        case SAMPLER_SOBOL:
+            return "sobol";
+    }
+
+    return "unknown";
+}
+
+/** returns a hash of {x} in which every bit depends on every bit of {x} */
+static uint32_t hash(uint32_t x)
+{
+    // lowbias32 of chris wellons
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+
+    return x;
+}
+
+/** returns a float in [0, 1) of the 24 high bits of {x} */
+static float to_unit(uint32_t x)
+{
+    return (float) (x >> 8) / (float) (1u << 24);
+}
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+
+    return x;
+}
+
+/**
+ * returns {x}, a binary fraction of 32 bits, owen scrambled with {seed}: each bit is flipped or not depending on the
+ * bits above it. see "practical hash-based owen scrambling", burley 2020 */
+static uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    // the permutation of laine and karras flips each bit depending on the bits below it, so reverse around it
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+
+    return reverse_bits(x);
+}
+
+/** returns sample {n} of the sobol sequence in dimension 0, the van der corput sequence, as a binary fraction */
+static uint32_t sobol_0(uint32_t n)
+{
+    return reverse_bits(n);
+}
+
+/** returns sample {n} of the sobol sequence in dimension 1 as a binary fraction */
+static uint32_t sobol_1(uint32_t n)
+{
+    // direction numbers of the primitive polynomial x + 1
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; n > 0; n >>= 1, v ^= v >> 1) {
+        if (n & 1) {
+            result ^= v;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * returns the radical inverse of {n} in {base}, 2 or 3, owen scrambled with {seed}: each digit is permuted depending
+ * on the digits above it, including the zeros beyond the last digit of {n} down to the precision of a float */
+static float scrambled_radical_inverse(uint32_t n, uint32_t base, uint32_t seed)
+{
+    float digit = 1.f / (float) base;
+    float result = 0.f;
+    uint32_t prefix = seed; // hash of the digits so far
+    for (float scale = digit; scale * (float) (1u << 24) >= 1.f; scale *= digit) {
+        uint32_t d = n % base;
+        n /= base;
+
+        // in base 3, a rotation and a reflection give each of the six permutations of the digits
+        uint32_t h = hash(prefix);
+        uint32_t permuted = (d + h % base) % base;
+        if (base == 3 && (h >> 16) & 1) {
+            permuted = 2 - permuted;
+        }
+        result += (float) permuted * scale;
+        prefix = hash(prefix ^ (d + 1) * 0x9e3779b9u);
+    }
+
+    return result < 1.f ? result : 1.f - 1.f / (float) (1u << 24);
+}
+
+void sampler_position(const sampler_t *sampler, uint32_t i, uint32_t j, uint32_t n, float *u, float *v)
+{
+    uint32_t count = sampler->count > 0 ? sampler->count : 1;
+    uint32_t pixel = hash(hash(hash(sampler->seed) ^ i) ^ (j * 0x9e3779b9u));
+
+    // later rounds of count samples are scrambled or jittered differently
+    uint32_t round = n / count;
+    uint32_t seed = hash(pixel ^ round * 0x85ebca6bu);
+    uint32_t index = n % count;
+
+    switch (sampler->type) {
+        case SAMPLER_JITTERED: {
+            // rows of up to count^(1/2) cells, each row as high as its share of the cells so all have the same area
+            uint32_t columns = (uint32_t) ceilf(sqrtf((float) count));
+            uint32_t row = index / columns;
+            uint32_t cells = count - row * columns < columns ? count - row * columns : columns;
+            uint32_t h = hash(seed ^ index);
+            *u = ((float) (index - row * columns) + to_unit(h)) / (float) cells;
+            *v = ((float) (row * columns) + to_unit(hash(h)) * (float) cells) / (float) count;
+            break;
+        }
+        case SAMPLER_HALTON:
+            *u = scrambled_radical_inverse(index, 2, seed);
+            *v = scrambled_radical_inverse(index, 3, hash(seed));
+            break;
+        default:
+            *u = to_unit(owen_scramble(sobol_0(index), seed));
+            *v = to_unit(owen_scramble(sobol_1(index), hash(seed)));
+            break;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef RAY_TRACER_SAMPLER_H
+#define RAY_TRACER_SAMPLER_H
+
+#include <stdint.h>
+
+typedef enum {
+    SAMPLER_GRID,     // the regular grid of camera rays, the same in every pixel
+    SAMPLER_JITTERED, // one random position in each cell of a grid of count cells over the pixel
+    SAMPLER_HALTON,   // halton sequence in bases 2 and 3, owen scrambled per pixel
+    SAMPLER_SOBOL     // sobol sequence in its first two dimensions, owen scrambled per pixel
+} sampler_type_t;
+
+/** where the camera rays of a pixel go through it */
+typedef struct {
+    sampler_type_t type;
+    uint32_t count; // number of samples per pixel, not used by SAMPLER_GRID
+    uint32_t seed;  // varies the jitter and scrambling, images rendered with the same seed are identical
+} sampler_t;
+
+/** returns the name of {type}, as given on the command line */
+const char *sampler_name(sampler_type_t type);
+
+/**
+ * computes the position ({u}, {v}) in [0, 1)^2 within pixel ({i}, {j}) of sample {n} of {sampler}, which is not a
+ * SAMPLER_GRID. the position only depends on the seed, the pixel and {n}, not on the order pixels are rendered in.
+ * the first count samples of a pixel cover it evenly, samples from n = count on cover it again with other positions */
+void sampler_position(const sampler_t *sampler, uint32_t i, uint32_t j, uint32_t n, float *u, float *v);
+
+#endif //RAY_TRACER_SAMPLER_H
@@ -1,24 +1,64 @@
 #include "scene.h"
+#include "lights.h"
 
-/** Whitted scene definition */
-#ifdef WHITTED_SCENE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+uint32_t SIZE_X;
+uint32_t SIZE_Y;
+float FOV;
+
+vec3f EYE;
+vec3f TARGET;
+vec3f UP;
+
+vec3f BACKGROUND;
+
+light_t *LIGHTS;
+sphere_t *SPHERES;
+plane_t *PLANES;
+mesh_t *MESHES;
+
+sphere_record_t *SPHERE_RECORDS;
+plane_record_t *PLANE_RECORDS;
+
+uint32_t LIGHTS_SIZE;
+uint32_t SPHERES_SIZE;
+uint32_t PLANES_SIZE;
+uint32_t MESHES_SIZE;
 
-const uint32_t SIZE_X = 1000;
-const uint32_t SIZE_Y = 750;
-const float FOV = (float) M_PI / 2.f;
+static void *storage;       // allocation holding the objects of the current scene
+static void *mapping;       // mapped file holding the objects of the current scene
+static size_t mapping_size;
 
-const vec3f EYE = {0.f, 4.f, -10.f};
-const vec3f TARGET = {0.f, 1.f, 0.f};
-const vec3f UP = {0.f, 1.f, 0.f};
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
-const vec3f BACKGROUND = {.2f, .7f, 1.f};
+typedef struct {
+    const char *name;
+    uint32_t size_x;
+    uint32_t size_y;
+    float fov;
+    vec3f eye;
+    vec3f target;
+    vec3f up;
+    vec3f background;
+    const light_t *lights;
+    uint32_t lights_size;
+    const sphere_t *spheres;
+    uint32_t spheres_size;
+    const plane_t *planes;
+    uint32_t planes_size;
+} builtin_scene_t;
 
-const light_t LIGHTS[] = {
+/** Whitted scene definition */
+static const light_t WHITTED_LIGHTS[] = {
         {.type=LIGHT_AMBIENT, .intensity=.9f},
         {.type=LIGHT_DIRECTIONAL, .intensity=.1f, .v.direction={0.f, 1.f, 0.f}}
 };
 
-const sphere_t SPHERES[] = {
+static const sphere_t WHITTED_SPHERES[] = {
         // reflective sphere
         {
                 .center={0.f, 2.5f, 2.f}, .radius=2.f,
@@ -45,7 +85,7 @@ const sphere_t SPHERES[] = {
         }
 };
 
-const plane_t PLANES[] = {
+static const plane_t WHITTED_PLANES[] = {
         // x/z-plane
         {
                 .type=PLANE_BOUNDED, .point={-8.f, 0.f, -8.f}, .normal={0.f, 1.f, 0.f},
@@ -57,24 +97,10 @@ const plane_t PLANES[] = {
         },
 };
 
-#endif
-
 /** Pool scene definition */
-#ifdef POOL_SCENE
-
 #define POINT_LIGHT_POS {5.f, 5.f, 0.f}
 
-const uint32_t SIZE_X = 1000;
-const uint32_t SIZE_Y = 200;
-const float FOV = (float) M_PI / 10.f;
-
-const vec3f EYE = {0.f, 4.f, -40.f};
-const vec3f TARGET = {0.f, 1.f, 0.f};
-const vec3f UP = {0.f, 1.f, 0.f};
-
-const vec3f BACKGROUND = {.1f, .1f, .1f};
-
-const light_t LIGHTS[] = {
+static const light_t POOL_LIGHTS[] = {
         {.type=LIGHT_AMBIENT, .intensity=.2f},
         {.type=LIGHT_POINT, .intensity=.9f, .v.location=POINT_LIGHT_POS},
         {.type=LIGHT_DIRECTIONAL, .intensity=.2f, .v.direction={1.f, 4.f, 4.f}}
@@ -85,7 +111,7 @@ const light_t LIGHTS[] = {
 #define SHININESS 1000.f
 #define REFLECTION {.type=REFLECTIVE, .fraction.reflectiveness=.3f}
 
-const sphere_t SPHERES[] = {
+static const sphere_t POOL_SPHERES[] = {
         // yellow (1)
         {
                 .center={0.f, 1.f, 0.f - RADIUS_DIAG * 2.f}, .radius=1.f,
@@ -163,7 +189,7 @@ const sphere_t SPHERES[] = {
         },
 };
 
-const plane_t PLANES[] = {
+static const plane_t POOL_PLANES[] = {
         // x/z-plane
         {
                 .type=PLANE_UNBOUNDED, .point={0.f, 0.f, 0.f}, .normal={0.f, 1.f, 0.f},
@@ -181,27 +207,13 @@ const plane_t PLANES[] = {
         }
 };
 
-#endif
-
 /** Art scene definition */
-#ifdef ART_SCENE
-
-const uint32_t SIZE_X = 1000;
-const uint32_t SIZE_Y = 1000;
-const float FOV = (float) M_PI / 2.f;
-
-const vec3f EYE = {0.f, 5.f, -40.f};
-const vec3f TARGET = {0.f, -24.f, 0.f};
-const vec3f UP = {0.f, 1.f, 0.f};
-
-const vec3f BACKGROUND = BLACK;
-
-const light_t LIGHTS[] = {
+static const light_t ART_LIGHTS[] = {
         {.type=LIGHT_AMBIENT, .intensity=.3f},
         {.type=LIGHT_POINT, .intensity=.9f, .v.location={0.f, 5.f, -41.f}},
 };
 
-const sphere_t SPHERES[] = {
+static const sphere_t ART_SPHERES[] = {
         {
                 .center={1.7f, .8f, -22.f}, .radius=.8f,
                 .material={
@@ -234,7 +246,7 @@ const sphere_t SPHERES[] = {
 
 #define DISTANT {5.5f, 0.f, 8.f}
 
-const plane_t PLANES[] = {
+static const plane_t ART_PLANES[] = {
         // x/z-plane
         {
                 .type=PLANE_UNBOUNDED, .point=DISTANT, .normal={0.f, 1.f, 0.f},
@@ -270,8 +282,257 @@ const plane_t PLANES[] = {
         }
 };
 
-#endif
+static const builtin_scene_t BUILTIN_SCENES[] = {
+        {
+                .name="whitted", .size_x=1000, .size_y=750, .fov=(float) M_PI / 2.f,
+                .eye={0.f, 4.f, -10.f}, .target={0.f, 1.f, 0.f}, .up={0.f, 1.f, 0.f}, .background={.2f, .7f, 1.f},
+                .lights=WHITTED_LIGHTS, .lights_size=ARRAY_SIZE(WHITTED_LIGHTS),
+                .spheres=WHITTED_SPHERES, .spheres_size=ARRAY_SIZE(WHITTED_SPHERES),
+                .planes=WHITTED_PLANES, .planes_size=ARRAY_SIZE(WHITTED_PLANES)
+        },
+        {
+                .name="pool", .size_x=1000, .size_y=200, .fov=(float) M_PI / 10.f,
+                .eye={0.f, 4.f, -40.f}, .target={0.f, 1.f, 0.f}, .up={0.f, 1.f, 0.f}, .background={.1f, .1f, .1f},
+                .lights=POOL_LIGHTS, .lights_size=ARRAY_SIZE(POOL_LIGHTS),
+                .spheres=POOL_SPHERES, .spheres_size=ARRAY_SIZE(POOL_SPHERES),
+                .planes=POOL_PLANES, .planes_size=ARRAY_SIZE(POOL_PLANES)
+        },
+        {
+                .name="art", .size_x=1000, .size_y=1000, .fov=(float) M_PI / 2.f,
+                .eye={0.f, 5.f, -40.f}, .target={0.f, -24.f, 0.f}, .up={0.f, 1.f, 0.f}, .background=BLACK,
+                .lights=ART_LIGHTS, .lights_size=ARRAY_SIZE(ART_LIGHTS),
+                .spheres=ART_SPHERES, .spheres_size=ARRAY_SIZE(ART_SPHERES),
+                .planes=ART_PLANES, .planes_size=ARRAY_SIZE(ART_PLANES)
+        }
+};
+
+const char *scene_builtin_name(uint32_t i)
+{
+    return i < ARRAY_SIZE(BUILTIN_SCENES) ? BUILTIN_SCENES[i].name : NULL;
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+bool scene_hash(const char *name, uint64_t *hash)
+{
+    *hash = HASH_INIT;
+    for (uint32_t i = 0; i < ARRAY_SIZE(BUILTIN_SCENES); i++) {
+        if (strcmp(BUILTIN_SCENES[i].name, name) == 0) {
+            *hash = hash_bytes(hash_bytes(*hash, "builtin", 8), name, strlen(name));
+            return true;
+        }
+    }
+
+    FILE *file = fopen(name, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t block[65536];
+    size_t read;
+    while ((read = fread(block, 1, sizeof(block), file)) > 0) {
+        *hash = hash_bytes(*hash, block, read);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+
+    return ok;
+}
+
+bool scene_load_builtin(const char *name)
+{
+    const builtin_scene_t *scene = NULL;
+    for (uint32_t i = 0; i < ARRAY_SIZE(BUILTIN_SCENES); i++) {
+        if (strcmp(BUILTIN_SCENES[i].name, name) == 0) {
+            scene = &BUILTIN_SCENES[i];
+        }
+    }
+    if (!scene) {
+        return false;
+    }
+
+    scene_allocate(scene->lights_size, scene->spheres_size, scene->planes_size);
+    SIZE_X = scene->size_x;
+    SIZE_Y = scene->size_y;
+    FOV = scene->fov;
+    EYE = scene->eye;
+    TARGET = scene->target;
+    UP = scene->up;
+    BACKGROUND = scene->background;
+    memcpy(LIGHTS, scene->lights, LIGHTS_SIZE * sizeof(light_t));
+    memcpy(SPHERES, scene->spheres, SPHERES_SIZE * sizeof(sphere_t));
+    memcpy(PLANES, scene->planes, PLANES_SIZE * sizeof(plane_t));
+
+    return true;
+}
+
+void scene_allocate(uint32_t lights_size, uint32_t spheres_size, uint32_t planes_size)
+{
+    scene_unload();
+
+    // a single allocation, the arrays are ordered by decreasing alignment requirements of their members
+    size_t size = spheres_size * sizeof(sphere_t) + planes_size * sizeof(plane_t) + lights_size * sizeof(light_t);
+    storage = malloc(size > 0 ? size : 1);
+
+    SPHERES = storage;
+    PLANES = (plane_t *) (SPHERES + spheres_size);
+    LIGHTS = (light_t *) (PLANES + planes_size);
+    SPHERES_SIZE = spheres_size;
+    PLANES_SIZE = planes_size;
+    LIGHTS_SIZE = lights_size;
+
+    SIZE_X = 1000;
+    SIZE_Y = 750;
+    FOV = (float) M_PI / 2.f;
+    vec3f origin = {0.f, 0.f, 0.f};
+    vec3f forward = {0.f, 0.f, 1.f};
+    vec3f up = {0.f, 1.f, 0.f};
+    EYE = origin;
+    TARGET = forward;
+    UP = up;
+    BACKGROUND = origin;
+}
+
+void scene_allocate_meshes(uint32_t meshes_size)
+{
+    MESHES = calloc(meshes_size > 0 ? meshes_size : 1, sizeof(mesh_t));
+    MESHES_SIZE = meshes_size;
+}
+
+void scene_assign_mapping(void *new_mapping, size_t size)
+{
+    free(storage);
+    storage = NULL;
+    mapping = new_mapping;
+    mapping_size = size;
+}
+
+void scene_compile(void)
+{
+    free(SPHERE_RECORDS);
+    SPHERE_RECORDS = malloc((SPHERES_SIZE > 0 ? SPHERES_SIZE : 1) * sizeof(sphere_record_t));
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        SPHERE_RECORDS[i].center = SPHERES[i].center;
+        SPHERE_RECORDS[i].radius2 = SPHERES[i].radius * SPHERES[i].radius;
+    }
+
+    free(PLANE_RECORDS);
+    PLANE_RECORDS = malloc((PLANES_SIZE > 0 ? PLANES_SIZE : 1) * sizeof(plane_record_t));
+    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
+        const plane_t *plane = &PLANES[i];
+        // directions are normalized here once instead of on every test, the rest is zero for unbounded planes
+        plane_record_t record = {.point=plane->point, .normal=vec3f_norm(plane->normal), .type=plane->type};
+        if (plane->type == PLANE_BOUNDED) {
+            record.first = vec3f_norm(plane->first);
+            record.second = vec3f_norm(plane->second);
+            record.first_length = vec3f_len(plane->first);
+            record.second_length = vec3f_len(plane->second);
+        }
+        PLANE_RECORDS[i] = record;
+    }
+
+    light_tree_free(&LIGHT_TREE);
+    light_tree_build(&LIGHT_TREE);
+}
+
+void scene_unload(void)
+{
+    free(SPHERE_RECORDS);
+    SPHERE_RECORDS = NULL;
+    free(PLANE_RECORDS);
+    PLANE_RECORDS = NULL;
+    light_tree_free(&LIGHT_TREE);
+
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        mesh_free(&MESHES[i]);
+    }
+    free(MESHES);
+    MESHES = NULL;
+    MESHES_SIZE = 0;
+
+    free(storage);
+    storage = NULL;
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = NULL;
+    }
+
+    LIGHTS = NULL;
+    SPHERES = NULL;
+    PLANES = NULL;
+    LIGHTS_SIZE = 0;
+    SPHERES_SIZE = 0;
+    PLANES_SIZE = 0;
+}
+
+size_t scene_memory(void)
+{
+    size_t size = (size_t) SPHERES_SIZE * (sizeof(sphere_t) + sizeof(sphere_record_t)) +
+                  (size_t) PLANES_SIZE * (sizeof(plane_t) + sizeof(plane_record_t)) +
+                  (size_t) LIGHTS_SIZE * sizeof(light_t) + (size_t) MESHES_SIZE * sizeof(mesh_t);
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        size += mesh_memory(&MESHES[i]);
+    }
+
+    return size;
+}
+
+void scene_detach(scene_state_t *state)
+{
+    *state = (scene_state_t) {
+            .size_x=SIZE_X, .size_y=SIZE_Y, .fov=FOV, .eye=EYE, .target=TARGET, .up=UP, .background=BACKGROUND,
+            .lights=LIGHTS, .spheres=SPHERES, .planes=PLANES, .meshes=MESHES, .sphere_records=SPHERE_RECORDS,
+            .plane_records=PLANE_RECORDS, .light_tree=LIGHT_TREE, .lights_size=LIGHTS_SIZE, .spheres_size=SPHERES_SIZE,
+            .planes_size=PLANES_SIZE, .meshes_size=MESHES_SIZE, .storage=storage, .mapping=mapping,
+            .mapping_size=mapping_size
+    };
+
+    // the memory now belongs to the state, unloading no longer releases it
+    LIGHTS = NULL;
+    SPHERES = NULL;
+    PLANES = NULL;
+    MESHES = NULL;
+    SPHERE_RECORDS = NULL;
+    PLANE_RECORDS = NULL;
+    memset(&LIGHT_TREE, 0, sizeof(light_tree_t));
+    LIGHTS_SIZE = 0;
+    SPHERES_SIZE = 0;
+    PLANES_SIZE = 0;
+    MESHES_SIZE = 0;
+    storage = NULL;
+    mapping = NULL;
+    mapping_size = 0;
+}
 
-const uint32_t LIGHTS_SIZE = sizeof(LIGHTS) / sizeof(light_t);
-const uint32_t SPHERES_SIZE = sizeof(SPHERES) / sizeof(sphere_t);
-const uint32_t PLANES_SIZE = sizeof(PLANES) / sizeof(plane_t);
\ No newline at end of file
+void scene_attach(scene_state_t *state)
+{
+    SIZE_X = state->size_x;
+    SIZE_Y = state->size_y;
+    FOV = state->fov;
+    EYE = state->eye;
+    TARGET = state->target;
+    UP = state->up;
+    BACKGROUND = state->background;
+    LIGHTS = state->lights;
+    SPHERES = state->spheres;
+    PLANES = state->planes;
+    MESHES = state->meshes;
+    SPHERE_RECORDS = state->sphere_records;
+    PLANE_RECORDS = state->plane_records;
+    LIGHT_TREE = state->light_tree;
+    LIGHTS_SIZE = state->lights_size;
+    SPHERES_SIZE = state->spheres_size;
+    PLANES_SIZE = state->planes_size;
+    MESHES_SIZE = state->meshes_size;
+    storage = state->storage;
+    mapping = state->mapping;
+    mapping_size = state->mapping_size;
+    memset(state, 0, sizeof(scene_state_t));
+}
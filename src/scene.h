@@ -1,7 +1,10 @@
 #ifndef RAY_TRACER_SCENE_H
 #define RAY_TRACER_SCENE_H
 
+#include <stddef.h>
 #include "util.h"
+#include "mesh.h"
+#include "lights.h"
 
 /** Color definitions */
 #define RED    {1.f, 0.f, 0.f}
@@ -15,29 +18,105 @@
 #define YELLOW {1.f, 1.f, 0.f}
 #define GRAY   {7.f, 7.f, 7.f}
 
-/** define exactly one scene */
-//#define POOL_SCENE
-#define WHITTED_SCENE
-//#define ART_SCENE
+/** scene loaded when none is specified */
+#define DEFAULT_SCENE "whitted"
 
-/** scene-specific definitions */
-extern const uint32_t SIZE_X;    // number of pixels in horizontal direction
-extern const uint32_t SIZE_Y;    // number of pixels in vertical direction
-extern const float FOV;          // field of view (radians)
+/** largest width and height of an image, so the number of pixels and of their bytes are far from overflowing */
+#define MAX_IMAGE_SIZE 16384
 
-extern const vec3f EYE;          // eye position
-extern const vec3f TARGET;       // lookat position
-extern const vec3f UP;           // up-vector
+/** scene-specific definitions, set by loading a scene */
+extern uint32_t SIZE_X;    // number of pixels in horizontal direction
+extern uint32_t SIZE_Y;    // number of pixels in vertical direction
+extern float FOV;          // field of view (radians)
 
-extern const vec3f BACKGROUND;   // color of the background
+extern vec3f EYE;          // eye position
+extern vec3f TARGET;       // lookat position
+extern vec3f UP;           // up-vector
 
-extern const light_t LIGHTS[];   // the lights in the scene
-extern const sphere_t SPHERES[]; // the spheres in the scene
-extern const plane_t PLANES[];   // the planes in the scene
+extern vec3f BACKGROUND;   // color of the background
 
-/** workaround to obtain the size of the extern const array */
-extern const uint32_t LIGHTS_SIZE;
-extern const uint32_t SPHERES_SIZE;
-extern const uint32_t PLANES_SIZE;
+extern light_t *LIGHTS;    // the lights in the scene
+extern sphere_t *SPHERES;  // the spheres in the scene
+extern plane_t *PLANES;    // the planes in the scene
+extern mesh_t *MESHES;     // the meshes in the scene
+
+/** intersection records of the objects, set by scene_compile */
+extern sphere_record_t *SPHERE_RECORDS;
+extern plane_record_t *PLANE_RECORDS;
+
+extern uint32_t LIGHTS_SIZE;
+extern uint32_t SPHERES_SIZE;
+extern uint32_t PLANES_SIZE;
+extern uint32_t MESHES_SIZE;
+
+/** a loaded scene with its records, set aside by scene_detach so that several scenes can be kept in memory */
+typedef struct {
+    uint32_t size_x;
+    uint32_t size_y;
+    float fov;
+    vec3f eye;
+    vec3f target;
+    vec3f up;
+    vec3f background;
+    light_t *lights;
+    sphere_t *spheres;
+    plane_t *planes;
+    mesh_t *meshes;
+    sphere_record_t *sphere_records;
+    plane_record_t *plane_records;
+    light_tree_t light_tree;
+    uint32_t lights_size;
+    uint32_t spheres_size;
+    uint32_t planes_size;
+    uint32_t meshes_size;
+    void *storage;
+    void *mapping;
+    size_t mapping_size;
+} scene_state_t;
+
+/** returns the name of built-in scene {i}, or NULL if there is no such scene */
+const char *scene_builtin_name(uint32_t i);
+
+/** loads built-in scene {name}, returns false if there is no such scene */
+bool scene_load_builtin(const char *name);
+
+/** start of an fnv-1a hash, to which bytes are added by hash_bytes */
+#define HASH_INIT 14695981039346656037ull
+
+/** adds {size} bytes of {data} to fnv-1a hash {hash} and returns the result */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+
+/**
+ * sets {hash} to a hash of scene {name}: of its name if it is a built-in scene, which takes precedence as when
+ * loading, otherwise of the contents of its file. returns false if the file cannot be read */
+bool scene_hash(const char *name, uint64_t *hash);
+
+/**
+ * makes room for a scene with the given number of objects in a single allocation, and points the object arrays to it.
+ * the camera is reset and the objects are left uninitialized */
+void scene_allocate(uint32_t lights_size, uint32_t spheres_size, uint32_t planes_size);
+
+/** makes room for {meshes_size} meshes after the other objects are allocated or assigned, left to be loaded */
+void scene_allocate_meshes(uint32_t meshes_size);
+
+/** makes the object arrays point into {mapping} of {size} bytes, which is unmapped when the scene is unloaded */
+void scene_assign_mapping(void *mapping, size_t size);
+
+/**
+ * computes the intersection records of the spheres and planes and the light hierarchy of the current scene, which are
+ * released when it is unloaded. call again after changing the spheres, planes or lights */
+void scene_compile(void);
+
+/** releases the memory of the current scene */
+void scene_unload(void);
+
+/** returns the number of bytes used by the objects of the current scene, their intersection records and the meshes */
+size_t scene_memory(void);
+
+/** moves the current scene into {state}, after which no scene is loaded */
+void scene_detach(scene_state_t *state);
+
+/** makes the scene of {state} the current scene, which must be unloaded or detached. {state} is left empty */
+void scene_attach(scene_state_t *state);
 
 #endif //RAY_TRACER_SCENE_H
@@ -0,0 +1,802 @@
+#include "scene_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_io.h"
+#include "scene.h"
+
+/** identifies a compiled scene */
+static const char SCENE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+static const uint32_t SCENE_VERSION = 2;
+static const uint32_t SCENE_ENDIANNESS = 0x01020304;
+
+/** longest path of a mesh in a compiled scene, including the terminating '\0' */
+#define MESH_PATH_SIZE 4096
+
+/** mesh of a compiled scene, which is loaded from its own file */
+typedef struct {
+    char path[MESH_PATH_SIZE];
+    material_t material;
+    float scale;
+    vec3f translation;
+} mesh_reference_t;
+
+/** header of a compiled scene, followed by the spheres, planes, lights and meshes at the given offsets */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianness;
+    uint32_t light_size;  // sizeof(light_t) of the writer
+    uint32_t sphere_size; // sizeof(sphere_t) of the writer
+    uint32_t plane_size;  // sizeof(plane_t) of the writer
+    uint32_t size_x;
+    uint32_t size_y;
+    float fov;
+    vec3f eye;
+    vec3f target;
+    vec3f up;
+    vec3f background;
+    uint32_t lights_size;
+    uint32_t spheres_size;
+    uint32_t planes_size;
+    uint32_t meshes_size;
+    uint64_t spheres_offset;
+    uint64_t planes_offset;
+    uint64_t lights_offset;
+    uint64_t meshes_offset;
+} scene_header_t;
+
+/** alignment of the object arrays in a compiled scene */
+#define SCENE_ALIGNMENT 64
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + SCENE_ALIGNMENT - 1) & ~(uint64_t) (SCENE_ALIGNMENT - 1);
+}
+
+/** open addressing table of indices, the keys are stored by the user of the table */
+typedef struct {
+    uint32_t *slots;
+    uint32_t mask;
+} index_table_t;
+
+#define NO_INDEX UINT32_MAX
+
+static void index_table_init(index_table_t *table, uint32_t count)
+{
+    uint32_t capacity = 16;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    table->slots = malloc(capacity * sizeof(uint32_t));
+    memset(table->slots, 0xff, capacity * sizeof(uint32_t));
+    table->mask = capacity - 1;
+}
+
+static void index_table_free(index_table_t *table)
+{
+    free(table->slots);
+}
+
+/** a material defined in a text scene, {name} points into the text */
+typedef struct {
+    const char *name;
+    uint32_t length;
+    material_t material;
+} named_material_t;
+
+typedef struct {
+    const char *path;
+    const char *p;  // current position, the text is terminated by '\0'
+    uint32_t line;
+    named_material_t *materials;
+    uint32_t materials_size;
+    index_table_t material_table;
+} parser_t;
+
+static bool parse_error(const parser_t *parser, const char *message)
+{
+    fprintf(stderr, "%s:%u: %s\n", parser->path, parser->line, message);
+
+    return false;
+}
+
+static void skip_blank(parser_t *parser)
+{
+    while (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\r') {
+        parser->p++;
+    }
+    if (*parser->p == '#') {
+        while (*parser->p != '\n' && *parser->p != '\0') {
+            parser->p++;
+        }
+    }
+}
+
+/** moves to the start of the next line, returns false at the end of the text */
+static bool next_line(parser_t *parser)
+{
+    while (*parser->p != '\n' && *parser->p != '\0') {
+        parser->p++;
+    }
+    if (*parser->p == '\0') {
+        return false;
+    }
+    parser->p++;
+    parser->line++;
+
+    return true;
+}
+
+/** reads the next word of the current line into {word}, {length}, returns false if there is none */
+static bool parse_word(parser_t *parser, const char **word, uint32_t *length)
+{
+    if (at_line_end(&parser->p, NULL)) {
+        return false;
+    }
+    *word = parser->p;
+    while (*parser->p != ' ' && *parser->p != '\t' && *parser->p != '\r' && *parser->p != '\n' &&
+           *parser->p != '\0' && *parser->p != '#') {
+        parser->p++;
+    }
+    *length = (uint32_t) (parser->p - *word);
+
+    return true;
+}
+
+static bool word_is(const char *word, uint32_t length, const char *keyword)
+{
+    return strlen(keyword) == length && memcmp(word, keyword, length) == 0;
+}
+
+static bool parse_float(parser_t *parser, float *value)
+{
+    skip_blank(parser);
+    char *end;
+    *value = strtof(parser->p, &end);
+    if (end == parser->p) {
+        return parse_error(parser, "expected a number");
+    }
+    parser->p = end;
+
+    return true;
+}
+
+static bool parse_uint(parser_t *parser, uint32_t *value)
+{
+    skip_blank(parser);
+    char *end;
+    unsigned long number = strtoul(parser->p, &end, 10);
+    if (end == parser->p || number == 0 || number > UINT32_MAX) {
+        return parse_error(parser, "expected a positive integer");
+    }
+    *value = (uint32_t) number;
+    parser->p = end;
+
+    return true;
+}
+
+static bool parse_vec3f(parser_t *parser, vec3f *value)
+{
+    return parse_float(parser, &value->x) && parse_float(parser, &value->y) && parse_float(parser, &value->z);
+}
+
+static uint32_t find_material(const parser_t *parser, const char *name, uint32_t length)
+{
+    uint32_t slot = (uint32_t) hash_bytes(HASH_INIT, name, length) & parser->material_table.mask;
+    while (parser->material_table.slots[slot] != NO_INDEX) {
+        const named_material_t *material = &parser->materials[parser->material_table.slots[slot]];
+        if (material->length == length && memcmp(material->name, name, length) == 0) {
+            return parser->material_table.slots[slot];
+        }
+        slot = (slot + 1) & parser->material_table.mask;
+    }
+
+    return NO_INDEX;
+}
+
+static bool parse_material(parser_t *parser)
+{
+    named_material_t *named = &parser->materials[parser->materials_size];
+    if (!parse_word(parser, &named->name, &named->length)) {
+        return parse_error(parser, "expected a material name");
+    }
+    if (find_material(parser, named->name, named->length) != NO_INDEX) {
+        return parse_error(parser, "material is defined twice");
+    }
+
+    material_t *material = &named->material;
+    if (!parse_vec3f(parser, &material->color) || !parse_float(parser, &material->shininess)) {
+        return false;
+    }
+
+    const char *word;
+    uint32_t length;
+    if (!parse_word(parser, &word, &length)) {
+        return parse_error(parser, "expected a reflection type");
+    }
+    if (word_is(word, length, "none")) {
+        material->reflection.type = NONE;
+    } else if (word_is(word, length, "reflective")) {
+        material->reflection.type = REFLECTIVE;
+    } else if (word_is(word, length, "refractive")) {
+        material->reflection.type = REFRACTIVE;
+    } else if (word_is(word, length, "transparent")) {
+        material->reflection.type = REFLECTIVE_REFRACTIVE;
+    } else {
+        return parse_error(parser, "unknown reflection type");
+    }
+    if (!parse_float(parser, &material->reflection.fraction.reflectiveness) ||
+        !parse_float(parser, &material->reflection.refractive_index)) {
+        return false;
+    }
+
+    uint32_t slot = (uint32_t) hash_bytes(HASH_INIT, named->name, named->length) & parser->material_table.mask;
+    while (parser->material_table.slots[slot] != NO_INDEX) {
+        slot = (slot + 1) & parser->material_table.mask;
+    }
+    parser->material_table.slots[slot] = parser->materials_size++;
+
+    return true;
+}
+
+static bool parse_material_name(parser_t *parser, material_t *material)
+{
+    const char *name;
+    uint32_t length;
+    if (!parse_word(parser, &name, &length)) {
+        return parse_error(parser, "expected a material name");
+    }
+    uint32_t index = find_material(parser, name, length);
+    if (index == NO_INDEX) {
+        return parse_error(parser, "unknown material");
+    }
+    *material = parser->materials[index].material;
+
+    return true;
+}
+
+static bool parse_light(parser_t *parser, light_t *light)
+{
+    const char *word;
+    uint32_t length;
+    if (!parse_word(parser, &word, &length)) {
+        return parse_error(parser, "expected a light type");
+    }
+    memset(light, 0, sizeof(light_t));
+    if (word_is(word, length, "ambient")) {
+        light->type = LIGHT_AMBIENT;
+        return parse_float(parser, &light->intensity);
+    } else if (word_is(word, length, "directional")) {
+        light->type = LIGHT_DIRECTIONAL;
+        return parse_float(parser, &light->intensity) && parse_vec3f(parser, &light->v.direction);
+    } else if (word_is(word, length, "point")) {
+        light->type = LIGHT_POINT;
+        if (!parse_float(parser, &light->intensity) || !parse_vec3f(parser, &light->v.location)) {
+            return false;
+        }
+        if (at_line_end(&parser->p, NULL)) {
+            return true;
+        }
+        if (!parse_word(parser, &word, &length) || !word_is(word, length, "radius")) {
+            return parse_error(parser, "expected radius");
+        }
+        if (!parse_float(parser, &light->radius)) {
+            return false;
+        }
+        if (!(light->radius > 0.f)) {
+            return parse_error(parser, "radius has to be positive");
+        }
+        return true;
+    }
+
+    return parse_error(parser, "unknown light type");
+}
+
+static bool parse_sphere(parser_t *parser, sphere_t *sphere)
+{
+    return parse_vec3f(parser, &sphere->center) && parse_float(parser, &sphere->radius) &&
+           parse_material_name(parser, &sphere->material);
+}
+
+static bool parse_plane(parser_t *parser, plane_t *plane)
+{
+    const char *word;
+    uint32_t length;
+    if (!parse_word(parser, &word, &length)) {
+        return parse_error(parser, "expected a plane type");
+    }
+    memset(plane, 0, sizeof(plane_t));
+    if (word_is(word, length, "unbounded")) {
+        plane->type = PLANE_UNBOUNDED;
+    } else if (word_is(word, length, "bounded")) {
+        plane->type = PLANE_BOUNDED;
+    } else {
+        return parse_error(parser, "unknown plane type");
+    }
+    if (!parse_vec3f(parser, &plane->point) || !parse_vec3f(parser, &plane->normal)) {
+        return false;
+    }
+    if (plane->type == PLANE_BOUNDED &&
+        (!parse_vec3f(parser, &plane->first) || !parse_vec3f(parser, &plane->second))) {
+        return false;
+    }
+    if (!parse_material_name(parser, &plane->material)) {
+        return false;
+    }
+
+    if (at_line_end(&parser->p, NULL)) {
+        return true;
+    }
+    if (!parse_word(parser, &word, &length) || !word_is(word, length, "checker")) {
+        return parse_error(parser, "expected checker");
+    }
+    plane->checkered_xz = true;
+
+    return parse_vec3f(parser, &plane->checker_color);
+}
+
+/** returns file {name} of {length} characters relative to the directory of {path}, allocated */
+static char *resolve_path(const char *path, const char *name, uint32_t length)
+{
+    const char *slash = strrchr(path, '/');
+    size_t directory_length = name[0] == '/' || !slash ? 0 : (size_t) (slash - path) + 1;
+    char *result = malloc(directory_length + length + 1);
+    memcpy(result, path, directory_length);
+    memcpy(result + directory_length, name, length);
+    result[directory_length + length] = '\0';
+
+    return result;
+}
+
+/** applies the {scale} and {translation} of a mesh, which is loaded before */
+static void transform_mesh(mesh_t *mesh, float scale, vec3f translation)
+{
+    if (scale != 1.f || translation.x != 0.f || translation.y != 0.f || translation.z != 0.f) {
+        mesh_transform(mesh, scale, translation);
+    }
+}
+
+static bool parse_mesh(parser_t *parser, mesh_t *mesh)
+{
+    const char *name;
+    uint32_t length;
+    if (!parse_word(parser, &name, &length)) {
+        return parse_error(parser, "expected a mesh file");
+    }
+    material_t material;
+    if (!parse_material_name(parser, &material)) {
+        return false;
+    }
+
+    float scale = 1.f;
+    vec3f translation = {0.f, 0.f, 0.f};
+    const char *word;
+    uint32_t word_length;
+    while (parse_word(parser, &word, &word_length)) {
+        if (word_is(word, word_length, "scale")) {
+            if (!parse_float(parser, &scale)) {
+                return false;
+            }
+            if (!(scale > 0.f)) {
+                return parse_error(parser, "scale has to be positive");
+            }
+        } else if (word_is(word, word_length, "translate")) {
+            if (!parse_vec3f(parser, &translation)) {
+                return false;
+            }
+        } else {
+            return parse_error(parser, "expected scale or translate");
+        }
+    }
+
+    char *file = resolve_path(parser->path, name, length);
+    bool ok = mesh_load(mesh, file);
+    free(file);
+    if (!ok) {
+        return parse_error(parser, "failed to load mesh");
+    }
+    mesh->material = material;
+    transform_mesh(mesh, scale, translation);
+
+    return true;
+}
+
+/** parses the text scene {text}, which the objects are counted in first so they can be stored in one allocation */
+static bool parse_scene(const char *path, const char *text)
+{
+    parser_t parser = {.path=path, .p=text, .line=1};
+
+    /** first pass: count the objects */
+    uint32_t lights_size = 0;
+    uint32_t spheres_size = 0;
+    uint32_t planes_size = 0;
+    uint32_t meshes_size = 0;
+    uint32_t materials_size = 0;
+    do {
+        const char *word;
+        uint32_t length;
+        if (parse_word(&parser, &word, &length)) {
+            if (word_is(word, length, "light")) {
+                lights_size++;
+            } else if (word_is(word, length, "sphere")) {
+                spheres_size++;
+            } else if (word_is(word, length, "plane")) {
+                planes_size++;
+            } else if (word_is(word, length, "mesh")) {
+                meshes_size++;
+            } else if (word_is(word, length, "material")) {
+                materials_size++;
+            }
+        }
+    } while (next_line(&parser));
+
+    scene_allocate(lights_size, spheres_size, planes_size);
+    scene_allocate_meshes(meshes_size);
+    parser.materials = malloc((materials_size > 0 ? materials_size : 1) * sizeof(named_material_t));
+    index_table_init(&parser.material_table, materials_size);
+
+    /** second pass: parse the objects */
+    parser.p = text;
+    parser.line = 1;
+    uint32_t light = 0;
+    uint32_t sphere = 0;
+    uint32_t plane = 0;
+    uint32_t mesh = 0;
+    bool ok = true;
+    do {
+        const char *word;
+        uint32_t length;
+        if (!parse_word(&parser, &word, &length)) {
+            continue;
+        }
+        if (word_is(word, length, "size")) {
+            ok = parse_uint(&parser, &SIZE_X) && parse_uint(&parser, &SIZE_Y);
+            if (ok && (SIZE_X > MAX_IMAGE_SIZE || SIZE_Y > MAX_IMAGE_SIZE)) {
+                ok = parse_error(&parser, "image size exceeds the maximum of 16384 pixels per side");
+            }
+        } else if (word_is(word, length, "fov")) {
+            ok = parse_float(&parser, &FOV);
+        } else if (word_is(word, length, "eye")) {
+            ok = parse_vec3f(&parser, &EYE);
+        } else if (word_is(word, length, "target")) {
+            ok = parse_vec3f(&parser, &TARGET);
+        } else if (word_is(word, length, "up")) {
+            ok = parse_vec3f(&parser, &UP);
+        } else if (word_is(word, length, "background")) {
+            ok = parse_vec3f(&parser, &BACKGROUND);
+        } else if (word_is(word, length, "light")) {
+            ok = parse_light(&parser, &LIGHTS[light++]);
+        } else if (word_is(word, length, "material")) {
+            ok = parse_material(&parser);
+        } else if (word_is(word, length, "sphere")) {
+            ok = parse_sphere(&parser, &SPHERES[sphere++]);
+        } else if (word_is(word, length, "plane")) {
+            ok = parse_plane(&parser, &PLANES[plane++]);
+        } else if (word_is(word, length, "mesh")) {
+            ok = parse_mesh(&parser, &MESHES[mesh++]);
+        } else {
+            ok = parse_error(&parser, "unknown keyword");
+        }
+        if (ok && !at_line_end(&parser.p, NULL)) {
+            ok = parse_error(&parser, "unexpected value at end of line");
+        }
+    } while (ok && next_line(&parser));
+
+    index_table_free(&parser.material_table);
+    free(parser.materials);
+    if (!ok) {
+        scene_unload();
+    }
+
+    return ok;
+}
+
+/** maps the compiled scene of {size} bytes in file {fd} */
+static bool map_compiled(const char *path, int fd, size_t size)
+{
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const scene_header_t *header = mapping;
+    if (header->version != SCENE_VERSION || header->endianness != SCENE_ENDIANNESS ||
+        header->light_size != sizeof(light_t) || header->sphere_size != sizeof(sphere_t) ||
+        header->plane_size != sizeof(plane_t)) {
+        fprintf(stderr, "%s: compiled scene was written by an incompatible build\n", path);
+        munmap(mapping, size);
+        return false;
+    }
+    if (header->spheres_offset + (uint64_t) header->spheres_size * sizeof(sphere_t) > size ||
+        header->planes_offset + (uint64_t) header->planes_size * sizeof(plane_t) > size ||
+        header->lights_offset + (uint64_t) header->lights_size * sizeof(light_t) > size ||
+        header->meshes_offset + (uint64_t) header->meshes_size * sizeof(mesh_reference_t) > size ||
+        header->size_x == 0 || header->size_y == 0 || header->size_x > MAX_IMAGE_SIZE ||
+        header->size_y > MAX_IMAGE_SIZE) {
+        fprintf(stderr, "%s: compiled scene is truncated or corrupt\n", path);
+        munmap(mapping, size);
+        return false;
+    }
+
+    scene_assign_mapping(mapping, size);
+    SIZE_X = header->size_x;
+    SIZE_Y = header->size_y;
+    FOV = header->fov;
+    EYE = header->eye;
+    TARGET = header->target;
+    UP = header->up;
+    BACKGROUND = header->background;
+    SPHERES = (sphere_t *) ((char *) mapping + header->spheres_offset);
+    PLANES = (plane_t *) ((char *) mapping + header->planes_offset);
+    LIGHTS = (light_t *) ((char *) mapping + header->lights_offset);
+    SPHERES_SIZE = header->spheres_size;
+    PLANES_SIZE = header->planes_size;
+    LIGHTS_SIZE = header->lights_size;
+
+    /** meshes are not part of the compiled scene, they are loaded from their own files */
+    const mesh_reference_t *references = (const mesh_reference_t *) ((char *) mapping + header->meshes_offset);
+    scene_allocate_meshes(header->meshes_size);
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        const mesh_reference_t *reference = &references[i];
+        if (!memchr(reference->path, '\0', MESH_PATH_SIZE) || !(reference->scale > 0.f)) {
+            fprintf(stderr, "%s: compiled scene is truncated or corrupt\n", path);
+            scene_unload();
+            return false;
+        }
+        if (!mesh_load(&MESHES[i], reference->path)) {
+            scene_unload();
+            return false;
+        }
+        MESHES[i].material = reference->material;
+        transform_mesh(&MESHES[i], reference->scale, reference->translation);
+    }
+
+    return true;
+}
+
+bool scene_load_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t) info.st_size;
+
+    char magic[sizeof(SCENE_MAGIC)];
+    if (size >= sizeof(scene_header_t) && pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic) &&
+        memcmp(magic, SCENE_MAGIC, sizeof(magic)) == 0) {
+        bool ok = map_compiled(path, fd, size);
+        close(fd);
+        return ok;
+    }
+
+    /** text scene, read as a whole and terminated */
+    char *text = malloc(size + 1);
+    size_t read_size = 0;
+    while (read_size < size) {
+        ssize_t count = read(fd, text + read_size, size - read_size);
+        if (count <= 0) {
+            fprintf(stderr, "%s: %s\n", path, count < 0 ? strerror(errno) : "unexpected end of file");
+            free(text);
+            close(fd);
+            return false;
+        }
+        read_size += (size_t) count;
+    }
+    text[size] = '\0';
+    close(fd);
+
+    bool ok = parse_scene(path, text);
+    free(text);
+
+    return ok;
+}
+
+static const char *reflection_name(reflect_type_t type)
+{
+    switch (type) {
+        case REFLECTIVE:
+            return "reflective";
+        case REFRACTIVE:
+            return "refractive";
+        case REFLECTIVE_REFRACTIVE:
+            return "transparent";
+        default:
+            return "none";
+    }
+}
+
+/** writes the definition of {material} the first time it is seen, returns its index in {materials} */
+static uint32_t write_material(
+        FILE *file, const material_t *material, material_t *materials, uint32_t *materials_size,
+        index_table_t *table)
+{
+    uint32_t slot = (uint32_t) hash_bytes(HASH_INIT, material, sizeof(material_t)) & table->mask;
+    while (table->slots[slot] != NO_INDEX) {
+        if (memcmp(&materials[table->slots[slot]], material, sizeof(material_t)) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & table->mask;
+    }
+
+    uint32_t index = (*materials_size)++;
+    materials[index] = *material;
+    table->slots[slot] = index;
+    fprintf(file, "material m%u %.9g %.9g %.9g %.9g %s %.9g %.9g\n", index,
+            material->color.x, material->color.y, material->color.z, material->shininess,
+            reflection_name(material->reflection.type), material->reflection.fraction.reflectiveness,
+            material->reflection.refractive_index);
+
+    return index;
+}
+
+bool scene_write_text(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "size %u %u\n", SIZE_X, SIZE_Y);
+    fprintf(file, "fov %.9g\n", FOV);
+    fprintf(file, "eye %.9g %.9g %.9g\n", EYE.x, EYE.y, EYE.z);
+    fprintf(file, "target %.9g %.9g %.9g\n", TARGET.x, TARGET.y, TARGET.z);
+    fprintf(file, "up %.9g %.9g %.9g\n", UP.x, UP.y, UP.z);
+    fprintf(file, "background %.9g %.9g %.9g\n", BACKGROUND.x, BACKGROUND.y, BACKGROUND.z);
+
+    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
+        const light_t *light = &LIGHTS[i];
+        if (light->type == LIGHT_AMBIENT) {
+            fprintf(file, "light ambient %.9g\n", light->intensity);
+        } else {
+            fprintf(file, "light %s %.9g %.9g %.9g %.9g", light->type == LIGHT_POINT ? "point" : "directional",
+                    light->intensity, light->v.location.x, light->v.location.y, light->v.location.z);
+            if (light->type == LIGHT_POINT && light->radius > 0.f) {
+                fprintf(file, " radius %.9g", light->radius);
+            }
+            fprintf(file, "\n");
+        }
+    }
+
+    /** materials are written before their first use, identical materials are shared */
+    uint32_t object_count = get_object_count();
+    material_t *materials = malloc((object_count > 0 ? object_count : 1) * sizeof(material_t));
+    uint32_t materials_size = 0;
+    index_table_t table;
+    index_table_init(&table, object_count);
+
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        const sphere_t *sphere = &SPHERES[i];
+        uint32_t material = write_material(file, &sphere->material, materials, &materials_size, &table);
+        fprintf(file, "sphere %.9g %.9g %.9g %.9g m%u\n",
+                sphere->center.x, sphere->center.y, sphere->center.z, sphere->radius, material);
+    }
+    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
+        const plane_t *plane = &PLANES[i];
+        uint32_t material = write_material(file, &plane->material, materials, &materials_size, &table);
+        fprintf(file, "plane %s %.9g %.9g %.9g %.9g %.9g %.9g",
+                plane->type == PLANE_BOUNDED ? "bounded" : "unbounded",
+                plane->point.x, plane->point.y, plane->point.z, plane->normal.x, plane->normal.y, plane->normal.z);
+        if (plane->type == PLANE_BOUNDED) {
+            fprintf(file, " %.9g %.9g %.9g %.9g %.9g %.9g",
+                    plane->first.x, plane->first.y, plane->first.z, plane->second.x, plane->second.y, plane->second.z);
+        }
+        fprintf(file, " m%u", material);
+        if (plane->checkered_xz) {
+            fprintf(file, " checker %.9g %.9g %.9g",
+                    plane->checker_color.x, plane->checker_color.y, plane->checker_color.z);
+        }
+        fprintf(file, "\n");
+    }
+    bool complete = true;
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        const mesh_t *mesh = &MESHES[i];
+        if (!mesh->path) {
+            fprintf(stderr, "%s: mesh %u was not loaded from a file\n", path, i);
+            complete = false;
+            continue;
+        }
+        uint32_t material = write_material(file, &mesh->material, materials, &materials_size, &table);
+        fprintf(file, "mesh %s m%u", mesh->path, material);
+        if (mesh->scale != 1.f) {
+            fprintf(file, " scale %.9g", mesh->scale);
+        }
+        if (mesh->translation.x != 0.f || mesh->translation.y != 0.f || mesh->translation.z != 0.f) {
+            fprintf(file, " translate %.9g %.9g %.9g", mesh->translation.x, mesh->translation.y, mesh->translation.z);
+        }
+        fprintf(file, "\n");
+    }
+
+    index_table_free(&table);
+    free(materials);
+
+    bool ok = !ferror(file) && complete;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write scene\n", path);
+    }
+
+    return ok;
+}
+
+bool scene_write_compiled(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    scene_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.endianness = SCENE_ENDIANNESS;
+    header.light_size = sizeof(light_t);
+    header.sphere_size = sizeof(sphere_t);
+    header.plane_size = sizeof(plane_t);
+    header.size_x = SIZE_X;
+    header.size_y = SIZE_Y;
+    header.fov = FOV;
+    header.eye = EYE;
+    header.target = TARGET;
+    header.up = UP;
+    header.background = BACKGROUND;
+    header.lights_size = LIGHTS_SIZE;
+    header.spheres_size = SPHERES_SIZE;
+    header.planes_size = PLANES_SIZE;
+    header.spheres_offset = align_offset(sizeof(header));
+    header.planes_offset = align_offset(header.spheres_offset + (uint64_t) SPHERES_SIZE * sizeof(sphere_t));
+    header.lights_offset = align_offset(header.planes_offset + (uint64_t) PLANES_SIZE * sizeof(plane_t));
+    header.meshes_size = MESHES_SIZE;
+    header.meshes_offset = align_offset(header.lights_offset + (uint64_t) LIGHTS_SIZE * sizeof(light_t));
+
+    /** meshes are referred to by their file */
+    mesh_reference_t *references = calloc(MESHES_SIZE > 0 ? MESHES_SIZE : 1, sizeof(mesh_reference_t));
+    bool ok = true;
+    for (uint32_t i = 0; i < MESHES_SIZE && ok; i++) {
+        const mesh_t *mesh = &MESHES[i];
+        ok = mesh->path && strlen(mesh->path) < MESH_PATH_SIZE;
+        if (ok) {
+            strcpy(references[i].path, mesh->path);
+            references[i].material = mesh->material;
+            references[i].scale = mesh->scale;
+            references[i].translation = mesh->translation;
+        } else {
+            fprintf(stderr, "%s: mesh %u was not loaded from a file, or its path is too long\n", path, i);
+        }
+    }
+
+    uint64_t offset = sizeof(header);
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && write_array(file, &offset, header.spheres_offset, SPHERES, sizeof(sphere_t), SPHERES_SIZE);
+    ok = ok && write_array(file, &offset, header.planes_offset, PLANES, sizeof(plane_t), PLANES_SIZE);
+    ok = ok && write_array(file, &offset, header.lights_offset, LIGHTS, sizeof(light_t), LIGHTS_SIZE);
+    ok = ok && write_array(
+            file, &offset, header.meshes_offset, references, sizeof(mesh_reference_t), MESHES_SIZE);
+    free(references);
+
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write scene\n", path);
+    }
+
+    return ok;
+}
@@ -0,0 +1,39 @@
+#ifndef RAY_TRACER_SCENE_FILE_H
+#define RAY_TRACER_SCENE_FILE_H
+
+#include <stdbool.h>
+
+/**
+ * loads the scene in file {path}, which is either a compiled scene written by scene_write_compiled or a text scene.
+ * returns false and prints the reason to stderr if the file cannot be loaded.
+ *
+ * a text scene consists of lines of whitespace-separated values, '#' starts a comment. angles are in radians:
+ *   size WIDTH HEIGHT
+ *   fov ANGLE
+ *   eye X Y Z
+ *   target X Y Z
+ *   up X Y Z
+ *   background R G B
+ *   light ambient INTENSITY
+ *   light directional INTENSITY X Y Z
+ *   light point INTENSITY X Y Z [radius R]
+ *   material NAME R G B SHININESS none|reflective|refractive|transparent FRACTION REFRACTIVE_INDEX
+ *   sphere X Y Z RADIUS MATERIAL
+ *   plane unbounded PX PY PZ NX NY NZ MATERIAL [checker R G B]
+ *   plane bounded PX PY PZ NX NY NZ FX FY FZ SX SY SZ MATERIAL [checker R G B]
+ *   mesh FILE MATERIAL [scale S] [translate X Y Z]
+ * the width and height are at most MAX_IMAGE_SIZE. materials have to be defined before they are used. mesh files are
+ * loaded with mesh_load, relative to the directory of the scene, their vertices are scaled before they are translated.
+ * a point light with a radius falls off smoothly to nothing at that distance, see light_falloff */
+bool scene_load_file(const char *path);
+
+/** writes the current scene to {path} in the text format, returns false on failure */
+bool scene_write_text(const char *path);
+
+/**
+ * writes the current scene to {path} in the compiled format, which is mapped into memory as is when loaded.
+ * meshes are referred to by their files. compiled scenes are only portable between builds with the same object
+ * layout. returns false on failure */
+bool scene_write_compiled(const char *path);
+
+#endif //RAY_TRACER_SCENE_FILE_H
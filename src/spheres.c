@@ -0,0 +1,287 @@
+#include "spheres.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include "scene.h"
+#include "stats.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHERES_X86
+#include <immintrin.h>
+#endif
+
+sphere_soa_t SPHERES_SOA;
+
+void sphere_soa_init(sphere_soa_t *soa, uint32_t count)
+{
+    size_t size = (count + SPHERE_SOA_PADDING) * sizeof(float);
+    soa->x = malloc(size);
+    soa->y = malloc(size);
+    soa->z = malloc(size);
+    soa->r2 = malloc(size);
+    soa->count = count;
+
+    for (uint32_t i = 0; i < count + SPHERE_SOA_PADDING; i++) {
+        soa->x[i] = 0.f;
+        soa->y[i] = 0.f;
+        soa->z[i] = 0.f;
+        soa->r2[i] = -1.f;
+    }
+}
+
+void sphere_soa_set(sphere_soa_t *soa, uint32_t i, const sphere_record_t *sphere)
+{
+    soa->x[i] = sphere->center.x;
+    soa->y[i] = sphere->center.y;
+    soa->z[i] = sphere->center.z;
+    soa->r2[i] = sphere->radius2;
+}
+
+void sphere_soa_from_scene(sphere_soa_t *soa)
+{
+    sphere_soa_init(soa, SPHERES_SIZE);
+    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+        sphere_soa_set(soa, i, &SPHERE_RECORDS[i]);
+    }
+}
+
+void sphere_soa_free(sphere_soa_t *soa)
+{
+    free(soa->x);
+    free(soa->y);
+    free(soa->z);
+    free(soa->r2);
+    soa->x = soa->y = soa->z = soa->r2 = NULL;
+    soa->count = 0;
+}
+
+size_t sphere_soa_memory(const sphere_soa_t *soa)
+{
+    return soa->x ? 4 * ((size_t) soa->count + SPHERE_SOA_PADDING) * sizeof(float) : 0;
+}
+
+/**
+ * all kernels evaluate the terms of reflect_sphere in the same order, so they find the exact same distances.
+ * with v = start - center and b = v.d: t = -b - sqrt(b^2 - (v.v - r^2)), the ray misses if -b + sqrt(..) < 0 */
+
+static uint32_t closest_sphere_scalar(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t)
+{
+    uint32_t closest = NO_SPHERE;
+    float t_smallest = t_max;
+    for (uint32_t i = first; i < first + count; i++) {
+        float vx = ray.start.x - soa->x[i];
+        float vy = ray.start.y - soa->y[i];
+        float vz = ray.start.z - soa->z[i];
+        float b = vx * ray.direction.x + vy * ray.direction.y + vz * ray.direction.z;
+        float discriminant = b * b - ((vx * vx + vy * vy + vz * vz) - soa->r2[i]);
+        if (!(discriminant >= 0.f)) {
+            continue;
+        }
+
+        float square_root = sqrtf(discriminant);
+        float t_neg = -b - square_root;
+        float t_pos = -b + square_root;
+        if (t_pos < 0.f || t_neg < t_min || t_neg > t_smallest || (closest != NO_SPHERE && t_neg == t_smallest)) {
+            continue;
+        }
+
+        t_smallest = t_neg;
+        closest = i;
+    }
+
+    *t = t_smallest;
+
+    return closest;
+}
+
+#ifdef SPHERES_X86
+
+static uint32_t closest_sphere_sse(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t)
+{
+    const __m128 sx = _mm_set1_ps(ray.start.x);
+    const __m128 sy = _mm_set1_ps(ray.start.y);
+    const __m128 sz = _mm_set1_ps(ray.start.z);
+    const __m128 dx = _mm_set1_ps(ray.direction.x);
+    const __m128 dy = _mm_set1_ps(ray.direction.y);
+    const __m128 dz = _mm_set1_ps(ray.direction.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 lo = _mm_set1_ps(t_min);
+    const __m128i end = _mm_set1_epi32((int32_t) (first + count));
+    const __m128i step = _mm_set1_epi32(4);
+
+    __m128 best_t = _mm_set1_ps(t_max);
+    __m128i best_index = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32((int32_t) first, (int32_t) first + 1, (int32_t) first + 2, (int32_t) first + 3);
+
+    for (uint32_t i = first; i < first + count; i += 4) {
+        __m128 vx = _mm_sub_ps(sx, _mm_loadu_ps(&soa->x[i]));
+        __m128 vy = _mm_sub_ps(sy, _mm_loadu_ps(&soa->y[i]));
+        __m128 vz = _mm_sub_ps(sz, _mm_loadu_ps(&soa->z[i]));
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, dx), _mm_mul_ps(vy, dy)), _mm_mul_ps(vz, dz));
+        __m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_sub_ps(vv, _mm_loadu_ps(&soa->r2[i])));
+        __m128 square_root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+        __m128 neg_b = _mm_xor_ps(b, sign);
+        __m128 t_neg = _mm_sub_ps(neg_b, square_root);
+        __m128 t_pos = _mm_add_ps(neg_b, square_root);
+
+        // strictly closer than the best hit so far keeps the first of equally close entries per lane
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t_pos, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(t_neg, lo));
+        mask = _mm_and_ps(mask, _mm_or_ps(
+                _mm_cmplt_ps(t_neg, best_t),
+                _mm_and_ps(_mm_cmpeq_ps(t_neg, best_t), _mm_castsi128_ps(_mm_cmplt_epi32(best_index, _mm_setzero_si128())))));
+        mask = _mm_and_ps(mask, _mm_castsi128_ps(_mm_cmplt_epi32(index, end)));
+
+        best_t = _mm_or_ps(_mm_and_ps(mask, t_neg), _mm_andnot_ps(mask, best_t));
+        __m128i mask_i = _mm_castps_si128(mask);
+        best_index = _mm_or_si128(_mm_and_si128(mask_i, index), _mm_andnot_si128(mask_i, best_index));
+        index = _mm_add_epi32(index, step);
+    }
+
+    float lane_t[4];
+    int32_t lane_index[4];
+    _mm_storeu_ps(lane_t, best_t);
+    _mm_storeu_si128((__m128i *) lane_index, best_index);
+
+    uint32_t closest = NO_SPHERE;
+    float t_smallest = t_max;
+    for (uint32_t lane = 0; lane < 4; lane++) {
+        if (lane_index[lane] < 0) {
+            continue;
+        }
+        if (closest == NO_SPHERE || lane_t[lane] < t_smallest ||
+            (lane_t[lane] == t_smallest && (uint32_t) lane_index[lane] < closest)) {
+            t_smallest = lane_t[lane];
+            closest = (uint32_t) lane_index[lane];
+        }
+    }
+
+    *t = t_smallest;
+
+    return closest;
+}
+
+__attribute__((target("avx2")))
+static uint32_t closest_sphere_avx2(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t)
+{
+    const __m256 sx = _mm256_set1_ps(ray.start.x);
+    const __m256 sy = _mm256_set1_ps(ray.start.y);
+    const __m256 sz = _mm256_set1_ps(ray.start.z);
+    const __m256 dx = _mm256_set1_ps(ray.direction.x);
+    const __m256 dy = _mm256_set1_ps(ray.direction.y);
+    const __m256 dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256 lo = _mm256_set1_ps(t_min);
+    const __m256i end = _mm256_set1_epi32((int32_t) (first + count));
+    const __m256i step = _mm256_set1_epi32(8);
+
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256i best_index = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32((int32_t) first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+    for (uint32_t i = first; i < first + count; i += 8) {
+        __m256 vx = _mm256_sub_ps(sx, _mm256_loadu_ps(&soa->x[i]));
+        __m256 vy = _mm256_sub_ps(sy, _mm256_loadu_ps(&soa->y[i]));
+        __m256 vz = _mm256_sub_ps(sz, _mm256_loadu_ps(&soa->z[i]));
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, dx), _mm256_mul_ps(vy, dy)), _mm256_mul_ps(vz, dz));
+        __m256 vv = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_sub_ps(vv, _mm256_loadu_ps(&soa->r2[i])));
+        __m256 square_root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+        __m256 neg_b = _mm256_xor_ps(b, sign);
+        __m256 t_neg = _mm256_sub_ps(neg_b, square_root);
+        __m256 t_pos = _mm256_add_ps(neg_b, square_root);
+
+        // strictly closer than the best hit so far keeps the first of equally close entries per lane
+        __m256 unset = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_setzero_si256(), best_index));
+        __m256 mask = _mm256_and_ps(
+                _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), _mm256_cmp_ps(t_pos, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t_neg, lo, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_or_ps(
+                _mm256_cmp_ps(t_neg, best_t, _CMP_LT_OQ),
+                _mm256_and_ps(_mm256_cmp_ps(t_neg, best_t, _CMP_EQ_OQ), unset)));
+        mask = _mm256_and_ps(mask, _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+
+        best_t = _mm256_blendv_ps(best_t, t_neg, mask);
+        best_index = _mm256_castps_si256(
+                _mm256_blendv_ps(_mm256_castsi256_ps(best_index), _mm256_castsi256_ps(index), mask));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    float lane_t[8];
+    int32_t lane_index[8];
+    _mm256_storeu_ps(lane_t, best_t);
+    _mm256_storeu_si256((__m256i *) lane_index, best_index);
+
+    uint32_t closest = NO_SPHERE;
+    float t_smallest = t_max;
+    for (uint32_t lane = 0; lane < 8; lane++) {
+        if (lane_index[lane] < 0) {
+            continue;
+        }
+        if (closest == NO_SPHERE || lane_t[lane] < t_smallest ||
+            (lane_t[lane] == t_smallest && (uint32_t) lane_index[lane] < closest)) {
+            t_smallest = lane_t[lane];
+            closest = (uint32_t) lane_index[lane];
+        }
+    }
+
+    *t = t_smallest;
+
+    return closest;
+}
+
+#endif
+
+typedef uint32_t (*closest_sphere_fn_t)(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t);
+
+static closest_sphere_fn_t closest_sphere_fn = closest_sphere_scalar;
+
+sphere_kernel_t sphere_kernel_select(sphere_kernel_t kernel)
+{
+#ifdef SPHERES_X86
+    __builtin_cpu_init();
+    if ((kernel == KERNEL_AUTO || kernel == KERNEL_AVX2) && __builtin_cpu_supports("avx2")) {
+        closest_sphere_fn = closest_sphere_avx2;
+        return KERNEL_AVX2;
+    }
+    if (kernel != KERNEL_SCALAR && __builtin_cpu_supports("sse2")) {
+        closest_sphere_fn = closest_sphere_sse;
+        return KERNEL_SSE;
+    }
+#else
+    (void) kernel;
+#endif
+
+    closest_sphere_fn = closest_sphere_scalar;
+    return KERNEL_SCALAR;
+}
+
+const char *sphere_kernel_name(sphere_kernel_t kernel)
+{
+    switch (kernel) {
+        case KERNEL_AUTO:
+            return "auto";
+        case KERNEL_SCALAR:
+            return "scalar";
+        case KERNEL_SSE:
+            return "sse";
+        case KERNEL_AVX2:
+            return "avx2";
+    }
+
+    return "unknown";
+}
+
+uint32_t closest_sphere(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t)
+{
+    STATS_ADD(STAT_SPHERE_TESTS, count);
+    return closest_sphere_fn(soa, first, count, ray, t_min, t_max, t);
+}
@@ -0,0 +1,62 @@
+#ifndef RAY_TRACER_SPHERES_H
+#define RAY_TRACER_SPHERES_H
+
+#include <stdint.h>
+#include "util.h"
+
+/** returned by closest_sphere if no sphere is hit */
+#define NO_SPHERE UINT32_MAX
+
+/** number of entries the arrays extend beyond {count}, allowing kernels to read full vectors at the end */
+#define SPHERE_SOA_PADDING 8
+
+/**
+ * packed copy of sphere geometry, structure of arrays to test multiple spheres at once.
+ * entries with a negative {r2} are never hit, and can be used as placeholders for other objects */
+typedef struct {
+    float *x;
+    float *y;
+    float *z;
+    float *r2; // squared radius
+    uint32_t count;
+} sphere_soa_t;
+
+typedef enum {
+    KERNEL_AUTO,   // widest kernel supported by the processor
+    KERNEL_SCALAR,
+    KERNEL_SSE,    // four spheres per instruction
+    KERNEL_AVX2    // eight spheres per instruction
+} sphere_kernel_t;
+
+/** the spheres of SPHERES, in the same order */
+extern sphere_soa_t SPHERES_SOA;
+
+/** allocates {soa} for {count} entries, which are all placeholders */
+void sphere_soa_init(sphere_soa_t *soa, uint32_t count);
+
+/** sets entry {i} of {soa} to the geometry of {sphere} */
+void sphere_soa_set(sphere_soa_t *soa, uint32_t i, const sphere_record_t *sphere);
+
+/** fills {soa} with the spheres in SPHERE_RECORDS, call scene_compile first */
+void sphere_soa_from_scene(sphere_soa_t *soa);
+
+/** frees the memory of {soa} */
+void sphere_soa_free(sphere_soa_t *soa);
+
+/** returns the number of bytes used by the arrays of {soa} */
+size_t sphere_soa_memory(const sphere_soa_t *soa);
+
+/** selects the kernel used by closest_sphere, falling back to narrower kernels if not supported. returns the selection */
+sphere_kernel_t sphere_kernel_select(sphere_kernel_t kernel);
+
+/** returns the name of {kernel} */
+const char *sphere_kernel_name(sphere_kernel_t kernel);
+
+/**
+ * returns the index of the closest entry in [{first}, {first} + {count}) of {soa} that {ray} hits within [t_min, t_max],
+ * or NO_SPHERE if there is none. {t} contains the distance to the hit, which equals hit.t of reflect_sphere.
+ * of equally close entries the first is returned */
+uint32_t closest_sphere(
+        const sphere_soa_t *soa, uint32_t first, uint32_t count, ray_t ray, float t_min, float t_max, float *t);
+
+#endif //RAY_TRACER_SPHERES_H
@@ -0,0 +1,92 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef USE_STATS
+/** statistics of threads that are not tracing, discarded */
+static stats_t STATS_DISCARDED;
+
+__thread stats_t *STATS = &STATS_DISCARDED;
+#endif
+
+static const char *COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+        "rays_primary", "rays_reflection", "rays_refraction", "rays_culled", "rays_shadow",
+        "shadow_cached", "shadow_blocked", "lights_skipped", "sphere_tests", "plane_tests", "triangle_tests",
+        "node_visits"
+};
+
+static const char *TIMER_NAMES[STAT_TIMER_COUNT] = {
+        "trace", "intersect", "lighting", "shadow", "load", "build", "render", "write"
+};
+
+void stats_add(stats_t *a, const stats_t *b)
+{
+    for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++) {
+        a->counters[i] += b->counters[i];
+    }
+    for (uint32_t i = 0; i < STAT_TIMER_COUNT; i++) {
+        a->timers[i] += b->timers[i];
+    }
+}
+
+/** returns {a} / {b}, or 0 if {b} is 0 */
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double) a / (double) b : 0.;
+}
+
+void stats_print(const stats_t *stats, FILE *file)
+{
+    const uint64_t *c = stats->counters;
+    const uint64_t *t = stats->timers;
+    uint64_t rays = c[STAT_RAYS_PRIMARY] + c[STAT_RAYS_REFLECTION] + c[STAT_RAYS_REFRACTION];
+    uint64_t tests = c[STAT_SPHERE_TESTS] + c[STAT_PLANE_TESTS] + c[STAT_TRIANGLE_TESTS];
+
+    fprintf(file, "rays:               %llu primary, %llu reflection, %llu refraction, %llu culled\n",
+            (unsigned long long) c[STAT_RAYS_PRIMARY], (unsigned long long) c[STAT_RAYS_REFLECTION],
+            (unsigned long long) c[STAT_RAYS_REFRACTION], (unsigned long long) c[STAT_RAYS_CULLED]);
+    fprintf(file, "shadow rays:        %llu, %.1f%% blocked by the cached occluder, %.1f%% stopped early, "
+                  "%llu lights skipped\n",
+            (unsigned long long) c[STAT_RAYS_SHADOW], 100. * ratio(c[STAT_SHADOW_CACHED], c[STAT_RAYS_SHADOW]),
+            100. * ratio(c[STAT_SHADOW_BLOCKED], c[STAT_RAYS_SHADOW]), (unsigned long long) c[STAT_LIGHTS_SKIPPED]);
+    fprintf(file, "intersection tests: %llu spheres, %llu planes, %llu triangles, %llu nodes (%.1f tests per ray)\n",
+            (unsigned long long) c[STAT_SPHERE_TESTS], (unsigned long long) c[STAT_PLANE_TESTS],
+            (unsigned long long) c[STAT_TRIANGLE_TESTS], (unsigned long long) c[STAT_NODE_VISITS],
+            ratio(tests, rays + c[STAT_RAYS_SHADOW]));
+    fprintf(file, "thread time:        trace %.1f ms (intersect %.1f ms, lighting %.1f ms, of which shadow %.1f ms)\n",
+            t[STAT_TIMER_TRACE] / 1e6, t[STAT_TIMER_INTERSECT] / 1e6, t[STAT_TIMER_LIGHTING] / 1e6,
+            t[STAT_TIMER_SHADOW] / 1e6);
+    fprintf(file, "wall time:          load %.1f ms, build %.1f ms, render %.1f ms, write %.1f ms\n",
+            t[STAT_TIMER_LOAD] / 1e6, t[STAT_TIMER_BUILD] / 1e6, t[STAT_TIMER_RENDER] / 1e6,
+            t[STAT_TIMER_WRITE] / 1e6);
+    fprintf(file, "throughput:         %.2f Mrays/s (camera, reflection, refraction and shadow rays)\n",
+            ratio(rays + c[STAT_RAYS_SHADOW], t[STAT_TIMER_RENDER]) * 1e3);
+}
+
+bool stats_write_json(const stats_t *stats, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "{\n  \"counters\": {");
+    for (uint32_t i = 0; i < STAT_COUNTER_COUNT; i++) {
+        fprintf(file, "%s\n    \"%s\": %llu", i ? "," : "", COUNTER_NAMES[i], (unsigned long long) stats->counters[i]);
+    }
+    fprintf(file, "\n  },\n  \"timers_ns\": {");
+    for (uint32_t i = 0; i < STAT_TIMER_COUNT; i++) {
+        fprintf(file, "%s\n    \"%s\": %llu", i ? "," : "", TIMER_NAMES[i], (unsigned long long) stats->timers[i]);
+    }
+    fprintf(file, "\n  }\n}\n");
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write statistics\n", path);
+    }
+
+    return ok;
+}
@@ -0,0 +1,98 @@
+#ifndef RAY_TRACER_STATS_H
+#define RAY_TRACER_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+/** events counted while tracing */
+typedef enum {
+    STAT_RAYS_PRIMARY,      // camera rays
+    STAT_RAYS_REFLECTION,   // traced reflections
+    STAT_RAYS_REFRACTION,   // traced refractions
+    STAT_RAYS_CULLED,       // reflections and refractions not traced because of their small weight
+    STAT_RAYS_SHADOW,       // rays towards non-ambient lights
+    STAT_SHADOW_CACHED,     // shadow rays blocked by the cached occluder of the light
+    STAT_SHADOW_BLOCKED,    // shadow rays that stopped at an opaque object
+    STAT_LIGHTS_SKIPPED,    // lights not shaded at a hit: out of reach, below the threshold or not drawn
+    STAT_SPHERE_TESTS,      // ray/sphere intersection tests
+    STAT_PLANE_TESTS,       // ray/plane intersection tests
+    STAT_TRIANGLE_TESTS,    // ray/triangle intersection tests
+    STAT_NODE_VISITS,       // hierarchy nodes visited by single rays
+    STAT_COUNTER_COUNT
+} stat_counter_t;
+
+/** phases of which the time is measured */
+typedef enum {
+    STAT_TIMER_TRACE,       // trace_ray and trace_packet, summed over threads
+    STAT_TIMER_INTERSECT,   // closest object queries, summed over threads
+    STAT_TIMER_LIGHTING,    // compute_lighting, summed over threads
+    STAT_TIMER_SHADOW,      // shadow queries as part of lighting, summed over threads
+    STAT_TIMER_LOAD,        // loading the scene
+    STAT_TIMER_BUILD,       // preparing the scene for tracing
+    STAT_TIMER_RENDER,      // rendering the image
+    STAT_TIMER_WRITE,       // writing the image, the part that did not overlap with rendering
+    STAT_TIMER_COUNT
+} stat_timer_t;
+
+typedef struct {
+    uint64_t counters[STAT_COUNTER_COUNT];
+    uint64_t timers[STAT_TIMER_COUNT]; // nanoseconds
+    uint32_t random; // state of the generator selecting the timed calls
+} stats_t;
+
+/** reading the clock costs more than some timed phases, so one in this many calls is timed and counted this often */
+#define STATS_TIMER_SAMPLING 64
+
+/** returns whether to time the current call, calls are selected at random as the order of calls is regular */
+static inline bool stats_sample(stats_t *stats)
+{
+    // xorshift
+    uint32_t x = stats->random ? stats->random : 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    stats->random = x;
+
+    return x % STATS_TIMER_SAMPLING == 0;
+}
+
+/** returns a monotonic time in nanoseconds */
+static inline uint64_t stats_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+#ifdef USE_STATS
+/** statistics of the calling thread, bound to those in its trace context by STATS_BIND */
+extern __thread stats_t *STATS;
+
+#define STATS_ENABLED 1
+#define STATS_BIND(stats) (STATS = (stats))
+#define STATS_ADD(counter, n) (STATS->counters[counter] += (n))
+#define STATS_TIME_BEGIN(timer) \
+    const uint64_t timer##_begin = stats_sample(STATS) ? stats_now() : 0
+#define STATS_TIME_END(timer) \
+    (timer##_begin ? (void) (STATS->timers[timer] += (stats_now() - timer##_begin) * STATS_TIMER_SAMPLING) : (void) 0)
+#else
+#define STATS_ENABLED 0
+#define STATS_BIND(stats) ((void) 0)
+#define STATS_ADD(counter, n) ((void) (counter), (void) (n))
+#define STATS_TIME_BEGIN(timer) ((void) 0)
+#define STATS_TIME_END(timer) ((void) 0)
+#endif
+
+/** adds the counters and timers of {b} to {a} */
+void stats_add(stats_t *a, const stats_t *b);
+
+/** prints a summary of {stats} to {file} */
+void stats_print(const stats_t *stats, FILE *file);
+
+/** writes {stats} as a json object to file {path}, returns false on failure */
+bool stats_write_json(const stats_t *stats, const char *path);
+
+#endif //RAY_TRACER_STATS_H
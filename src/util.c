@@ -1,7 +1,46 @@
 #include "util.h"
 #include "scene.h"
+#include "bvh.h"
+#include "lights.h"
+#include "render_cache.h"
+#include "spheres.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 const float T_CLOSE = 0.005f;
+const float MIN_RAY_WEIGHT = 1.f / 256.f;
+
+size_t trace_context_memory(uint32_t depth)
+{
+    size_t lights = LIGHTS_SIZE > 0 ? LIGHTS_SIZE : 1;
+    return arena_size(lights * sizeof(object_t)) + arena_size((depth + 1) * sizeof(pending_ray_t)) +
+           arena_size(lights * sizeof(light_sample_t)) + arena_size(lights * sizeof(uint32_t)) +
+           arena_size(lights * sizeof(float));
+}
+
+void trace_context_init(trace_context_t *context, arena_t *arena, uint32_t depth)
+{
+    size_t lights = LIGHTS_SIZE > 0 ? LIGHTS_SIZE : 1;
+    context->occluders = arena_alloc(arena, MEMORY_THREADS, lights * sizeof(object_t));
+    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
+        context->occluders[i].type = OBJECT_SPHERE;
+        context->occluders[i].index = NO_OBJECT;
+    }
+    // a ray pushes at most two rays of one less depth, one of which waits while the other is traced, so the stack of a
+    // camera ray never holds more than depth + 1 rays
+    context->rays = arena_alloc(arena, MEMORY_THREADS, (depth + 1) * sizeof(pending_ray_t));
+    context->rays_size = 0;
+    context->min_weight = MIN_RAY_WEIGHT;
+    context->light_threshold = 0.f;
+    context->light_samples = 0;
+    context->selected = arena_alloc(arena, MEMORY_THREADS, lights * sizeof(light_sample_t));
+    context->light_candidates = arena_alloc(arena, MEMORY_THREADS, lights * sizeof(uint32_t));
+    context->light_weights = arena_alloc(arena, MEMORY_THREADS, lights * sizeof(float));
+    context->record = NULL;
+    memset(&context->stats, 0, sizeof(stats_t));
+}
 
 vec3f reflect(vec3f ray, vec3f normal)
 {
@@ -11,10 +50,11 @@ vec3f reflect(vec3f ray, vec3f normal)
     ));
 }
 
-bool reflect_sphere(hit_t *hit, ray_t ray, sphere_t sphere)
+bool reflect_sphere(hit_t *hit, ray_t ray, const sphere_record_t *sphere)
 {
-    vec3f v = vec3f_sub(ray.start, sphere.center);
-    float discriminant = powf(vec3f_dot(v, ray.direction), 2) - (vec3f_dot(v, v) - powf(sphere.radius, 2));
+    vec3f v = vec3f_sub(ray.start, sphere->center);
+    float b = vec3f_dot(v, ray.direction);
+    float discriminant = b * b - (vec3f_dot(v, v) - sphere->radius2);
 
     if (discriminant < 0) {
         // quantity under the square root is negative, no intersection
@@ -22,8 +62,8 @@ bool reflect_sphere(hit_t *hit, ray_t ray, sphere_t sphere)
     }
 
     float square_root = sqrtf(discriminant);
-    float t_neg = -vec3f_dot(v, ray.direction) - square_root;
-    float t_pos = -vec3f_dot(v, ray.direction) + square_root;
+    float t_neg = -b - square_root;
+    float t_pos = -b + square_root;
 
     if (t_neg < 0 && t_pos < 0) {
         // no positive solution, no intersection
@@ -34,10 +74,10 @@ bool reflect_sphere(hit_t *hit, ray_t ray, sphere_t sphere)
     hit->t = fminf(t_neg, t_pos);
 
     // intersection point of ray and sphere
-    vec3f y = vec3f_add(ray.start, vec3f_scale(ray.direction, hit->t));
+    vec3f y = vec3f_madd(ray.start, ray.direction, hit->t);
 
     // normal to the sphere
-    hit->normal = vec3f_norm(vec3f_sub(y, sphere.center));
+    hit->normal = vec3f_norm(vec3f_sub(y, sphere->center));
 
     // reflection direction
     vec3f r = reflect(vec3f_norm(ray.direction), hit->normal);
@@ -48,59 +88,167 @@ bool reflect_sphere(hit_t *hit, ray_t ray, sphere_t sphere)
     return true;
 }
 
-bool reflect_plane(hit_t *hit, ray_t ray, plane_t plane)
+/** returns whether point {y} of the plane of bounded {plane} lies within its bounds */
+static bool plane_contains(const plane_record_t *plane, vec3f y)
+{
+    vec3f a = vec3f_sub(y, plane->point);
+
+    // scalar projection of a on the first direction
+    float a_n = vec3f_dot(a, plane->first);
+    if (a_n < 0 || a_n > plane->first_length) {
+        return false;
+    }
+
+    // scalar projection of a on the second direction
+    float a_m = vec3f_dot(a, plane->second);
+
+    return a_m >= 0 && a_m <= plane->second_length;
+}
+
+bool reflect_plane(hit_t *hit, ray_t ray, const plane_record_t *plane)
 {
-    vec3f normal = vec3f_norm(plane.normal);
-    float denominator = vec3f_dot(ray.direction, normal);
+    STATS_ADD(STAT_PLANE_TESTS, 1);
+    float denominator = vec3f_dot(ray.direction, plane->normal);
 
     if (fabsf(denominator) == 0.f) {
         // direction and plane parallel, no intersection
         return false;
     }
 
-    float t = vec3f_dot(vec3f_sub(plane.point, ray.start), normal) / denominator;
+    float t = vec3f_dot(vec3f_sub(plane->point, ray.start), plane->normal) / denominator;
     if (t < 0) {
         // plane behind ray's origin, no intersection
         return false;
     }
 
-    // reflected direction
-    vec3f r = reflect(ray.direction, normal);
-
     // hit point
-    vec3f y = vec3f_add(ray.start, vec3f_scale(ray.direction, t));
-
-    if (plane.type == PLANE_BOUNDED) {
-        // if plane is bounded, perform containment checks
-        vec3f a = vec3f_sub(y, plane.point);
+    vec3f y = vec3f_madd(ray.start, ray.direction, t);
 
-        // scalar projection of a on the first direction
-        float a_n = vec3f_dot(a, vec3f_norm(plane.first));
-        if (a_n < 0 || a_n > vec3f_len(plane.first)) {
-            return false;
-        }
-
-        // scalar projection of a on the second direction
-        float a_m = vec3f_dot(a, vec3f_norm(plane.second));
-        if (a_m < 0 || a_m > vec3f_len(plane.second)) {
-            return false;
-        }
+    if (plane->type == PLANE_BOUNDED && !plane_contains(plane, y)) {
+        // if plane is bounded, the hit point should lie within its bounds
+        return false;
     }
 
     hit->t = t;
     hit->reflect.start = y;
-    hit->reflect.direction = r;
-    hit->normal = normal;
+    hit->reflect.direction = reflect(ray.direction, plane->normal);
+    hit->normal = plane->normal;
 
     return true;
 }
 
-float compute_lighting(ray_t origin, vec3f normal, ray_t reflected, float shininess)
+bool occludes_sphere(ray_t ray, const sphere_record_t *sphere, float t_min, float t_max)
+{
+    STATS_ADD(STAT_SPHERE_TESTS, 1);
+    // same terms as reflect_sphere, so both agree on the distance
+    vec3f v = vec3f_sub(ray.start, sphere->center);
+    float b = vec3f_dot(v, ray.direction);
+    float discriminant = b * b - (vec3f_dot(v, v) - sphere->radius2);
+    if (discriminant < 0) {
+        return false;
+    }
+
+    float square_root = sqrtf(discriminant);
+    if (-b + square_root < 0) {
+        // no positive solution
+        return false;
+    }
+
+    float t = -b - square_root;
+
+    return t_min < t && t < t_max;
+}
+
+bool occludes_plane(ray_t ray, const plane_record_t *plane, float t_min, float t_max)
+{
+    STATS_ADD(STAT_PLANE_TESTS, 1);
+    float denominator = vec3f_dot(ray.direction, plane->normal);
+    if (fabsf(denominator) == 0.f) {
+        return false;
+    }
+
+    float t = vec3f_dot(vec3f_sub(plane->point, ray.start), plane->normal) / denominator;
+    if (t < 0 || !(t_min < t && t < t_max)) {
+        return false;
+    }
+
+    return plane->type != PLANE_BOUNDED ||
+           plane_contains(plane, vec3f_madd(ray.start, ray.direction, t));
+}
+
+bool occludes_object(ray_t ray, object_t object, float t_min, float t_max)
+{
+    switch (object.type) {
+        case OBJECT_SPHERE:
+            return occludes_sphere(ray, &SPHERE_RECORDS[object.index], t_min, t_max);
+        case OBJECT_PLANE:
+            return occludes_plane(ray, &PLANE_RECORDS[object.index], t_min, t_max);
+        default:
+            return mesh_occludes(&MESHES[object.index], ray, t_min, t_max);
+    }
+}
+
+ray_t get_light_ray(const light_t *light, vec3f point, float *t_max)
+{
+    /** compute direction to light */
+    vec3f l; // direction to the light
+    *t_max = FLT_MAX;
+    if (light->type == LIGHT_POINT) {
+        l = vec3f_norm(vec3f_sub(light->v.location, point));
+        *t_max = 1.f; // prevent creating shadows beyond the light source
+    } else { // if (light->type == LIGHT_DIRECTION)
+        l = vec3f_norm(light->v.direction);
+    }
+
+    ray_t intersection_to_light = {.start=point, .direction=l};
+
+    return intersection_to_light;
+}
+
+float add_light(
+        float intensity, const light_t *light, vec3f l, float shadow_factor,
+        ray_t origin, vec3f normal, ray_t reflected, float shininess)
 {
+    if (shadow_factor == 0.f) {
+        // objects let no light through, no diffuse and specular contributions
+        return intensity;
+    }
+
+    /** diffuse contribution */
+    float ln = vec3f_dot(l, normal);
+    if (ln > 0.f) {
+        intensity += shadow_factor * light->intensity * ln;
+    }
+
+    /** specular contribution */
+    if (shininess != -1.f) {
+        // if there is a specular component
+        vec3f e = vec3f_norm(vec3f_sub(origin.start, reflected.start)); // direction to the eye
+        vec3f h = vec3f_norm(vec3f_add(e, l));
+        float hn = vec3f_dot(h, reflected.direction);
+        if (hn > 0.f) {
+            intensity += shadow_factor * light->intensity * powf(hn, shininess);
+        }
+    }
+
+    return intensity;
+}
+
+float clamp_intensity(float intensity)
+{
+    // clamp to ensure [0, 1]
+    return intensity > 1.f ? 1.f : intensity < 0.f ? 0.f : intensity;
+}
+
+float compute_lighting(trace_context_t *context, ray_t origin, vec3f normal, ray_t reflected, float shininess)
+{
+    STATS_TIME_BEGIN(STAT_TIMER_LIGHTING);
     float intensity = 0.f;
 
-    for (uint32_t i = 0; i < LIGHTS_SIZE; i++) {
-        const light_t *light = &LIGHTS[i];
+    light_sample_t *samples = context->selected;
+    uint32_t count = light_select(context, reflected.start, samples);
+    for (uint32_t i = 0; i < count; i++) {
+        const light_t *light = &LIGHTS[samples[i].light];
 
         /** compute ambient contribution */
         if (light->type == LIGHT_AMBIENT) {
@@ -108,61 +256,56 @@ float compute_lighting(ray_t origin, vec3f normal, ray_t reflected, float shinin
             continue;
         }
 
-        /** compute direction to light */
-        vec3f l; // direction to the light
-        float t_max = FLT_MAX;
-        if (light->type == LIGHT_POINT) {
-            l = vec3f_norm(vec3f_sub(light->v.location, reflected.start));
-            t_max = 1.f; // prevent creating shadows beyond the light source
-        } else { // if (light->type == LIGHT_DIRECTION)
-            l = vec3f_norm(light->v.direction);
-        }
-
         /** compute how much light the objects between intersection and light let trough */
-        ray_t intersection_to_light = {.start=reflected.start, .direction=l};
+        float t_max;
+        ray_t intersection_to_light = get_light_ray(light, reflected.start, &t_max);
         // t_min = TCLOSE to prevent casting shadow on itself
-        float shadow_factor = get_shadow_factor(intersection_to_light, T_CLOSE, t_max);
-        if (shadow_factor == 0.f) {
-            // objects let no light through, no diffuse and specular contributions
-            continue;
+        STATS_TIME_BEGIN(STAT_TIMER_SHADOW);
+        STATS_ADD(STAT_RAYS_SHADOW, 1);
+        float shadow_factor = get_shadow_factor(
+                intersection_to_light, T_CLOSE, t_max, &context->occluders[samples[i].light]);
+        STATS_TIME_END(STAT_TIMER_SHADOW);
+        if (context->record) {
+            trace_record_shadow(context->record, intersection_to_light, T_CLOSE, t_max, samples[i].light);
         }
 
-        /** diffuse contribution */
-        float ln = vec3f_dot(l, normal);
-        if (ln > 0.f) {
-            intensity += shadow_factor * light->intensity * ln;
-        }
+        intensity = add_light(
+                intensity, light, intersection_to_light.direction, shadow_factor * samples[i].scale, origin, normal,
+                reflected, shininess);
+    }
 
-        /** specular contribution */
-        if (shininess != -1.f) {
-            // if there is a specular component
-            vec3f e = vec3f_norm(vec3f_sub(origin.start, reflected.start)); // direction to the eye
-            vec3f h = vec3f_norm(vec3f_add(e, l));
-            float hn = vec3f_dot(h, reflected.direction);
-            if (hn > 0.f) {
-                intensity += shadow_factor * light->intensity * powf(hn, shininess);
-            }
-        }
+    STATS_TIME_END(STAT_TIMER_LIGHTING);
+    return clamp_intensity(intensity);
+}
+
+bool get_closest_sphere(hit_t *reflected, uint32_t *sphere, ray_t origin, float t_min, float t_max)
+{
+    // find the closest sphere on the packed geometry, only compute the full hit for that sphere
+    float t;
+    uint32_t closest = closest_sphere(&SPHERES_SOA, 0, SPHERES_SOA.count, origin, t_min, t_max, &t);
+    if (closest == NO_SPHERE) {
+        return false;
     }
 
-    // clamp to ensure [0, 1]
-    intensity = intensity > 1.f ? 1.f : intensity < 0.f ? 0.f : intensity;
-    return intensity;
+    *sphere = closest;
+    reflect_sphere(reflected, origin, &SPHERE_RECORDS[closest]);
+
+    return true;
 }
 
-bool get_closest_sphere(hit_t *reflected, sphere_t *sphere, ray_t origin, float t_min, float t_max)
+bool get_closest_plane(hit_t *reflected, uint32_t *plane, ray_t origin, float t_min, float t_max)
 {
     float t_smallest;
     bool found_one = false;
-    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
+    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
         hit_t hit;
-        if (reflect_sphere(&hit, origin, SPHERES[i])) {
+        if (reflect_plane(&hit, origin, &PLANE_RECORDS[i])) {
             if ((!found_one && hit.t >= t_min && hit.t <= t_max) ||
                 (hit.t < t_smallest && hit.t >= t_min && hit.t <= t_max)) {
                 t_smallest = hit.t;
                 found_one = true;
 
-                *sphere = SPHERES[i];
+                *plane = i;
                 *reflected = hit;
             }
         }
@@ -171,167 +314,281 @@ bool get_closest_sphere(hit_t *reflected, sphere_t *sphere, ray_t origin, float
     return found_one;
 }
 
-bool get_closest_plane(hit_t *reflected, plane_t *plane, ray_t origin, float t_min, float t_max)
+bool get_closest_mesh(hit_t *reflected, uint32_t *mesh, ray_t origin, float t_min, float t_max)
 {
-    float t_smallest;
     bool found_one = false;
-    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
-        hit_t hit;
-        if (reflect_plane(&hit, origin, PLANES[i])) {
-            if ((!found_one && hit.t >= t_min && hit.t <= t_max) ||
-                (hit.t < t_smallest && hit.t >= t_min && hit.t <= t_max)) {
-                t_smallest = hit.t;
-                found_one = true;
+    for (uint32_t i = 0; i < MESHES_SIZE; i++) {
+        // each mesh only reports hits closer than the closest so far
+        if (mesh_closest(&MESHES[i], reflected, origin, t_min, t_max)) {
+            t_max = reflected->t;
+            found_one = true;
 
-                *plane = PLANES[i];
-                *reflected = hit;
-            }
+            *mesh = i;
         }
     }
 
     return found_one;
 }
 
-vec3f trace_ray(ray_t ray, uint32_t depth, float t_min, float t_max)
+bool get_closest_object(hit_t *reflected, object_t *object, ray_t origin, float t_min, float t_max)
 {
+#ifdef USE_BVH
+    return bvh_closest(&BVH, reflected, object, origin, t_min, t_max);
+#else
     /** check sphere intersection */
-    sphere_t closest_sphere; // sphere that has the closest intersection with the ray
-    hit_t sphere_hit;               // ray reflecting of closest sphere
-    bool sphere_intersect = get_closest_sphere(&sphere_hit, &closest_sphere, ray, t_min, t_max);
+    uint32_t closest_sphere; // sphere that has the closest intersection with the ray
+    hit_t sphere_hit;        // ray reflecting of closest sphere
+    bool sphere_intersect = get_closest_sphere(&sphere_hit, &closest_sphere, origin, t_min, t_max);
 
     /** check plane intersection */
-    plane_t closest_plane;
+    uint32_t closest_plane;
     hit_t plane_hit;
-    bool plane_intersect = get_closest_plane(&plane_hit, &closest_plane, ray, t_min, t_max);
+    bool plane_intersect = get_closest_plane(&plane_hit, &closest_plane, origin, t_min, t_max);
 
     if (!sphere_intersect && !plane_intersect) {
-        // if the ray does not hit an object, use the background color
-        vec3f background_color = BACKGROUND;
-        return background_color;
+        // meshes are tested last, so they do not change which of a sphere and a plane at the same distance is hit
+        if (get_closest_mesh(reflected, &object->index, origin, t_min, t_max)) {
+            object->type = OBJECT_MESH;
+            return true;
+        }
+        return false;
     }
 
-    /** properties of the intersected object */
-    material_t material;
-    hit_t hit;
     if ((sphere_intersect && !plane_intersect) || (sphere_intersect && sphere_hit.t < plane_hit.t)) {
-        material = closest_sphere.material;
-        hit = sphere_hit;
+        object->type = OBJECT_SPHERE;
+        object->index = closest_sphere;
+        *reflected = sphere_hit;
     } else { // (!sphere_intersect && plane_intersect) || (plane_intersect && sphere_hit.t >= plane_hit.t)
-        material = closest_plane.material;
-        hit = plane_hit;
+        object->type = OBJECT_PLANE;
+        object->index = closest_plane;
+        *reflected = plane_hit;
+    }
 
-        if (closest_plane.checkered_xz) {
+    /** meshes have to be strictly closer than the sphere or plane */
+    hit_t mesh_hit;
+    uint32_t closest_mesh;
+    if (get_closest_mesh(&mesh_hit, &closest_mesh, origin, t_min, reflected->t) && mesh_hit.t < reflected->t) {
+        object->type = OBJECT_MESH;
+        object->index = closest_mesh;
+        *reflected = mesh_hit;
+    }
+
+    return true;
+#endif
+}
+
+uint32_t get_object_count(void)
+{
+    return SPHERES_SIZE + PLANES_SIZE + MESHES_SIZE;
+}
+
+object_t get_object(uint32_t i)
+{
+    object_t object;
+    if (i < SPHERES_SIZE) {
+        object.type = OBJECT_SPHERE;
+        object.index = i;
+    } else if (i < SPHERES_SIZE + PLANES_SIZE) {
+        object.type = OBJECT_PLANE;
+        object.index = i - SPHERES_SIZE;
+    } else {
+        object.type = OBJECT_MESH;
+        object.index = i - SPHERES_SIZE - PLANES_SIZE;
+    }
+
+    return object;
+}
+
+material_t get_material(object_t object, const hit_t *hit)
+{
+    /** properties of the intersected object */
+    material_t material;
+    if (object.type == OBJECT_SPHERE) {
+        material = SPHERES[object.index].material;
+    } else if (object.type == OBJECT_MESH) {
+        material = MESHES[object.index].material;
+    } else {
+        const plane_t *closest_plane = &PLANES[object.index];
+        material = closest_plane->material;
+
+        if (closest_plane->checkered_xz) {
             // if a checker pattern should be applied in x/y-plane
-            if (hit.reflect.start.x * hit.reflect.start.z > 0) {
+            if (hit->reflect.start.x * hit->reflect.start.z > 0) {
                 // components have different sign
-                if (((signed) hit.reflect.start.x + (signed) hit.reflect.start.z) % 2) {
-                    material.color = closest_plane.checker_color;
+                if (((signed) hit->reflect.start.x + (signed) hit->reflect.start.z) % 2) {
+                    material.color = closest_plane->checker_color;
                 }
             } else {
                 // components have same sign (flip pattern)
-                if (((signed) hit.reflect.start.x + (signed) hit.reflect.start.z + 1) % 2) {
-                    material.color = closest_plane.checker_color;
+                if (((signed) hit->reflect.start.x + (signed) hit->reflect.start.z + 1) % 2) {
+                    material.color = closest_plane->checker_color;
                 }
             }
         }
     }
 
-    float intensity = compute_lighting(ray, hit.normal, hit.reflect, material.shininess);
-    // the color of the closest sphere the ray hits
-    vec3f color_intersection = vec3f_scale(material.color, intensity);
+    return material;
+}
+
+/** pushes {ray} of {weight} onto the ray stack of {context} */
+static void push_ray(trace_context_t *context, ray_t ray, float weight, float t_min, uint32_t depth)
+{
+    pending_ray_t *pending = &context->rays[context->rays_size++];
+    pending->ray = ray;
+    pending->weight = weight;
+    pending->t_min = t_min;
+    pending->depth = depth;
+}
+
+/**
+ * pushes reflection or refraction {ray} of {weight}, unless it contributes too little to be traced.
+ * {counter} counts the ray if it is traced */
+static void push_secondary_ray(
+        trace_context_t *context, ray_t ray, float weight, uint32_t depth, stat_counter_t counter)
+{
+    if (weight > 0.f && weight >= context->min_weight) {
+        STATS_ADD(counter, 1);
+        push_ray(context, ray, weight, T_CLOSE, depth);
+    } else {
+        STATS_ADD(STAT_RAYS_CULLED, 1);
+    }
+}
+
+vec3f shade_pending(
+        trace_context_t *context, const pending_ray_t *pending, const hit_t *hit, const material_t *material,
+        float intensity, vec3f color)
+{
+    // the color of the closest object the ray hits
+    vec3f color_intersection = vec3f_scale(material->color, intensity);
+    float weight = pending->weight;
 
-    if (depth == 0) {
+    if (pending->depth == 0 || material->reflection.type == NONE) {
         // if max depth is reached, do not reflect or refract ray
-        return color_intersection;
+        return vec3f_madd(color, color_intersection, weight);
     }
 
-    /** compute reflective color */
-    vec3f reflected_color;
-    if (material.reflection.type == REFLECTIVE || material.reflection.type == REFLECTIVE_REFRACTIVE) {
-        // recursive call
-        reflected_color = trace_ray(hit.reflect, depth - 1, T_CLOSE, t_max);
+    if (material->reflection.type == REFLECTIVE) {
+        // color is determined by color of intersection and reflection
+        float reflectiveness = material->reflection.fraction.reflectiveness;
+        push_secondary_ray(context, hit->reflect, weight * reflectiveness, pending->depth - 1, STAT_RAYS_REFLECTION);
+        return vec3f_add(color, vec3f_scale(color_intersection, weight * (1.f - reflectiveness)));
     }
 
     /** common code for REFRACTIVE and REFLECTIVE_REFRACTIVE */
-    float cos_i = vec3f_dot(hit.normal, ray.direction); // cosine of angle of incidence
+    ray_t ray = pending->ray;
+    float cos_i = vec3f_dot(hit->normal, ray.direction); // cosine of angle of incidence
     float eta_i; // refractive index of the material the ray is in
     float eta_t; // refractive index of the material the refractive ray is in
     vec3f n; // vector pointing into the material the ray is going into
     if (cos_i < 0) {
         // ray hits outside of sphere
         eta_i = 1.f;
-        eta_t = material.reflection.refractive_index;
-        n = hit.normal;
+        eta_t = material->reflection.refractive_index;
+        n = hit->normal;
         cos_i = -cos_i; // cos_i needs to be positive
     } else {
         // ray hits inside of sphere
-        eta_i = material.reflection.refractive_index;
+        eta_i = material->reflection.refractive_index;
         eta_t = 1.f;
-        n = vec3f_scale(hit.normal, -1.f);
+        n = vec3f_scale(hit->normal, -1.f);
     }
 
-    /** compute refractive color */
-    vec3f refracted_color;
-    if (material.reflection.type == REFRACTIVE || material.reflection.type == REFLECTIVE_REFRACTIVE) {
-        float eta_r = eta_i / eta_t;
-        float discriminant = 1.f - eta_r * eta_r * (1.f - cos_i * cos_i);
-
-        if (discriminant < 0) {
-            // discriminant is negative, total internal refraction
-            return color_intersection;
-        }
+    float eta_r = eta_i / eta_t;
+    float discriminant = 1.f - eta_r * eta_r * (1.f - cos_i * cos_i);
+    if (discriminant < 0) {
+        // discriminant is negative, total internal refraction
+        return vec3f_madd(color, color_intersection, weight);
+    }
 
-        float b = eta_r * cos_i - sqrtf(discriminant);
-        vec3f refraction_dir = vec3f_norm(vec3f_add(vec3f_scale(ray.direction, eta_r), vec3f_scale(n, b)));
-        ray_t refraction = {hit.reflect.start, refraction_dir};
+    float b = eta_r * cos_i - sqrtf(discriminant);
+    vec3f refraction_dir = vec3f_norm(vec3f_add(vec3f_scale(ray.direction, eta_r), vec3f_scale(n, b)));
+    ray_t refraction = {hit->reflect.start, refraction_dir};
 
-        // recursive call
-        refracted_color = trace_ray(refraction, depth - 1, T_CLOSE, t_max);
+    if (material->reflection.type == REFRACTIVE) {
+        // color is determined by color of intersection and refraction
+        float refractiveness = material->reflection.fraction.refractiveness;
+        push_secondary_ray(context, refraction, weight * refractiveness, pending->depth - 1, STAT_RAYS_REFRACTION);
+        return vec3f_add(color, vec3f_scale(color_intersection, weight * (1.f - refractiveness)));
     }
 
+    /** REFLECTIVE_REFRACTIVE: color is determined by color of reflection and refraction */
     float kr; // reflected component
-    float kt; // refracted component
-    if (material.reflection.type == REFLECTIVE_REFRACTIVE) {
-        // use snell's law to compute the reflective and refractive components
-        // sinus of angle of refraction
-        float sin_t = eta_i / eta_t * sqrtf(fmaxf(0.f, 1.f - cos_i * cos_i));
-
-        if (sin_t >= 1.f) {
-            // total internal reflection, only reflection
-            kr = 1.f;
-        } else {
-            // cosinus of angle of refraction
-            float cos_t = sqrtf(fmaxf(0.f, 1.f - sin_t * sin_t));
-            float r_parallel = ((eta_t * cos_i) - (eta_i * cos_t)) / ((eta_t * cos_i) + (eta_i * cos_t));
-            float r_perpendicular = ((eta_i * cos_i) - (eta_t * cos_t)) / ((eta_i * cos_i) + (eta_t * cos_t));
-            kr = (r_parallel * r_parallel + r_perpendicular * r_perpendicular) / 2.f;
+    // use snell's law to compute the reflective and refractive components
+    // sinus of angle of refraction
+    float sin_t = eta_i / eta_t * sqrtf(fmaxf(0.f, 1.f - cos_i * cos_i));
+    if (sin_t >= 1.f) {
+        // total internal reflection, only reflection
+        kr = 1.f;
+    } else {
+        // cosinus of angle of refraction
+        float cos_t = sqrtf(fmaxf(0.f, 1.f - sin_t * sin_t));
+        float r_parallel = ((eta_t * cos_i) - (eta_i * cos_t)) / ((eta_t * cos_i) + (eta_i * cos_t));
+        float r_perpendicular = ((eta_i * cos_i) - (eta_t * cos_t)) / ((eta_i * cos_i) + (eta_t * cos_t));
+        kr = (r_parallel * r_parallel + r_perpendicular * r_perpendicular) / 2.f;
+    }
+    float kt = 1.f - kr; // refracted component
+
+    // the reflection is pushed last, so it is traced first
+    push_secondary_ray(context, refraction, weight * kt, pending->depth - 1, STAT_RAYS_REFRACTION);
+    push_secondary_ray(context, hit->reflect, weight * kr, pending->depth - 1, STAT_RAYS_REFLECTION);
+
+    return color;
+}
+
+/** returns {color} plus the weighted colors of the rays on the stack of {context} above {base}, which are popped */
+static vec3f trace_pending(trace_context_t *context, uint32_t base, float t_max, vec3f color)
+{
+    while (context->rays_size > base) {
+        pending_ray_t pending = context->rays[--context->rays_size];
+
+        object_t object; // object that has the closest intersection with the ray
+        hit_t hit;       // ray reflecting of closest object
+        STATS_TIME_BEGIN(STAT_TIMER_INTERSECT);
+        bool found = get_closest_object(&hit, &object, pending.ray, pending.t_min, t_max);
+        STATS_TIME_END(STAT_TIMER_INTERSECT);
+        if (context->record) {
+            trace_record_ray(
+                    context->record, pending.ray, pending.t_min, found ? hit.t : t_max, pending.depth,
+                    found ? &object : NULL);
+        }
+        if (!found) {
+            // if the ray does not hit an object, use the background color
+            color = vec3f_madd(color, BACKGROUND, pending.weight);
+            continue;
         }
 
-        kt = 1.f - kr;
+        material_t material = get_material(object, &hit);
+        float intensity = compute_lighting(context, pending.ray, hit.normal, hit.reflect, material.shininess);
+        color = shade_pending(context, &pending, &hit, &material, intensity, color);
     }
 
-    switch (material.reflection.type) {
-        case NONE:
-            return color_intersection;
-        case REFLECTIVE:
-            // color is determined by color of intersection and reflection
-            return vec3f_add(
-                    vec3f_scale(color_intersection, 1.f - material.reflection.fraction.reflectiveness),
-                    vec3f_scale(reflected_color, material.reflection.fraction.reflectiveness)
-            );
-        case REFRACTIVE:
-            // color is determined by color of intersection and refraction
-            return vec3f_add(
-                    vec3f_scale(color_intersection, 1.f - material.reflection.fraction.refractiveness),
-                    vec3f_scale(refracted_color, material.reflection.fraction.refractiveness)
-            );
-        case REFLECTIVE_REFRACTIVE:
-            // color is determined by color of reflection and refraction
-            return vec3f_add(
-                    vec3f_scale(reflected_color, kr),
-                    vec3f_scale(refracted_color, kt)
-            );
-    }
+    return color;
+}
+
+vec3f trace_ray(trace_context_t *context, ray_t ray, uint32_t depth, float t_min, float t_max)
+{
+    STATS_TIME_BEGIN(STAT_TIMER_TRACE);
+    STATS_ADD(STAT_RAYS_PRIMARY, 1);
+    uint32_t base = context->rays_size;
+    push_ray(context, ray, 1.f, t_min, depth);
+
+    vec3f color = {0.f, 0.f, 0.f};
+    color = trace_pending(context, base, t_max, color);
+    STATS_TIME_END(STAT_TIMER_TRACE);
+
+    return color;
+}
+
+vec3f shade_hit(
+        trace_context_t *context, ray_t ray, hit_t hit, material_t material, float intensity, uint32_t depth,
+        float t_max)
+{
+    uint32_t base = context->rays_size;
+    pending_ray_t pending = {.ray=ray, .weight=1.f, .t_min=T_CLOSE, .depth=depth};
+
+    vec3f color = {0.f, 0.f, 0.f};
+    color = shade_pending(context, &pending, &hit, &material, intensity, color);
+    return trace_pending(context, base, t_max, color);
 }
 
 float get_light_troughput(material_t material)
@@ -351,34 +608,52 @@ float get_light_troughput(material_t material)
     }
 }
 
-float get_shadow_factor(ray_t l, float t_min, float t_max)
+float get_object_troughput(object_t object)
 {
-    hit_t hit;
+    switch (object.type) {
+        case OBJECT_SPHERE:
+            return get_light_troughput(SPHERES[object.index].material);
+        case OBJECT_PLANE:
+            return get_light_troughput(PLANES[object.index].material);
+        default:
+            return get_light_troughput(MESHES[object.index].material);
+    }
+}
 
+float get_shadow_factor(ray_t l, float t_min, float t_max, object_t *occluder)
+{
+    // the last object that blocked this light is likely to block it again
+    if (occluder && occluder->index != NO_OBJECT && occludes_object(l, *occluder, t_min, t_max)) {
+        STATS_ADD(STAT_SHADOW_CACHED, 1);
+        return 0.f;
+    }
+
+#ifdef USE_BVH
+    return bvh_shadow_factor(&BVH, l, t_min, t_max, occluder);
+#else
     // light starts at full strength
     float light_strength = 1.f;
 
-    // calculate how much light the spheres let trough
-    for (uint32_t i = 0; i < SPHERES_SIZE; i++) {
-        if (reflect_sphere(&hit, l, SPHERES[i]) && t_min < hit.t && hit.t < t_max) {
-            light_strength *= get_light_troughput(SPHERES[i].material);
-            if (light_strength == 0.f) {
-                // if the throughput has reached 0, return early
-                return 0.f;
-            }
+    for (uint32_t i = 0; i < get_object_count(); i++) {
+        object_t object = get_object(i);
+
+        // fully transparent objects do not change the light, do not test them
+        float throughput = get_object_troughput(object);
+        if (throughput == 1.f || !occludes_object(l, object, t_min, t_max)) {
+            continue;
         }
-    }
 
-    // calculate how much light the planes let trough
-    for (uint32_t i = 0; i < PLANES_SIZE; i++) {
-        if (reflect_plane(&hit, l, PLANES[i]) && t_min < hit.t && hit.t < t_max) {
-            light_strength *= get_light_troughput(PLANES[i].material);
-            if (light_strength == 0.f) {
-                // if the throughput has reached 0, return early
-                return 0.f;
+        light_strength *= throughput;
+        if (light_strength == 0.f) {
+            // if the throughput has reached 0, return early
+            STATS_ADD(STAT_SHADOW_BLOCKED, 1);
+            if (occluder && throughput == 0.f) {
+                *occluder = object;
             }
+            return 0.f;
         }
     }
 
     return light_strength;
-}
\ No newline at end of file
+#endif
+}
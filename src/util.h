@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <float.h>
 #include "vec3.h"
+#include "stats.h"
+#include "arena.h"
 
 typedef enum {
     NONE,                 // no transparency, no reflection
@@ -56,6 +58,23 @@ typedef struct {
     vec3f checker_color; // the secondary color of the checkered pattern
 } plane_t;
 
+/** sphere as tested for intersections, compiled from a sphere_t by scene_compile */
+typedef struct {
+    vec3f center;
+    float radius2; // radius squared
+} sphere_record_t;
+
+/** plane as tested for intersections, compiled from a plane_t by scene_compile */
+typedef struct {
+    vec3f point;
+    vec3f normal;        // unit normal
+    vec3f first;         // PLANE_BOUNDED: unit direction of first
+    vec3f second;        // PLANE_BOUNDED: unit direction of second
+    float first_length;  // PLANE_BOUNDED: length of first
+    float second_length; // PLANE_BOUNDED: length of second
+    plane_type_t type;
+} plane_record_t;
+
 typedef struct {
     vec3f start;
     vec3f direction;
@@ -67,6 +86,18 @@ typedef struct {
     float t;       // distance from origin ray to hit
 } hit_t;
 
+typedef enum {
+    OBJECT_SPHERE, OBJECT_PLANE, OBJECT_MESH
+} object_type_t;
+
+typedef struct {
+    object_type_t type;
+    uint32_t index; // index into SPHERES, PLANES or MESHES
+} object_t;
+
+/** index of an object that does not refer to anything */
+#define NO_OBJECT UINT32_MAX
+
 typedef enum {
     LIGHT_AMBIENT, LIGHT_POINT, LIGHT_DIRECTIONAL
 } light_type_t;
@@ -78,39 +109,141 @@ typedef struct {
         vec3f direction; // LIGHT_DIRECTIONAL: direction vector of the light
         vec3f location;  // LIGHT_POINT: location of the point light
     } v;
+    float radius;        // LIGHT_POINT: distance at which the light has fallen off to nothing, 0: no falloff
 } light_t;
 
 extern const float T_CLOSE; // near clipping plane preventing sphere casting shadows and reflections on self
 
+/** a ray that still has to be traced, and the fraction of its color that ends up in the traced sample */
+typedef struct {
+    ray_t ray;
+    float weight;
+    float t_min;
+    uint32_t depth; // number of reflections/refractions left
+} pending_ray_t;
+
+/** a light selected to shade a point, and the factor its intensity is scaled by at the point, see light_select */
+typedef struct {
+    uint32_t light; // index in LIGHTS
+    float scale;
+} light_sample_t;
+
+/** state of a thread tracing rays, owned by that thread */
+typedef struct {
+    object_t *occluders;        // per light: the last object that fully blocked it, tested first by the next shadow
+    pending_ray_t *rays;        // stack of rays that still have to be traced, of room for those of one camera ray
+    uint32_t rays_size;
+    float min_weight;           // reflections and refractions with a smaller weight are not traced
+    float light_threshold;      // lights reaching a point with no more intensity are skipped, see light_select
+    uint32_t light_samples;     // 0: all lights with a radius are shaded, otherwise: number drawn per point
+    light_sample_t *selected;   // per light: the lights selected by compute_lighting
+    uint32_t *light_candidates; // per light: room for light_select
+    float *light_weights;
+    struct trace_record *record; // if not NULL: the rays traced and objects hit are added to it, see render_cache.h
+    stats_t stats;              // counters and timers of this thread, when built with statistics
+} trace_context_t;
+
+/** default of min_weight, a ray of this weight cannot change an 8-bit color by more than a step */
+extern const float MIN_RAY_WEIGHT;
+
+/** returns the bytes of an arena that trace_context_init takes for the current scene and {depth} */
+size_t trace_context_memory(uint32_t depth);
+
+/**
+ * allocates the state of {context} for the current scene from {arena}, for rays of at most {depth} reflections and
+ * refractions. the state is freed with the arena */
+void trace_context_init(trace_context_t *context, arena_t *arena, uint32_t depth);
+
 /** returns reflected ray. {ray} and {normal} should have been normalized */
 vec3f reflect(vec3f ray, vec3f normal);
 
 /** returns whether {ray} and {sphere} intersect, if so: {hit} contains the information about the intersection */
-bool reflect_sphere(hit_t *hit, ray_t ray, sphere_t sphere);
+bool reflect_sphere(hit_t *hit, ray_t ray, const sphere_record_t *sphere);
 
 /** returns whether {ray} and {plane} intersect, if so: {hit} contains the information about the intersection */
-bool reflect_plane(hit_t *hit, ray_t ray, plane_t plane);
+bool reflect_plane(hit_t *hit, ray_t ray, const plane_record_t *plane);
+
+/** returns whether {ray} hits {sphere} at a distance in (t_min, t_max), without computing the intersection */
+bool occludes_sphere(ray_t ray, const sphere_record_t *sphere, float t_min, float t_max);
+
+/** returns whether {ray} hits {plane} at a distance in (t_min, t_max), without computing the intersection */
+bool occludes_plane(ray_t ray, const plane_record_t *plane, float t_min, float t_max);
+
+/** returns whether {ray} hits {object} at a distance in (t_min, t_max) */
+bool occludes_object(ray_t ray, object_t object, float t_min, float t_max);
+
+/** returns the ray from {point} towards {light}, only objects up to {t_max} cast a shadow */
+ray_t get_light_ray(const light_t *light, vec3f point, float *t_max);
+
+/**
+ * returns {intensity} plus the diffuse and specular contribution of non-ambient {light} in direction {l},
+ * of which a fraction {shadow_factor} reaches the intersection */
+float add_light(
+        float intensity, const light_t *light, vec3f l, float shadow_factor,
+        ray_t origin, vec3f normal, ray_t reflected, float shininess);
+
+/** returns {intensity} clamped to [0, 1] */
+float clamp_intensity(float intensity);
+
+/**
+ * returns {color} plus the weighted color of {pending} at {hit} on {material}, lit with {intensity}.
+ * pushes the reflection and refraction onto the ray stack of {context}, weighted by the fraction of the color they
+ * make up */
+vec3f shade_pending(
+        trace_context_t *context, const pending_ray_t *pending, const hit_t *hit, const material_t *material,
+        float intensity, vec3f color);
 
 /** returns the intensity of a ray at a intersection */
-float compute_lighting(ray_t origin, vec3f normal, ray_t reflected, float shininess);
+float compute_lighting(trace_context_t *context, ray_t origin, vec3f normal, ray_t reflected, float shininess);
 
 /**
  * returns whether {origin} intersects with a sphere in SPHERES, if so:
- * {sphere} contains the closest sphere, {reflected} contains the ray bouncing off that sphere */
-bool get_closest_sphere(hit_t *reflected, sphere_t *sphere, ray_t origin, float t_min, float t_max);
+ * {sphere} contains the index of the closest sphere, {reflected} contains the ray bouncing off that sphere */
+bool get_closest_sphere(hit_t *reflected, uint32_t *sphere, ray_t origin, float t_min, float t_max);
 
 /**
  * returns whether {origin} intersects with a plane in PLANES, if so:
- * {plane} contains the closest plane, {reflected} contains the ray bouncing off that plane */
-bool get_closest_plane(hit_t *reflected, plane_t *plane, ray_t origin, float t_min, float t_max);
+ * {plane} contains the index of the closest plane, {reflected} contains the ray bouncing off that plane */
+bool get_closest_plane(hit_t *reflected, uint32_t *plane, ray_t origin, float t_min, float t_max);
 
-/** returns the color of a ray */
-vec3f trace_ray(ray_t ray, uint32_t depth, float t_min, float t_max);
+/**
+ * returns whether {origin} intersects with a mesh in MESHES, if so:
+ * {mesh} contains the index of the closest mesh, {reflected} contains the ray bouncing off that mesh */
+bool get_closest_mesh(hit_t *reflected, uint32_t *mesh, ray_t origin, float t_min, float t_max);
+
+/**
+ * returns whether {origin} intersects with an object in the scene, if so:
+ * {object} refers to the closest object, {reflected} contains the ray bouncing off that object */
+bool get_closest_object(hit_t *reflected, object_t *object, ray_t origin, float t_min, float t_max);
+
+/** returns the number of objects in the scene */
+uint32_t get_object_count(void);
+
+/** returns object {i} of the scene, counting the spheres first, then the planes, then the meshes */
+object_t get_object(uint32_t i);
+
+/** returns the material of {object} at the intersection {hit} */
+material_t get_material(object_t object, const hit_t *hit);
+
+/**
+ * returns the color of a ray, traced without recursion on the ray stack of {context}. reflections and refractions
+ * that contribute less than the min_weight of {context} to the color are not traced */
+vec3f trace_ray(trace_context_t *context, ray_t ray, uint32_t depth, float t_min, float t_max);
+
+/** returns the color of {ray} that hits {material} at {hit}, lit with {intensity}. traces reflections and refractions */
+vec3f shade_hit(
+        trace_context_t *context, ray_t ray, hit_t hit, material_t material, float intensity, uint32_t depth,
+        float t_max);
 
 /** returns the fraction of light that passes trough a material */
 float get_light_troughput(material_t material);
 
-/** {l} ray towards light */
-float get_shadow_factor(ray_t l, float t_min, float t_max);
+/** returns the fraction of light that passes trough {object} */
+float get_object_troughput(object_t object);
+
+/**
+ * {l} ray towards light. {occluder} is tested first if it refers to an object,
+ * if the light is fully blocked by a single object {occluder} is set to that object */
+float get_shadow_factor(ray_t l, float t_min, float t_max, object_t *occluder);
 
 #endif //RAY_TRACER_UTIL_H
@@ -1,8 +1,19 @@
 #ifndef RAY_TRACE_NM_MATH_H
 #define RAY_TRACE_NM_MATH_H
 
+#include <float.h>
 #include <math.h>
 #include <stdbool.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/**
+ * the operations are defined in this header, so they are inlined into their callers without link time optimization.
+ * vec3f keeps its layout of three floats, which is stored as is in compiled scenes and binary meshes.
+ * built with USE_STRICT_MATH, every operation rounds as written: vec3f_norm divides each component by the length and
+ * vec3f_norm_fast is vec3f_norm. otherwise vec3f_norm multiplies by the reciprocal of the length and vec3f_norm_fast
+ * approximates it, both within a few units in the last place */
 
 typedef struct {
     float x;
@@ -10,30 +21,107 @@ typedef struct {
     float z;
 } vec3f;
 
-// todo: maybe pass pointer and return result to prevent unnecessary copies
-
 /** return a + b */
-vec3f vec3f_add(vec3f a, vec3f b);
+static inline vec3f vec3f_add(vec3f a, vec3f b)
+{
+    vec3f result = {a.x + b.x, a.y + b.y, a.z + b.z};
+
+    return result;
+}
 
 /** return a - b */
-vec3f vec3f_sub(vec3f a, vec3f b);
+static inline vec3f vec3f_sub(vec3f a, vec3f b)
+{
+    vec3f result = {a.x - b.x, a.y - b.y, a.z - b.z};
+
+    return result;
+}
 
 /** return dot product of a and b */
-float vec3f_dot(vec3f a, vec3f b);
+static inline float vec3f_dot(vec3f a, vec3f b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
 
 /** return cross product of a and b */
-vec3f vec3f_cross(vec3f a, vec3f b);
+static inline vec3f vec3f_cross(vec3f a, vec3f b)
+{
+    vec3f result = {
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+    };
 
-/** return length of a */
-float vec3f_len(vec3f a);
+    return result;
+}
 
-/** returns the normalized vector a */
-vec3f vec3f_norm(vec3f a);
+/** return length of a */
+static inline float vec3f_len(vec3f a)
+{
+    return sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+}
 
 /** returns a scaled by k */
-vec3f vec3f_scale(vec3f a, float k);
+static inline vec3f vec3f_scale(vec3f a, float k)
+{
+    vec3f result = {a.x * k, a.y * k, a.z * k};
+
+    return result;
+}
+
+/** returns a + b * k, rounded as vec3f_add(a, vec3f_scale(b, k)) unless contracted to fused multiply-adds */
+static inline vec3f vec3f_madd(vec3f a, vec3f b, float k)
+{
+    vec3f result = {a.x + b.x * k, a.y + b.y * k, a.z + b.z * k};
+
+    return result;
+}
+
+/** returns the normalized vector a, or the zero vector if a is */
+static inline vec3f vec3f_norm(vec3f a)
+{
+    float len = vec3f_len(a);
+
+    if (len == 0) {
+        vec3f result = {0.f, 0.f, 0.f};
+        return result;
+    }
+
+#ifdef USE_STRICT_MATH
+    vec3f result = {a.x / len, a.y / len, a.z / len};
+
+    return result;
+#else
+    return vec3f_scale(a, 1.f / len);
+#endif
+}
+
+/**
+ * returns the normalized vector a, or the zero vector if a is, using the reciprocal square root estimate of the
+ * processor refined by a newton step. only faster than vec3f_norm where square roots and divisions are slow, see
+ * ray_tracer_micro */
+static inline vec3f vec3f_norm_fast(vec3f a)
+{
+#if defined(USE_STRICT_MATH) || !defined(__SSE__)
+    return vec3f_norm(a);
+#else
+    float len2 = vec3f_dot(a, a);
+    if (!(len2 >= FLT_MIN && len2 <= FLT_MAX)) {
+        // the estimate does not handle zero, denormals and infinity
+        return vec3f_norm(a);
+    }
+
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(len2)));
+    r = r * (1.5f - .5f * len2 * r * r);
+
+    return vec3f_scale(a, r);
+#endif
+}
 
 /** returns true if a and b are equal */
-bool vec3f_eq(vec3f a, vec3f b);
+static inline bool vec3f_eq(vec3f a, vec3f b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
 
 #endif //RAY_TRACE_NM_MATH_H
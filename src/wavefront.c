@@ -0,0 +1,294 @@
+#include "wavefront.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "lights.h"
+#include "stats.h"
+
+/** bits per axis of the quantized origins that the rays of a wave are sorted by */
+#define ORIGIN_BITS 9
+
+void wavefront_init(wavefront_t *wavefront)
+{
+    memset(wavefront, 0, sizeof(wavefront_t));
+}
+
+void wavefront_free(wavefront_t *wavefront)
+{
+    free(wavefront->rays);
+    free(wavefront->next);
+    free(wavefront->keys);
+    free(wavefront->order);
+    free(wavefront->keys_swap);
+    free(wavefront->order_swap);
+    free(wavefront->hits);
+    free(wavefront->objects);
+    free(wavefront->materials);
+    free(wavefront->found);
+    free(wavefront->first_sample);
+    free(wavefront->samples);
+    free(wavefront->shadow_factors);
+    free(wavefront->sample_order);
+    free(wavefront->sample_hits);
+    free(wavefront->light_offsets);
+    memset(wavefront, 0, sizeof(wavefront_t));
+}
+
+/** makes room for {size} rays in the current and the next wave, keeping the rays of both */
+static void reserve(wavefront_t *wavefront, uint32_t size)
+{
+    if (size <= wavefront->capacity) {
+        return;
+    }
+    uint32_t capacity = wavefront->capacity * 2 > size ? wavefront->capacity * 2 : size;
+    wavefront->rays = realloc(wavefront->rays, capacity * sizeof(wave_ray_t));
+    wavefront->next = realloc(wavefront->next, capacity * sizeof(wave_ray_t));
+    wavefront->keys = realloc(wavefront->keys, capacity * sizeof(uint32_t));
+    wavefront->order = realloc(wavefront->order, capacity * sizeof(uint32_t));
+    wavefront->keys_swap = realloc(wavefront->keys_swap, capacity * sizeof(uint32_t));
+    wavefront->order_swap = realloc(wavefront->order_swap, capacity * sizeof(uint32_t));
+    wavefront->hits = realloc(wavefront->hits, capacity * sizeof(hit_t));
+    wavefront->objects = realloc(wavefront->objects, capacity * sizeof(object_t));
+    wavefront->materials = realloc(wavefront->materials, capacity * sizeof(material_t));
+    wavefront->found = realloc(wavefront->found, capacity * sizeof(uint32_t));
+    wavefront->first_sample = realloc(wavefront->first_sample, (capacity + 1) * sizeof(uint32_t));
+    wavefront->capacity = capacity;
+}
+
+/** returns {x} in [0, 1) quantized to ORIGIN_BITS bits, with two zero bits between each */
+static uint32_t spread_bits(float x)
+{
+    float scaled = x * (float) (1u << ORIGIN_BITS);
+    uint32_t q = scaled > 0.f ? (uint32_t) fminf(scaled, (float) ((1u << ORIGIN_BITS) - 1)) : 0;
+    uint32_t result = 0;
+    for (uint32_t bit = 0; bit < ORIGIN_BITS; bit++) {
+        result |= ((q >> bit) & 1) << (3 * bit);
+    }
+
+    return result;
+}
+
+/**
+ * orders the {count} rays of the current wave by their direction octant, then by the morton code of their origin
+ * within the bounds of all origins, by a radix sort of 8 bits per pass. rays that continue close to each other in
+ * the same direction tend to visit the same nodes and objects */
+static void sort_wave(wavefront_t *wavefront, uint32_t count)
+{
+    aabb_t bounds = aabb_empty();
+    for (uint32_t i = 0; i < count; i++) {
+        aabb_grow(&bounds, wavefront->rays[i].pending.ray.start);
+    }
+    vec3f extent = vec3f_sub(bounds.max, bounds.min);
+    vec3f scale = {
+            extent.x > 0.f ? 1.f / extent.x : 0.f, extent.y > 0.f ? 1.f / extent.y : 0.f,
+            extent.z > 0.f ? 1.f / extent.z : 0.f
+    };
+
+    uint32_t *keys = wavefront->keys;
+    uint32_t *order = wavefront->order;
+    for (uint32_t i = 0; i < count; i++) {
+        ray_t ray = wavefront->rays[i].pending.ray;
+        uint32_t octant = (ray.direction.x < 0.f) | (ray.direction.y < 0.f) << 1 | (ray.direction.z < 0.f) << 2;
+        vec3f p = vec3f_sub(ray.start, bounds.min);
+        keys[i] = octant << (3 * ORIGIN_BITS) | spread_bits(p.x * scale.x) | spread_bits(p.y * scale.y) << 1 |
+                  spread_bits(p.z * scale.z) << 2;
+        order[i] = i;
+    }
+
+    uint32_t *keys_swap = wavefront->keys_swap;
+    uint32_t *order_swap = wavefront->order_swap;
+    for (uint32_t shift = 0; shift < 3 * ORIGIN_BITS + 3; shift += 8) {
+        uint32_t offsets[256] = {0};
+        for (uint32_t i = 0; i < count; i++) {
+            offsets[(keys[i] >> shift) & 0xff]++;
+        }
+        uint32_t sum = 0;
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t size = offsets[b];
+            offsets[b] = sum;
+            sum += size;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t slot = offsets[(keys[i] >> shift) & 0xff]++;
+            keys_swap[slot] = keys[i];
+            order_swap[slot] = order[i];
+        }
+        uint32_t *swap = keys;
+        keys = keys_swap;
+        keys_swap = swap;
+        swap = order;
+        order = order_swap;
+        order_swap = swap;
+    }
+
+    /** move the rays into sorted order, the next wave is empty and serves as the destination */
+    for (uint32_t i = 0; i < count; i++) {
+        wavefront->next[i] = wavefront->rays[order[i]];
+    }
+    wave_ray_t *rays = wavefront->rays;
+    wavefront->rays = wavefront->next;
+    wavefront->next = rays;
+}
+
+/** finds the closest object of each ray of the wave, returns the number of rays that hit one */
+static uint32_t intersect_wave(wavefront_t *wavefront, uint32_t count, float t_max, vec3f *colors)
+{
+    STATS_TIME_BEGIN(STAT_TIMER_INTERSECT);
+    uint32_t found_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const pending_ray_t *pending = &wavefront->rays[i].pending;
+        if (get_closest_object(
+                &wavefront->hits[i], &wavefront->objects[i], pending->ray, pending->t_min, t_max)) {
+            wavefront->found[found_count++] = i;
+        } else {
+            // if the ray does not hit an object, use the background color
+            vec3f *color = &colors[wavefront->rays[i].sample];
+            *color = vec3f_madd(*color, BACKGROUND, pending->weight);
+        }
+    }
+    STATS_TIME_END(STAT_TIMER_INTERSECT);
+
+    return found_count;
+}
+
+/** selects the lights of the hits of the wave and orders the samples by light */
+static void select_wave(trace_context_t *context, wavefront_t *wavefront, uint32_t found_count)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < found_count; i++) {
+        if (size + LIGHTS_SIZE > wavefront->sample_capacity) {
+            uint32_t capacity = wavefront->sample_capacity * 2 > size + LIGHTS_SIZE ?
+                                wavefront->sample_capacity * 2 : size + LIGHTS_SIZE;
+            wavefront->samples = realloc(wavefront->samples, capacity * sizeof(light_sample_t));
+            wavefront->shadow_factors = realloc(wavefront->shadow_factors, capacity * sizeof(float));
+            wavefront->sample_order = realloc(wavefront->sample_order, capacity * sizeof(uint32_t));
+            wavefront->sample_hits = realloc(wavefront->sample_hits, capacity * sizeof(uint32_t));
+            wavefront->sample_capacity = capacity;
+        }
+        wavefront->first_sample[i] = size;
+        const hit_t *hit = &wavefront->hits[wavefront->found[i]];
+        uint32_t count = light_select(context, hit->reflect.start, &wavefront->samples[size]);
+        for (uint32_t s = size; s < size + count; s++) {
+            wavefront->sample_hits[s] = i;
+        }
+        size += count;
+    }
+    wavefront->first_sample[found_count] = size;
+
+    // counting sort by light
+    if (!wavefront->light_offsets) {
+        wavefront->light_offsets = malloc((LIGHTS_SIZE + 1) * sizeof(uint32_t));
+    }
+    uint32_t *offsets = wavefront->light_offsets;
+    memset(offsets, 0, (LIGHTS_SIZE + 1) * sizeof(uint32_t));
+    for (uint32_t s = 0; s < size; s++) {
+        offsets[wavefront->samples[s].light + 1]++;
+    }
+    for (uint32_t l = 0; l < LIGHTS_SIZE; l++) {
+        offsets[l + 1] += offsets[l];
+    }
+    for (uint32_t s = 0; s < size; s++) {
+        wavefront->sample_order[offsets[wavefront->samples[s].light]++] = s;
+    }
+}
+
+/** traces the shadow rays of the samples light by light, so consecutive rays go to the same light from nearby points */
+static void shadow_wave(trace_context_t *context, wavefront_t *wavefront, uint32_t found_count)
+{
+    STATS_TIME_BEGIN(STAT_TIMER_SHADOW);
+    for (uint32_t o = 0; o < wavefront->first_sample[found_count]; o++) {
+        uint32_t s = wavefront->sample_order[o];
+        uint32_t light_index = wavefront->samples[s].light;
+        const light_t *light = &LIGHTS[light_index];
+        if (light->type == LIGHT_AMBIENT) {
+            continue;
+        }
+        const hit_t *hit = &wavefront->hits[wavefront->found[wavefront->sample_hits[s]]];
+        float t_light;
+        ray_t to_light = get_light_ray(light, hit->reflect.start, &t_light);
+        STATS_ADD(STAT_RAYS_SHADOW, 1);
+        wavefront->shadow_factors[s] = get_shadow_factor(to_light, T_CLOSE, t_light, &context->occluders[light_index]);
+    }
+    STATS_TIME_END(STAT_TIMER_SHADOW);
+}
+
+/**
+ * lights and shades the hits of the wave, adding to {colors}. the reflections and refractions are pushed onto the
+ * ray stack of {context} by shade_pending, and moved from there to the next wave */
+static void shade_wave(trace_context_t *context, wavefront_t *wavefront, uint32_t found_count, vec3f *colors)
+{
+    for (uint32_t i = 0; i < found_count; i++) {
+        uint32_t r = wavefront->found[i];
+        wavefront->materials[r] = get_material(wavefront->objects[r], &wavefront->hits[r]);
+    }
+
+    uint32_t base = context->rays_size;
+    for (uint32_t i = 0; i < found_count; i++) {
+        uint32_t r = wavefront->found[i];
+        const wave_ray_t *ray = &wavefront->rays[r];
+        const hit_t *hit = &wavefront->hits[r];
+        const material_t *material = &wavefront->materials[r];
+
+        /** the lights are added in the order of compute_lighting */
+        float intensity = 0.f;
+        for (uint32_t s = wavefront->first_sample[i]; s < wavefront->first_sample[i + 1]; s++) {
+            const light_sample_t *sample = &wavefront->samples[s];
+            const light_t *light = &LIGHTS[sample->light];
+            if (light->type == LIGHT_AMBIENT) {
+                intensity += light->intensity;
+                continue;
+            }
+            float t_light;
+            ray_t to_light = get_light_ray(light, hit->reflect.start, &t_light);
+            intensity = add_light(
+                    intensity, light, to_light.direction, wavefront->shadow_factors[s] * sample->scale,
+                    ray->pending.ray, hit->normal, hit->reflect, material->shininess);
+        }
+        intensity = clamp_intensity(intensity);
+
+        colors[ray->sample] = shade_pending(context, &ray->pending, hit, material, intensity, colors[ray->sample]);
+
+        reserve(wavefront, wavefront->next_size + context->rays_size - base);
+        while (context->rays_size > base) {
+            wave_ray_t *spawned = &wavefront->next[wavefront->next_size++];
+            spawned->pending = context->rays[--context->rays_size];
+            spawned->sample = wavefront->rays[r].sample;
+        }
+    }
+}
+
+void trace_wavefront(
+        trace_context_t *context, wavefront_t *wavefront, vec3f *colors, const ray_t *rays, uint32_t count,
+        uint32_t depth, float t_min, float t_max)
+{
+    STATS_TIME_BEGIN(STAT_TIMER_TRACE);
+    STATS_ADD(STAT_RAYS_PRIMARY, count);
+    reserve(wavefront, count);
+    for (uint32_t i = 0; i < count; i++) {
+        wave_ray_t *ray = &wavefront->rays[i];
+        ray->pending = (pending_ray_t) {.ray=rays[i], .weight=1.f, .t_min=t_min, .depth=depth};
+        ray->sample = i;
+        colors[i] = (vec3f) {0.f, 0.f, 0.f};
+    }
+
+    uint32_t size = count;
+    while (size > 0) {
+        sort_wave(wavefront, size);
+        uint32_t found_count = intersect_wave(wavefront, size, t_max, colors);
+        // the shadow rays are counted as part of the lighting, as in compute_lighting
+        STATS_TIME_BEGIN(STAT_TIMER_LIGHTING);
+        select_wave(context, wavefront, found_count);
+        shadow_wave(context, wavefront, found_count);
+        wavefront->next_size = 0;
+        shade_wave(context, wavefront, found_count, colors);
+        STATS_TIME_END(STAT_TIMER_LIGHTING);
+
+        // the spawned rays are the next wave
+        wave_ray_t *swap = wavefront->rays;
+        wavefront->rays = wavefront->next;
+        wavefront->next = swap;
+        size = wavefront->next_size;
+    }
+    STATS_TIME_END(STAT_TIMER_TRACE);
+}
@@ -0,0 +1,52 @@
+#ifndef RAY_TRACER_WAVEFRONT_H
+#define RAY_TRACER_WAVEFRONT_H
+
+#include <stdint.h>
+#include "util.h"
+
+/** a ray of a wave and the camera ray whose color it adds to */
+typedef struct {
+    pending_ray_t pending;
+    uint32_t sample;
+} wave_ray_t;
+
+/** state of a thread tracing waves of rays, reused between calls to trace_wavefront */
+typedef struct {
+    wave_ray_t *rays;        // the current wave, then sorted
+    wave_ray_t *next;        // the reflections and refractions spawned by the current wave
+    uint32_t next_size;
+    uint32_t capacity;       // of rays and next, and of the arrays per ray below
+    uint32_t *keys;          // sort keys and the order they sort the rays in, and room for the radix sort
+    uint32_t *order;
+    uint32_t *keys_swap;
+    uint32_t *order_swap;
+    hit_t *hits;             // per ray of the wave
+    object_t *objects;
+    material_t *materials;
+    uint32_t *found;         // indices of the rays that hit an object
+    uint32_t *first_sample;  // per ray in found and one more: index of its first light in samples
+    light_sample_t *samples; // lights selected for the rays in found, see light_select
+    float *shadow_factors;   // per sample: fraction of the light let through, as by get_shadow_factor
+    uint32_t *sample_hits;   // per sample: index in found of its ray
+    uint32_t *sample_order;  // samples in order of their light
+    uint32_t sample_capacity;
+    uint32_t *light_offsets; // per light and one more: room for sorting the samples by light
+} wavefront_t;
+
+/** makes {wavefront} an empty state */
+void wavefront_init(wavefront_t *wavefront);
+
+/** frees the memory of {wavefront} */
+void wavefront_free(wavefront_t *wavefront);
+
+/**
+ * traces the {count} camera rays {rays} in waves and stores their colors in {colors}: each wave is sorted by the
+ * direction octant and origin of its rays, intersected, then the shadow rays towards the lights chosen by light_select
+ * are traced light by light, then it is shaded, spawning the reflections and refractions of the next wave. the colors
+ * equal those of trace_ray up to the rounding of the order in which the rays add to them. {context} is the state of
+ * the calling thread */
+void trace_wavefront(
+        trace_context_t *context, wavefront_t *wavefront, vec3f *colors, const ray_t *rays, uint32_t count,
+        uint32_t depth, float t_min, float t_max);
+
+#endif //RAY_TRACER_WAVEFRONT_H